@@ -1611,6 +1611,95 @@ double vec_twonorm_sqr_dp(const float * x, size_t n)
     return result;
 }
 
+namespace {
+
+struct DotprodOp {
+    static v2df apply(v2df x, v2df y)
+    {
+        return x * y;
+    }
+
+    static double apply(double x, double y)
+    {
+        return x * y;
+    }
+};
+
+struct EuclideanSqrOp {
+    static v2df apply(v2df x, v2df y)
+    {
+        v2df d = x - y;
+        return d * d;
+    }
+
+    static double apply(double x, double y)
+    {
+        double d = x - y;
+        return d * d;
+    }
+};
+
+template<typename Op>
+double vec_batch_dp_one_sse2(const float * x, const float * y, size_t n)
+{
+    v2df rr0 = vec_splat(0.0), rr1 = rr0;
+    size_t i = 0;
+
+    for (; i + 4 <= n;  i += 4) {
+        v4sf xxxx = _mm_loadu_ps(x + i);
+        v4sf yyyy = _mm_loadu_ps(y + i);
+        v2df xx0 = __builtin_ia32_cvtps2pd(xxxx);
+        v2df yy0 = __builtin_ia32_cvtps2pd(yyyy);
+        xxxx = _mm_shuffle_ps(xxxx, xxxx, 14);
+        yyyy = _mm_shuffle_ps(yyyy, yyyy, 14);
+        v2df xx1 = __builtin_ia32_cvtps2pd(xxxx);
+        v2df yy1 = __builtin_ia32_cvtps2pd(yyyy);
+        rr0 += Op::apply(xx0, yy0);
+        rr1 += Op::apply(xx1, yy1);
+    }
+
+    double results[4];
+    *(v2df *)(results + 0) = rr0;
+    *(v2df *)(results + 2) = rr1;
+
+    double result = (results[0] + results[2]) + (results[1] + results[3]);
+    for (;  i < n;  ++i)
+        result += Op::apply(x[i], y[i]);
+    return result;
+}
+
+} // file scope
+
+void vec_dotprod_batch_dp_sse2(const float * x, const float * const * y,
+                               size_t dims, size_t n, double * r)
+{
+    for (size_t j = 0;  j < n;  ++j)
+        r[j] = vec_batch_dp_one_sse2<DotprodOp>(x, y[j], dims);
+}
+
+void vec_euclidean_sqr_batch_dp_sse2(const float * x, const float * const * y,
+                                     size_t dims, size_t n, double * r)
+{
+    for (size_t j = 0;  j < n;  ++j)
+        r[j] = vec_batch_dp_one_sse2<EuclideanSqrOp>(x, y[j], dims);
+}
+
+void vec_dotprod_batch_dp(const float * x, const float * const * y,
+                          size_t dims, size_t n, double * r)
+{
+    if (has_avx())
+        Avx::vec_dotprod_batch_dp(x, y, dims, n, r);
+    else vec_dotprod_batch_dp_sse2(x, y, dims, n, r);
+}
+
+void vec_euclidean_sqr_batch_dp(const float * x, const float * const * y,
+                                size_t dims, size_t n, double * r)
+{
+    if (has_avx())
+        Avx::vec_euclidean_sqr_batch_dp(x, y, dims, n, r);
+    else vec_euclidean_sqr_batch_dp_sse2(x, y, dims, n, r);
+}
+
 double vec_twonorm_sqr(const double * x, size_t n)
 {
     unsigned i = 0;
@@ -164,6 +164,19 @@ inline double vec_twonorm_sqr_dp(const double * x, size_t n)
     return vec_twonorm_sqr(x, n);
 }
 
+// Batched dot products of x with each of the n vectors y[0] ... y[n-1],
+// all of which have dims elements, accumulated in double precision:
+// r[j] = sum_i x[i] * y[j][i].  The result for each y[j] doesn't depend
+// upon n or upon the other vectors, and exchanging x and y[j] gives
+// exactly the same result.
+void vec_dotprod_batch_dp(const float * x, const float * const * y,
+                          size_t dims, size_t n, double * r);
+
+// Batched squared euclidean distances, with the same guarantees as
+// vec_dotprod_batch_dp: r[j] = sum_i (x[i] - y[j][i])^2.
+void vec_euclidean_sqr_batch_dp(const float * x, const float * const * y,
+                                size_t dims, size_t n, double * r);
+
 // KL divergence: kl = sum(p * log(p / q))
 double vec_kl(const float * p, const float * q, size_t n);
 
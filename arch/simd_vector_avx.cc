@@ -112,6 +112,105 @@ float vec_dotprod(const float * x, const float * y, size_t n)
     return Generic::vec_dotprod_generic(x, y, n);
 }
 
+namespace {
+
+struct DotprodOp {
+    static v4df apply(v4df x, v4df y)
+    {
+        return x * y;
+    }
+
+    static double apply(double x, double y)
+    {
+        return x * y;
+    }
+};
+
+struct EuclideanSqrOp {
+    static v4df apply(v4df x, v4df y)
+    {
+        v4df d = x - y;
+        return d * d;
+    }
+
+    static double apply(double x, double y)
+    {
+        double d = x - y;
+        return d * d;
+    }
+};
+
+inline v4df load_4_dp(const float * x)
+{
+    return _mm256_cvtps_pd(_mm_loadu_ps(x));
+}
+
+template<typename Op>
+double finish_batch_dp(v4df rr, const float * x, const float * y,
+                       size_t i, size_t n)
+{
+    double results[4];
+    *(v4df *)results = rr;
+
+    double result = (results[0] + results[1]) + (results[2] + results[3]);
+    for (;  i < n;  ++i)
+        result += Op::apply(x[i], y[i]);
+    return result;
+}
+
+template<typename Op>
+void vec_batch_dp(const float * x, const float * const * y,
+                  size_t dims, size_t n, double * r)
+{
+    size_t nvec = dims & ~size_t(3);
+    size_t j = 0;
+
+    // Four vectors at once, so that each load of x is used four times.  The
+    // operations for each vector are the same as in the loop below, so the
+    // result for each doesn't depend upon how they were grouped.
+    for (; j + 4 <= n;  j += 4) {
+        const float * y0 = y[j + 0], * y1 = y[j + 1];
+        const float * y2 = y[j + 2], * y3 = y[j + 3];
+
+        v4df rr0 = { 0.0, 0.0, 0.0, 0.0 }, rr1 = rr0, rr2 = rr0, rr3 = rr0;
+
+        for (size_t i = 0;  i < nvec;  i += 4) {
+            v4df xx = load_4_dp(x + i);
+            rr0 += Op::apply(xx, load_4_dp(y0 + i));
+            rr1 += Op::apply(xx, load_4_dp(y1 + i));
+            rr2 += Op::apply(xx, load_4_dp(y2 + i));
+            rr3 += Op::apply(xx, load_4_dp(y3 + i));
+        }
+
+        r[j + 0] = finish_batch_dp<Op>(rr0, x, y0, nvec, dims);
+        r[j + 1] = finish_batch_dp<Op>(rr1, x, y1, nvec, dims);
+        r[j + 2] = finish_batch_dp<Op>(rr2, x, y2, nvec, dims);
+        r[j + 3] = finish_batch_dp<Op>(rr3, x, y3, nvec, dims);
+    }
+
+    for (; j < n;  ++j) {
+        const float * yj = y[j];
+        v4df rr = { 0.0, 0.0, 0.0, 0.0 };
+        for (size_t i = 0;  i < nvec;  i += 4)
+            rr += Op::apply(load_4_dp(x + i), load_4_dp(yj + i));
+        r[j] = finish_batch_dp<Op>(rr, x, yj, nvec, dims);
+    }
+}
+
+} // file scope
+
+void vec_dotprod_batch_dp(const float * x, const float * const * y,
+                          size_t dims, size_t n, double * r)
+{
+    vec_batch_dp<DotprodOp>(x, y, dims, n, r);
+}
+
+void vec_euclidean_sqr_batch_dp(const float * x, const float * const * y,
+                                size_t dims, size_t n, double * r)
+{
+    vec_batch_dp<EuclideanSqrOp>(x, y, dims, n, r);
+}
+
 } // namespace Avx
 } // namespace SIMD
 } // namespace ML
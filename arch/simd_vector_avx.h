@@ -21,6 +21,14 @@ double vec_dotprod(const double * x, const double * y, size_t n);
 /// Single precision vector dot product, avx version
 float vec_dotprod(const float * x, const float * y, size_t n);
 
+/// Batched single precision dot products in double precision, avx version
+void vec_dotprod_batch_dp(const float * x, const float * const * y,
+                          size_t dims, size_t n, double * r);
+
+/// Batched squared euclidean distances in double precision, avx version
+void vec_euclidean_sqr_batch_dp(const float * x, const float * const * y,
+                                size_t dims, size_t n, double * r);
+
 } // namespace Avx
 } // namespace SIMD
 } // namespace ML
@@ -838,3 +838,50 @@ BOOST_AUTO_TEST_CASE( vec_min_max_el_test )
     }
 }
 
+
+void vec_batch_dp_test_case(int nvals, int nvecs)
+{
+    cerr << "testing batch distance kernels with " << nvals << " values and "
+         << nvecs << " vectors" << endl;
+
+    vector<vector<float> > vecs(nvecs + 1, vector<float>(nvals));
+    for (auto & v: vecs)
+        for (auto & x: v)
+            x = rand() / 16384.0 - 65536.0;
+
+    const float * x = &vecs[0][0];
+    vector<const float *> y;
+    for (unsigned j = 1;  j <= nvecs;  ++j)
+        y.push_back(&vecs[j][0]);
+
+    vector<double> dp(nvecs), eu(nvecs);
+    SIMD::vec_dotprod_batch_dp(x, &y[0], nvals, nvecs, &dp[0]);
+    SIMD::vec_euclidean_sqr_batch_dp(x, &y[0], nvals, nvecs, &eu[0]);
+
+    for (unsigned j = 0;  j < nvecs;  ++j) {
+        double dp2 = 0.0, eu2 = 0.0;
+        for (unsigned i = 0;  i < nvals;  ++i) {
+            dp2 += (double)x[i] * y[j][i];
+            double d = (double)x[i] - y[j][i];
+            eu2 += d * d;
+        }
+
+        BOOST_CHECK_CLOSE(dp[j], dp2, 1e-10);
+        BOOST_CHECK_CLOSE(eu[j], eu2, 1e-10);
+
+        // Exactly symmetric, and independent of the other vectors
+        double dp3, eu3;
+        SIMD::vec_dotprod_batch_dp(y[j], &x, nvals, 1, &dp3);
+        SIMD::vec_euclidean_sqr_batch_dp(y[j], &x, nvals, 1, &eu3);
+        BOOST_CHECK_EQUAL(dp3, dp[j]);
+        BOOST_CHECK_EQUAL(eu3, eu[j]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( vec_batch_dp_test )
+{
+    for (auto x: {1, 2, 3, 4, 5, 8, 9, 16, 17, 123}) {
+        for (auto n: {1, 3, 4, 9})
+            vec_batch_dp_test_case(x, n);
+    }
+}
@@ -13,6 +13,12 @@
 #include "mldb/types/any_impl.h"
 #include "mldb/types/structure_description.h"
 #include "mldb/types/vector_description.h"
+#include "mldb/base/exc_assert.h"
+#include "mldb/rest/rest_request_router.h"
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <map>
 
 using namespace std;
 
@@ -37,6 +43,213 @@ MergedDatasetConfigDescription()
 }
 
 
+/*****************************************************************************/
+/* MERGE CACHE                                                               */
+/*****************************************************************************/
+
+namespace {
+
+/** Row and column hashes of a dataset that takes part in a merge, each
+    sorted by hash.
+*/
+struct DatasetHashes {
+    std::vector<uint64_t> rows;
+    std::vector<uint64_t> columns;
+};
+
+/** Keeps the parts of merging that are expensive to recreate, keyed on
+    the identity of the datasets involved, so that a merge over mostly the
+    same datasets as an earlier one (for example a continuous window that
+    has moved forward by one partition) only does the work for what is new:
+
+    - The sorted hashes of each dataset that has been merged, for as long
+      as the dataset lives and isn't committed again;
+    - The sub-merges that group datasets together when there are too many
+      for a single level, for as long as a merge that uses them is alive.
+
+    Entries only hold weak references, so that the cache never keeps a
+    dataset alive.
+*/
+struct MergeCache {
+
+    MergeCache()
+        : sweepAt(64)
+    {
+    }
+
+    std::shared_ptr<const DatasetHashes>
+    getHashes(const std::shared_ptr<Dataset> & dataset)
+    {
+        uint64_t generation = dataset->getCommitGeneration();
+
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            auto it = hashes.find(dataset.get());
+            if (it != hashes.end()
+                && it->second.generation == generation
+                && it->second.dataset.lock() == dataset)
+                return it->second.hashes;
+        }
+
+        auto result = std::make_shared<DatasetHashes>();
+
+        auto matrix = dataset->getMatrixView();
+        for (auto & r: matrix->getRowHashes())
+            result->rows.push_back(r.hash());
+        for (auto & c: matrix->getColumnNames())
+            result->columns.push_back(c.hash());
+
+        std::sort(result->rows.begin(), result->rows.end());
+        ExcAssert(std::unique(result->rows.begin(), result->rows.end())
+                  == result->rows.end());
+        std::sort(result->columns.begin(), result->columns.end());
+        ExcAssert(std::unique(result->columns.begin(), result->columns.end())
+                  == result->columns.end());
+
+        std::unique_lock<std::mutex> guard(mutex);
+        HashesEntry & entry = hashes[dataset.get()];
+        entry.dataset = dataset;
+        entry.generation = generation;
+        entry.hashes = result;
+        sweep();
+        return result;
+    }
+
+    std::shared_ptr<Dataset>
+    getSubMerge(MldbServer * server,
+                const std::vector<std::shared_ptr<Dataset> > & datasets)
+    {
+        std::vector<const Dataset *> key;
+        std::vector<uint64_t> generations;
+        for (auto & d: datasets) {
+            key.push_back(d.get());
+            generations.push_back(d->getCommitGeneration());
+        }
+
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            auto it = subMerges.find(key);
+            if (it != subMerges.end()
+                && it->second.generations == generations) {
+                auto merged = it->second.merged.lock();
+                bool same = !!merged;
+                for (unsigned i = 0;  same && i < datasets.size();  ++i)
+                    same = it->second.members[i].lock() == datasets[i];
+                if (same)
+                    return merged;
+            }
+        }
+
+        auto result = std::make_shared<MergedDataset>(server, datasets);
+
+        std::unique_lock<std::mutex> guard(mutex);
+        SubMergeEntry & entry = subMerges[key];
+        entry.members.assign(datasets.begin(), datasets.end());
+        entry.generations = std::move(generations);
+        entry.merged = result;
+        sweep();
+        return result;
+    }
+
+private:
+    struct HashesEntry {
+        std::weak_ptr<Dataset> dataset;
+        uint64_t generation;
+        std::shared_ptr<const DatasetHashes> hashes;
+    };
+
+    struct SubMergeEntry {
+        std::vector<std::weak_ptr<Dataset> > members;
+        std::vector<uint64_t> generations;
+        std::weak_ptr<Dataset> merged;
+    };
+
+    /// Drop entries for datasets that no longer exist.  This is done
+    /// each time the cache doubles in size, so it's amortized constant
+    /// time.  Mutex must be held.
+    void sweep()
+    {
+        if (hashes.size() + subMerges.size() < sweepAt)
+            return;
+
+        for (auto it = hashes.begin();  it != hashes.end();) {
+            if (it->second.dataset.expired())
+                it = hashes.erase(it);
+            else ++it;
+        }
+
+        for (auto it = subMerges.begin();  it != subMerges.end();) {
+            if (it->second.merged.expired())
+                it = subMerges.erase(it);
+            else ++it;
+        }
+
+        sweepAt = std::max<size_t>(64, 2 * (hashes.size() + subMerges.size()));
+    }
+
+    std::mutex mutex;
+    std::unordered_map<const Dataset *, HashesEntry> hashes;
+    std::map<std::vector<const Dataset *>, SubMergeEntry> subMerges;
+    size_t sweepAt;
+};
+
+MergeCache mergeCache;
+
+/** Maximum number of datasets that can be merged in one level, which is
+    the number of bits in the bitmap of the index.
+*/
+enum { MAX_MERGE_WIDTH = 32 };
+
+/** Is this dataset the last one of its group when datasets are grouped
+    into sub-merges?  This depends only on the dataset itself, so that
+    adding or removing datasets at one end of a list only changes the
+    groups at that end, and the others can be reused from the cache.
+    On average one dataset in eight ends a group.
+*/
+bool endsGroup(const Dataset * dataset)
+{
+    uint64_t h = (uint64_t)(uintptr_t)dataset * 0x9e3779b97f4a7c15ULL;
+    return (h >> 61) == 0;
+}
+
+/** Group datasets into sub-merges, returning a list about eight times
+    shorter to merge in their place.
+*/
+std::vector<std::shared_ptr<Dataset> >
+groupDatasets(MldbServer * server,
+              const std::vector<std::shared_ptr<Dataset> > & datasets)
+{
+    // Groups have at least this many members, so that each level is at
+    // least this many times smaller than the last one
+    static const unsigned MIN_GROUP_SIZE = 4;
+
+    std::vector<std::shared_ptr<Dataset> > result;
+    std::vector<std::shared_ptr<Dataset> > group;
+
+    auto finishGroup = [&] ()
+        {
+            if (group.size() == 1)
+                result.push_back(group[0]);
+            else if (!group.empty())
+                result.push_back(mergeCache.getSubMerge(server, group));
+            group.clear();
+        };
+
+    for (auto & d: datasets) {
+        group.push_back(d);
+        if (group.size() == MAX_MERGE_WIDTH - 1
+            || (group.size() >= MIN_GROUP_SIZE && endsGroup(d.get())))
+            finishGroup();
+    }
+
+    finishGroup();
+
+    return result;
+}
+
+} // file scope
+
+
 /*****************************************************************************/
 /* MERGED INTERNAL REPRESENTATION                                            */
 /*****************************************************************************/
@@ -45,104 +258,106 @@ MergedDatasetConfigDescription()
 struct MergedDataset::Itl
     : public MatrixView, public ColumnIndex {
 
-    IdHashes rowIndex;
-    IdHashes columnIndex;
+    /** Index of which of the datasets contain each row and column.  It
+        is shared with the views created by restrictTimeRange(), as they
+        have the same rows and columns.
+    */
+    struct Indexes {
+        IdHashes rowIndex;
+        IdHashes columnIndex;
+    };
+
+    std::shared_ptr<const Indexes> indexes;
+
+    /** How much queries restricted by time managed to skip.  It is also
+        shared with the views.
+    */
+    struct Stats {
+        Stats()
+            : timeRestrictions(0), datasetsSkipped(0), datasetsRestricted(0)
+        {
+        }
+
+        /// Number of queries that were restricted to a time range
+        std::atomic<uint64_t> timeRestrictions;
+
+        /// Number of merged datasets that those queries didn't read
+        std::atomic<uint64_t> datasetsSkipped;
+
+        /// Number that they read only part of
+        std::atomic<uint64_t> datasetsRestricted;
+    };
+
+    std::shared_ptr<Stats> stats;
 
     /// Datasets that it was constructed with
     std::vector<std::shared_ptr<Dataset> > datasetsIn;
 
-    /// Datasets that were actually merged.  There will be a maximum of 31
+    /// Datasets that were actually merged.  There will be a maximum of 32
     /// of them, as any more will be sub-merged
     std::vector<std::shared_ptr<Dataset> > datasets;
 
     /// Matrix view.  Length is the same as that of datasets.
     std::vector<std::shared_ptr<MatrixView> > matrices;
 
-    Itl(MldbServer * server, std::vector<std::shared_ptr<Dataset> > datasets)
-    {
-        // 1.  Sort them so that the biggest ones are at the start
+    /// Bitmap of the datasets that cells are read from.  Rows and columns
+    /// are known from all of them.
+    uint32_t cellMask;
 
-        //for (auto & d: datasets) {
-        //    cerr << "dataset has " << d->getMatrixView()->getRowHashes().size()
-        //         << " rows and " << d->getMatrixView()->getColumnNames().size()
-        //         << " columns" << endl;
-        //}
+    /// Timestamp range of each of the datasets, calculated when first
+    /// needed
+    mutable std::once_flag datasetRangesOnce;
+    mutable std::vector<std::pair<Date, Date> > datasetRanges;
 
+    Itl(MldbServer * server, std::vector<std::shared_ptr<Dataset> > datasets)
+        : stats(std::make_shared<Stats>()), cellMask(-1)
+    {
         if (datasets.empty())
             throw ML::Exception("Attempt to merge no datasets together");
 
+        // Now work out how our tree is laid out.  If there are too many
+        // to merge in one go, they are grouped into sub-merges in a way
+        // that's stable as datasets are added or removed, so that the
+        // sub-merges can be reused.
+        std::vector<std::shared_ptr<Dataset> > toMerge = datasets;
+        while (toMerge.size() > MAX_MERGE_WIDTH)
+            toMerge = groupDatasets(server, toMerge);
 
-        std::sort(datasets.begin(), datasets.end(),
-                  [] (std::shared_ptr<Dataset> p1,
-                      std::shared_ptr<Dataset> p2)
-                  {
-                      return false;
-                      //return p1->behaviourCount() + p1->subjectCount()
-                      //    > p2->behaviourCount() + p2->subjectCount();
-                  });
-
-        std::vector<std::shared_ptr<Dataset> > toMerge;
-
-        // Now work out how our tree is laid out.  We aim to have the biggest
-        // entries at the start so they don't need a sub-tree.
-        int numSubMerges = (datasets.size() - 1) / 31;
+        std::vector<std::shared_ptr<const DatasetHashes> >
+            hashes(toMerge.size());
 
-        // The first 31 - numSubMerges get added directly
-        int numDirect = std::max(0, 31 - numSubMerges);
-        numDirect = std::min<int>(numDirect, datasets.size());
-
-        for (unsigned i = 0;  i < numDirect;  ++i) {
-            toMerge.push_back(datasets[i]);
-        }
-
-        // The rest get broken down into groups of 31, pre-merged, and then added
-        for (int current = numDirect;  current < datasets.size();  ) {
-            //cerr << "current = " << current << " toMerge.size() = "
-            //     << toMerge.size() << endl;
-            vector<std::shared_ptr<Dataset> > subToMerge;
-            for (; current < datasets.size() && subToMerge.size() < 31;  ++current) {
-                //cerr << "adding " << current << endl;
-                subToMerge.push_back(datasets[current]);
-            }
+        auto onDataset = [&] (int i)
+            {
+                hashes[i] = mergeCache.getHashes(toMerge[i]);
+            };
 
-            //cerr << "merging " << subToMerge.size() << " files" << endl;
+        ML::run_in_parallel(0, toMerge.size(), onDataset);
 
-            toMerge.push_back(std::make_shared<MergedDataset>(server, subToMerge));
-            //cerr << "done merging " << subToMerge.size() << " files" << endl;
-        }
+        auto newIndexes = std::make_shared<Indexes>();
 
-        ExcAssertLessEqual(toMerge.size(), 32);
-    
         auto getRowHashes = [&] (int datasetIndex)
             {
-                auto dataset = toMerge[datasetIndex];
                 MergeHashEntries result;
-                vector<RowHash> rows = dataset->getMatrixView()->getRowHashes();
-                std::sort(rows.begin(), rows.end());
-                ExcAssert(std::unique(rows.begin(), rows.end()) == rows.end());
-
+                const auto & rows = hashes[datasetIndex]->rows;
                 result.reserve(rows.size());
                 for (auto r: rows)
-                    result.add(r.hash(), 1ULL << datasetIndex);
+                    result.add(r, 1ULL << datasetIndex);
                 return result;
             };
 
         auto getColumnHashes = [&] (int datasetIndex)
             {
-                auto dataset = toMerge[datasetIndex];
                 MergeHashEntries result;
-                vector<ColumnName> cols = dataset->getMatrixView()->getColumnNames();
-                std::sort(cols.begin(), cols.end());
-                ExcAssert(std::unique(cols.begin(), cols.end()) == cols.end());
+                const auto & cols = hashes[datasetIndex]->columns;
                 result.reserve(cols.size());
                 for (auto c: cols)
-                    result.add(c.hash(), 1ULL << datasetIndex);
+                    result.add(c, 1ULL << datasetIndex);
                 return result;
             };
 
         auto initRowBucket = [&] (int i, MergeHashEntryBucket & b)
             {
-                auto & b2 = rowIndex.buckets[i];
+                auto & b2 = newIndexes->rowIndex.buckets[i];
 
                 b2.reserve(b.size());
 
@@ -155,7 +370,7 @@ struct MergedDataset::Itl
 
         auto initColumnBucket = [&] (int i, MergeHashEntryBucket & b)
             {
-                auto & b2 = columnIndex.buckets[i];
+                auto & b2 = newIndexes->columnIndex.buckets[i];
 
                 b2.reserve(b.size());
 
@@ -172,6 +387,7 @@ struct MergedDataset::Itl
         mergeColumns.join();
         mergeRows.join();
 
+        this->indexes = std::move(newIndexes);
         this->datasetsIn = std::move(datasets);
         this->datasets = std::move(toMerge);
         for (auto & d: this->datasets) {
@@ -183,6 +399,24 @@ struct MergedDataset::Itl
              << " columns" << endl;
     }
 
+    /** Create a view of another merge that has the same rows and columns,
+        but only reads cells from the datasets in cellMask, and reads
+        them from the given datasets in place of its own.
+    */
+    Itl(const Itl & other, uint32_t cellMask,
+        std::vector<std::shared_ptr<Dataset> > datasets)
+        : indexes(other.indexes),
+          stats(other.stats),
+          datasetsIn(other.datasetsIn),
+          datasets(std::move(datasets)),
+          cellMask(cellMask)
+    {
+        ExcAssertEqual(this->datasets.size(), other.datasets.size());
+        for (auto & d: this->datasets) {
+            matrices.emplace_back(d->getMatrixView());
+        }
+    }
+
     struct MergedRowStream : public RowStream {
 
         MergedRowStream(const MergedDataset::Itl* source) : source(source)
@@ -197,7 +431,7 @@ struct MergedDataset::Itl
         /* set where the stream should start*/
         virtual void initAt(size_t start)
         {
-            it = source->rowIndex.begin();
+            it = source->indexes->rowIndex.begin();
             for (size_t i = 0; i < start; ++i)
                 ++it;
         }
@@ -250,7 +484,7 @@ struct MergedDataset::Itl
                 return true;
             };
 
-        rowIndex.forEach(onRow);
+        indexes->rowIndex.forEach(onRow);
 
         return result;
     }
@@ -283,6 +517,15 @@ struct MergedDataset::Itl
         if (!bitmap)
             throw ML::Exception("Row not known");
 
+        bitmap &= cellMask;
+        if (!bitmap) {
+            // None of the datasets we read cells from have the row
+            MatrixNamedRow result;
+            result.rowHash = rowName;
+            result.rowName = rowName;
+            return result;
+        }
+
         int bit = ML::lowest_bit(bitmap, -1);
         MatrixNamedRow result = std::move(datasets[bit]->getMatrixView()->getRow(rowName));
         bitmap = bitmap & ~(1 << bit);
@@ -334,7 +577,7 @@ struct MergedDataset::Itl
                 return true;
             };
         
-        columnIndex.forEach(onColumn);
+        indexes->columnIndex.forEach(onColumn);
         
         return result;
     }
@@ -371,6 +614,14 @@ struct MergedDataset::Itl
         if (!bitmap)
             throw ML::Exception("Column not known");
 
+        bitmap &= cellMask;
+        if (!bitmap) {
+            MatrixColumn result;
+            result.columnHash = columnHash;
+            result.columnName = columnHash;
+            return result;
+        }
+
         int bit = ML::lowest_bit(bitmap, -1);
         MatrixColumn result = std::move(datasets[bit]->getColumnIndex()->getColumn(columnHash));
         bitmap = bitmap & ~(1 << bit);
@@ -396,7 +647,7 @@ struct MergedDataset::Itl
                     const std::function<bool (const CellValue &)> & filter) const
     {
         std::vector<std::tuple<RowName, CellValue> > result;
-        uint32_t bitmap = getColumnBitmap(columnName);
+        uint32_t bitmap = getColumnBitmap(columnName) & cellMask;
         if (bitmap)
         {
             int bit = ML::lowest_bit(bitmap, -1);
@@ -408,6 +659,7 @@ struct MergedDataset::Itl
             while (bitmap) {
                 int bit = ML::lowest_bit(bitmap, -1);
                 auto column = datasets[bit]->getColumnIndex()->getColumnValues(columnName, filter);
+                bitmap = bitmap & ~(1 << bit);
                 if (column.empty())
                     continue;
 
@@ -417,8 +669,6 @@ struct MergedDataset::Itl
                 result.insert(result.end(),
                               std::make_move_iterator(column.begin()),
                               std::make_move_iterator(column.end()));
-
-                bitmap = bitmap & ~(1 << bit);
             }
 
             if (!sorted) {
@@ -433,22 +683,38 @@ struct MergedDataset::Itl
 
     virtual size_t getRowCount() const
     {
-        return rowIndex.size();
+        return indexes->rowIndex.size();
     }
 
     virtual size_t getColumnCount() const
     {
-        return columnIndex.size();
+        return indexes->columnIndex.size();
     }
 
     uint32_t getRowBitmap(RowHash rowHash) const
     {
-        return rowIndex.getDefault(rowHash, 0);
+        return indexes->rowIndex.getDefault(rowHash, 0);
     }
 
     uint32_t getColumnBitmap(ColumnHash columnHash) const
     {
-        return columnIndex.getDefault(columnHash, 0);
+        return indexes->columnIndex.getDefault(columnHash, 0);
+    }
+
+    const std::vector<std::pair<Date, Date> > & getDatasetRanges() const
+    {
+        auto calcRanges = [&] ()
+            {
+                datasetRanges.resize(datasets.size());
+                auto onDataset = [&] (int i)
+                    {
+                        datasetRanges[i] = datasets[i]->getTimestampRange();
+                    };
+                ML::run_in_parallel(0, datasets.size(), onDataset);
+            };
+
+        std::call_once(datasetRangesOnce, calcRanges);
+        return datasetRanges;
     }
 
     std::pair<Date, Date> getTimestampRange() const
@@ -456,8 +722,12 @@ struct MergedDataset::Itl
         std::pair<Date, Date> result(Date::notADate(), Date::notADate());
         bool first = true;
 
-        for (auto & d: datasets) {
-            std::pair<Date, Date> dsRange = d->getTimestampRange();
+        const auto & ranges = getDatasetRanges();
+
+        for (unsigned i = 0;  i < ranges.size();  ++i) {
+            if (!(cellMask & (1U << i)))
+                continue;
+            std::pair<Date, Date> dsRange = ranges[i];
             if (!dsRange.first.isADate()
                 || !dsRange.second.isADate())
                 continue;
@@ -473,6 +743,50 @@ struct MergedDataset::Itl
 
         return result;
     }
+
+    /** Return a view that skips the datasets with no cells between
+        earliest and latest, and restricts those that have only some of
+        their cells in the range, or null if that wouldn't skip anything.
+    */
+    std::shared_ptr<Itl>
+    restrictTimeRange(Date earliest, Date latest) const
+    {
+        const auto & ranges = getDatasetRanges();
+
+        uint32_t newMask = cellMask;
+        std::vector<std::shared_ptr<Dataset> > newDatasets = datasets;
+        int numSkipped = 0, numRestricted = 0;
+
+        for (unsigned i = 0;  i < datasets.size();  ++i) {
+            if (!(newMask & (1U << i)))
+                continue;
+
+            Date first = ranges[i].first, last = ranges[i].second;
+            if (!first.isADate() || !last.isADate())
+                continue;
+
+            if (last < earliest || first > latest) {
+                newMask &= ~(1U << i);
+                ++numSkipped;
+            }
+            else if (first < earliest || last > latest) {
+                auto restricted = datasets[i]->restrictTimeRange(earliest, latest);
+                if (restricted) {
+                    newDatasets[i] = std::move(restricted);
+                    ++numRestricted;
+                }
+            }
+        }
+
+        if (numSkipped == 0 && numRestricted == 0)
+            return nullptr;
+
+        stats->timeRestrictions += 1;
+        stats->datasetsSkipped += numSkipped;
+        stats->datasetsRestricted += numRestricted;
+
+        return std::make_shared<Itl>(*this, newMask, std::move(newDatasets));
+    }
 };
 
 
@@ -505,6 +819,12 @@ MergedDataset(MldbServer * owner,
     itl.reset(new Itl(server, datasetsToMerge));
 }
 
+MergedDataset::
+MergedDataset(MldbServer * owner, std::shared_ptr<Itl> itl)
+    : Dataset(owner), itl(std::move(itl))
+{
+}
+
 MergedDataset::
 ~MergedDataset()
 {
@@ -520,6 +840,25 @@ getStatus() const
     return result;
 }
 
+RestRequestMatchResult
+MergedDataset::
+handleRequest(RestConnection & connection,
+              const RestRequest & request,
+              RestRequestParsingContext & context) const
+{
+    if (context.remaining == "/stats" && request.verb == "GET") {
+        Json::Value result;
+        result["timeRestrictions"] = itl->stats->timeRestrictions.load();
+        result["datasetsSkipped"] = itl->stats->datasetsSkipped.load();
+        result["datasetsRestricted"] = itl->stats->datasetsRestricted.load();
+
+        connection.sendResponse(200, result);
+        return RestRequestRouter::MR_YES;
+    }
+
+    return Dataset::handleRequest(connection, request, context);
+}
+
 std::pair<Date, Date>
 MergedDataset::
 getTimestampRange() const
@@ -527,6 +866,16 @@ getTimestampRange() const
     return itl->getTimestampRange();
 }
 
+std::shared_ptr<Dataset>
+MergedDataset::
+restrictTimeRange(Date earliest, Date latest) const
+{
+    auto restricted = itl->restrictTimeRange(earliest, latest);
+    if (!restricted)
+        return nullptr;
+    return std::shared_ptr<Dataset>(new MergedDataset(server, restricted));
+}
+
 std::shared_ptr<MatrixView>
 MergedDataset::
 getMatrixView() const
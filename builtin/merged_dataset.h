@@ -59,9 +59,24 @@ struct MergedDataset: public Dataset {
 
     virtual std::pair<Date, Date> getTimestampRange() const;
 
+    virtual std::shared_ptr<Dataset>
+    restrictTimeRange(Date earliest, Date latest) const;
+
+    /** GET /stats returns how much queries restricted by time have
+        managed to skip.
+    */
+    virtual RestRequestMatchResult
+    handleRequest(RestConnection & connection,
+                  const RestRequest & request,
+                  RestRequestParsingContext & context) const;
+
 private:
     MergedDatasetConfig datasetConfig;
     struct Itl;
+
+    /** Constructor used for views that share another's index */
+    MergedDataset(MldbServer * owner, std::shared_ptr<Itl> itl);
+
     std::shared_ptr<Itl> itl;
 };
 
@@ -264,6 +264,12 @@ struct TransposedDataset::Itl
         return dataset->getTimestampRange();
     }
 
+    uint64_t
+    getCommitGeneration() const
+    {
+        return dataset->getCommitGeneration();
+    }
+
 };
 
 
@@ -312,6 +318,13 @@ getTimestampRange() const
     return itl->getTimestampRange();
 }
 
+uint64_t
+TransposedDataset::
+getCommitGeneration() const
+{
+    return itl->getCommitGeneration();
+}
+
 std::shared_ptr<MatrixView>
 TransposedDataset::
 getMatrixView() const
@@ -44,6 +44,8 @@ struct TransposedDataset: public Dataset {
 
     virtual std::pair<Date, Date> getTimestampRange() const;
 
+    virtual uint64_t getCommitGeneration() const;
+
     virtual std::shared_ptr<MatrixView> getMatrixView() const;
     virtual std::shared_ptr<ColumnIndex> getColumnIndex() const;
     virtual std::shared_ptr<RowStream> getRowStream() const;
@@ -13,6 +13,7 @@
 #include "mldb/types/tuple_description.h"
 #include "mldb/types/vector_description.h"
 #include "mldb/server/analytics.h"
+#include "mldb/server/bound_queries.h"
 #include "mldb/sql/sql_expression.h"
 #include "mldb/jml/utils/lightweight_hash.h"
 #include "mldb/server/dataset_context.h"
@@ -231,6 +232,14 @@ getColumnRowCount(const ColumnName & column) const
     return getColumnStats(column, toStoreResult).rowCount();
 }
 
+bool
+ColumnIndex::
+forEachNumericBlock(const std::vector<ColumnName> & columns,
+                    const OnNumericBlock & onBlock) const
+{
+    return false;
+}
+
 bool
 ColumnIndex::
 forEachColumnGetStats(const OnColumnStats & onColumnStats) const
@@ -324,7 +333,7 @@ getColumnValues(const ColumnName & column,
 
 Dataset::
 Dataset(MldbServer * server)
-    : server(server)
+    : server(server), commitGeneration(0)
 {
 }
 
@@ -385,6 +394,13 @@ getTimestampRange() const
     return result;
 }
 
+std::shared_ptr<Dataset>
+Dataset::
+restrictTimeRange(Date earliest, Date latest) const
+{
+    return nullptr;
+}
+
 Date
 Dataset::
 quantizeTimestamp(Date timestamp) const
@@ -552,68 +568,41 @@ queryStructured(const SelectExpression & select,
                 Utf8String alias,
                 bool allowMT) const
 {
-    ExcAssert(&where);
-    ExcAssert(&having);
-    ExcAssert(&rowName);
-    //cerr << "limit = " << limit << endl;
-    //cerr << "offset = " << offset << endl;
-
-    std::mutex lock;
     std::vector<MatrixNamedRow> output;
 
-    if (!having.isConstantTrue() && groupBy.clauses.empty())
-        throw HttpReturnException(400, "HAVING expression requires a GROUP BY expression");
-
-    std::vector< std::shared_ptr<SqlExpression> > aggregators = select.findAggregators();
-    std::vector< std::shared_ptr<SqlExpression> > havingaggregators = having.findAggregators();
-
-    // Do it ungrouped if possible
-    if (groupBy.clauses.empty() && aggregators.empty()) {
-        auto aggregator = [&] (NamedRowValue & row_,
-                               const std::vector<ExpressionValue> & calc)
-            {
-                MatrixNamedRow row = row_.flattenDestructive();
-                row.rowName = RowName(calc.at(0).toUtf8String());
-                row.rowHash = row.rowName;
-                std::unique_lock<std::mutex> guard(lock);
-                output.emplace_back(std::move(row));
-                return true;
-            };
-
-        // MLDB-154: if we have a limit or offset, we probably want a stable ordering
-        // Due to a bug that led to it being always enabled we will always do this
-        OrderByExpression orderBy_ = orderBy;
-        if (limit != -1 || offset != 0 || true) {
-            orderBy_.clauses.emplace_back(SqlExpression::parse("rowHash()"), ASC);
-        }
-        
-        //cerr << "orderBy_ = " << jsonEncode(orderBy_) << endl;
-        iterateDataset(select, *this, alias, when, where,
-                       { rowName.shallowCopy() }, aggregator, orderBy_, offset, limit,
-                       nullptr);
-    }
-    else {
-
-        aggregators.insert(aggregators.end(), havingaggregators.begin(), havingaggregators.end());
+    auto onRow = [&] (MatrixNamedRow & row)
+        {
+            output.emplace_back(std::move(row));
+            return true;
+        };
 
-        // Otherwise do it grouped...
-        auto aggregator = [&] (NamedRowValue & row_)
-            {
-                MatrixNamedRow row = row_.flattenDestructive();
-                std::unique_lock<std::mutex> guard(lock);
-                output.emplace_back(row);
-                return true;
-            };
-
-        iterateDatasetGrouped(select, *this, alias, when, where,
-                              groupBy, aggregators, having, rowName,
-                              aggregator, orderBy, offset, limit,
-                              nullptr, allowMT);
-    }
+    queryStructuredIncremental(onRow, select, when, where, orderBy, groupBy,
+                               having, rowName, offset, limit, alias,
+                               allowMT);
 
     return output;
 }
 
+void
+Dataset::
+queryStructuredIncremental(const std::function<bool (MatrixNamedRow & row)> & onRow,
+                           const SelectExpression & select,
+                           const WhenExpression & when,
+                           const SqlExpression & where,
+                           const OrderByExpression & orderBy,
+                           const TupleExpression & groupBy,
+                           const SqlExpression & having,
+                           const SqlExpression & rowName,
+                           ssize_t offset,
+                           ssize_t limit,
+                           Utf8String alias,
+                           bool allowMT) const
+{
+    BoundDatasetQuery(select, *this, alias, when, where, orderBy, groupBy,
+                      having, rowName, offset, limit, allowMT)
+        .execute(onRow);
+}
+
 template<typename Filter>
 static std::pair<std::vector<RowName>, Any>
 executeFilteredColumnExpression(const Dataset & dataset,
@@ -1489,6 +1478,20 @@ commit()
 {
 }
 
+uint64_t
+Dataset::
+getCommitGeneration() const
+{
+    return commitGeneration.load(std::memory_order_acquire);
+}
+
+void
+Dataset::
+bumpCommitGeneration()
+{
+    commitGeneration.fetch_add(1, std::memory_order_release);
+}
+
 BoundFunction
 Dataset::
 overrideFunction(const Datacratic::Utf8String&,
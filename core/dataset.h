@@ -13,6 +13,7 @@
 #include "mldb/core/mldb_entity.h"
 #include "mldb/sql/cell_value.h"
 #include "mldb/types/url.h"
+#include <atomic>
 
 // NOTE TO MLDB DEVELOPERS: This is an API header file.  No includes
 // should be added, especially value_description.h.
@@ -172,6 +173,23 @@ struct ColumnIndex {
         implementation uses getColumnStats.
     */
     virtual uint64_t getColumnRowCount(const ColumnName & column) const;
+
+    typedef std::function<void (size_t numRows,
+                                const double * const * values,
+                                const bool * const * isNull,
+                                const Date * timestamps)> OnNumericBlock;
+
+    /** Call onBlock for consecutive blocks of rows, covering every row
+        exactly once in an unspecified order, with the values of each of
+        the given columns decoded as doubles.  values[i] and isNull[i]
+        hold numRows entries for columns[i]; a null value is undefined.
+        Returns false without calling onBlock if a column is unknown or
+        can contain something other than numbers and nulls, or if the
+        index can't do this without materializing rows, which is the
+        default.  Used to run aggregates over whole numeric columns.
+    */
+    virtual bool forEachNumericBlock(const std::vector<ColumnName> & columns,
+                                     const OnNumericBlock & onBlock) const;
 };
 
 
@@ -293,9 +311,23 @@ struct Dataset: public MldbEntity {
     */
     virtual std::shared_ptr<RowValueInfo> getRowInfo() const;
 
-    /** Commit changes to the database.  Default is a no-op. */
+    /** Commit changes to the database.  Default is a no-op.
+
+        Implementations that make new data visible should call
+        bumpCommitGeneration() once they have done so.
+    */
     virtual void commit();
 
+    /** Return a number that changes every time the data visible through
+        this dataset changes due to a commit, or to a write for datasets
+        where writes are visible straight away.  Query plans that are bound
+        against the dataset are only reused while it stays the same.
+
+        Datasets that wrap other datasets should override this to combine
+        the generations of the datasets they read from.
+    */
+    virtual uint64_t getCommitGeneration() const;
+
     /** Select from the database. */
     virtual std::vector<MatrixNamedRow>
     queryStructured(const SelectExpression & select,
@@ -310,6 +342,25 @@ struct Dataset: public MldbEntity {
                     Utf8String alias = "",
                     bool allowMT = true) const;
 
+    /** Select from the database, passing each row of output to onRow as
+        it's produced rather than returning them all at the end.  Rows are
+        passed in order, one at a time.  If onRow returns false, no more
+        rows are passed.
+    */
+    virtual void
+    queryStructuredIncremental(const std::function<bool (MatrixNamedRow & row)> & onRow,
+                               const SelectExpression & select,
+                               const WhenExpression & when,
+                               const SqlExpression & where,
+                               const OrderByExpression & orderBy,
+                               const TupleExpression & groupBy,
+                               const SqlExpression & having,
+                               const SqlExpression & rowName,
+                               ssize_t offset,
+                               ssize_t limit,
+                               Utf8String alias = "",
+                               bool allowMT = true) const;
+
     /** Select from the database. */
     virtual std::vector<MatrixNamedRow>
     queryString(const Utf8String & query) const;
@@ -420,6 +471,17 @@ struct Dataset: public MldbEntity {
     */
     virtual std::pair<Date, Date> getTimestampRange() const;
 
+    /** Return a view of this dataset for a query that will only look at
+        cells with timestamps between earliest and latest inclusive.  The
+        view has exactly the same rows and columns, but may leave out
+        cells outside of that range, which allows it to skip reading
+        parts of the dataset that can't contribute.
+
+        Returns null if there is nothing to gain, which is the default.
+    */
+    virtual std::shared_ptr<Dataset>
+    restrictTimeRange(Date earliest, Date latest) const;
+
     /** Perform any internal quantization on the given timestamp.  This should
         transform a timestamp into exactly the timestamp that would be read
         back from the dataset on a query, were it recorded into the dataset.
@@ -432,6 +494,15 @@ struct Dataset: public MldbEntity {
     /* In the case of a dataset with rows composed from other datasets (i.e., joins)
        This will return the name that the row has in the table with this alias*/
     virtual RowName getOriginalRowName(const Utf8String& tableName, const RowName & name) const;
+
+protected:
+    /** Called by implementations of commit() once the committed data is
+        visible, to invalidate plans bound against the old data.
+    */
+    void bumpCommitGeneration();
+
+private:
+    std::atomic<uint64_t> commitGeneration;
 };
 
 
@@ -722,6 +722,14 @@ apply(const FunctionContext & input) const
     return function->apply(*this, input);
 }
 
+std::vector<FunctionOutput>
+FunctionApplier::
+applyBatch(const std::vector<FunctionContext> & inputs) const
+{
+    ExcAssert(function);
+    return function->applyBatch(*this, inputs);
+}
+
 
 /*****************************************************************************/
 /* FUNCTION                                                                  */
@@ -738,6 +746,18 @@ Function::
 {
 }
 
+std::vector<FunctionOutput>
+Function::
+applyBatch(const FunctionApplier & applier,
+           const std::vector<FunctionContext> & contexts) const
+{
+    std::vector<FunctionOutput> result;
+    result.reserve(contexts.size());
+    for (auto & c: contexts)
+        result.emplace_back(apply(applier, c));
+    return result;
+}
+
 Any
 Function::
 getStatus() const
@@ -418,6 +418,11 @@ struct FunctionApplier {
 
     /// Apply the function to the given context
     FunctionOutput apply(const FunctionContext & input) const;
+
+    /// Apply the function to each of the given contexts.  This gives the
+    /// function a chance to amortize its work over many rows.
+    std::vector<FunctionOutput>
+    applyBatch(const std::vector<FunctionContext> & inputs) const;
 };
 
 
@@ -497,6 +502,15 @@ protected:
 
     virtual FunctionOutput apply(const FunctionApplier & applier, const FunctionContext & context) const = 0;
 
+    /** Used by the FunctionApplier to apply the function to a batch of
+        inputs, returning one output per input.  The default calls apply()
+        on each of them; functions that can share work between rows (for
+        example by scoring them all at once) override it.
+    */
+    virtual std::vector<FunctionOutput>
+    applyBatch(const FunctionApplier & applier,
+               const std::vector<FunctionContext> & contexts) const;
+
     friend class FunctionApplier;
 };
 
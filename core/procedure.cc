@@ -17,6 +17,7 @@
 #include "mldb/core/plugin.h"
 #include "mldb/core/function.h"
 #include "mldb/types/any_impl.h"
+#include "mldb/jml/utils/worker_task.h"
 
 
 using namespace std;
@@ -30,6 +31,38 @@ namespace MLDB {
 /* PROCEDURE TRAINING                                                         */
 /*****************************************************************************/
 
+DEFINE_ENUM_DESCRIPTION(RunPriority);
+
+RunPriorityDescription::
+RunPriorityDescription()
+{
+    addValue("low", RP_LOW,
+             "Background work, which only gets threads that nothing more "
+             "important needs");
+    addValue("normal", RP_NORMAL, "Default priority");
+    addValue("high", RP_HIGH,
+             "Latency sensitive work, which gets threads before anything "
+             "else");
+}
+
+static_assert((int)RP_LOW == (int)ML::PRIORITY_LOW
+              && (int)RP_NORMAL == (int)ML::PRIORITY_NORMAL
+              && (int)RP_HIGH == (int)ML::PRIORITY_HIGH,
+              "run priorities must match job priorities");
+
+void validateMaxParallelism(int maxParallelism)
+{
+    if (maxParallelism == 0 || maxParallelism < -1)
+        throw HttpReturnException(400, "maxParallelism must be -1 or positive",
+                                  "maxParallelism", maxParallelism);
+}
+
+ProcedureRunConfig::
+ProcedureRunConfig()
+    : priority(RP_NORMAL), maxParallelism(-1)
+{
+}
+
 DEFINE_STRUCTURE_DESCRIPTION(ProcedureRunConfig);
 
 ProcedureRunConfigDescription::
@@ -39,6 +72,15 @@ ProcedureRunConfigDescription()
 
     addField("id", &ProcedureRunConfig::id, "ID of run");
     addField("params", &ProcedureRunConfig::params, "Parameters of run");
+    addField("priority", &ProcedureRunConfig::priority,
+             "Priority of the run's work in the shared thread pool, relative "
+             "to queries and other runs.  Use `low` for long background "
+             "work so that interactive queries aren't held up by it.",
+             RP_NORMAL);
+    addField("maxParallelism", &ProcedureRunConfig::maxParallelism,
+             "Maximum number of threads that the run can use at once, or -1 "
+             "for no limit.  The thread that the run was started on comes "
+             "on top of this.", -1);
 }
 
 DEFINE_STRUCTURE_DESCRIPTION(ProcedureRunStatus);
@@ -61,6 +103,20 @@ ProcedureRun(Procedure * owner,
     runStarted = Date::now();
     ExcAssert(owner);
     this->config.reset(new ProcedureRunConfig(std::move(config)));
+
+    int maxParallelism = this->config->maxParallelism;
+    validateMaxParallelism(maxParallelism);
+
+    // Everything run in the thread pool on behalf of the run is scheduled
+    // with its priority.  Runs with the default settings keep those of
+    // whatever started them, such as a parent procedure.
+    std::unique_ptr<ML::Job_Class_Guard> jobClass;
+    if (this->config->priority != RP_NORMAL || maxParallelism != -1) {
+        jobClass.reset(new ML::Job_Class_Guard
+                       ((ML::Job_Priority)this->config->priority,
+                        maxParallelism));
+    }
+
     try {
         RunOutput output = owner->run(*this->config, onProgress);
         this->results = std::move(output.results);
@@ -38,9 +38,29 @@ typedef EntityType<Procedure> ProcedureType;
 /* PROCEDURE TRAINING                                                        */
 /*****************************************************************************/
 
+/** Priority of the work done by a procedure run or a query, relative to
+    the rest of the work running in the same process.
+*/
+enum RunPriority {
+    RP_LOW,      ///< Background work that shouldn't hold up anything else
+    RP_NORMAL,   ///< Default priority
+    RP_HIGH      ///< Latency sensitive work
+};
+
+DECLARE_ENUM_DESCRIPTION(RunPriority);
+
+/** Throw a 400 error unless maxParallelism is -1 (no limit) or a positive
+    number of threads.
+*/
+void validateMaxParallelism(int maxParallelism);
+
 struct ProcedureRunConfig {
+    ProcedureRunConfig();
+
     Utf8String id;
     Any params;
+    RunPriority priority;
+    int maxParallelism;
 };
 
 DECLARE_STRUCTURE_DESCRIPTION(ProcedureRunConfig);
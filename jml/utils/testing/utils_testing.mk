@@ -11,3 +11,4 @@ $(eval $(call test,string_functions_test,arch utils,boost))
 $(eval $(call test,csv_parsing_test,arch utils,boost))
 
 $(eval $(call test,worker_task_test,worker_task arch boost_thread pthread,boost))
+$(eval $(call test,worker_task_benchmark,worker_task arch,boost manual))
@@ -0,0 +1,172 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* worker_task_benchmark.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Benchmark of the work stealing worker task against a scheduler with a
+   single shared job queue, as the worker task used to be.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "mldb/jml/utils/worker_task.h"
+#include "mldb/arch/timers.h"
+#include <condition_variable>
+#include <atomic>
+#include <list>
+#include <iostream>
+
+using namespace ML;
+using namespace std;
+
+
+/*****************************************************************************/
+/* CENTRAL QUEUE TASK                                                        */
+/*****************************************************************************/
+
+/** Minimal scheduler with all jobs in a single list protected by a single
+    mutex, as in the previous implementation of Worker_Task but without
+    any of its bookkeeping, which makes it a best case for a shared queue.
+    Waiting threads run jobs too, so that nested groups don't deadlock.
+*/
+
+struct Central_Queue_Task {
+
+    struct Group {
+        std::atomic<int> outstanding;
+        Group() : outstanding(0) {}
+    };
+
+    Central_Queue_Task(int threads)
+        : shutdown(false)
+    {
+        for (unsigned i = 0;  i < threads;  ++i)
+            workers.emplace_back([=] () { this->runWorker(); });
+    }
+
+    ~Central_Queue_Task()
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            shutdown = true;
+            changed.notify_all();
+        }
+        for (auto & t: workers)
+            t.join();
+    }
+
+    template<typename Fn>
+    void do_group(int first, int last, Fn doWork)
+    {
+        Group group;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            for (int i = first;  i < last;  ++i) {
+                ++group.outstanding;
+                jobs.emplace_back([=,&group] () { doWork(i); }, &group);
+            }
+            changed.notify_all();
+        }
+
+        while (group.outstanding > 0) {
+            if (!runOne(false)) {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard,
+                             [&] () { return !jobs.empty()
+                                      || group.outstanding == 0; });
+            }
+        }
+    }
+
+    bool runOne(bool wait)
+    {
+        std::pair<Job, Group *> job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (wait)
+                changed.wait(guard,
+                             [&] () { return !jobs.empty() || shutdown; });
+            if (jobs.empty())
+                return false;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job.first();
+
+        std::unique_lock<std::mutex> guard(lock);
+        if (--job.second->outstanding == 0)
+            changed.notify_all();
+        return true;
+    }
+
+    void runWorker()
+    {
+        while (!shutdown)
+            runOne(true);
+    }
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::list<std::pair<Job, Group *> > jobs;
+    std::vector<std::thread> workers;
+    std::atomic<bool> shutdown;
+};
+
+namespace {
+
+/// Do a small amount of work, as in a real job
+void spin(int n)
+{
+    volatile double x = 0;
+    for (int i = 0;  i < n;  ++i)
+        x = x + i;
+}
+
+template<typename Task>
+double benchmark(Task & task, int numOuter, int numInner, int workPerJob)
+{
+    Timer timer;
+    std::atomic<int> count(0);
+
+    auto doOuter = [&] (int)
+        {
+            task.do_group(0, numInner,
+                          [&] (int) { spin(workPerJob);  ++count; });
+        };
+
+    task.do_group(0, numOuter, doOuter);
+
+    BOOST_CHECK_EQUAL(count, numOuter * numInner);
+    return timer.elapsed_wall();
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( benchmark_worker_task )
+{
+    for (int nthreads: { 1, 2, 4, 8, 16, 32, 64 }) {
+        if (nthreads > 2 * num_threads())
+            break;
+
+        Worker_Task stealing(nthreads - 1);
+        Central_Queue_Task central(nthreads - 1);
+
+        for (int work: { 0, 100, 1000 }) {
+            // Flat group of many small jobs, then many small nested groups
+            for (auto shape: { make_pair(1, 200000), make_pair(2000, 100) }) {
+                double t1 = benchmark(central, shape.first, shape.second,
+                                      work);
+                double t2 = benchmark(stealing, shape.first, shape.second,
+                                      work);
+
+                cerr << "threads " << nthreads << " work " << work
+                     << " groups " << shape.first << "x" << shape.second
+                     << ": central " << t1 << "s stealing " << t2
+                     << "s speedup " << t1 / t2 << endl;
+            }
+        }
+    }
+}
@@ -15,6 +15,7 @@
 #include <boost/thread/barrier.hpp>
 #include <vector>
 #include <stdint.h>
+#include <atomic>
 #include <iostream>
 
 #include "mldb/jml/utils/worker_task.h"
@@ -161,3 +162,145 @@ BOOST_AUTO_TEST_CASE( test_exception )
                           std::exception);
     }
 }
+
+BOOST_AUTO_TEST_CASE( test_nested_groups )
+{
+    Worker_Task worker(3);
+
+    for (unsigned iter = 0;  iter < 20;  ++iter) {
+        std::atomic<int> count(0);
+
+        auto doOuter = [&] (int i)
+            {
+                run_in_parallel(0, 100, [&] (int j) { ++count; },
+                                -1, "", "", worker);
+            };
+
+        run_in_parallel(0, 100, doOuter, -1, "", "", worker);
+        BOOST_CHECK_EQUAL(count, 10000);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_nested_exception )
+{
+    Worker_Task worker(3);
+    set_trace_exceptions(false);
+
+    for (unsigned iter = 0;  iter < 20;  ++iter) {
+        JML_TRACE_EXCEPTIONS(false);
+        std::atomic<int> count(0);
+
+        auto doOuter = [&] (int i)
+            {
+                auto doInner = [&] (int j)
+                {
+                    if (i == 50 && j == 50)
+                        throw Exception("there was an exception");
+                    ++count;
+                };
+
+                run_in_parallel(0, 100, doInner, -1, "", "", worker);
+            };
+
+        BOOST_CHECK_THROW(run_in_parallel(0, 100, doOuter, -1, "", "",
+                                          worker),
+                          std::exception);
+
+        // The remaining jobs of the failed group were skipped
+        BOOST_CHECK_LT(count, 10000);
+    }
+
+    // The worker is still usable afterwards
+    std::atomic<int> count(0);
+    run_in_parallel(0, 1000, [&] (int i) { ++count; }, -1, "", "", worker);
+    BOOST_CHECK_EQUAL(count, 1000);
+}
+
+BOOST_AUTO_TEST_CASE( test_no_threads )
+{
+    // With no worker threads, the calling thread does all of the work
+    Worker_Task worker(0);
+    std::atomic<int> count(0);
+    run_in_parallel(0, 1000, [&] (int i) { ++count; }, -1, "", "", worker);
+    BOOST_CHECK_EQUAL(count, 1000);
+}
+
+BOOST_AUTO_TEST_CASE( test_max_parallelism )
+{
+    Worker_Task worker(7);
+
+    for (int maxParallelism: { 1, 2, 4 }) {
+        std::atomic<int> running(0), maxRunning(0), count(0);
+
+        auto doJob = [&] (int i)
+            {
+                int r = ++running;
+                int m = maxRunning;
+                while (r > m && !maxRunning.compare_exchange_weak(m, r)) ;
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                --running;
+                ++count;
+            };
+
+        {
+            Job_Class_Guard guard(PRIORITY_LOW, maxParallelism);
+            run_in_parallel(0, 200, doJob, -1, "", "", worker);
+        }
+
+        BOOST_CHECK_EQUAL(count, 200);
+
+        // The thread waiting for the group may run jobs on top of the limit
+        BOOST_CHECK_LE(maxRunning, maxParallelism + 1);
+    }
+
+    BOOST_CHECK_THROW(Job_Class(PRIORITY_NORMAL, 0), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_priority )
+{
+    Worker_Task worker(3);
+
+    // Flood the worker with background jobs from another thread
+    std::atomic<int> numLow(0);
+    std::thread background([&] ()
+        {
+            Job_Class_Guard guard(PRIORITY_LOW);
+            run_in_parallel(0, 4000,
+                            [&] (int)
+                            {
+                                std::this_thread::sleep_for
+                                    (std::chrono::microseconds(50));
+                                ++numLow;
+                            },
+                            -1, "", "", worker);
+        });
+
+    while (numLow < 10)
+        std::this_thread::yield();
+
+    // High priority jobs, and the groups nested within them, overtake them
+    std::atomic<int> numHigh(0);
+    {
+        Job_Class_Guard guard(PRIORITY_HIGH);
+        BOOST_CHECK_EQUAL(Job_Class::current()->priority, PRIORITY_HIGH);
+
+        auto doOuter = [&] (int)
+            {
+                BOOST_CHECK_EQUAL(Job_Class::current()->priority,
+                                  PRIORITY_HIGH);
+                run_in_parallel(0, 10, [&] (int) { ++numHigh; },
+                                -1, "", "", worker);
+            };
+        run_in_parallel(0, 10, doOuter, -1, "", "", worker);
+    }
+
+    int lowWhenFinished = numLow;
+    cerr << "low priority jobs done when high priority finished: "
+         << lowWhenFinished << endl;
+    BOOST_CHECK_EQUAL(numHigh, 100);
+    BOOST_CHECK_LT(lowWhenFinished, 4000);
+
+    background.join();
+    BOOST_CHECK_EQUAL(numLow, 4000);
+    BOOST_CHECK(!Job_Class::current());
+}
@@ -18,6 +18,7 @@
 #include "mldb/jml/utils/environment.h"
 #include "mldb/jml/utils/guard.h"
 #include "mldb/arch/cpu_info.h"
+#include <deque>
 
 
 using namespace std;
@@ -49,6 +50,177 @@ void log(const string & msg)
 const Job NO_JOB;
 
 
+/*****************************************************************************/
+/* JOB CLASS                                                                 */
+/*****************************************************************************/
+
+namespace {
+
+/// Class of the groups created by this thread; null if none was set
+thread_local const std::shared_ptr<Job_Class> * current_class = nullptr;
+
+const std::shared_ptr<Job_Class> default_class;
+
+} // file scope
+
+Job_Class::
+Job_Class(Job_Priority priority, int maxParallelism)
+    : priority(priority), maxParallelism(maxParallelism), running(0)
+{
+    if (priority < PRIORITY_LOW || priority >= NUM_PRIORITIES)
+        throw Exception("Job_Class: invalid priority %d", (int)priority);
+    if (maxParallelism == 0 || maxParallelism < -1)
+        throw Exception("Job_Class: maximum parallelism must be -1 or "
+                        "positive, not %d", maxParallelism);
+}
+
+std::shared_ptr<Job_Class>
+Job_Class::
+current()
+{
+    return current_class ? *current_class : default_class;
+}
+
+Job_Class_Guard::
+Job_Class_Guard(std::shared_ptr<Job_Class> cls)
+    : cls(std::move(cls)), previous(current_class)
+{
+    current_class = &this->cls;
+}
+
+Job_Class_Guard::
+Job_Class_Guard(Job_Priority priority, int maxParallelism)
+    : Job_Class_Guard(std::make_shared<Job_Class>(priority, maxParallelism))
+{
+}
+
+Job_Class_Guard::
+~Job_Class_Guard()
+{
+    current_class = previous;
+}
+
+
+/*****************************************************************************/
+/* WORKER_TASK INTERNALS                                                     */
+/*****************************************************************************/
+
+struct Worker_Task::Job_Info {
+    Job_Info()
+        : id(-1), group(nullptr), cls(nullptr), priority(PRIORITY_NORMAL),
+          counted(false)
+    {
+    }
+
+    Job_Info(Job job, Job error, const std::string & info, Id id,
+             Group_Info * group, Job_Class * cls, int priority)
+        : job(std::move(job)), error(std::move(error)), id(id), group(group),
+          cls(cls), priority(priority), counted(false), info(info)
+    {
+    }
+
+    Job job;
+    Job error;
+    Id id;
+    Group_Info * group;  // kept alive by its outstanding job count
+    Job_Class * cls;     // kept alive by the group
+    int priority;
+    bool counted;        // counted against the class's parallelism
+    std::string info;
+    void dump(std::ostream & stream, int indent = 0) const;
+};
+
+struct Worker_Task::Group_Info {
+    Group_Info(Id id, const Job & finished, const std::string & info,
+               std::shared_ptr<Group_Info> parent,
+               std::shared_ptr<Job_Class> cls, bool locked)
+        : id(id), finished(finished), info(info), parent(std::move(parent)),
+          cls(std::move(cls)),
+          priority(this->cls ? this->cls->priority : PRIORITY_NORMAL),
+          pending(locked), groups_outstanding(0), locked(locked), error(false),
+          removed(false)
+        {
+        }
+
+    Id id;
+    Job finished;
+    std::string info;
+    std::shared_ptr<Group_Info> parent;  ///< Group to notify when finished
+    std::shared_ptr<Job_Class> cls;      ///< Class the jobs run under
+    int priority;                        ///< Priority of the jobs
+
+    /// Number of jobs (queued or running) and child groups outstanding,
+    /// plus one if locked.  The group is finished when this gets to zero.
+    std::atomic<int> pending;
+
+    std::atomic<int> groups_outstanding; ///< Number of groups waiting for
+    std::atomic<bool> locked;
+    std::atomic<bool> error;             ///< A job in the group threw
+    std::atomic<bool> removed;           ///< Group is finished
+
+    std::mutex exc_lock;
+    std::exception_ptr exc;              ///< Exception to rethrow
+
+    /** Increment the pending count, unless the group has already been
+        removed. */
+    bool acquire()
+    {
+        ++pending;
+        if (!removed)
+            return true;
+        --pending;
+        return false;
+    }
+
+    void set_error(std::exception_ptr ptr)
+    {
+        std::unique_lock<std::mutex> guard(exc_lock);
+        if (!exc)
+            exc = std::move(ptr);
+        error = true;
+    }
+
+    /// Has this group or one of its parents had an error?
+    bool cancelled() const
+    {
+        for (const Group_Info * g = this;  g;  g = g->parent.get())
+            if (g->error)
+                return true;
+        return false;
+    }
+
+    /// Is this group the given one or one of its children?
+    bool in_group(const Group_Info * group) const
+    {
+        for (const Group_Info * g = this;  g;  g = g->parent.get())
+            if (g == group)
+                return true;
+        return false;
+    }
+
+    void dump(std::ostream & stream, int indent = 0) const;
+};
+
+struct Worker_Task::Queue {
+    Spinlock lock;
+    std::deque<Job_Info> jobs[NUM_PRIORITIES];
+    char padding[64];  // avoid false sharing between the queues' locks
+};
+
+namespace {
+
+/// Worker task and queue owned by this thread, if it's a worker thread
+thread_local const Worker_Task * current_task = nullptr;
+thread_local int current_queue = -1;
+
+/// Round robin position for jobs added by threads that aren't workers
+thread_local unsigned next_external_queue = 0;
+
+std::atomic<uint64_t> next_serial(0);
+
+} // file scope
+
+
 /*****************************************************************************/
 /* WORKER_TASK                                                               */
 /*****************************************************************************/
@@ -63,10 +235,13 @@ instance(int thr)
 
 Worker_Task::
 Worker_Task(int threads)
-    : jobs_sem(0), finished_sem(1), state_change_sem(0), shutdown_sem(0),
-      next_group(0), next_job(0), num_queued(0),
-      num_running(0), force_finished(false)
+    : serial_(++next_serial), next_queue(0),
+      next_group(0), next_job(0), num_queued(0), num_running(0),
+      job_events(0), num_idle(0), num_waiting(0), force_finished(false)
 {
+    for (auto & n: num_queued_priority)
+        n = 0;
+
     if (threads == -1)
         threads = num_cpus();
 
@@ -77,6 +252,11 @@ Worker_Task(int threads)
     if (threads > 1024)
         throw ML::Exception("Trying to create too many threads in worker task");
 
+    // With no worker threads, jobs are only run by the threads waiting
+    // for them, but they still need somewhere to go
+    numQueues = std::max(threads, 1);
+    queues.reset(new Queue[numQueues]);
+
     /* Create our threads */
     for (unsigned i = 0;  i < threads;  ++i)
         workerThreads_.emplace_back(new std::thread(std::bind(&Worker_Task::runWorkerThread, this)));
@@ -88,29 +268,52 @@ Worker_Task::
     log("~Worker_Task: stopping worker task\n");
     force_finished = true;
 
-    // Wake up all tasks by providing jobs
-    for (unsigned i = 0;  i < threads_;  ++i)
-        jobs_sem.release();
+    // Wake up all threads so that they see that we're finished
+    {
+        Guard guard(sleep_lock);
+        jobs_available.notify_all();
+        state_changed.notify_all();
+    }
 
     /* TODO: finish all tasks */
-    if (jobs.size() || groups.size())
-        cerr << "at the end, there were " << jobs.size()
+    if (num_queued || groups.size())
+        cerr << "at the end, there were " << num_queued
              << " jobs outstanding and "
              << groups.size() << " groups outstanding" << endl;
 
-    for (unsigned i = 0;  i < threads_;  ++i)
-        shutdown_sem.acquire();
-
     // Join all worker threads
-    for (auto & t: workerThreads_) {
-        while (!t->joinable())
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    for (auto & t: workerThreads_)
         t->join();
-    }
 
     log("~Worker_Task: stopped worker task\n");
 }
 
+const std::shared_ptr<Worker_Task::Group_Info> &
+Worker_Task::
+find_group(Id group) const
+{
+    static thread_local uint64_t cached_serial = 0;
+    static thread_local Id cached_id = -1;
+    static thread_local std::shared_ptr<Group_Info> cached_group;
+
+    if (cached_serial == serial_ && cached_id == group
+        && cached_group && !cached_group->removed)
+        return cached_group;
+
+    {
+        Guard guard(groups_lock);
+        auto it = groups.find(group);
+        if (it != groups.end())
+            cached_group = it->second;
+        else cached_group.reset();
+    }
+
+    cached_serial = serial_;
+    cached_id = group;
+
+    return cached_group;
+}
+
 Worker_Task::Id
 Worker_Task::
 get_group(const Job & group_finish, const std::string & info_str,
@@ -120,790 +323,544 @@ get_group(const Job & group_finish, const std::string & info_str,
 
     if (!locked) cerr << "warning: creating unlocked group" << endl;
 
-    Guard guard(lock);
-    Id id = next_group++;
-    groups[id].finished = group_finish;
-    groups[id].parent_group = parent_group;
-    groups[id].locked = locked;
-    groups[id].info = info_str;
-
-    /* Add a job for the group.  This allows us to keep track of where the child
-       jobs get inserted. */
-    Job_Info info(group_finish, Job(),
-                  format("job for group %lld: ", id) + info_str, -1, id);
-    
-    Jobs::iterator where = jobs.end();
-
-    /* Insert it at the end of its parent's jobs if it has one. */
+    std::shared_ptr<Group_Info> parent;
     if (parent_group != -1) {
-        groups[parent_group].groups_outstanding += 1;
-        where = groups[parent_group].group_job;
+        parent = find_group(parent_group);
+        if (!parent || !parent->acquire())
+            throw Exception("Worker_Task::get_group(): parent group %lld "
+                            "doesn't exist", parent_group);
+        ++parent->groups_outstanding;
     }
-    
-    Jobs::iterator it = jobs.insert(where, info);
-    groups[id].group_job = it;
-    
-    notify_state_changed();
-    
+
+    // Groups take the class of the thread creating them, or of their
+    // parent if the thread hasn't set one
+    std::shared_ptr<Job_Class> cls;
+    if (current_class)
+        cls = *current_class;
+    else if (parent)
+        cls = parent->cls;
+
+    Id id = next_group++;
+    auto group = std::make_shared<Group_Info>(id, group_finish, info_str,
+                                              std::move(parent),
+                                              std::move(cls), locked);
+
+    Guard guard(groups_lock);
+    groups[id] = std::move(group);
+
     return id;
 }
 
 void Worker_Task::unlock_group(int group)
 {
     //cerr << "unlocked group " << group << endl;
-    Guard guard(lock);
-    if (!groups.count(group))
+    auto group_info = find_group(group);
+    if (!group_info)
         throw Exception("Worker_Task::unlock_group(): group info has none");
-    groups[group].locked = false;
-    check_finished_ul(group);
 
-    notify_state_changed();
+    if (group_info->locked.exchange(false))
+        release_group(group_info.get());
+    else if (group_info->pending == 0)
+        finish_group(group_info.get());
 }
 
 Worker_Task::Id
 Worker_Task::
-add(const Job & job, const Job & error, const std::string & job_info, Id group)
+add(Job job, Job error, const std::string & job_info, Id group)
 {
-    /* Wait to manupulate */
-    Guard guard(lock);
-    Job_Info info(job, error, job_info, next_job++, group);
-
-    /* Find where to put it. */
+    Group_Info * group_info = nullptr;
+    Job_Class * cls = nullptr;
+    int priority = PRIORITY_NORMAL;
 
     if (group != -1) {
-        if (!groups.count(group))
+        const auto & info = find_group(group);
+        if (!info)
             throw Exception("Worker_Task::add(): group info has none");
 
-        Group_Info & group_info = groups[group];
-        if (group_info.exc) {
+        if (info->error) {
             log("ignoring job addition to an error group\n");
             return -1;
         }
-        ++group_info.jobs_outstanding;
-        
-        /* Jobs::iterator it = */ jobs.insert(group_info.group_job, info);
+
+        if (!info->acquire())
+            throw Exception("Worker_Task::add(): group has finished");
+
+        // The job's pending count now keeps the group alive
+        group_info = info.get();
+        cls = info->cls.get();
+        priority = info->priority;
+    }
+    else if (current_class && *current_class) {
+        // Jobs outside of a group aren't limited, but keep their priority
+        priority = (*current_class)->priority;
     }
-    else jobs.push_back(info);
-    
-    ++num_queued;
-    
-    jobs_sem.release();  // release one to allow something to run the job
-    
-    /* If this is the first job running, then we are no longer finished so we
-       acquire the finished semaphore. */
-    if (num_queued + num_running == 1)
-        finished_sem.acquire();
 
-    notify_state_changed();
-    
-    return info.id;
+    Id id = next_job++;
+    push_job(Job_Info(std::move(job), std::move(error), job_info, id,
+                      group_info, cls, priority));
+    return id;
 }
 
 Worker_Task::Id
 Worker_Task::
-add(const Job & job, const std::string & job_info, Id group)
+add(Job job, const std::string & job_info, Id group)
 {
-    return add(job, Job(), job_info, group);
+    return add(std::move(job), Job(), job_info, group);
 }
 
-void Worker_Task::finish_all()
+void
+Worker_Task::
+push_job(Job_Info info)
 {
-    /* Wait until we are finished */
-    finished_sem.acquire();
+    int q;
+    if (current_task == this)
+        q = current_queue;
+    else q = next_external_queue++ % numQueues;
 
-    /* Let something else finish */
-    finished_sem.release();
-}
+    int priority = info.priority;
 
-void Worker_Task::clear_all()
-{
-    throw Exception("Worker_Task::clear_all(): not implemented");
+    // Counted before it's visible, so that a thread that finds the job
+    // never makes the count negative
+    ++num_queued;
+    ++num_queued_priority[priority];
+
+    {
+        std::unique_lock<Spinlock> guard(queues[q].lock);
+        queues[q].jobs[priority].emplace_back(std::move(info));
+    }
+
+    ++job_events;
+    notify_worker();
+    notify_waiters();
 }
 
-int Worker_Task::runWorkerThread()
+bool
+Worker_Task::
+pop_job(Queue & queue, Job_Info & info, int priority, bool back,
+        const Group_Info * group, bool onlyGroup)
 {
-    //cerr << "worker function" << endl;
-    
-    /* This is the worker function.  We grab work while there is any until it
-       is time to exit. */
-    
-    while (!force_finished) {
-        
-        log("runWorkerThread: getting job\n");
-        Job_Info info = get_job();
-        log("runWorkerThread: got job: " + to_string(info.id) + "\n");
+    // How far into the queue we look for a job that we can run
+    static constexpr size_t MAX_SCAN = 16;
 
-        if (force_finished) break;
+    std::unique_lock<Spinlock> guard(queue.lock);
+    auto & jobs = queue.jobs[priority];
 
-        try {
-            log("runWorkerThread: running job\n");
-            //cerr << "thread " << ACE_OS::thr_self() << " is running job "
-            //     << info.id << " (" << info.info << ")" << endl;
-            if (!info.invalidGroup) {
-                info.job();
-            }
-            else {
-                log("skipping job from invalid group\n");
-            }
-        }
-        catch (const std::exception & exc) {
-            log("runWorkerThread: job exception: " + string(exc.what())
-                + "\n");
-            // TODO: make this exception go to the calling process
-            //cerr << "thread " << ACE_OS::thr_self() << " running job "
-            //     << info.id << " (" << info.info << "): " << endl;
-            //cerr << "warning: job threw exception: "
-            //     << exc.what() << endl;
-            try {
-                if (info.error) info.error();
-            }
-            catch (const std::exception & exc) {
-                cerr << "warning: job error function throw exception: "
-                     << exc.what() << endl;
-            }
+    for (size_t i = 0;  i < jobs.size() && i < MAX_SCAN;  ++i) {
+        size_t index = back ? jobs.size() - 1 - i : i;
+        Job_Info & job = jobs[index];
 
-            /* Indicate that the job's group had an error. */
-            if (info.group != -1) {
-                Guard guard(lock);
-                Group_Info & group_info = groups[info.group];
-                if (!group_info.exc) {
-                    /* When a job fails in a group, all remaining jobs from
-                       this group are marked for skipping and the queue is
-                       cleaned up gradually via get_job/finish_job. This
-                       marking is performed by both the worker and control
-                       threads. When it is known that all jobs have been fully
-                       executed or skipped, the group is then removed and the
-                       exception rethrown from the control thread. */
-                    group_info.exc = current_exception();
-                    mark_group_jobs_invalid_ul(group_info, info.group);
-                }
+        bool inGroup = group && job.group && job.group->in_group(group);
+        if (onlyGroup && !inGroup)
+            continue;
+
+        // Jobs of the group we're waiting for run on our own time, so
+        // they're not counted against the parallelism of their class
+        bool counted = false;
+        if (!inGroup && job.cls && job.cls->maxParallelism != -1) {
+            if (++job.cls->running > job.cls->maxParallelism) {
+                --job.cls->running;
+                continue;
             }
+            counted = true;
         }
-        //cerr << "thread " << ACE_OS::thr_self() << " is finished job "
-        //     << info.id << " (" << info.info << ")" << endl;
-        finish_job(info);
-    }
-
-    shutdown_sem.release();
-    
-    return 0;
-}
 
-void Worker_Task::notify_state_changed()
-{
-    // must be called with the lock held
-    for (set<Semaphore *>::const_iterator it = state_semaphores.begin();
-         it != state_semaphores.end();  ++it)
-        (*it)->release();
-}
-
-void Worker_Task::add_state_semaphore(Semaphore & sem)
-{
-    Guard guard(lock);
-    if (state_semaphores.count(&sem))
-        throw Exception("same state semaphore added twice");
-    state_semaphores.insert(&sem);
-}
+        info = std::move(job);
+        info.counted = counted;
+        jobs.erase(jobs.begin() + index);
+        return true;
+    }
 
-void Worker_Task::remove_state_semaphore(Semaphore & sem)
-{
-    Guard guard(lock);
-    if (!state_semaphores.count(&sem))
-        throw Exception("state semaphore was lost");
-    state_semaphores.erase(&sem);
+    return false;
 }
 
-void Worker_Task::run_until_released(Semaphore & sem, int group)
+bool
+Worker_Task::
+try_get_job(Job_Info & info, const Group_Info * group)
 {
-    /* We check at every change in state for either a) the semaphore
-       being free or b) a job being available. */
+    if (force_finished || num_queued <= 0)
+        return false;
 
-    Semaphore state_semaphore(0);
-    add_state_semaphore(state_semaphore);
+    int own = current_task == this ? current_queue : -1;
+    unsigned start = own == -1 ? next_external_queue++ : own + 1;
 
-    /* Make sure we remove this semaphore at the end. */
-    Call_Guard guard(std::bind(&Worker_Task::remove_state_semaphore,
-                                 this, std::ref(state_semaphore)));
-    
-    while (sem.tryacquire() == -1) {
+    // A thread waiting for a group only runs other jobs that are at least
+    // as important as the group, so that it's not held up by them
+    int minPriority = group ? group->priority : PRIORITY_LOW;
 
-        /* Run a job, if there is one old job to finish. */
-        
-        Job_Info info;
-        if (try_get_job(info, group)) {
-            // release lock here
+    for (int priority = NUM_PRIORITIES - 1;  priority >= 0;  --priority) {
+        if (num_queued_priority[priority] <= 0)
+            continue;
 
-            try {
-                if (!info.invalidGroup) {
-                    info.job();
-                }
-                else {
-                    log("skipping job from invalid group\n");
-                }
-            }
-            catch (const std::exception & exc) {
-                // TODO: make this exception go to the calling process
-                cerr << "warning: job threw exception: "
-                     << exc.what() << endl;
-                try {
-                    if (info.error) info.error();
-                }
-                catch (const std::exception & exc) {
-                    cerr << "warning: job error function throw exception: "
-                         << exc.what() << endl;
-                }
+        bool onlyGroup = priority < minPriority;
+        if (onlyGroup && !group)
+            break;
+
+        bool found = false;
+
+        // Our own queue first, newest job first
+        if (own != -1)
+            found = pop_job(queues[own], info, priority, true /* back */,
+                            group, onlyGroup);
+
+        // Then steal the oldest job from the others, preferring the group
+        // we're waiting for
+        for (int pass = group ? 0 : 1;  pass < 2 && !found;  ++pass) {
+            if (pass == 1 && onlyGroup)
+                break;
+            for (unsigned i = 0;  i < numQueues && !found;  ++i) {
+                found = pop_job(queues[(start + i) % numQueues], info,
+                                priority, false /* back */, group,
+                                pass == 0);
             }
-
-            finish_job(info);
-
-            continue;
         }
 
-        /* Wait for a state change. */
-        state_semaphore.acquire();
+        if (found) {
+            --num_queued;
+            --num_queued_priority[priority];
+            ++num_running;
+            return true;
+        }
     }
-    
-    sem.release();
-}
 
-void
-Worker_Task::
-cancel_group(Group_Info & group_info, int group)
-{
-    Guard guard(lock);
-    cancel_group_ul(group_info, group);
+    return false;
 }
 
 void
 Worker_Task::
-cancel_group_ul(Group_Info & group_info, int group)
+run_job(Job_Info & info)
 {
-    log("cancel_group_ul\n");
-    //cerr << "thread " << ACE_OS::thr_self() << " cancel_group() "
-    //     << group_info.info << endl;
-    
-    /* We clean up the group by scanning through its list of tasks, removing
-       those that haven't run yet, and calling all of the handlers. */
-    Jobs::iterator it = jobs.begin();
-        
-    /* Iterate through this group's jobs. */
-        
-    while (it != group_info.group_job) {
-        while (it != group_info.group_job
-               && (it->id == -1 || !in_group(*it, group))) ++it;
-            
-        if (it == group_info.group_job) break;
-            
-        /* Remove this job. */
-        //cerr << "removing job " << it->id << " (" << it->info
-        //     << ")" << endl;
-
-            
-        Jobs::iterator next = it;
-        ++next;
-        remove_job_ul(it);
-        it = next;
+    if (info.group && info.group->cancelled()) {
+        log("skipping job from invalid group\n");
+        finish_job(info);
+        return;
     }
-    
-    log("finished clearning jobs for group " + to_string(group) + "\n");
-}
 
-void
-Worker_Task::
-mark_group_jobs_invalid_ul(Group_Info & group_info, int group)
-{
-    log("mark_group_jobs_invalid_ul\n");
+    // Groups created by the job inherit its class
+    const std::shared_ptr<Job_Class> * old_class = current_class;
+    current_class = info.group ? &info.group->cls : &default_class;
 
-    if (group == -1) {
-        throw ML::Exception("cannot mark group -1 as invalid");
+    try {
+        info.job();
     }
+    catch (...) {
+        auto exc = std::current_exception();
 
-    for (Jobs::iterator it = jobs.begin(); it != group_info.group_job; it++) {
-        if (it->group == group) {
-            it->invalidGroup = true;
+        try {
+            if (info.error) info.error();
+        }
+        catch (const std::exception & exc) {
+            cerr << "warning: job error function throw exception: "
+                 << exc.what() << endl;
         }
+
+        /* Indicate that the job's group had an error.  The remaining jobs
+           of the group are skipped as they come up, and the exception is
+           rethrown by the thread waiting for the group. */
+        if (info.group)
+            info.group->set_error(exc);
+        else log("job outside of a group threw an exception\n");
     }
 
-    log("mark_group_jobs_invalid_ul done\n");
+    current_class = old_class;
+
+    finish_job(info);
 }
 
 void
 Worker_Task::
-wait_group_finished(Group_Info & group_info, int group)
+finish_job(const Job_Info & info)
 {
-    // cancel_group(group_info, group);
-    /* Wait until everything has stopped running in this group. */
-
-    Semaphore state_semaphore(0);
-    add_state_semaphore(state_semaphore);
+    // Another job of the class may be able to run now
+    if (info.counted) {
+        --info.cls->running;
+        ++job_events;
+        notify_worker();
+        notify_waiters();
+    }
 
-    /* Make sure we remove this semaphore at the end. */
-    Call_Guard guard(std::bind(&Worker_Task::remove_state_semaphore,
-                                 this, std::ref(state_semaphore)));
-    
-    while (group_info.jobs_running > 0)
-        state_semaphore.acquire();
+    if (info.group)
+        release_group(info.group);
 
-    /* Group should be finished. */
-    log("group finished\n");
+    if (--num_running == 0 && num_queued == 0)
+        notify_waiters();
 }
 
 void
 Worker_Task::
-run_until_finished(int group, bool unlock)
-{
-    /* We check at every change in state for either a) the group being
-       finished or b) an error from the group or c) a job being available.
-    */
+release_group(Group_Info * group)
+{
+    // Once the count is decremented, the group may be removed from under
+    // us by the thread waiting for it, so we can't touch it any more
+    int left = --group->pending;
+    if (left == 0)
+        finish_group(group);
+    else if (left == 1) {
+        // Only the lock of a thread waiting for it may remain
+        notify_waiters();
+    }
+}
 
-    map<Id, Group_Info>::iterator group_it;
-    
-    /* Lock the group so that it doesn't get removed. */
+bool
+Worker_Task::
+finish_group(Group_Info * group)
+{
+    /* If group has an exception attached to it, it must stay in memory
+       until the control thread handles it. */
     {
-        Guard guard(lock);
-        group_it = groups.find(group);
-        if (group_it == groups.end()) {
-            if (!unlock) return;  // group must have finished
-            throw Exception("Worker_Task::run_until_finished(): "
-                            "group doesn't exist but should be locked");
-        }
-        if (group_it->second.locked && !unlock)
-            throw Exception("Worker_Task::run_until_finished(): "
-                            "group is locked; it won't ever finish");
-        group_it->second.locked = true;
+        std::unique_lock<std::mutex> guard(group->exc_lock);
+        if (group->exc)
+            return false;
     }
 
-    /* The group is locked for now; make sure it will be unlocked at the
-       end. */
-    Call_Guard unlock_guard(std::bind(&Worker_Task::unlock_group,
-                                        this, group));
-    
-    /* Since the group is locked, this object must remain in memory here
-       and so we don't need to lock to access it.  (A map's iterators
-       aren't invalidated unless the actual object itself is removed).
-    */
-    Group_Info & group_info = group_it->second;
+    if (group->removed.exchange(true))
+        return false;
 
-    /* Create a semaphore so that we get notified of state changes. */
-    Semaphore state_semaphore(0);
-    add_state_semaphore(state_semaphore);
-    
-    /* Make sure we remove this semaphore at the end. */
-    Call_Guard state_guard(std::bind(&Worker_Task::remove_state_semaphore,
-                                       this, std::ref(state_semaphore)));
-    
-    for (;;) {
-        //cerr << "thread " << ACE_OS::thr_self() << " is waiting for group "
-        //     << group << " to finish" << endl;
+    //cerr << "finished group " << group->id << endl;
 
-        /* Is the group finished?  If so, we can get out of here. */
-        {
-            if (group_info.jobs_outstanding
-                + group_info.jobs_running
-                + group_info.groups_outstanding == 0) {
-                /* We're finished */
-
-                /* If the group had an error, clean up the group structures,
-                 * then rethrow the exception that occurred. */
-                if (group_info.exc) {
-                    //cerr << "thread " << ACE_OS::thr_self()
-                    //     << " had a group error" << endl;
-
-                    /* Save and replace the exception ptr, as we're about to
-                       remove the group. */
-                    exception_ptr exc = group_info.exc;
-                    group_info.exc = exception_ptr();
-
-                    /* Unlock the group to allow everything to finish. */
-                    unlock_guard.clear();
-                    unlock_group(group);
-
-                    /* Done; throw the exception. */
-                    if (exc)
-                        rethrow_exception(exc);
-                }
-                else
-                    return;
-            }
+    if (group->finished && !group->error) {
+        try {
+            group->finished();
         }
-
-        /* Run a job if we can */
-        Job_Info info;
-        log("run_until_finished: try to get job\n");
-        if (try_get_job(info, group)) {
-            log("run_until_finished: got job: " + to_string(info.id) + "\n");
-            try {
-                //cerr << "thread " << ACE_OS::thr_self() << " is running job "
-                //     << info.id << " (" << info.info << ")" << endl;
-                log("run_until_finished: running job\n");
-                if (!info.invalidGroup) {
-                    info.job();
-                }
-                else {
-                    log("skipping job from invalid group\n");
-                }
-
-                //cerr << "thread " << ACE_OS::thr_self() << " finished job "
-                //     << info.id << " (" << info.info << ")" << endl;
-            }
-            catch (const std::exception & exc) {
-                log("run_until_finished: job exception\n");
-                // TODO: make this exception go to the calling process
-                //cerr << "thread " << ACE_OS::thr_self() << " running job "
-                //     << info.id << " (" << info.info << "):" << endl;
-                // cerr << "run_until_finished: warning: job threw exception: "
-                //      << exc.what() << endl;
-                try {
-                    if (info.error) info.error();
-                }
-                catch (const std::exception & exc) {
-                    cerr << "warning: job error function throw exception: "
-                         << exc.what() << endl;
-                }
-
-                /* Indicate that the job's group had an error. */
-                if (info.group != -1) {
-                    Guard guard(lock);
-                    Group_Info & group_info = groups[info.group];
-                    if (!group_info.exc) {
-                        group_info.exc = current_exception();
-                        mark_group_jobs_invalid_ul(group_info, info.group);
-                    }
-                }
-            }
-            finish_job(info);
-            
-            continue;  // no state change needed
+        catch (const std::exception & exc) {
+            cerr << "Worker_Task::check_finished(): " << exc.what() << endl;
         }
-        
-        /* Wait for a state change. */
-        state_semaphore.acquire();
     }
-}
 
-void
-Worker_Task::
-lend_thread(int group)
-{
-    /* Run a job if we can */
-    Job_Info info;
-    if (try_get_job(info, group)) {
-        try {
-            //cerr << "thread " << ACE_OS::thr_self() << " is running job "
-            //     << info.id << " (" << info.info << ")" << endl;
-            if (!info.invalidGroup) {
-                info.job();
-            }
-            else {
-                log("skipping job from invalid group\n");
-            }
+    // Keep it alive until we're done with it
+    std::shared_ptr<Group_Info> holder;
+    {
+        Guard guard(groups_lock);
+        auto it = groups.find(group->id);
+        if (it != groups.end()) {
+            holder = std::move(it->second);
+            groups.erase(it);
         }
-        catch (const std::exception & exc) {
-            // TODO: make this exception go to the calling process
-            //cerr << "thread " << ACE_OS::thr_self() << " running job "
-            //     << info.id << " (" << info.info << "):" << endl;
-            cerr << "warning: job threw exception: "
-                 << exc.what() << endl;
-            try {
-                if (info.error) info.error();
-            }
-            catch (const std::exception & exc) {
-                cerr << "warning: job error function throw exception: "
-                     << exc.what() << endl;
-            }
+    }
 
-            /* Indicate that the job's group had an error. */
-            if (info.group != -1) {
-                Guard guard(lock);
-                Group_Info & group_info = groups[info.group];
-                if (!group_info.exc) {
-                    group_info.exc = current_exception();
-                    cancel_group_ul(group_info, info.group);
-                }
-            }
-        }
-        //cerr << "thread " << ACE_OS::thr_self() << " finished job "
-        //     << info.id << " (" << info.info << ")" << endl;
-        finish_job(info);
+    if (group->parent) {
+        --group->parent->groups_outstanding;
+        release_group(group->parent.get());
     }
+
+    notify_waiters();
+
+    return true;
 }
 
-bool Worker_Task::in_group(const Job_Info & info, int group)
+void Worker_Task::notify_worker()
 {
-    if (group == -1) return true;
-    
-    /* Check all parents. */
-    if (info.group == group) return true;
-    else if (info.group == -1) return false;
-    else {
-        Group_Info * group_info = &groups[info.group];
-        
-        while (group_info) {
-            Id parent = group_info->parent_group;
-
-            if (parent == -1) group_info = 0;
-            else {
-                if (!groups.count(parent))
-                    throw Exception("Worker_Task::in_group(): invalid "
-                                    "group number");
-                group_info = &groups[parent];
-            }
-        }
+    if (num_idle > 0) {
+        Guard guard(sleep_lock);
+        jobs_available.notify_one();
     }
-
-    return false;
 }
 
-Worker_Task::Job_Info
-Worker_Task::get_job(int group)
+void Worker_Task::notify_waiters()
 {
-    /* Block until we can acquire a semaphore to have jobs. */
-    for (unsigned i = 0;  i < 100;  ++i) {
-        if (jobs_sem.tryacquire() == 0) {
-            return get_job_impl(group);
-        }
-        sched_yield();
+    if (num_waiting > 0) {
+        Guard guard(sleep_lock);
+        state_changed.notify_all();
     }
-    jobs_sem.acquire();
+}
 
-    return get_job_impl(group);
+void Worker_Task::finish_all()
+{
+    /* Wait until we are finished */
+    Guard guard(sleep_lock);
+    ++num_waiting;
+    state_changed.wait(guard,
+                       [&] () { return num_queued + num_running == 0; });
+    --num_waiting;
 }
 
-bool Worker_Task::try_get_job(Worker_Task::Job_Info & job, int group)
+void Worker_Task::clear_all()
 {
-    if (jobs_sem.tryacquire() == -1) return false;
-    
-    job = get_job_impl(group);
-    return true;
+    throw Exception("Worker_Task::clear_all(): not implemented");
 }
 
-Worker_Task::Job_Info Worker_Task::get_job_impl(int group)
+int Worker_Task::runWorkerThread()
 {
-    //cerr << "thread " << ACE_OS::thr_self()
-    //     << " is getting a job in group " << group
-    //     << endl;
-    if (force_finished) return Job_Info();
+    //cerr << "worker function" << endl;
 
-    for (unsigned i = 0;  i < 100;  ++i) {
-        Guard guard(lock, std::try_to_lock);
-        if (guard)
-            return get_job_impl_ul(group);
-        sched_yield();
-    }
+    current_task = this;
+    current_queue = next_queue++ % numQueues;
+
+    /* This is the worker function.  We grab work while there is any until it
+       is time to exit. */
+    
+    while (!force_finished) {
+        
+        uint64_t events = job_events;
+
+        Job_Info info;
+        if (try_get_job(info, nullptr)) {
+            run_job(info);
+            continue;
+        }
 
-    Guard guard(lock);
+        // Jobs tend to come in bursts, so spin for a little while before
+        // going to sleep.  Queued jobs may not be runnable due to their
+        // class's parallelism, so we wait for something to change rather
+        // than for jobs to be queued.
+        bool changed = false;
+        for (unsigned i = 0;  i < 100 && !changed;  ++i) {
+            sched_yield();
+            changed = job_events != events;
+        }
+        if (changed)
+            continue;
+
+        Guard guard(sleep_lock);
+        ++num_idle;
+        jobs_available.wait(guard,
+                            [&] ()
+                            {
+                                return force_finished || job_events != events;
+                            });
+        --num_idle;
+    }
 
-    //static int numJobs = 0;
-    //cerr << "getting job " << ++numJobs << endl;
+    current_task = nullptr;
+    current_queue = -1;
 
-    return get_job_impl_ul(group);
+    return 0;
 }
 
-Worker_Task::Job_Info
-Worker_Task::
-get_job_impl_ul(int group)
+void Worker_Task::run_until_released(Semaphore & sem, int group)
 {
-    //cerr << "thread " << ACE_OS::thr_self()
-    //     << " is getting a job in group " << group
-    //     << endl;
-    if (force_finished) return Job_Info();
+    /* We check regularly for either a) the semaphore being free or b) a job
+       being available. */
+
+    std::shared_ptr<Group_Info> group_info;
+    if (group != -1)
+        group_info = find_group(group);
 
-    Jobs::iterator it;
+    while (sem.tryacquire() == -1) {
 
-    if (group == -1) {
-        it = jobs.begin();
+        uint64_t events = job_events;
 
-        /* Try to find one whose id isn't -1 but which is in the group
-           anyway. */
-        while (it != jobs.end() && it->id == -1) ++it;
+        /* Run a job, if there is one old job to finish. */
         
-        if (it == jobs.end())
-            throw Exception("get_job(): internal error: "
-                            "semaphore acquired with zero jobs");
-    }
-    else {
-        map<Id, Group_Info>::const_iterator group_it
-            = groups.find(group);
-        if (group_it == groups.end()) {
-            //throw Exception("iterator not found in group");
-            cerr << "couldn't find group " << group << " in  list"
-                 << endl;
-            return get_job_impl_ul(-1);
+        Job_Info info;
+        if (try_get_job(info, group_info.get())) {
+            run_job(info);
+            continue;
         }
-        else if (group_it->second.exc)
-            return get_job_impl_ul(-1);  // group has an error; we don't do it
-        else it = jobs.begin();
-        
-        /* Try to find one whose id isn't -1 but which is in the group
-           anyway. */
-        while (it != group_it->second.group_job
-               && (it->id == -1 || !in_group(*it, group)))
-            ++it;
-        
-        /* If we didn't find one in our group, we select any job at all
-           so that we make some progress. */
-        if (it == group_it->second.group_job || !in_group(*it, group))
-            return get_job_impl_ul(-1);
-    }
-    
-    Job_Info result = *it;
-    ++num_running;
 
-    if (result.group != -1) ++groups[result.group].jobs_running;
+        /* Wait for a state change.  Releasing the semaphore doesn't notify
+           us, so we poll it. */
+        Guard guard(sleep_lock);
+        ++num_waiting;
+        state_changed.wait_for(guard, std::chrono::milliseconds(1),
+                               [&] () { return job_events != events; });
+        --num_waiting;
+    }
     
-    --num_queued;
-    jobs.erase(it);
-
-    notify_state_changed();
-
-    return result;
+    sem.release();
 }
 
 void
 Worker_Task::
-finish_job(const Job_Info & info)
+run_until_finished(int group, bool unlock)
 {
-    Guard guard(lock, std::defer_lock);
+    /* We check at every change in state for either a) the group being
+       finished or b) an error from the group or c) a job being available.
+    */
 
-    for (unsigned i = 0;  i < 100;  ++i) {
-        guard.try_lock();
-        if (guard) break;
+    std::shared_ptr<Group_Info> group_info = find_group(group);
+    if (!group_info) {
+        if (!unlock) return;  // group must have finished
+        throw Exception("Worker_Task::run_until_finished(): "
+                        "group doesn't exist but should be locked");
     }
 
-    if (!guard)
-        guard.lock();
+    /* Lock the group so that it doesn't get removed. */
+    if (!unlock) {
+        if (group_info->locked)
+            throw Exception("Worker_Task::run_until_finished(): "
+                            "group is locked; it won't ever finish");
+        if (!group_info->acquire())
+            return;  // group finished in the meantime
+        group_info->locked = true;
+    }
 
-    --num_running;
-    
-    /* Finish off the group if we need to. */
-    Id group = info.group;
-    if (group != -1) {
+    /* The group is locked for now; make sure it will be unlocked at the
+       end. */
+    Call_Guard unlock_guard(std::bind(&Worker_Task::unlock_group,
+                                        this, group));
 
-        if (!groups.count(group))
-            throw Exception("Worker_Task::finish_job(): invalid group number");
+    for (;;) {
+        //cerr << "thread " << ACE_OS::thr_self() << " is waiting for group "
+        //     << group << " to finish" << endl;
 
-        Group_Info * group_info = &groups[group];
+        /* Is the group finished (apart from our lock)?  If so, we can get
+           out of here. */
+        if (group_info->pending == 1) {
+            /* If the group had an error, clean up the group structures,
+               then rethrow the exception that occurred. */
+            if (group_info->error) {
+                exception_ptr exc;
+                {
+                    std::unique_lock<std::mutex> guard(group_info->exc_lock);
+                    std::swap(exc, group_info->exc);
+                }
 
-        --group_info->jobs_outstanding;
-        --group_info->jobs_running;
+                /* Unlock the group to allow everything to finish. */
+                unlock_guard.clear();
+                unlock_group(group);
 
-        if (group_info->jobs_outstanding < 0)
-            throw Exception("Worker_Task::finish_job(): "
-                            "group has negative outstanding count");
+                /* Done; throw the exception. */
+                if (exc)
+                    rethrow_exception(exc);
+            }
+            return;
+        }
 
-        if (group_info->jobs_running < 0)
-            throw Exception("Worker_Task::finish_job(): "
-                            "group has negative running count");
-        
-        check_finished_ul(group);
-    }
-    
-    if (num_queued + num_running == 0) finished_sem.release();
+        uint64_t events = job_events;
+
+        /* Run a job if we can */
+        Job_Info info;
+        if (try_get_job(info, group_info.get())) {
+            run_job(info);
+            continue;  // no state change needed
+        }
 
-    notify_state_changed();
+        /* Wait for a state change. */
+        Guard guard(sleep_lock);
+        ++num_waiting;
+        state_changed.wait(guard,
+                           [&] ()
+                           {
+                               return group_info->pending == 1
+                                   || job_events != events
+                                   || force_finished;
+                           });
+        --num_waiting;
+
+        if (force_finished)
+            throw Exception("Worker_Task::run_until_finished(): "
+                            "worker task was destroyed");
+    }
 }
 
 void
 Worker_Task::
-remove_job_ul(const Jobs::iterator & it)
+lend_thread(int group)
 {
-    --num_queued;
-    
-    if (jobs_sem.tryacquire() == -1) {
-        log(string("remove_job_ul error:\n")
-            + "errno = " + to_string(errno) + "\n"
-            + "error = " + strerror(errno) + "\n"
-            + "Worker_Task::remove_job_ul(): couldn't acquire the job "
-            + "semaphore\n"
-            + "force_finished = " + to_string(force_finished) + "\n");
-        dump();
-        abort();
-    }
-
-    /* Finish off the group if we need to. */
-    Id group = it->group;
-    if (group != -1) {
-
-        if (!groups.count(group))
-            throw Exception("Worker_Task::finish_job(): invalid group number");
-
-        Group_Info * group_info = &groups[group];
-
-        --group_info->jobs_outstanding;
-
-        if (group_info->jobs_outstanding < 0)
-            throw Exception("Worker_Task::finish_job(): "
-                            "group has negative outstanding count");
-        
-        check_finished_ul(group);
-    }
-
-    jobs.erase(it);
-    
-    if (num_queued + num_running == 0) finished_sem.release();
-    
-    notify_state_changed();
+    /* Run a job if we can */
+    std::shared_ptr<Group_Info> group_info = find_group(group);
+    Job_Info info;
+    if (try_get_job(info, group_info.get()))
+        run_job(info);
 }
 
 bool Worker_Task::check_finished(Id group)
 {
-    Guard guard(lock);
-    return check_finished_ul(group);
-}
-
-bool Worker_Task::check_finished_ul(Id group)
-{
-    if (!groups.count(group))
-        throw Exception("Worker_Task::finish_job(): invalid group number");
-    
-    Group_Info * group_info = &groups[group];
-
-    /* Go through the list of parents and notify everywhere of what is
-       finished. */
-    while (group_info && group_info->jobs_outstanding == 0
-           && group_info->groups_outstanding == 0) {
-        //cerr << "  *** yes, group " << group << " is finished" << endl;
-
-        /* If group has an exception attached to it, it must stay in memory
-           until the control thread handles it. */
-        if (group_info->exc || group_info->locked) return false;
-
-        //cerr << "finished group " << group << endl;
-
-        try {
-            if (group_info->finished && !group_info->exc)
-                group_info->finished();
-        }
-        catch (const std::exception & exc) {
-            cerr << "Worker_Task::check_finished(): " << exc.what() << endl;
-        }
-        
-        /* Get rid of the job for the group. */
-        jobs.erase(group_info->group_job);
-
-        Id parent = group_info->parent_group;
-
-        if (parent == -1) group_info = 0;
-        else {
-            if (!groups.count(parent))
-                throw Exception("Worker_Task::finish_job(): invalid "
-                                "group number");
-            group_info = &groups[parent];
-            --group_info->groups_outstanding;
-
-            if (group_info->groups_outstanding < 0) {
-                dump();
-                cerr << "check_finished(" << group << "): "
-                     << "groups_outstainding < 0" << endl;
-                cerr << "parent = " << parent << endl;
-            }
-        }
-        groups.erase(group);
-        group = parent;
-
-        notify_state_changed();
-    }
-    
+    auto group_info = find_group(group);
+    if (!group_info)
+        throw Exception("Worker_Task::check_finished(): invalid group number");
+    if (group_info->pending == 0)
+        return finish_group(group_info.get());
     return false;
 }
 
@@ -929,8 +886,9 @@ dump(std::ostream & stream, int indent) const
     string i(indent, ' ');
     stream << i << "Job_Info @ " << this << endl;
     stream << i << "  id         = " << id << endl;
-    stream << i << "  group      = " << group << endl;
+    stream << i << "  group      = " << (group ? group->id : -1) << endl;
     stream << i << "  info       = " << info << endl;
+    stream << i << "  priority   = " << priority << endl;
     stream << i << "  job set    = " << (bool)job << endl;
     stream << i << "  error set  = " << (bool)error << endl;
 }
@@ -942,13 +900,15 @@ dump(std::ostream & stream, int indent) const
     string i(indent, ' ');
     stream << i << "Group_Info @ " << this << endl;
     stream << i << "  info               = " << info << endl;
-    stream << i << "  jobs outstanding   = " << jobs_outstanding << endl;
-    stream << i << "  jobs running       = " << jobs_running << endl;
+    stream << i << "  priority           = " << priority << endl;
+    stream << i << "  max parallelism    = "
+           << (cls ? cls->maxParallelism : -1) << endl;
+    stream << i << "  pending            = " << pending << endl;
     stream << i << "  groups outstanding = " << groups_outstanding << endl;
-    stream << i << "  parent group       = " << parent_group << endl;
-    stream << i << "  group job          = " << &(*group_job) << endl;
+    stream << i << "  parent group       = " << (parent ? parent->id : -1)
+           << endl;
     stream << i << "  locked             = " << locked << endl;
-    stream << i << "  exc              = "   << (bool)exc << endl;
+    stream << i << "  error              = " << error << endl;
     stream << i << "  finished set       = " << (bool)finished << endl;
 }
 
@@ -959,26 +919,29 @@ dump() const
     std::ostream & stream = cerr;
 
     stream << "Worker_Task @ " << this << endl;
-    stream << "  number of jobs   = " << jobs.size() << endl;
     stream << "  next group       = " << next_group << endl;
     stream << "  next job         = " << next_job << endl;
     stream << "  num queued       = " << num_queued << endl;
     stream << "  num running      = " << num_running << endl;
-    stream << "  number of groups = " << groups.size() << endl;
-    stream << "  state semaphores = " << state_semaphores.size() << endl;
-    stream << "  force finishned  = " << force_finished << endl;
+    stream << "  num idle         = " << num_idle << endl;
+    stream << "  num waiting      = " << num_waiting << endl;
+    stream << "  force finished   = " << force_finished << endl;
     stream << endl;
-    stream << "  jobs:" << endl;
-    int i = 0;
-    for (Jobs::const_iterator it = jobs.begin();  it != jobs.end();  ++it, ++i) {
-        stream << "   " << i << ":" << endl;
-        it->dump(cerr, 4);
+    stream << "  queues:" << endl;
+    for (unsigned i = 0;  i < numQueues;  ++i) {
+        std::unique_lock<Spinlock> guard(queues[i].lock);
+        for (unsigned p = 0;  p < NUM_PRIORITIES;  ++p) {
+            stream << "   " << i << " priority " << p << ": "
+                   << queues[i].jobs[p].size() << " jobs" << endl;
+            for (auto & job: queues[i].jobs[p])
+                job.dump(cerr, 4);
+        }
     }
+    Guard guard(groups_lock);
     stream << "  groups:" << endl;
-    for (map<Id, Group_Info>::const_iterator it = groups.begin();
-         it != groups.end();  ++it) {
-        stream << "   group with ID " << it->first << ":" << endl;
-        it->second.dump(cerr, 4);
+    for (auto & g: groups) {
+        stream << "   group with ID " << g.first << ":" << endl;
+        g.second->dump(cerr, 4);
     }
     stream << endl;
 }
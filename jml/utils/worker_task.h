@@ -21,6 +21,9 @@
 #include <mutex>
 #include <set>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
 
 
 namespace ML {
@@ -41,6 +44,61 @@ extern const Job NO_JOB;
 int num_threads();
 
 
+/*****************************************************************************/
+/* JOB CLASS                                                                 */
+/*****************************************************************************/
+
+/** Priority of a class of jobs.  Queued jobs of a higher priority are always
+    started before those of a lower one; running jobs are not preempted.
+*/
+enum Job_Priority {
+    PRIORITY_LOW,      ///< Background work, such as training
+    PRIORITY_NORMAL,   ///< Default priority
+    PRIORITY_HIGH,     ///< Latency sensitive work, such as interactive queries
+    NUM_PRIORITIES
+};
+
+/** Scheduling parameters shared by all of the job groups created for one
+    piece of work, such as a query or a procedure run.  A group takes the
+    class of the thread that creates it (see Job_Class_Guard), and the jobs
+    of a group run under its class, so that nested groups inherit it.
+*/
+struct Job_Class {
+    Job_Class(Job_Priority priority = PRIORITY_NORMAL,
+              int maxParallelism = -1);
+
+    Job_Priority priority;
+
+    /** Maximum number of jobs of the class that run at once, or -1 for no
+        limit.  A thread waiting for a group always helps to run the jobs
+        of that group on top of this, as it would be blocked otherwise.
+    */
+    int maxParallelism;
+
+    /// Number of jobs counted against maxParallelism that are running
+    std::atomic<int> running;
+
+    /// Return the class of groups created by this thread (null for default)
+    static std::shared_ptr<Job_Class> current();
+};
+
+/** Sets the class of the job groups created by the current thread for as
+    long as it exists.
+*/
+struct Job_Class_Guard {
+    Job_Class_Guard(std::shared_ptr<Job_Class> cls);
+    Job_Class_Guard(Job_Priority priority, int maxParallelism = -1);
+    ~Job_Class_Guard();
+
+    Job_Class_Guard(const Job_Class_Guard & other) = delete;
+    void operator = (const Job_Class_Guard & other) = delete;
+
+private:
+    std::shared_ptr<Job_Class> cls;
+    const std::shared_ptr<Job_Class> * previous;
+};
+
+
 /*****************************************************************************/
 /* WORKER_TASK                                                               */
 /*****************************************************************************/
@@ -49,12 +107,20 @@ int num_threads();
    The jobs can be arranged in groups, with a job that gets run once the
    group is finished, and the groups can be arranged in a hierarchy.
 
-   The jobs are scheduled such that with any group, jobs belonging to an
-   earlier subgroup are all scheduled before any belonging to a later
-   subgroup, regardless of the order in which they are scheduled.  (This
-   corresponds to a depth first search through the group tree).  The effect
-   is to guarantee that the average number of groups outstanding will be
-   as small as possible.
+   The jobs are scheduled by work stealing: a thread runs the jobs it
+   created itself most recently first, and idle threads steal the oldest
+   jobs of the others.  Jobs created within a job therefore tend to be
+   finished before their sisters are started (which corresponds to a depth
+   first search through the group tree), keeping the number of groups
+   outstanding small.
+
+   If a job throws, the remaining jobs of its group (and of the group's
+   children) are skipped and the exception is rethrown from
+   run_until_finished().
+
+   Each group has a Job_Class giving its priority and the maximum number of
+   its jobs that can run at once, which allows background work to share
+   the threads with latency sensitive work.
 
    It works multithreaded, and deals with all locking and unlocking.
 */
@@ -109,7 +175,7 @@ public:
             
             for (int i = 0; first != last;  ++first, ++i)
                 add(std::bind<void>(doWork, first),
-                    jobName + ML::format("%d", i),
+                    jobName.empty() ? jobName : jobName + ML::format("%d", i),
                     group);
         }
 
@@ -121,13 +187,13 @@ private:
         the same group will be scheduled together.  If there is an exception or
         an error, the error job will be called.
     */
-    Id add(const Job & job, const Job & error,
+    Id add(Job job, Job error,
            const std::string & info, Id group = -1);
 public:
 
     /** Add a job that belongs to the given group.  Jobs which are scheduled into
         the same group will be scheduled together. */
-    Id add(const Job & job, const std::string & info, Id group = -1);
+    Id add(Job job, const std::string & info, Id group = -1);
 
     /** Check if a group is finished, and if so call its finish job. */
     bool check_finished(Id group);
@@ -178,113 +244,89 @@ public:
 private:
     int threads_;
 
-    std::vector<std::unique_ptr<std::thread> > workerThreads_;
-    
-    struct Job_Info;
-
-    typedef std::list<Job_Info> Jobs;
-    
-    struct Job_Info {
-        Job_Info() : id(-1), group(-1) {}
-        Job_Info(const Job & job, const Job & error,
-                 const std::string & info, Id id, Id group = -1)
-            : job(job), error(error), id(id), group(group),
-              invalidGroup(false), info(info) {}
-        Job job;
-        Job error;
-        Id id;    // if -1, this is a group end marker
-        Id group;
-        bool invalidGroup; // true is group has error set
-        std::string info;
-        void dump(std::ostream & stream, int indent = 0) const;
-    };
-
-    struct Group_Info {
-        Group_Info()
-            : jobs_outstanding(0), jobs_running(0),
-              groups_outstanding(0), parent_group(0),
-              locked(false)
-        {
-        }
-
-        Job finished;
-        int jobs_outstanding;      ///< Number of jobs waiting for
-        int jobs_running;          ///< Number of jobs that are running
-        int groups_outstanding;    ///< Number of groups waiting for
-        Id parent_group;           ///< Group to notify when finished
-        Jobs::iterator group_job;  ///< Job for the group; always last
-        bool locked;
-        std::exception_ptr exc;    ///< Exception to rethrow
-        std::string info;
-
-        void dump(std::ostream & stream, int indent = 0) const;
-    };
+    /// Unique number for this task, used to key per-thread caches
+    uint64_t serial_;
 
-    /** Get a job. */
-    Job_Info get_job(int group = -1);
+    std::vector<std::unique_ptr<std::thread> > workerThreads_;
 
-    /** Tries to get a job, but doesn't fail if there isn't one. */
-    bool try_get_job(Job_Info & info, int group = -1);
+    struct Job_Info;
+    struct Group_Info;
+    struct Queue;
+
+    /** Each worker thread owns one queue of jobs.  It pushes and pops the
+        jobs it creates at the back of its own queue, and steals from the
+        front of the others' when it runs out.  Threads that aren't workers
+        spread their jobs over the queues.  This avoids having every
+        scheduling operation go through a single lock.
+    */
+    std::unique_ptr<Queue[]> queues;
+    int numQueues;
+    std::atomic<int> next_queue;
+
+    /** Look up the group with the given ID, or return null if it doesn't
+        exist (any more).  Lookups are cached per thread, as jobs are
+        normally added to the same group many times in a row; the result
+        refers to the cache and must be copied if it's kept past the next
+        lookup. */
+    const std::shared_ptr<Group_Info> & find_group(Id group) const;
+
+    /** Try to get a job, preferring jobs in the given group (or its
+        children) if it's not null. */
+    bool try_get_job(Job_Info & info, const Group_Info * group);
+
+    /** Pop a job of the given priority from near the front or back of a
+        queue, skipping those whose class is already running as many jobs
+        as it's allowed to.  Jobs belonging to the given group (which the
+        calling thread is waiting for) are always allowed; if onlyGroup is
+        set, no other jobs are taken. */
+    bool pop_job(Queue & queue, Job_Info & info, int priority, bool back,
+                 const Group_Info * group, bool onlyGroup);
+
+    void push_job(Job_Info info);
+
+    /** Run the job, recording any exception it throws against its group
+        so that the rest of the group is skipped. */
+    void run_job(Job_Info & info);
 
-    /** Implementation of the get_job methods.  Requires that the jobs_sem
-        be acquired. */
-    Job_Info get_job_impl(int group);
-    
-    /** Unlocked implementation of the get_job methods.  Requires that the
-        jobs_sem be acquired and that the lock already be held. */
-    Job_Info get_job_impl_ul(int group);
-    
     void finish_job(const Job_Info & info);
 
-    void remove_job_ul(const Jobs::iterator & it);
-
-    void add_state_semaphore(Semaphore & sem);
-
-    void remove_state_semaphore(Semaphore & sem);
-
-    void notify_state_changed();
-
-    // Check_finished, bit without the lock held
-    bool check_finished_ul(Id group);
-
-    /** Is the given job in the group?  Searches up the parent hierarchy. */
-    bool in_group(const Job_Info & info, int group);
+    /// Record that one of the things a group is waiting for is done
+    void release_group(Group_Info * group);
 
-    /** Removes all queued jobs in the group.  Running jobs are left alone. */
-    void cancel_group(Group_Info & group_info, int group);
+    /// Remove a group once everything in it is done, and call its finish job
+    bool finish_group(Group_Info * group);
 
-    /** Removes all queued jobs in the group.  Running jobs are left alone. 
-        Lock must already be held. */
-    void cancel_group_ul(Group_Info & group_info, int group);
-
-    /** Marks invalid all the jobs belonging to a group, so that the worker threads can
-     * skip those jobs easily and in a lockless manner */
-    void mark_group_jobs_invalid_ul(Group_Info & group_info, int group);
-
-    /** Waits for running jobs to finish. */
-    void wait_group_finished(Group_Info & group_info, int group);
+    void notify_worker();
+    void notify_waiters();
 
     typedef std::mutex Lock;
-    //typedef Spinlock Lock;
     typedef std::unique_lock<Lock> Guard;
 
-    Semaphore jobs_sem, finished_sem, state_change_sem, shutdown_sem;
-
-    /** Jobs we are running. */
-    Jobs jobs;
-    Id next_group;
-    Id next_job;
-    int num_queued;
-    int num_running;
-    Lock lock;
-
     /** Groups that are currently running. */
-    std::map<Id, Group_Info> groups;
-
-    /** Semaphores that get released on each state change. */
-    std::set<Semaphore *> state_semaphores;
-
-    volatile bool force_finished;
+    std::map<Id, std::shared_ptr<Group_Info> > groups;
+    mutable Lock groups_lock;
+
+    std::atomic<Id> next_group;
+    std::atomic<Id> next_job;
+    std::atomic<int> num_queued;
+    std::atomic<int> num_queued_priority[NUM_PRIORITIES];
+    std::atomic<int> num_running;
+
+    /** Incremented whenever a job may have become runnable, which is when
+        a job is queued or when a job counted against the parallelism of
+        its class finishes.  Sleeping threads wait for it to change. */
+    std::atomic<uint64_t> job_events;
+
+    /** Worker threads with nothing to do sleep on jobs_available, and
+        threads waiting for a group to finish on state_changed.  The
+        counts allow us to skip the notifications when nobody waits. */
+    Lock sleep_lock;
+    std::condition_variable jobs_available;
+    std::condition_variable state_changed;
+    std::atomic<int> num_idle;
+    std::atomic<int> num_waiting;
+
+    std::atomic<bool> force_finished;
 
     /* Dump everything to cerr; for debugging */
     void dump() const;
@@ -0,0 +1,387 @@
+/** hnsw_index.cc
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Implementation of the HNSW approximate nearest neighbour index.
+*/
+
+#include "hnsw_index.h"
+#include "mldb/arch/exception.h"
+#include "mldb/base/exc_assert.h"
+#include <queue>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+
+
+using namespace std;
+
+
+namespace ML {
+
+constexpr int HnswIndex::BLOCK_BITS;
+constexpr size_t HnswIndex::BLOCK_SIZE;
+constexpr size_t HnswIndex::MAX_BLOCKS;
+constexpr size_t HnswIndex::NUM_LOCKS;
+
+
+/*****************************************************************************/
+/* HNSW INDEX                                                                */
+/*****************************************************************************/
+
+HnswIndex::
+HnswIndex(int numNeighbours, int efConstruction)
+    : numNeighbours(numNeighbours),
+      efConstruction(efConstruction),
+      blocks(new std::unique_ptr<Node[]>[MAX_BLOCKS]),
+      numBlocks(0),
+      numInserted(0),
+      levelMultiplier(1.0 / std::log(std::max(numNeighbours, 2)))
+{
+    if (numNeighbours < 2)
+        throw ML::Exception("HNSW index needs at least 2 neighbours per item");
+    if (efConstruction < 1)
+        throw ML::Exception("HNSW index needs efConstruction of at least 1");
+}
+
+HnswIndex::
+~HnswIndex()
+{
+}
+
+HnswIndex::Node &
+HnswIndex::
+getNode(int item) const
+{
+    ExcAssertGreaterEqual(item, 0);
+    ExcAssertLess((item >> BLOCK_BITS), numBlocks.load());
+    return blocks[item >> BLOCK_BITS][item & (BLOCK_SIZE - 1)];
+}
+
+std::mutex &
+HnswIndex::
+getLock(int item) const
+{
+    return locks[item % NUM_LOCKS];
+}
+
+void
+HnswIndex::
+reserve(size_t numItems)
+{
+    std::unique_lock<std::mutex> guard(reserveMutex);
+
+    size_t blocksNeeded = (numItems + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocksNeeded > MAX_BLOCKS)
+        throw ML::Exception("HNSW index can't hold %zd items", numItems);
+
+    for (size_t i = numBlocks;  i < blocksNeeded;  ++i) {
+        blocks[i].reset(new Node[BLOCK_SIZE]);
+        // Publish the block once it's ready
+        numBlocks = i + 1;
+    }
+}
+
+int
+HnswIndex::
+chooseLevel(int item) const
+{
+    // The level is a function of the item number, so that building the
+    // same index twice gives the same structure.  We use the splitmix64
+    // mixing function to get a uniform number from the item.
+    uint64_t x = item + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = x ^ (x >> 31);
+
+    double uniform = ((x >> 11) + 0.5) / 9007199254740992.0;  // 2^53
+    return -std::log(uniform) * levelMultiplier;
+}
+
+void
+HnswIndex::
+getLinks(int item, int level, std::vector<int> & links) const
+{
+    const Node & node = getNode(item);
+    std::unique_lock<std::mutex> guard(getLock(item));
+    if (level > node.level) {
+        links.clear();
+        return;
+    }
+    links = node.links[level];
+}
+
+std::vector<std::pair<float, int> >
+HnswIndex::
+searchLayer(const QueryDistanceBatch & distance,
+            const std::vector<std::pair<float, int> > & entries,
+            int ef, int level, int limit) const
+{
+    typedef std::pair<float, int> Entry;
+
+    // Closest unexpanded candidates first
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> >
+        candidates;
+
+    // Furthest of the current results first
+    std::priority_queue<Entry> results;
+
+    std::unordered_set<int> visited;
+    visited.reserve(ef * numNeighbours * 2);
+
+    for (auto & e: entries) {
+        if (!visited.insert(e.second).second)
+            continue;
+        candidates.push(e);
+        results.push(e);
+    }
+
+    while (results.size() > ef)
+        results.pop();
+
+    std::vector<int> links, toVisit;
+    std::vector<float> distances;
+
+    while (!candidates.empty()) {
+        Entry current = candidates.top();
+        if (results.size() >= ef && current.first > results.top().first)
+            break;
+        candidates.pop();
+
+        getLinks(current.second, level, links);
+
+        // Calculate the distances to all new neighbours in one batch
+        toVisit.clear();
+        for (int link: links) {
+            if (limit != -1 && link >= limit)
+                continue;
+            if (!visited.insert(link).second)
+                continue;
+            toVisit.push_back(link);
+        }
+
+        distances.resize(toVisit.size());
+        distance(toVisit.data(), toVisit.size(), distances.data());
+
+        for (size_t i = 0;  i < toVisit.size();  ++i) {
+            float dist = distances[i];
+            int link = toVisit[i];
+            if (results.size() < ef || dist < results.top().first) {
+                candidates.emplace(dist, link);
+                results.emplace(dist, link);
+                if (results.size() > ef)
+                    results.pop();
+            }
+        }
+    }
+
+    std::vector<Entry> result(results.size());
+    for (size_t i = result.size();  i > 0;  --i) {
+        result[i - 1] = results.top();
+        results.pop();
+    }
+
+    return result;
+}
+
+std::vector<int>
+HnswIndex::
+selectNeighbours(const std::vector<std::pair<float, int> > & candidates,
+                 int n, const ItemDistanceBatch & distance) const
+{
+    // Keep a candidate only if it's closer to the item than to any of the
+    // neighbours already chosen.  This keeps links in many directions,
+    // which is what makes the graph navigable for clustered data.  The
+    // candidates are sorted by distance to the item.
+    std::vector<int> result, pruned;
+    std::vector<float> distances;
+
+    for (auto & c: candidates) {
+        if (result.size() >= n)
+            break;
+        distances.resize(result.size());
+        distance(c.second, result.data(), result.size(), distances.data());
+        bool keep = true;
+        for (float d: distances) {
+            if (d < c.first) {
+                keep = false;
+                break;
+            }
+        }
+        if (keep)
+            result.push_back(c.second);
+        else pruned.push_back(c.second);
+    }
+
+    // Fill up with the closest of those we pruned
+    for (int p: pruned) {
+        if (result.size() >= n)
+            break;
+        result.push_back(p);
+    }
+
+    return result;
+}
+
+void
+HnswIndex::
+insert(int item, const ItemDistance & distance)
+{
+    insert(item, [&] (int from, const int * others, size_t num, float * result)
+           {
+               for (size_t i = 0;  i < num;  ++i)
+                   result[i] = distance(from, others[i]);
+           });
+}
+
+void
+HnswIndex::
+insert(int item, const ItemDistanceBatch & distance)
+{
+    Node & node = getNode(item);
+    int level = chooseLevel(item);
+
+    {
+        std::unique_lock<std::mutex> guard(getLock(item));
+        ExcAssertEqual(node.level, -1);
+        node.level = level;
+        node.links.resize(level + 1);
+    }
+
+    int entry, entryLevel;
+    {
+        std::unique_lock<std::mutex> guard(entryMutex);
+        if (entryPoints.empty()) {
+            entryPoints.emplace_back(item, level);
+            ++numInserted;
+            return;
+        }
+        std::tie(entry, entryLevel) = entryPoints.back();
+    }
+
+    auto distanceToItem = [&] (const int * others, size_t n, float * result)
+        {
+            distance(item, others, n, result);
+        };
+
+    float entryDist;
+    distanceToItem(&entry, 1, &entryDist);
+    std::vector<std::pair<float, int> > entries = { { entryDist, entry } };
+
+    // Greedy search down to our own level
+    for (int l = entryLevel;  l > level;  --l)
+        entries = searchLayer(distanceToItem, entries, 1, l, -1);
+
+    // Link in on each of our levels
+    for (int l = std::min(level, entryLevel);  l >= 0;  --l) {
+        auto candidates
+            = searchLayer(distanceToItem, entries, efConstruction, l, -1);
+
+        std::vector<int> neighbours
+            = selectNeighbours(candidates, numNeighbours, distance);
+
+        {
+            std::unique_lock<std::mutex> guard(getLock(item));
+            node.links[l] = neighbours;
+        }
+
+        // Add the reverse links, pruning the neighbour's links if it now
+        // has too many
+        size_t maxLinks = l == 0 ? 2 * numNeighbours : numNeighbours;
+
+        for (int n: neighbours) {
+            Node & other = getNode(n);
+            std::unique_lock<std::mutex> guard(getLock(n));
+            std::vector<int> & links = other.links.at(l);
+            links.push_back(item);
+            if (links.size() <= maxLinks)
+                continue;
+
+            std::vector<float> linkDistances(links.size());
+            distance(n, links.data(), links.size(), linkDistances.data());
+
+            std::vector<std::pair<float, int> > linkCandidates;
+            linkCandidates.reserve(links.size());
+            for (size_t i = 0;  i < links.size();  ++i)
+                linkCandidates.emplace_back(linkDistances[i], links[i]);
+            std::sort(linkCandidates.begin(), linkCandidates.end());
+            links = selectNeighbours(linkCandidates, maxLinks, distance);
+        }
+
+        entries = std::move(candidates);
+    }
+
+    if (level > entryLevel) {
+        std::unique_lock<std::mutex> guard(entryMutex);
+        if (level > entryPoints.back().second)
+            entryPoints.emplace_back(item, level);
+    }
+
+    ++numInserted;
+}
+
+std::vector<std::pair<float, int> >
+HnswIndex::
+search(const QueryDistance & distance, int n, int ef, int limit) const
+{
+    return search([&] (const int * items, size_t num, float * result)
+                  {
+                      for (size_t i = 0;  i < num;  ++i)
+                          result[i] = distance(items[i]);
+                  },
+                  n, ef, limit);
+}
+
+std::vector<std::pair<float, int> >
+HnswIndex::
+search(const QueryDistanceBatch & distance, int n, int ef, int limit) const
+{
+    int entry = -1, entryLevel = -1;
+    {
+        std::unique_lock<std::mutex> guard(entryMutex);
+        for (auto it = entryPoints.rbegin();  it != entryPoints.rend();  ++it) {
+            if (limit == -1 || it->first < limit) {
+                std::tie(entry, entryLevel) = *it;
+                break;
+            }
+        }
+    }
+
+    if (entry == -1)
+        return {};
+
+    float entryDist;
+    distance(&entry, 1, &entryDist);
+    std::vector<std::pair<float, int> > entries = { { entryDist, entry } };
+
+    for (int l = entryLevel;  l > 0;  --l)
+        entries = searchLayer(distance, entries, 1, l, limit);
+
+    auto result = searchLayer(distance, entries, std::max(ef, n), 0, limit);
+    if (result.size() > n)
+        result.resize(n);
+    return result;
+}
+
+size_t
+HnswIndex::
+memusage() const
+{
+    size_t result = sizeof(*this)
+        + numBlocks * BLOCK_SIZE * sizeof(Node);
+
+    for (size_t b = 0;  b < numBlocks;  ++b) {
+        for (size_t i = 0;  i < BLOCK_SIZE;  ++i) {
+            const Node & node = blocks[b][i];
+            result += node.links.capacity() * sizeof(std::vector<int>);
+            for (auto & l: node.links)
+                result += l.capacity() * sizeof(int);
+        }
+    }
+
+    return result;
+}
+
+} // namespace ML
@@ -0,0 +1,151 @@
+/** hnsw_index.h                                                   -*- C++ -*-
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Hierarchical navigable small world graph, for approximate nearest
+    neighbour search.  See Malkov and Yashunin, "Efficient and robust
+    approximate nearest neighbor search using Hierarchical Navigable Small
+    World graphs", 2016.
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* HNSW INDEX                                                                */
+/*****************************************************************************/
+
+/** Approximate nearest neighbour index over items numbered from zero.  The
+    index doesn't know anything about the items themselves; it calls back
+    to get the distance between two items or between an item and the query.
+
+    Items can be inserted from multiple threads at once, and searches can
+    run at the same time as insertions.  A search can be limited to the
+    items below a given number, which allows a reader to only see the items
+    of a given version of a dataset while newer items are being inserted.
+*/
+
+struct HnswIndex {
+
+    /// Distance between two items that are or will be in the index
+    typedef std::function<float (int, int)> ItemDistance;
+
+    /// Distance between an item in the index and the query
+    typedef std::function<float (int)> QueryDistance;
+
+    /// Distances between an item and each of n others, into result.  This
+    /// allows the distances to be calculated with batched kernels.
+    typedef std::function<void (int item, const int * others, size_t n,
+                                float * result)> ItemDistanceBatch;
+
+    /// Distances between the query and each of n items, into result
+    typedef std::function<void (const int * items, size_t n, float * result)>
+        QueryDistanceBatch;
+
+    /** Create an index.  numNeighbours is the number of links of each item
+        on each layer of the graph (twice that on the bottom layer), and
+        efConstruction is the number of candidates considered when
+        inserting.  Higher values of both give better recall at the
+        expense of memory and insertion time.
+    */
+    HnswIndex(int numNeighbours = 16, int efConstruction = 200);
+
+    ~HnswIndex();
+
+    HnswIndex(const HnswIndex & other) = delete;
+    void operator = (const HnswIndex & other) = delete;
+
+    /** Make sure that items up to numItems can be inserted.  This must not
+        be called concurrently with insert().
+    */
+    void reserve(size_t numItems);
+
+    /** Insert the given item, which must have been reserved.  This is
+        thread safe with respect to other insertions and searches.
+    */
+    void insert(int item, const ItemDistance & distance);
+    void insert(int item, const ItemDistanceBatch & distance);
+
+    /** Return the (approximately) n nearest items to the query, as sorted
+        (distance, item) pairs.  ef is the number of candidates to keep
+        during the search; higher values give better recall but a slower
+        search.  If limit is not -1, then only items below limit are
+        returned or visited.
+    */
+    std::vector<std::pair<float, int> >
+    search(const QueryDistance & distance, int n, int ef,
+           int limit = -1) const;
+    std::vector<std::pair<float, int> >
+    search(const QueryDistanceBatch & distance, int n, int ef,
+           int limit = -1) const;
+
+    /// Number of items that have been inserted
+    size_t size() const { return numInserted; }
+
+    size_t memusage() const;
+
+    int numNeighbours;
+    int efConstruction;
+
+private:
+    struct Node {
+        Node()
+            : level(-1)
+        {
+        }
+
+        int level;  ///< Highest layer of this node, or -1 if not inserted
+        std::vector<std::vector<int> > links;  ///< Links for each layer
+    };
+
+    /// Nodes are stored in fixed-size blocks that are never moved, so that
+    /// we can grow the index while it's being searched.
+    static constexpr int BLOCK_BITS = 16;
+    static constexpr size_t BLOCK_SIZE = 1 << BLOCK_BITS;
+    static constexpr size_t MAX_BLOCKS = 1 << 15;
+
+    std::unique_ptr<std::unique_ptr<Node[]>[]> blocks;
+    std::atomic<size_t> numBlocks;
+    std::atomic<size_t> numInserted;
+    std::mutex reserveMutex;
+
+    /// Links of a node are protected by one of these locks, chosen on its
+    /// item number
+    static constexpr size_t NUM_LOCKS = 1024;
+    mutable std::mutex locks[NUM_LOCKS];
+
+    /// Entry points of the graph, as (item, level) pairs.  The last is the
+    /// current one; earlier ones are kept for searches with a limit.
+    std::vector<std::pair<int, int> > entryPoints;
+    mutable std::mutex entryMutex;
+
+    /// Multiplier used to choose the level of a new item
+    double levelMultiplier;
+
+    Node & getNode(int item) const;
+    std::mutex & getLock(int item) const;
+
+    int chooseLevel(int item) const;
+
+    void getLinks(int item, int level, std::vector<int> & links) const;
+
+    std::vector<std::pair<float, int> >
+    searchLayer(const QueryDistanceBatch & distance,
+                const std::vector<std::pair<float, int> > & entries,
+                int ef, int level, int limit) const;
+
+    std::vector<int>
+    selectNeighbours(const std::vector<std::pair<float, int> > & candidates,
+                     int n, const ItemDistanceBatch & distance) const;
+};
+
+} // namespace ML
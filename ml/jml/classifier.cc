@@ -543,6 +543,64 @@ predict(int label,
     return optimized_predict_impl(label, fv, info, context);
 }
 
+void
+Classifier_Impl::
+predict_batch(const float * features, size_t numRows,
+              const Optimization_Info & info,
+              float * output,
+              PredictionContext * context) const
+{
+    size_t numIn = info.features_in();
+    size_t numLabels = label_count();
+
+    if (!predict_is_optimized() || !info) {
+        for (size_t i = 0;  i < numRows;  ++i) {
+            Dense_Feature_Set fset(make_unowned_sp(info.to_features),
+                                   features + i * numIn);
+            Label_Dist dist = predict(fset, context);
+            std::copy(dist.begin(), dist.end(), output + i * numLabels);
+        }
+        return;
+    }
+
+    float fv[info.features_out()];
+    double accum[numLabels];
+
+    for (size_t i = 0;  i < numRows;  ++i) {
+        info.apply(features + i * numIn, fv);
+        std::fill(accum, accum + numLabels, 0.0);
+        optimized_predict_impl(fv, info, accum, 1.0, context);
+        std::copy(accum, accum + numLabels, output + i * numLabels);
+    }
+}
+
+void
+Classifier_Impl::
+predict_batch(int label,
+              const float * features, size_t numRows,
+              const Optimization_Info & info,
+              float * output,
+              PredictionContext * context) const
+{
+    size_t numIn = info.features_in();
+
+    if (!predict_is_optimized() || !info) {
+        for (size_t i = 0;  i < numRows;  ++i) {
+            Dense_Feature_Set fset(make_unowned_sp(info.to_features),
+                                   features + i * numIn);
+            output[i] = predict(label, fset, context);
+        }
+        return;
+    }
+
+    float fv[info.features_out()];
+
+    for (size_t i = 0;  i < numRows;  ++i) {
+        info.apply(features + i * numIn, fv);
+        output[i] = optimized_predict_impl(label, fv, info, context);
+    }
+}
+
 bool
 Classifier_Impl::
 optimize_impl(Optimization_Info & info)
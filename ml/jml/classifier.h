@@ -361,6 +361,29 @@ public:
                           const Optimization_Info & info,
                           PredictionContext * context = 0) const;
 
+    /** Optimized predict for a batch of dense feature vectors.  The
+        features are a row-major matrix of numRows rows, each of which has
+        info.features_in() entries in the order of the features passed to
+        optimize().  The output has label_count() entries per row.
+
+        The default calls the optimized predict on each row, reusing the
+        same buffers.  Classifiers that can do better for many rows at once
+        may override.
+    */
+    virtual void predict_batch(const float * features, size_t numRows,
+                               const Optimization_Info & info,
+                               float * output,
+                               PredictionContext * context = 0) const;
+
+    /** Same as above, but only predicts the given label, and so the output
+        has one entry per row.
+    */
+    virtual void predict_batch(int label,
+                               const float * features, size_t numRows,
+                               const Optimization_Info & info,
+                               float * output,
+                               PredictionContext * context = 0) const;
+
     //protected:
 
     /** Function to override to perform the optimization.  Default will
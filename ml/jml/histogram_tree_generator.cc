@@ -0,0 +1,974 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* histogram_tree_generator.cc
+   Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+   Generator for decision trees trained over binned feature histograms.
+*/
+
+#include "histogram_tree_generator.h"
+#include "mldb/ml/jml/registry.h"
+#include "training_index.h"
+#include "training_index_iterators.h"
+#include "weighted_training.h"
+#include "stump_training.h"
+#include "mldb/jml/utils/smart_ptr_utils.h"
+#include "mldb/jml/utils/worker_task.h"
+
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_01.hpp>
+#include <algorithm>
+#include <numeric>
+
+
+using namespace std;
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* BINNED FEATURES                                                           */
+/*****************************************************************************/
+
+/** A feature whose values have been replaced by the number of the bin that
+    they fall into.  Bin 0 is for missing values.
+*/
+struct Histogram_Tree_Generator::Binned_Feature {
+    Feature feature;
+
+    /// Do splits test for a value being equal to that of a bin, rather
+    /// than less than it?
+    bool categorical;
+
+    /// Is the feature allowed to be missing?
+    bool optional;
+
+    /// Value that each bin stands for.  For an ordered feature, it's the
+    /// lowest value in the bin.  For a categorical feature it's the
+    /// category, or NaN for the bin that holds all of the categories that
+    /// didn't get a bin of their own.
+    std::vector<float> bin_values;
+
+    int nbins() const { return bin_values.size(); }
+
+    /// If true, each example has at most one value, and bins gives the bin
+    /// of each example.  Otherwise, there is an entry for each value in
+    /// examples, entry_bins and divisors, sorted by example.
+    bool dense;
+
+    std::vector<uint8_t> bins;
+
+    std::vector<uint32_t> examples;
+    std::vector<uint8_t> entry_bins;
+    std::vector<float> divisors;  ///< Empty if each divisor is 1
+};
+
+/** Binned features of a training dataset. */
+struct Histogram_Tree_Generator::Binned_Data {
+    std::weak_ptr<Dataset_Index::Itl> index;
+    std::map<Feature, std::shared_ptr<const Binned_Feature> > features;
+};
+
+namespace {
+
+/** Bin the values of a feature.  Ordered features are split into bins of
+    roughly equal numbers of values; categorical features have a bin for
+    each category, apart from the least frequent ones if there are too
+    many of them, which share a bin that can't be split on.
+*/
+std::shared_ptr<const Histogram_Tree_Generator::Binned_Feature>
+bin_feature(const Training_Data & data, const Feature & feature, int max_bins)
+{
+    auto result = std::make_shared<Histogram_Tree_Generator::Binned_Feature>();
+    result->feature = feature;
+
+    Feature_Info info = data.feature_space()->info(feature);
+    result->categorical
+        = info.type() == CATEGORICAL || info.type() == STRING;
+    result->optional = info.optional();
+
+    const Dataset_Index & index = data.index();
+
+    // Distinct values of the feature in order, with the number of times
+    // each occurs
+    vector<float> values;
+    vector<float> counts;
+    for (auto & v: index.freqs(feature)) {
+        if (isnan(v.first))
+            continue;
+        values.push_back(v.first);
+        counts.push_back(v.second);
+    }
+
+    vector<uint8_t> value_bins(values.size());
+    result->bin_values.push_back(NAN);  // missing
+
+    int max_value_bins = max_bins - 1;
+
+    if (result->categorical && values.size() > max_value_bins) {
+        // Most frequent categories first
+        vector<int> order(values.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&] (int i1, int i2)
+                         {
+                             return counts[i1] > counts[i2];
+                         });
+
+        int num_kept = max_value_bins - 1;
+        std::fill(value_bins.begin(), value_bins.end(), num_kept + 1);
+        for (unsigned i = 0;  i < num_kept;  ++i) {
+            value_bins[order[i]] = i + 1;
+            result->bin_values.push_back(values[order[i]]);
+        }
+        result->bin_values.push_back(NAN);  // the rest
+    }
+    else if (result->categorical) {
+        for (unsigned i = 0;  i < values.size();  ++i) {
+            value_bins[i] = i + 1;
+            result->bin_values.push_back(values[i]);
+        }
+    }
+    else {
+        double total = std::accumulate(counts.begin(), counts.end(), 0.0);
+        double per_bin = total / max_value_bins;
+        double in_bin = 0.0;
+
+        for (unsigned i = 0;  i < values.size();  ++i) {
+            if (i == 0
+                || (in_bin >= per_bin
+                    && result->bin_values.size() < max_bins)) {
+                result->bin_values.push_back(values[i]);
+                in_bin = 0.0;
+            }
+            value_bins[i] = result->bin_values.size() - 1;
+            in_bin += counts[i];
+        }
+    }
+
+    auto get_bin = [&] (float value) -> uint8_t
+        {
+            if (isnan(value))
+                return 0;
+            auto it = std::lower_bound(values.begin(), values.end(), value);
+            if (it == values.end() || *it != value)
+                throw Exception("histogram tree: value of feature "
+                                + data.feature_space()->print(feature)
+                                + " not in its frequency distribution");
+            return value_bins[it - values.begin()];
+        };
+
+    size_t nx = data.example_count();
+
+    Joint_Index joint = index.dist(feature, BY_EXAMPLE,
+                                   IC_VALUE | IC_DIVISOR | IC_EXAMPLE);
+
+    bool only_one = index.only_one(feature);
+
+    // Features that are mostly there are stored with one bin per example,
+    // which is the fastest to build histograms from
+    result->dense = only_one && index.count(feature) * 8 >= nx;
+
+    if (result->dense) {
+        result->bins.resize(nx, 0);
+        for (unsigned i = 0;  i < joint.size();  ++i)
+            result->bins[joint[i].example()] = get_bin(joint[i].value());
+    }
+    else {
+        result->examples.reserve(joint.size());
+        result->entry_bins.reserve(joint.size());
+        if (!only_one)
+            result->divisors.reserve(joint.size());
+
+        for (unsigned i = 0;  i < joint.size();  ++i) {
+            result->examples.push_back(joint[i].example());
+            result->entry_bins.push_back(get_bin(joint[i].value()));
+            if (!only_one)
+                result->divisors.push_back(joint[i].divisor());
+        }
+    }
+
+    return result;
+}
+
+/// Number of examples per block when building the histograms of a
+/// feature over several blocks of examples in parallel, and the most
+/// blocks that a feature is split into
+enum {
+    HISTOGRAM_BLOCK_SIZE = 65536,
+    MAX_HISTOGRAM_BLOCKS = 16
+};
+
+/// An example in a node of the tree, and how much of it is there.  Only
+/// examples with more than one value for the split feature can be
+/// divided between branches.
+struct Member {
+    uint32_t example;
+    float weight;
+};
+
+/** Grows a tree over binned features.  Each node has a histogram for
+    every feature, with a count for each bin, label and whether the label
+    is the correct one, which is all that's needed to score every split
+    point of the feature.
+*/
+struct Histogram_Trainer {
+    typedef Histogram_Tree_Generator::Binned_Feature Binned_Feature;
+    typedef W_normalT<double> W;
+    typedef Z_normal Z;
+
+    Histogram_Trainer(Tree & tree,
+                      const Feature_Space & fs,
+                      const vector<std::shared_ptr<const Binned_Feature> > & features,
+                      const vector<Label> & labels,
+                      const boost::multi_array<float, 2> & weights,
+                      int nl,
+                      int max_depth,
+                      Stump::Update update_alg,
+                      int trace)
+        : tree(tree), fs(fs), features(features), labels(labels),
+          weights(weights.data()), advance(weights.shape()[1] == 1 ? 0 : 1),
+          stride(weights.shape()[1]), nl(nl), S(2 * nl),
+          max_depth(max_depth), update_alg(update_alg), trace(trace)
+    {
+        size_t offset = 0;
+        for (auto & f: features) {
+            offsets.push_back(offset);
+            offset += f->nbins() * S;
+        }
+        hist_size = offset;
+    }
+
+    Tree & tree;
+    const Feature_Space & fs;
+    const vector<std::shared_ptr<const Binned_Feature> > & features;
+    const vector<Label> & labels;
+    const float * weights;
+    int advance;
+    int stride;
+    int nl;
+    int S;   ///< Number of values per bin of a histogram
+    int max_depth;
+    Stump::Update update_alg;
+    int trace;
+
+    vector<size_t> offsets;   ///< Start of each feature's histogram
+    size_t hist_size;
+
+    /** Add the given proportion of an example to the counts at h. */
+    JML_ALWAYS_INLINE void
+    add(double * h, uint32_t example, double weight) const
+    {
+        int label = labels[example];
+        const float * w = weights + example * stride;
+        for (int l = 0;  l < nl;  ++l, w += advance)
+            h[l * 2 + (label == l)] += weight * *w;
+    }
+
+    vector<double> calc_totals(const vector<Member> & members) const
+    {
+        vector<double> result(S, 0.0);
+        for (auto & m: members)
+            add(&result[0], m.example, m.weight);
+        return result;
+    }
+
+    /** Build the histograms of all features over the given examples. */
+    vector<double>
+    build_histograms(Thread_Context & context,
+                     const vector<Member> & members,
+                     const vector<double> & totals) const
+    {
+        vector<double> result(hist_size, 0.0);
+
+        // When there are enough features to keep everyone busy, each one
+        // is done as a single job; otherwise large nodes are also split
+        // up by blocks of examples.
+        size_t nblocks = members.size() / size_t(HISTOGRAM_BLOCK_SIZE);
+        if (features.size() >= 4 * num_threads())
+            nblocks = 1;
+        nblocks = std::max<size_t>(1, std::min<size_t>(nblocks, MAX_HISTOGRAM_BLOCKS));
+
+        vector<pair<int, int> > jobs;
+        for (unsigned f = 0;  f < features.size();  ++f) {
+            int n = features[f]->dense ? nblocks : 1;
+            for (unsigned b = 0;  b < n;  ++b)
+                jobs.emplace_back(f, b);
+        }
+
+        // Block 0 of each feature goes straight into the result; the
+        // others are added in afterwards.
+        vector<vector<double> > partials(jobs.size());
+
+        auto doJob = [&] (int j)
+            {
+                int f = jobs[j].first, block = jobs[j].second;
+                const Binned_Feature & feature = *features[f];
+
+                double * h = &result[offsets[f]];
+                if (block != 0) {
+                    partials[j].resize(feature.nbins() * S, 0.0);
+                    h = &partials[j][0];
+                }
+
+                if (feature.dense) {
+                    size_t first = members.size() * block / nblocks;
+                    size_t last = members.size() * (block + 1) / nblocks;
+                    const uint8_t * bins = &feature.bins[0];
+                    for (size_t i = first;  i < last;  ++i) {
+                        const Member & m = members[i];
+                        add(h + bins[m.example] * S, m.example, m.weight);
+                    }
+                    return;
+                }
+
+                // Sparse: go through the entries of the examples in the node
+                auto onMember = [&] (const Member & m, size_t first, size_t last)
+                    {
+                        for (size_t e = first;  e < last;  ++e) {
+                            double weight = m.weight;
+                            if (!feature.divisors.empty())
+                                weight *= feature.divisors[e];
+                            add(h + feature.entry_bins[e] * S, m.example, weight);
+                        }
+                    };
+
+                forEachMember(feature, members, onMember);
+            };
+
+        run_in_parallel(0, jobs.size(), doJob, context.group(),
+                        "histogram tree", "build histograms",
+                        context.worker());
+
+        for (unsigned j = 0;  j < jobs.size();  ++j) {
+            if (partials[j].empty())
+                continue;
+            double * h = &result[offsets[jobs[j].first]];
+            for (unsigned i = 0;  i < partials[j].size();  ++i)
+                h[i] += partials[j][i];
+        }
+
+        // Examples without an entry for a sparse feature are missing, and
+        // belong in bin 0.
+        for (unsigned f = 0;  f < features.size();  ++f) {
+            if (features[f]->dense)
+                continue;
+            double * h = &result[offsets[f]];
+            for (unsigned s = 0;  s < S;  ++s) {
+                double present = 0.0;
+                for (unsigned b = 1;  b < features[f]->nbins();  ++b)
+                    present += h[b * S + s];
+                h[s] = std::max(0.0, totals[s] - present);
+            }
+        }
+
+        return result;
+    }
+
+    /** Call onMember(member, first, last) for each member, with the range
+        of entries of a sparse feature that belong to it, which is empty if
+        the feature is missing.  Both are sorted by example. */
+    template<typename OnMember>
+    static void forEachMember(const Binned_Feature & feature,
+                              const vector<Member> & members,
+                              const OnMember & onMember)
+    {
+        const vector<uint32_t> & examples = feature.examples;
+        auto it = examples.begin(), end = examples.end();
+
+        // Small nodes look up their examples; large ones merge
+        bool lookup = members.size() * 16 < examples.size();
+
+        for (auto & m: members) {
+            if (lookup)
+                it = std::lower_bound(it, end, m.example);
+            else {
+                while (it != end && *it < m.example)
+                    ++it;
+            }
+
+            auto first = it;
+            while (it != end && *it == m.example)
+                ++it;
+
+            onMember(m, first - examples.begin(), it - examples.begin());
+        }
+    }
+
+    /// Best split found for a feature
+    struct Candidate {
+        Candidate()
+            : z(Z::worst), bin(-1)
+        {
+        }
+
+        double z;
+        int bin;    ///< Split bin, or 0 to split on presence
+    };
+
+    /** Find the best split point of a feature from its histogram. */
+    Candidate best_split(const Binned_Feature & feature, const double * h) const
+    {
+        Z calc_z;
+        Candidate result;
+
+        W w(nl);
+        vector<double> present(S, 0.0);
+        for (unsigned b = 1;  b < feature.nbins();  ++b)
+            for (unsigned s = 0;  s < S;  ++s)
+                present[s] += h[b * S + s];
+
+        double missing_total = 0.0, present_total = 0.0;
+        for (unsigned l = 0;  l < nl;  ++l) {
+            w(l, MISSING, false) = h[l * 2];
+            w(l, MISSING, true) = h[l * 2 + 1];
+            missing_total += h[l * 2] + h[l * 2 + 1];
+            present_total += present[l * 2] + present[l * 2 + 1];
+        }
+
+        if (present_total == 0.0)
+            return result;
+
+        double missing = calc_z.missing(w, feature.optional);
+
+        // Score the split with the given weight on the true side
+        auto score = [&] (const double * true_w, int bin)
+            {
+                double true_total = 0.0;
+                for (unsigned l = 0;  l < nl;  ++l) {
+                    w(l, true, false) = true_w[l * 2];
+                    w(l, true, true) = true_w[l * 2 + 1];
+                    w(l, false, false) = std::max(0.0, present[l * 2] - true_w[l * 2]);
+                    w(l, false, true) = std::max(0.0, present[l * 2 + 1] - true_w[l * 2 + 1]);
+                    true_total += true_w[l * 2] + true_w[l * 2 + 1];
+                }
+
+                double false_total = present_total - true_total;
+                int nonempty = (true_total > 0.0) + (false_total > 0.0)
+                    + (missing_total > 0.0);
+                if (nonempty < 2)
+                    return;
+
+                double z = calc_z.non_missing(w, missing);
+                if (z < result.z) {
+                    result.z = z;
+                    result.bin = bin;
+                }
+            };
+
+        // Present versus missing
+        if (missing_total > 0.0) {
+            for (unsigned l = 0;  l < nl;  ++l) {
+                w(l, true, false) = present[l * 2];
+                w(l, true, true) = present[l * 2 + 1];
+                w(l, false, false) = w(l, false, true) = 0.0;
+            }
+            double z = calc_z.non_missing_presence(w, missing);
+            if (z < result.z) {
+                result.z = z;
+                result.bin = 0;
+            }
+        }
+
+        if (feature.categorical) {
+            for (unsigned b = 1;  b < feature.nbins();  ++b) {
+                if (isnan(feature.bin_values[b]))
+                    continue;
+                score(h + b * S, b);
+            }
+        }
+        else {
+            // Everything below bin b is on the true side
+            vector<double> below(S, 0.0);
+            for (unsigned b = 2;  b < feature.nbins();  ++b) {
+                for (unsigned s = 0;  s < S;  ++s)
+                    below[s] += h[(b - 1) * S + s];
+                score(&below[0], b);
+            }
+        }
+
+        return result;
+    }
+
+    /** Which branch (false, true or MISSING) does a value in the given bin
+        go down? */
+    static int decide(const Binned_Feature & feature, int split_bin, int bin)
+    {
+        if (bin == 0)
+            return MISSING;
+        if (split_bin == 0)
+            return true;
+        if (feature.categorical)
+            return bin == split_bin;
+        return bin < split_bin;
+    }
+
+    void fill_prediction(Tree::Base & base, const vector<double> & totals,
+                         double total_weight) const
+    {
+        // Everything is in the false bucket, which is where the prediction
+        // is made from
+        W w(nl);
+        for (unsigned l = 0;  l < nl;  ++l) {
+            w(l, false, false) = totals[l * 2];
+            w(l, false, true) = totals[l * 2 + 1];
+        }
+
+        base.pred.resize(nl);
+        base.examples = total_weight;
+        double epsilon = xdiv<double>(1.0, total_weight);
+        C_any c(update_alg);
+        c(&base.pred[0], false, w, epsilon, false);
+    }
+
+    Tree::Ptr
+    train(Thread_Context & context,
+          vector<Member> members,
+          const vector<double> & totals,
+          vector<double> hist,
+          int depth) const
+    {
+        double total_weight = 0.0;
+        for (auto & m: members)
+            total_weight += m.weight;
+
+        Tree::Leaf leaf;
+        fill_prediction(leaf, totals, total_weight);
+
+        // Look for early stopping conditions
+        int num_non_zero_classes = 0;
+        double total_class_weight = 0.0;
+        for (unsigned l = 0;  l < nl;  ++l) {
+            num_non_zero_classes += totals[l * 2 + 1] != 0.0;
+            total_class_weight += totals[l * 2 + 1];
+        }
+
+        auto make_leaf = [&] () -> Tree::Ptr
+            {
+                Tree::Leaf * result = tree.new_leaf();
+                *result = leaf;
+                return result;
+            };
+
+        if (depth == max_depth
+            || num_non_zero_classes <= 1
+            || total_weight < 1.0
+            || total_class_weight == 0.0
+            || members.size() <= 1)
+            return make_leaf();
+
+        if (hist.empty())
+            hist = build_histograms(context, members, totals);
+
+        // Find the best split of each feature in parallel
+        vector<Candidate> candidates(features.size());
+
+        auto onFeature = [&] (int f)
+            {
+                candidates[f] = best_split(*features[f], &hist[offsets[f]]);
+            };
+
+        run_in_parallel(0, features.size(), onFeature, context.group(),
+                        "histogram tree", "find splits", context.worker());
+
+        int best = -1;
+        for (unsigned f = 0;  f < features.size();  ++f) {
+            if (candidates[f].bin == -1)
+                continue;
+            if (best == -1 || candidates[f].z < candidates[best].z)
+                best = f;
+        }
+
+        if (best == -1)
+            return make_leaf();
+
+        const Binned_Feature & feature = *features[best];
+        int split_bin = candidates[best].bin;
+
+        Split split;
+        if (split_bin == 0)
+            split = Split(feature.feature, -INFINITY, fs);
+        else split = Split(feature.feature, feature.bin_values[split_bin], fs);
+
+        if (trace)
+            cerr << "histogram tree: depth " << depth << " examples "
+                 << total_weight << " split " << split.print(fs)
+                 << " z " << candidates[best].z << endl;
+
+        // Split the examples between the branches, which stay in example
+        // order
+        vector<Member> branch_members[3];
+
+        if (feature.dense) {
+            for (auto & m: members) {
+                int branch = decide(feature, split_bin,
+                                    feature.bins[m.example]);
+                branch_members[branch].push_back(m);
+            }
+        }
+        else {
+            // An example with several values is divided between the
+            // branches according to its values; one with none is missing.
+            auto onMember = [&] (const Member & m, size_t first, size_t last)
+                {
+                    if (first == last) {
+                        branch_members[MISSING].push_back(m);
+                        return;
+                    }
+
+                    double fractions[3] = { 0.0, 0.0, 0.0 };
+                    for (size_t e = first;  e < last;  ++e) {
+                        double divisor = feature.divisors.empty()
+                            ? 1.0 : feature.divisors[e];
+                        fractions[decide(feature, split_bin,
+                                         feature.entry_bins[e])] += divisor;
+                    }
+
+                    for (unsigned b = 0;  b < 3;  ++b) {
+                        if (fractions[b] > 0.0)
+                            branch_members[b].push_back
+                                ({ m.example, float(m.weight * fractions[b]) });
+                    }
+                };
+
+            forEachMember(feature, members, onMember);
+        }
+
+        int num_branches = 0;
+        for (unsigned b = 0;  b < 3;  ++b)
+            num_branches += !branch_members[b].empty();
+
+        // If we put everything into one branch, then we can't split any
+        // further
+        if (num_branches < 2)
+            return make_leaf();
+
+        members = vector<Member>();
+
+        Tree::Node * node = tree.new_node();
+        node->split = split;
+        node->z = candidates[best].z;
+        node->examples = total_weight;
+        node->pred = leaf.pred;
+
+        // The histograms of the largest branch come from subtracting the
+        // others from ours, so that we only go over the smaller ones
+        int largest = 0;
+        for (unsigned b = 1;  b < 3;  ++b)
+            if (branch_members[b].size() > branch_members[largest].size())
+                largest = b;
+
+        vector<double> branch_totals[3];
+        vector<double> branch_hists[3];
+        for (unsigned b = 0;  b < 3;  ++b) {
+            if (branch_members[b].empty() || b == largest)
+                continue;
+            branch_totals[b] = calc_totals(branch_members[b]);
+            branch_hists[b] = build_histograms(context, branch_members[b],
+                                               branch_totals[b]);
+        }
+
+        branch_totals[largest] = totals;
+        branch_hists[largest] = std::move(hist);
+        for (unsigned b = 0;  b < 3;  ++b) {
+            if (branch_members[b].empty() || b == largest)
+                continue;
+            for (unsigned s = 0;  s < S;  ++s)
+                branch_totals[largest][s]
+                    = std::max(0.0, branch_totals[largest][s] - branch_totals[b][s]);
+            vector<double> & h = branch_hists[largest];
+            const vector<double> & other = branch_hists[b];
+            for (size_t i = 0;  i < h.size();  ++i)
+                h[i] = std::max(0.0, h[i] - other[i]);
+        }
+
+        Tree::Ptr * children[3];
+        children[false] = &node->child_false;
+        children[true] = &node->child_true;
+        children[MISSING] = &node->child_missing;
+
+        for (unsigned b = 0;  b < 3;  ++b) {
+            if (branch_members[b].empty()) {
+                // Nothing went this way; predict what we would have
+                Tree::Leaf * result = tree.new_leaf();
+                *result = leaf;
+                result->examples = 0.0;
+                *children[b] = result;
+                continue;
+            }
+
+            *children[b] = train(context, std::move(branch_members[b]),
+                                 branch_totals[b],
+                                 std::move(branch_hists[b]),
+                                 depth + 1);
+            branch_totals[b].clear();
+        }
+
+        return node;
+    }
+};
+
+} // file scope
+
+
+/*****************************************************************************/
+/* HISTOGRAM_TREE_GENERATOR                                                  */
+/*****************************************************************************/
+
+Histogram_Tree_Generator::
+Histogram_Tree_Generator()
+{
+    defaults();
+}
+
+Histogram_Tree_Generator::~Histogram_Tree_Generator()
+{
+}
+
+void
+Histogram_Tree_Generator::
+configure(const Configuration & config)
+{
+    Classifier_Generator::configure(config);
+
+    config.find(trace, "trace");
+    config.find(max_depth, "max_depth");
+    config.find(max_bins, "max_bins");
+    config.find(update_alg, "update_alg");
+    config.find(random_feature_propn, "random_feature_propn");
+}
+
+void
+Histogram_Tree_Generator::
+defaults()
+{
+    Classifier_Generator::defaults();
+    trace = 0;
+    max_depth = -1;
+    max_bins = 256;
+    update_alg = Stump::PROB;
+    random_feature_propn = 1.0;
+}
+
+Config_Options
+Histogram_Tree_Generator::
+options() const
+{
+    Config_Options result = Classifier_Generator::options();
+    result
+        .add("trace", trace, "0-",
+             "trace execution of training in a very fine-grained fashion")
+        .add("max_depth", max_depth, "0- or -1",
+             "give maximum tree depth.  -1 means go until data separated")
+        .add("max_bins", max_bins, "2-256",
+             "maximum number of bins each feature is quantized into, "
+             "including one for missing values")
+        .add("update_alg", update_alg,
+             "select the type of output that the tree gives")
+        .add("random_feature_propn", random_feature_propn, "0.0-1.0",
+             "proportion of the features to enable (for random forests)");
+
+    return result;
+}
+
+void
+Histogram_Tree_Generator::
+init(std::shared_ptr<const Feature_Space> fs, Feature predicted)
+{
+    Classifier_Generator::init(fs, predicted);
+    model = Decision_Tree(fs, predicted);
+}
+
+std::shared_ptr<Classifier_Impl>
+Histogram_Tree_Generator::
+generate(Thread_Context & context,
+         const Training_Data & training_set,
+         const Training_Data & validation_set,
+         const distribution<float> & training_ex_weights,
+         const distribution<float> & validate_ex_weights,
+         const std::vector<Feature> & features, int) const
+{
+    Feature predicted = model.predicted();
+
+    boost::multi_array<float, 2> weights
+        = expand_weights(training_set, training_ex_weights, predicted);
+
+    Decision_Tree current
+        = train_weighted(context, training_set, weights, features, max_depth);
+
+    if (verbosity > 2)
+        cerr << current.print() << endl;
+
+    return std::make_shared<Decision_Tree>(std::move(current));
+}
+
+std::shared_ptr<Classifier_Impl>
+Histogram_Tree_Generator::
+generate(Thread_Context & context,
+         const Training_Data & training_set,
+         const boost::multi_array<float, 2> & weights,
+         const std::vector<Feature> & features,
+         float & Z,
+         int recursion) const
+{
+    Decision_Tree current
+        = train_weighted(context, training_set, weights, features, max_depth);
+
+    if (verbosity > 2) cerr << current.print() << endl;
+
+    return make_sp(current.make_copy());
+}
+
+std::vector<std::shared_ptr<const Histogram_Tree_Generator::Binned_Feature> >
+Histogram_Tree_Generator::
+get_binned(Thread_Context & context,
+           const Training_Data & data,
+           const std::vector<Feature> & features) const
+{
+    const std::shared_ptr<Dataset_Index::Itl> & index = data.index().itl;
+
+    std::vector<std::shared_ptr<const Binned_Feature> > result(features.size());
+    std::vector<int> to_bin;
+    std::shared_ptr<Binned_Data> entry;
+
+    {
+        std::unique_lock<std::mutex> guard(binned_lock);
+
+        // Forget about training data that has gone away
+        for (auto it = binned.begin();  it != binned.end();) {
+            if (it->second->index.expired())
+                it = binned.erase(it);
+            else ++it;
+        }
+
+        std::shared_ptr<Binned_Data> & found = binned[index.get()];
+        if (!found || found->index.lock() != index) {
+            found = std::make_shared<Binned_Data>();
+            found->index = index;
+        }
+        entry = found;
+
+        for (unsigned i = 0;  i < features.size();  ++i) {
+            auto it = entry->features.find(features[i]);
+            if (it == entry->features.end())
+                to_bin.push_back(i);
+            else result[i] = it->second;
+        }
+    }
+
+    auto onFeature = [&] (int i)
+        {
+            result[to_bin[i]]
+                = bin_feature(data, features[to_bin[i]], max_bins);
+        };
+
+    run_in_parallel(0, to_bin.size(), onFeature, context.group(),
+                    "histogram tree", "bin features", context.worker());
+
+    std::unique_lock<std::mutex> guard(binned_lock);
+    for (int i: to_bin)
+        entry->features[features[i]] = result[i];
+
+    return result;
+}
+
+Decision_Tree
+Histogram_Tree_Generator::
+train_weighted(Thread_Context & context,
+               const Training_Data & data,
+               const boost::multi_array<float, 2> & weights,
+               const std::vector<Feature> & features,
+               int max_depth) const
+{
+    Decision_Tree result = model;
+
+    Feature predicted = model.predicted();
+
+    if (result.feature_space()->info(predicted).type() == REAL)
+        throw Exception("histogram_tree generator doesn't support regression; "
+                        "use decision_tree instead");
+
+    if (random_feature_propn < 0.0 || random_feature_propn > 1.0)
+        throw Exception("random_feature_propn is not between 0.0 and 1.0");
+
+    if (max_bins < 2 || max_bins > 256)
+        throw Exception("max_bins is not between 2 and 256");
+
+    // Features that can't be split on are left out
+    vector<Feature> usable_features;
+    for (auto & f: features) {
+        if (f == predicted
+            || result.feature_space()->info(f).type() == INUTILE)
+            continue;
+        usable_features.push_back(f);
+    }
+
+    vector<Feature> filtered_features;
+    if (random_feature_propn < 1.0) {
+
+        int iter = 0;
+        while (filtered_features.empty() && iter < 50) {
+            typedef boost::mt19937 engine_type;
+            engine_type engine(context.random());
+            boost::uniform_01<engine_type> rng(engine);
+
+            for (unsigned i = 0;  i < usable_features.size();  ++i) {
+                if (rng() < random_feature_propn)
+                    filtered_features.push_back(usable_features[i]);
+            }
+            ++iter;
+        }
+
+        if (filtered_features.empty())
+            throw Exception("random_feature_propn is too low");
+    }
+    else filtered_features = usable_features;
+
+    if (max_depth == -1)
+        max_depth = 50;
+
+    vector<std::shared_ptr<const Binned_Feature> > binned_features
+        = get_binned(context, data, filtered_features);
+
+    int nl = data.label_count(predicted);
+    int nlw = weights.shape()[1];
+
+    // Examples with no weight for any label take no part
+    vector<Member> members;
+    members.reserve(data.example_count());
+    for (unsigned i = 0;  i < data.example_count();  ++i) {
+        bool non_zero = false;
+        for (unsigned j = 0;  j < nlw && !non_zero;  ++j)
+            non_zero = weights[i][j] != 0;
+        if (non_zero)
+            members.push_back({ i, 1.0f });
+    }
+
+    Histogram_Trainer trainer(result.tree, *result.feature_space(),
+                              binned_features,
+                              data.index().labels(predicted),
+                              weights, nl, max_depth, update_alg, trace);
+
+    vector<double> totals = trainer.calc_totals(members);
+
+    result.tree.root = trainer.train(context, std::move(members), totals,
+                                     vector<double>(), 0);
+    result.encoding = Stump::update_to_encoding(update_alg);
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* REGISTRATION                                                              */
+/*****************************************************************************/
+
+namespace {
+
+Register_Factory<Classifier_Generator, Histogram_Tree_Generator>
+    HISTOGRAM_TREE_REGISTER("histogram_tree");
+
+} // file scope
+
+} // namespace ML
@@ -0,0 +1,123 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* histogram_tree_generator.h                                      -*- C++ -*-
+   Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+   Generator for a decision tree that searches for splits over pre-binned
+   feature histograms.
+*/
+
+#ifndef __boosting__histogram_tree_generator_h__
+#define __boosting__histogram_tree_generator_h__
+
+
+#include "classifier_generator.h"
+#include "decision_tree.h"
+#include "stump.h"
+#include <map>
+#include <mutex>
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* HISTOGRAM_TREE_GENERATOR                                                  */
+/*****************************************************************************/
+
+/** Generates the same Decision_Tree classifier as the decision_tree
+    generator, but instead of an exact search over every value of every
+    feature, each feature is first quantized into at most 256 bins, and
+    split points are found from per-node histograms of label weight over
+    those bins.
+
+    The histograms of a node are built in parallel over features and over
+    blocks of examples, and the histogram of the largest child of a node
+    is obtained by subtracting the others from its parent, rather than by
+    going over its examples.  The binned features are kept for as long as
+    the training data they came from, so that boosting doesn't need to
+    bin again on each iteration.
+
+    Only classification problems are supported.
+*/
+
+class Histogram_Tree_Generator : public Classifier_Generator {
+public:
+    Histogram_Tree_Generator();
+
+    virtual ~Histogram_Tree_Generator();
+
+    /** Configure the generator with its parameters. */
+    virtual void
+    configure(const Configuration & config);
+
+    /** Return to the default configuration. */
+    virtual void defaults();
+
+    /** Return possible configuration options. */
+    virtual Config_Options options() const;
+
+    /** Initialize the generator, given the feature space to be used for
+        generation. */
+    virtual void init(std::shared_ptr<const Feature_Space> fs,
+                      Feature predicted);
+
+    using Classifier_Generator::generate;
+
+    /** Generate a classifier from one training set. */
+    virtual std::shared_ptr<Classifier_Impl>
+    generate(Thread_Context & context,
+             const Training_Data & training_data,
+             const Training_Data & validation_data,
+             const distribution<float> & training_weights,
+             const distribution<float> & validation_weights,
+             const std::vector<Feature> & features, int recursion) const;
+
+    /** Generate a classifier for boosting. */
+    virtual std::shared_ptr<Classifier_Impl>
+    generate(Thread_Context & context,
+             const Training_Data & training_data,
+             const boost::multi_array<float, 2> & weights,
+             const std::vector<Feature> & features,
+             float & Z,
+             int recursion) const;
+
+    int max_depth;
+    int max_bins;
+    int trace;
+    Stump::Update update_alg;
+    float random_feature_propn;
+
+    /* Once init has been called, we clone our potential models from this
+       one. */
+    Decision_Tree model;
+
+    Decision_Tree
+    train_weighted(Thread_Context & context,
+                   const Training_Data & data,
+                   const boost::multi_array<float, 2> & weights,
+                   const std::vector<Feature> & features,
+                   int max_depth) const;
+
+    struct Binned_Feature;
+    struct Binned_Data;
+
+private:
+    /** Return the binned version of the given features of the training
+        data, binning those that haven't been seen before. */
+    std::vector<std::shared_ptr<const Binned_Feature> >
+    get_binned(Thread_Context & context,
+               const Training_Data & data,
+               const std::vector<Feature> & features) const;
+
+    /** Binned features of each training dataset that's still alive,
+        keyed on its index. */
+    mutable std::mutex binned_lock;
+    mutable std::map<const void *, std::shared_ptr<Binned_Data> > binned;
+};
+
+
+} // namespace ML
+
+
+#endif /* __boosting__histogram_tree_generator_h__ */
@@ -37,6 +37,7 @@ LIBBOOSTING_SOURCES := \
         boosting_generator.cc \
         naive_bayes_generator.cc \
         decision_tree_generator.cc \
+        histogram_tree_generator.cc \
         feature_transformer.cc \
         glz_classifier_generator.cc \
         classifier_generator.cc \
@@ -0,0 +1,114 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* histogram_tree_test.cc
+   Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+   Test of the histogram tree generator.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <stdint.h>
+#include <iostream>
+
+#include "mldb/ml/jml/histogram_tree_generator.h"
+#include "mldb/ml/jml/training_data.h"
+#include "mldb/ml/jml/dense_features.h"
+#include "mldb/ml/jml/feature_info.h"
+#include "mldb/jml/utils/smart_ptr_utils.h"
+#include "mldb/jml/utils/vector_utils.h"
+
+using namespace ML;
+using namespace std;
+
+using boost::unit_test::test_suite;
+
+
+static const char * xor_dataset = "\
+LABEL X Y\n\
+1 0 0\n\
+0 1 0\n\
+0 0 1\n\
+1 1 1\n\
+";
+
+BOOST_AUTO_TEST_CASE( test_xor_function )
+{
+    Dense_Feature_Space fs;
+
+    Dense_Training_Data data;
+    data.init(xor_dataset, xor_dataset + strlen(xor_dataset),
+              make_unowned_sp(fs));
+    guess_all_info(data, fs, true);
+
+    Histogram_Tree_Generator generator;
+    generator.init(data.feature_space(), fs.features()[0]);
+
+    boost::multi_array<float, 2> weights(boost::extents[data.example_count()][1]);
+    std::fill(weights.data(), weights.data() + data.example_count(),
+              1.0 / data.example_count());
+
+    Thread_Context context;
+
+    Decision_Tree tree
+        = generator.train_weighted(context, data, weights, data.all_features(), 3);
+
+    cerr << tree.print();
+
+    BOOST_CHECK_EQUAL(tree.accuracy(data).first, 1.0);
+}
+
+/* A label that depends on a threshold of one feature, with another feature
+   that's noise, over more distinct values than there are bins.  The tree
+   should find the threshold to within a bin, and give the same tree when
+   trained a second time from the cached bins.
+*/
+BOOST_AUTO_TEST_CASE( test_threshold_more_values_than_bins )
+{
+    string dataset = "LABEL X NOISE\n";
+    for (unsigned i = 0;  i < 2000;  ++i) {
+        int x = (i * 7919) % 2000;
+        int noise = (i * 104729) % 13;
+        dataset += (x < 1300 ? "1 " : "0 ") + to_string(x) + " "
+            + to_string(noise) + "\n";
+    }
+
+    Dense_Feature_Space fs;
+
+    Dense_Training_Data data;
+    data.init(dataset.c_str(), dataset.c_str() + dataset.size(),
+              make_unowned_sp(fs));
+    guess_all_info(data, fs, true);
+
+    Configuration config;
+    config.parse_string("max_bins=32\n", "inbuilt config file");
+
+    Histogram_Tree_Generator generator;
+    generator.configure(config);
+    generator.init(data.feature_space(), fs.features()[0]);
+
+    boost::multi_array<float, 2> weights(boost::extents[data.example_count()][1]);
+    std::fill(weights.data(), weights.data() + data.example_count(),
+              1.0 / data.example_count());
+
+    Thread_Context context;
+
+    Decision_Tree tree1
+        = generator.train_weighted(context, data, weights, data.all_features(), 1);
+    Decision_Tree tree2
+        = generator.train_weighted(context, data, weights, data.all_features(), 1);
+
+    cerr << tree1.print();
+
+    // One bin is 2000 / 31 values wide
+    BOOST_CHECK_GE(tree1.accuracy(data).first, 1.0 - 65.0 / 2000);
+    BOOST_CHECK_EQUAL(tree1.print(), tree2.print());
+
+    // Going deeper can't do worse, but can't do better than the bins
+    Decision_Tree tree3
+        = generator.train_weighted(context, data, weights, data.all_features(), -1);
+    BOOST_CHECK_GE(tree3.accuracy(data).first, tree1.accuracy(data).first);
+}
@@ -41,6 +41,12 @@ train(const std::vector<distribution<float>> & points,
     // Smart initialization of the centroids
     // FIXME http://en.wikipedia.org/wiki/K-means%2B%2B#Initialization_algorithm
     clusters[0].centroid = points[rng() % points.size()];
+
+    // Centroids chosen so far and distances to them, for the batched
+    // distance calculation
+    std::vector<const float *> centroids(nbClusters);
+    std::vector<double> distances(nbClusters);
+    centroids[0] = clusters[0].centroid.data();
     int n = min(100, (int) points.size()/2);
     for (int i=1; i < nbClusters; ++i) {
         // This is my version of the wiki algorithm :
@@ -54,10 +60,12 @@ train(const std::vector<distribution<float>> & points,
             int randomIdx = rng() % points.size();
             // Find the closest cluster
             float distMin = INFINITY;
+            metric->distances(points[randomIdx], centroids.data(), i,
+                              distances.data());
             // For each cluster
             for (int k=0; k < i; ++k) {
 
-                float dist = metric->distance(points[randomIdx], clusters[k].centroid);
+                float dist = distances[k];
 
                 if (dist < distMin) {
                     distMin = dist;
@@ -77,6 +85,7 @@ train(const std::vector<distribution<float>> & points,
             bestPoint = rng() % points.size();
         }
         clusters[i].centroid = points[bestPoint];
+        centroids[i] = clusters[i].centroid.data();
         // cerr << "norm of best init centroid " << clusters[i].centroid.two_norm() << endl;
     }
 
@@ -196,11 +205,16 @@ distribution<float>
 KMeans::
 centroidDistances(const distribution<float> & point) const
 {
-    distribution<float> distances(clusters.size());
+    std::vector<const float *> centroids(clusters.size());
     for (int i=0; i < clusters.size(); ++i) {
-        distances[i] = metric->distance(point, clusters[i].centroid);
+        ExcAssertEqual(clusters[i].centroid.size(), point.size());
+        centroids[i] = clusters[i].centroid.data();
     }
-    return distances;
+
+    std::vector<double> distances(clusters.size());
+    metric->distances(point, centroids.data(), centroids.size(),
+                      distances.data());
+    return distribution<float>(distances.begin(), distances.end());
 }
 
 int
@@ -13,6 +13,8 @@
 #include "mldb/jml/db/persistent.h"
 #include "mldb/vfs/filter_streams.h"
 #include "mldb/jml/utils/worker_task.h"
+#include "mldb/arch/simd_vector.h"
+#include "mldb/base/exc_assert.h"
 #include <boost/math/special_functions/fpclassify.hpp>
 
 
@@ -31,6 +33,20 @@ public:
     virtual double distance(const distribution<float> & x,
                             const distribution<float> & y) const = 0;
 
+    // Distance between x and each of the n points in ys, which have the
+    // same number of elements as x.  The default calls distance() for each
+    // of them; metrics override it to use batched SIMD kernels.
+    virtual void distances(const distribution<float> & x,
+                           const float * const * ys, size_t n,
+                           double * result) const
+    {
+        distribution<float> y(x.size());
+        for (size_t i = 0;  i < n;  ++i) {
+            std::copy(ys[i], ys[i] + x.size(), y.begin());
+            result[i] = distance(x, y);
+        }
+    }
+
     // Computes the average of a set of points
     // This should correspond to the point that as the smallest
     // sum of `distance` between  all the points
@@ -49,7 +65,22 @@ class KMeansEuclideanMetric : public KMeansMetric {
 public:
     double distance(const distribution<float> & x,
                     const distribution<float> & y) const
-    { return (x - y).two_norm(); }
+    {
+        ExcAssertEqual(x.size(), y.size());
+        const float * yp = y.data();
+        double result;
+        distances(x, &yp, 1, &result);
+        return result;
+    }
+
+    void distances(const distribution<float> & x,
+                   const float * const * ys, size_t n,
+                   double * result) const
+    {
+        SIMD::vec_euclidean_sqr_batch_dp(x.data(), ys, x.size(), n, result);
+        for (size_t i = 0;  i < n;  ++i)
+            result[i] = sqrt(result[i]);
+    }
 
     distribution<float>
     average(const std::vector<distribution<float>> & points) const
@@ -102,6 +133,29 @@ public:
             return -x.dotprod(y) / y.two_norm() / x.two_norm();
     }
 
+    // Same as distance(), but the norm of x is only calculated once and the
+    // dot products use the batched kernel
+    void distances(const distribution<float> & x,
+                   const float * const * ys, size_t n,
+                   double * result) const
+    {
+        double xnorm = sqrt(SIMD::vec_twonorm_sqr_dp(x.data(), x.size()));
+        bool x_zero = !x.any();
+
+        SIMD::vec_dotprod_batch_dp(x.data(), ys, x.size(), n, result);
+
+        for (size_t i = 0;  i < n;  ++i) {
+            double ynorm = sqrt(SIMD::vec_twonorm_sqr_dp(ys[i], x.size()));
+            bool y_zero = !std::any_of(ys[i], ys[i] + x.size(),
+                                       [] (float v) { return v != 0.0f; });
+            if (x_zero && y_zero)
+                result[i] = -1.;
+            else if (x_zero || y_zero)
+                result[i] = 2.;
+            else result[i] = -result[i] / ynorm / xnorm;
+        }
+    }
+
     // Not perfect but probably does the trick
     // Returns the (normalized) mean of the normalized points
     distribution<float>
@@ -0,0 +1,143 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* hnsw_index_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test of the HNSW approximate nearest neighbour index.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "mldb/ml/hnsw_index.h"
+#include "mldb/jml/stats/distribution.h"
+#include <thread>
+#include <random>
+#include <iostream>
+
+using namespace ML;
+using namespace std;
+
+namespace {
+
+vector<distribution<float> > randomPoints(int n, int dims, int seed)
+{
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal;
+
+    vector<distribution<float> > result(n, distribution<float>(dims));
+    for (auto & p: result)
+        for (auto & v: p)
+            v = normal(rng);
+    return result;
+}
+
+float dist(const distribution<float> & p1, const distribution<float> & p2)
+{
+    return (p1 - p2).two_norm();
+}
+
+/** Return the proportion of the true k nearest neighbours that the index
+    finds, over the given queries.
+*/
+double recall(const HnswIndex & index,
+              const vector<distribution<float> > & points,
+              const vector<distribution<float> > & queries,
+              int k, int ef, int limit = -1)
+{
+    size_t numPoints = limit == -1 ? points.size() : limit;
+    size_t found = 0;
+
+    for (auto & q: queries) {
+        vector<pair<float, int> > exact;
+        for (unsigned i = 0;  i < numPoints;  ++i)
+            exact.emplace_back(dist(points[i], q), i);
+        std::sort(exact.begin(), exact.end());
+        exact.resize(k);
+
+        auto approx = index.search([&] (int i) { return dist(points[i], q); },
+                                   k, ef, limit);
+        BOOST_REQUIRE_LE(approx.size(), k);
+
+        for (unsigned i = 1;  i < approx.size();  ++i)
+            BOOST_CHECK_LE(approx[i - 1].first, approx[i].first);
+
+        for (auto & a: approx) {
+            if (limit != -1)
+                BOOST_CHECK_LT(a.second, limit);
+            for (auto & e: exact) {
+                if (e.second == a.second) {
+                    ++found;
+                    break;
+                }
+            }
+        }
+    }
+
+    return 1.0 * found / (k * queries.size());
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_hnsw_recall )
+{
+    auto points = randomPoints(5000, 16, 1);
+    auto queries = randomPoints(100, 16, 2);
+
+    HnswIndex index(16, 100);
+    index.reserve(points.size());
+
+    auto itemDist = [&] (int i, int j) { return dist(points[i], points[j]); };
+
+    // Insert from several threads at once
+    int numThreads = 4;
+    vector<std::thread> threads;
+    for (int t = 0;  t < numThreads;  ++t) {
+        threads.emplace_back([&,t] ()
+                             {
+                                 for (unsigned i = t;  i < points.size();
+                                      i += numThreads)
+                                     index.insert(i, itemDist);
+                             });
+    }
+    for (auto & t: threads)
+        t.join();
+
+    BOOST_CHECK_EQUAL(index.size(), points.size());
+
+    double r = recall(index, points, queries, 10, 100);
+    cerr << "recall at ef=100: " << r << endl;
+    BOOST_CHECK_GE(r, 0.9);
+
+    // Recall can be traded for speed
+    double r2 = recall(index, points, queries, 10, 10);
+    cerr << "recall at ef=10: " << r2 << endl;
+    BOOST_CHECK_LE(r2, r);
+
+    // Searches limited to the first items only see those
+    double r3 = recall(index, points, queries, 10, 100, 2500);
+    cerr << "recall limited to 2500: " << r3 << endl;
+    BOOST_CHECK_GE(r3, 0.8);
+}
+
+BOOST_AUTO_TEST_CASE( test_hnsw_small )
+{
+    HnswIndex index;
+
+    // Empty index finds nothing
+    BOOST_CHECK(index.search([] (int) { return 0.0f; }, 10, 10).empty());
+
+    auto points = randomPoints(3, 2, 3);
+    auto itemDist = [&] (int i, int j) { return dist(points[i], points[j]); };
+    index.reserve(points.size());
+    for (unsigned i = 0;  i < points.size();  ++i)
+        index.insert(i, itemDist);
+
+    // With fewer points than neighbours, they should all be returned
+    auto res = index.search([&] (int i) { return dist(points[i], points[0]); },
+                            10, 10);
+    BOOST_REQUIRE_EQUAL(res.size(), 3);
+    BOOST_CHECK_EQUAL(res[0].second, 0);
+    BOOST_CHECK_EQUAL(res[0].first, 0.0);
+}
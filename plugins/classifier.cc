@@ -730,6 +730,40 @@ getDetails() const
     return result;
 }
 
+bool
+ClassifyFunction::
+getDenseFeatureSet(const FunctionContext & context,
+                   float * features, Date & ts) const
+{
+    auto row = context.get<RowValue>("features");
+
+    ts = Date::negativeInfinity();
+
+    std::fill(features, features + itl->featureSpace->columnInfo.size(),
+              std::numeric_limits<float>::quiet_NaN());
+
+    for (auto & r: row) {
+        ColumnName columnName(std::get<0>(r));
+        ColumnHash columnHash(columnName);
+
+        auto it = itl->featureSpace->columnInfo.find(columnHash);
+        if (it == itl->featureSpace->columnInfo.end())
+            continue;
+
+        CellValue value = std::get<1>(r);
+        ts.setMax(std::get<2>(r));
+
+        // TODO: if more than one value, we need to fall back
+        if (!isnanf(features[it->second.index]))
+            return false;
+        
+        features[it->second.index]
+            = itl->featureSpace->encodeFeatureValue(columnHash, value);
+    }
+
+    return true;
+}
+
 std::tuple<std::vector<float>, std::shared_ptr<ML::Mutable_Feature_Set>, Date>
 ClassifyFunction::
 getFeatureSet(const FunctionContext & context, bool attemptDense) const
@@ -738,32 +772,11 @@ getFeatureSet(const FunctionContext & context, bool attemptDense) const
 
     Date ts = Date::negativeInfinity();
 
-    bool multiValue = false;
     if (attemptDense) {
-        std::vector<float> denseFeatures(itl->featureSpace->columnInfo.size(),
-                                         std::numeric_limits<float>::quiet_NaN());
-        for (auto & r: row) {
-            ColumnName columnName(std::get<0>(r));
-            ColumnHash columnHash(columnName);
-
-            auto it = itl->featureSpace->columnInfo.find(columnHash);
-            if (it == itl->featureSpace->columnInfo.end())
-                continue;
-
-            CellValue value = std::get<1>(r);
-            ts.setMax(std::get<2>(r));
-
-            // TODO: if more than one value, we need to fall back
-            if (!isnanf(denseFeatures[it->second.index])) {
-                multiValue = true;
-                break;
-            }
-        
-            denseFeatures[it->second.index]
-                = itl->featureSpace->encodeFeatureValue(columnHash, value);
-        }
-        if (!multiValue)
+        std::vector<float> denseFeatures(itl->featureSpace->columnInfo.size());
+        if (getDenseFeatureSet(context, denseFeatures.data(), ts))
             return std::make_tuple( std::move(denseFeatures), nullptr, ts );
+        ts = Date::negativeInfinity();
     }
 
 
@@ -894,6 +907,94 @@ apply(const FunctionApplier & applier_,
     return result;
 }
 
+std::vector<FunctionOutput>
+ClassifyFunction::
+applyBatch(const FunctionApplier & applier_,
+           const std::vector<FunctionContext> & contexts) const
+{
+    auto & applier = (ClassifyFunctionApplier &)applier_;
+
+    // Classifiers that can't be optimized have no dense feature layout to
+    // batch over
+    if (!applier.optInfo)
+        return Function::applyBatch(applier, contexts);
+
+    std::vector<FunctionOutput> result(contexts.size());
+
+    size_t numFeatures = itl->featureSpace->columnInfo.size();
+    ExcAssertEqual(applier.optInfo.features_in(), numFeatures);
+
+    // Gather the rows that can be scored densely into a row-major matrix.
+    // The others are scored one at a time.
+    std::vector<float> dense(contexts.size() * numFeatures);
+    std::vector<size_t> denseRows;
+    std::vector<Date> timestamps;
+    denseRows.reserve(contexts.size());
+    timestamps.reserve(contexts.size());
+
+    for (size_t i = 0;  i < contexts.size();  ++i) {
+        Date ts;
+        float * features = dense.data() + denseRows.size() * numFeatures;
+        if (getDenseFeatureSet(contexts[i], features, ts)) {
+            denseRows.push_back(i);
+            timestamps.push_back(ts);
+        }
+        else result[i] = apply(applier, contexts[i]);
+    }
+
+    if (denseRows.empty())
+        return result;
+
+    int labelCount = itl->classifier.label_count();
+    auto cat = itl->labelInfo.categorical();
+    auto & impl = *itl->classifier.impl;
+
+    if (cat) {
+        std::vector<float> scores(denseRows.size() * labelCount);
+        impl.predict_batch(dense.data(), denseRows.size(), applier.optInfo,
+                           scores.data());
+
+        std::vector<RowName> labelNames;
+        for (unsigned i = 0;  i < labelCount;  ++i)
+            labelNames.emplace_back(cat->print(i));
+
+        for (size_t n = 0;  n < denseRows.size();  ++n) {
+            vector<tuple<Coord, ExpressionValue> > row;
+            row.reserve(labelCount);
+
+            for (unsigned i = 0;  i < labelCount;  ++i) {
+                row.emplace_back(labelNames[i],
+                                 ExpressionValue(scores[n * labelCount + i],
+                                                 timestamps[n]));
+            }
+
+            result[denseRows[n]].set("scores", row);
+        }
+    }
+    else {
+        int label;
+        if (itl->labelInfo.type() == ML::REAL) {
+            ExcAssertEqual(labelCount, 1);
+            label = 0;
+        }
+        else {
+            ExcAssertEqual(labelCount, 2);
+            label = 1;
+        }
+
+        std::vector<float> scores(denseRows.size());
+        impl.predict_batch(label, dense.data(), denseRows.size(),
+                           applier.optInfo, scores.data());
+
+        for (size_t n = 0;  n < denseRows.size();  ++n) {
+            result[denseRows[n]].set("score",
+                                     ExpressionValue(scores[n], timestamps[n]));
+        }
+    }
+
+    return result;
+}
+
 FunctionInfo
 ClassifyFunction::
 getFunctionInfo() const
@@ -993,6 +1094,14 @@ ExplainFunction::
 {
 }
 
+std::vector<FunctionOutput>
+ExplainFunction::
+applyBatch(const FunctionApplier & applier,
+           const std::vector<FunctionContext> & contexts) const
+{
+    return Function::applyBatch(applier, contexts);
+}
+
 FunctionOutput
 ExplainFunction::
 apply(const FunctionApplier & applier,
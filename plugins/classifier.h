@@ -132,9 +132,25 @@ struct ClassifyFunction: public Function {
     virtual FunctionOutput apply(const FunctionApplier & applier,
                               const FunctionContext & context) const;
 
+    /** Score a batch of rows.  Those that can be represented as a dense
+        feature vector are put into a single matrix and scored together
+        with the optimized classifier; the others go through apply().
+    */
+    virtual std::vector<FunctionOutput>
+    applyBatch(const FunctionApplier & applier,
+               const std::vector<FunctionContext> & contexts) const;
+
     /** Describe what the input and output is for this function. */
     virtual FunctionInfo getFunctionInfo() const;
 
+    /** Fill in the dense feature vector for the given context, which has
+        one entry per column of the feature space, and set ts to the latest
+        timestamp of its features.  Returns false if a column has more than
+        one value, in which case the sparse feature set needs to be used.
+    */
+    bool getDenseFeatureSet(const FunctionContext & context,
+                            float * features, Date & ts) const;
+
     /** Return the feature set for the given function context.  If
         returnDense is true, then it will attempt to return an optimized
         (dense) feature vector.
@@ -169,6 +185,11 @@ struct ExplainFunction: public ClassifyFunction {
     virtual FunctionOutput apply(const FunctionApplier & applier,
                               const FunctionContext & context) const;
 
+    /** Explanations are made one at a time. */
+    virtual std::vector<FunctionOutput>
+    applyBatch(const FunctionApplier & applier,
+               const std::vector<FunctionContext> & contexts) const;
+
     /** Describe what the input and output is for this function. */
     virtual FunctionInfo getFunctionInfo() const;
 };
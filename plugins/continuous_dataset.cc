@@ -422,7 +422,8 @@ void
 ContinuousDataset::
 commit()
 {
-    return itl->commit();
+    itl->commit();
+    bumpCommitGeneration();
 }
     
 std::pair<Date, Date>
@@ -79,6 +79,14 @@ CsvDatasetConfigDescription::CsvDatasetConfigDescription()
     addField("timestamp", &CsvDatasetConfig::timestamp,
              "Expression for row timestamp.",
              SqlExpression::parse("fileTimestamp()"));
+    addField("cacheFileUrl", &CsvDatasetConfig::cacheFileUrl,
+             "If set, the parsed dataset is cached in a binary file at this "
+             "URL.  When the dataset is next loaded from the same file "
+             "with the same configuration, it will be loaded directly from "
+             "the cache file (memory mapping it when possible) instead of "
+             "parsing the CSV file again.  If the cache file doesn't exist "
+             "or is out of date, the CSV file is parsed and the cache file "
+             "is (re)written.");
 
     onUnknownField = [] (CsvDatasetConfig * config,
                          JsonParsingContext & context)
@@ -568,11 +576,19 @@ struct CsvDataset::Itl: public TabularDataStore {
     static constexpr size_t ROWS_PER_CHUNK=65536;
 
     Itl(MldbServer * server, const CsvDatasetConfig & conf, const CsvDataset* parentDataset)
+        : numLineErrors(0), loadedFromCache(false)
     {
         // For now... later we can memory map and only keep the offsets,
         // or stream through on a query
         config = conf;
         filename = config.dataFileUrl.toString();
+
+        Json::Value cacheSource;
+        if (!config.cacheFileUrl.empty()) {
+            cacheSource = getCacheSource();
+            if (loadFromCache(cacheSource))
+                return;
+        }
         
         // Ask for a memory mappable stream if possible
         ML::filter_istream stream(filename, { { "mapped", "true" } });
@@ -970,6 +986,90 @@ struct CsvDataset::Itl: public TabularDataStore {
              << " lines/second" << endl;
 
         numLineErrors = numSkipped;
+
+        if (!config.cacheFileUrl.empty()) {
+            saveToCache(cacheSource);
+        }
+    }
+
+    /** Return a description of the source data and configuration that
+        is saved in the cache file, which allows us to know if the cache
+        file corresponds to what we were asked to load.
+    */
+    Json::Value getCacheSource() const
+    {
+        FsObjectInfo info = getUriObjectInfo(filename);
+        CsvDatasetConfig sourceConfig = config;
+        sourceConfig.cacheFileUrl = Url();
+
+        Json::Value result;
+        result["dataFileUrl"] = filename;
+        result["lastModified"] = jsonEncode(info.lastModified);
+        result["size"] = jsonEncode(info.size);
+        result["etag"] = info.etag;
+        result["config"] = jsonEncode(sourceConfig);
+        return result;
+    }
+
+    /** Attempt to load the dataset from the cache file.  Returns false
+        if there is no cache file or it was made from a different source
+        file or configuration.
+    */
+    bool loadFromCache(const Json::Value & cacheSource)
+    {
+        string cacheFilename = config.cacheFileUrl.toString();
+        if (!tryGetUriObjectInfo(cacheFilename))
+            return false;
+
+        ML::Timer timer;
+
+        auto onMetadata = [&] (const Json::Value & metadata)
+            {
+                if (metadata["source"].asString()
+                    != cacheSource.toStringNoNewLine()) {
+                    cerr << "cache file " << cacheFilename
+                         << " is out of date; re-parsing CSV" << endl;
+                    return false;
+                }
+                numLineErrors = metadata["numLineErrors"].asInt();
+                return true;
+            };
+
+        // A cache file we can't read is a cache miss; it will be replaced
+        // once the CSV file has been parsed again
+        try {
+            if (!load(cacheFilename, onMetadata))
+                return false;
+        } catch (const std::exception & exc) {
+            cerr << "error loading cache file " << cacheFilename
+                 << "; re-parsing CSV: " << exc.what() << endl;
+            numLineErrors = 0;
+            return false;
+        }
+
+        // Our filename is still the CSV file, not the cache
+        filename = config.dataFileUrl.toString();
+        loadedFromCache = true;
+
+        cerr << "loaded " << rowCount << " rows from cache file "
+             << cacheFilename << " in " << timer.elapsed() << endl;
+
+        return true;
+    }
+
+    /** Save the parsed dataset to the cache file. */
+    void saveToCache(const Json::Value & cacheSource) const
+    {
+        ML::Timer timer;
+
+        Json::Value metadata;
+        metadata["source"] = cacheSource.toStringNoNewLine();
+        metadata["numLineErrors"] = numLineErrors;
+
+        save(config.cacheFileUrl.toString(), metadata);
+
+        cerr << "saved cache file " << config.cacheFileUrl << " in "
+             << timer.elapsed() << endl;
     }
 
     struct LineError {
@@ -981,6 +1081,9 @@ struct CsvDataset::Itl: public TabularDataStore {
     int64_t numLineErrors;
     std::vector<LineError> lineErrors;
 
+    /// Was this dataset loaded from its cache file rather than parsed?
+    bool loadedFromCache;
+
 };
 
 
@@ -1019,6 +1122,7 @@ getStatus() const
     Json::Value status;
     status["numLineErrors"] = itl->numLineErrors;
     status["rowCount"] = itl->rowCount;
+    status["loadedFromCache"] = itl->loadedFromCache;
     return status;
 }
 
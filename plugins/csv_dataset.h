@@ -44,6 +44,7 @@ struct CsvDatasetConfig: public PersistentDatasetConfig {
     std::shared_ptr<SqlExpression> named;  ///< Row name to output
     std::shared_ptr<SqlExpression> timestamp;   ///< Timestamp for row
 
+    Url cacheFileUrl;  ///< Binary file to cache the parsed dataset in
 };
 
 DECLARE_STRUCTURE_DESCRIPTION(CsvDatasetConfig);
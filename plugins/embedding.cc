@@ -9,6 +9,7 @@
 
 #include "embedding.h"
 #include "mldb/ml/tsne/vantage_point_tree.h"
+#include "mldb/ml/hnsw_index.h"
 #include "mldb/arch/rcu_protected.h"
 #include "mldb/rest/rest_request_binding.h"
 #include "mldb/arch/simd_vector.h"
@@ -23,6 +24,7 @@
 #include "mldb/types/hash_wrapper_description.h"
 #include "mldb/vfs/filter_streams.h"
 #include "mldb/arch/timers.h"
+#include <future>
 
 using namespace std;
 
@@ -51,6 +53,23 @@ operator >> (ML::DB::Store_Reader & store, Coord & coord)
 /* EMBEDDING DATASET CONFIG                                                  */
 /*****************************************************************************/
 
+DEFINE_ENUM_DESCRIPTION(EmbeddingIndexType);
+
+EmbeddingIndexTypeDescription::
+EmbeddingIndexTypeDescription()
+{
+    addValue("vptree", EMBEDDING_INDEX_VPTREE,
+             "Exact vantage point tree.  This returns the true nearest "
+             "neighbours, but degrades towards a linear scan for "
+             "high-dimensional data.");
+    addValue("hnsw", EMBEDDING_INDEX_HNSW,
+             "Approximate hierarchical navigable small world graph.  This "
+             "scales to large, high-dimensional datasets but may miss some "
+             "of the true nearest neighbours; see the hnsw parameters to "
+             "trade off recall against speed.  The graph is held in memory "
+             "only, and isn't saved with the dataset.");
+}
+
 DEFINE_STRUCTURE_DESCRIPTION(EmbeddingDatasetConfig);
 
 EmbeddingDatasetConfigDescription::
@@ -64,6 +83,19 @@ EmbeddingDatasetConfigDescription()
              "good for normalized embeddings like the SVD) and 'euclidean' "
              "(which is good for geometric embeddings like the t-SNE "
              "algorithm).", METRIC_EUCLIDEAN);
+    addField("index", &EmbeddingDatasetConfig::index,
+             "Index used to answer nearest neighbour queries.",
+             EMBEDDING_INDEX_VPTREE);
+    addField("hnswNeighbours", &EmbeddingDatasetConfig::hnswNeighbours,
+             "Number of links per row in each layer of the HNSW graph.  "
+             "Higher values improve recall at the expense of memory and "
+             "indexing time.", 16);
+    addField("hnswEfConstruction", &EmbeddingDatasetConfig::hnswEfConstruction,
+             "Number of candidates considered when adding a row to the HNSW "
+             "graph.  Higher values build a better graph more slowly.", 200);
+    addField("hnswEfSearch", &EmbeddingDatasetConfig::hnswEfSearch,
+             "Number of candidates considered when searching the HNSW graph.  "
+             "Higher values improve recall but make queries slower.", 100);
 }
 
 
@@ -72,8 +104,10 @@ EmbeddingDatasetConfigDescription()
 /*****************************************************************************/
 
 struct EmbeddingDatasetRepr {
+    typedef ML::VantagePointTreeT<int> VantagePointTree;
+
     EmbeddingDatasetRepr(MetricSpace metric)
-        : vpTree(new ML::VantagePointTreeT<int>()),
+        : mainTreeRows(0), indexedRows(0),
           distance(DistanceMetric::create(metric))
     {
     }
@@ -81,7 +115,7 @@ struct EmbeddingDatasetRepr {
     EmbeddingDatasetRepr(std::vector<ColumnName> columnNames,
                          MetricSpace metric)
         : columnNames(columnNames), columns(this->columnNames.size()),
-          vpTree(new ML::VantagePointTreeT<int>()),
+          mainTreeRows(0), indexedRows(0),
           distance(DistanceMetric::create(metric))
     {
         for (unsigned i = 0;  i < this->columnNames.size();  ++i) {
@@ -89,13 +123,22 @@ struct EmbeddingDatasetRepr {
         }
     }
 
+    /** Copy the representation to add rows to it.  The trees are immutable
+        once built, and so they are shared rather than copied.
+    */
     EmbeddingDatasetRepr(const EmbeddingDatasetRepr & other)
         : columnNames(other.columnNames),
           columns(other.columns),
           columnIndex(other.columnIndex),
           rows(other.rows),
           rowIndex(other.rowIndex),
-          vpTree(ML::VantagePointTreeT<int>::deepCopy(other.vpTree.get()))
+          vpTree(other.vpTree),
+          mainTreeRows(other.mainTreeRows),
+          deltaTree(other.deltaTree),
+          indexedRows(other.indexedRows),
+          hnsw(other.hnsw),
+          hnswEfSearch(other.hnswEfSearch),
+          distance(other.distance->clone())
     {
     }
 
@@ -143,31 +186,41 @@ struct EmbeddingDatasetRepr {
         }
     };
 
-    float dist(unsigned row1, unsigned row2) const
+    /** Calculate the distances between row1 and each of the n rows in
+        rows2, in one batch.
+    */
+    void distBatch(unsigned row1, const int * rows2, size_t n,
+                   float * result) const
     {
         ExcAssertLess(row1, rows.size());
-        ExcAssertLess(row2, rows.size());
+        ExcAssertEqual(rows[row1].coords.size(), columns.size());
+        distance->distBatch(row1, rows[row1].coords, rows2,
+                            getCoords(rows2, n).data(), n, result);
+    }
 
-        if (row1 == row2)
-            return 0.0f;
-        
-        float result = distance->dist(row1, row2,
-                                      rows[row1].coords,
-                                      rows[row2].coords);
-        
-        ExcAssert(isfinite(result));
-        return result;
+    /** Calculate the distances between the given point and each of the n
+        rows in rows2, in one batch.
+    */
+    void distBatch(const ML::distribution<float> & coords1,
+                   const int * rows2, size_t n, float * result) const
+    {
+        ExcAssertEqual(coords1.size(), columns.size());
+        distance->distBatch(-1, coords1, rows2,
+                            getCoords(rows2, n).data(), n, result);
     }
 
-    float dist(unsigned row1, const ML::distribution<float> & row2) const
+    /** Return pointers to the coordinates of the given rows, which is what
+        the batched distance calculations need.
+    */
+    std::vector<const float *> getCoords(const int * rowNums, size_t n) const
     {
-        ExcAssertLess(row1, rows.size());
-        ExcAssertEqual(row2.size(), columns.size());
-        
-        float result = distance->dist(row1, -1,
-                                      rows[row1].coords,
-                                      row2);
-        ExcAssert(isfinite(result));
+        std::vector<const float *> result(n);
+        for (size_t i = 0;  i < n;  ++i) {
+            ExcAssertLess(rowNums[i], rows.size());
+            const Row & row = rows[rowNums[i]];
+            ExcAssertEqual(row.coords.size(), columns.size());
+            result[i] = row.coords.data();
+        }
         return result;
     }
     
@@ -198,10 +251,110 @@ struct EmbeddingDatasetRepr {
 
     std::vector<Row> rows;
     ML::Lightweight_Hash<uint64_t, int> rowIndex;
-    
-    std::unique_ptr<ML::VantagePointTreeT<int> > vpTree;
+
+    /// Vantage point tree over rows [0, mainTreeRows).  This is rebuilt
+    /// in the background once enough rows have been added to it.
+    std::shared_ptr<const VantagePointTree> vpTree;
+    size_t mainTreeRows;
+
+    /// Vantage point tree over rows [mainTreeRows, indexedRows), which were
+    /// added since vpTree was built.  This is rebuilt on each commit, so
+    /// the cost of a commit depends upon the number of recent rows, not on
+    /// the size of the whole dataset.
+    std::shared_ptr<const VantagePointTree> deltaTree;
+
+    /// Number of rows that are in the column index and the trees
+    size_t indexedRows;
+
+    /// Approximate index, used instead of the trees if set.  This is shared
+    /// between all versions and also contains rows of later versions, so
+    /// searches must be limited to indexedRows.
+    std::shared_ptr<const ML::HnswIndex> hnsw;
+    int hnswEfSearch = 0;
+
     std::unique_ptr<DistanceMetric> distance;
 
+    /** Create a vantage point tree over the rows in [begin, end).  Returns
+        a null pointer if the range is empty.
+    */
+    VantagePointTree * createTree(size_t begin, size_t end) const
+    {
+        std::vector<int> items;
+        items.reserve(end - begin);
+        for (size_t i = begin;  i < end;  ++i) {
+            items.push_back(i);
+        }
+
+        // Function used to build the VP tree, that scans all of the items in
+        // parallel.
+        auto calcDist = [&] (int item, const std::vector<int> & items, int depth)
+            -> ML::distribution<float>
+            {
+                ExcAssertLessEqual(depth, 100);  // 2^100 items is enough
+
+                ML::distribution<float> result(items.size());
+
+                // Distances are calculated in blocks, which allows the
+                // batched distance kernels to be used
+                static constexpr size_t BLOCK_SIZE = 256;
+                size_t numBlocks = (items.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+                auto doBlock = [&] (size_t block)
+                {
+                    size_t begin = block * BLOCK_SIZE;
+                    size_t end = std::min(begin + BLOCK_SIZE, items.size());
+                    distBatch(item, items.data() + begin, end - begin,
+                              result.data() + begin);
+                };
+
+                if (items.size() < 10000 || depth > 2) {
+                    for (size_t b = 0;  b < numBlocks;  ++b)
+                        doBlock(b);
+                }
+                else ML::run_in_parallel_blocked(0, numBlocks, doBlock);
+                
+                return result;
+            };
+        
+        return VantagePointTree::createParallel(items, calcDist);
+    }
+
+    /** Return the at most n closest neighbours over both trees, given a
+        function that calculates the distance to a batch of rows.
+    */
+    std::vector<std::pair<float, int> >
+    search(const ML::HnswIndex::QueryDistanceBatch & distBatch, int n,
+           float maximumDist) const
+    {
+        std::vector<std::pair<float, int> > result;
+
+        if (hnsw) {
+            result = hnsw->search(distBatch, n, hnswEfSearch, indexedRows);
+            while (!result.empty() && result.back().first > maximumDist)
+                result.pop_back();
+            return result;
+        }
+
+        // The trees are searched one node at a time
+        auto dist = [&] (int item)
+            {
+                float result;
+                distBatch(&item, 1, &result);
+                return result;
+            };
+
+        if (vpTree)
+            result = vpTree->search(dist, n, maximumDist);
+        if (deltaTree) {
+            auto recent = deltaTree->search(dist, n, maximumDist);
+            result.insert(result.end(), recent.begin(), recent.end());
+            std::sort(result.begin(), result.end());
+            if (result.size() > n)
+                result.resize(n);
+        }
+        return result;
+    }
+
     void save(const std::string & filename)
     {
         ML::filter_ostream stream(filename);
@@ -229,33 +382,76 @@ EmbeddingDatasetRepr::
 serialize(ML::DB::Store_Writer & store) const
 {
     store << string("EMBEDDING_DATASET")
-          << ML::DB::compact_size_t(1);  // version
-    store << columnNames << columns << rows;
-    vpTree->serialize(store);
+          << ML::DB::compact_size_t(2);  // version
+    store << columnNames << columns << rows
+          << ML::DB::compact_size_t(mainTreeRows)
+          << ML::DB::compact_size_t(indexedRows);
+    VantagePointTree::serializePtr(store, vpTree.get());
+    VantagePointTree::serializePtr(store, deltaTree.get());
+
+    // The approximate index isn't saved.  Nothing loads an embedding
+    // dataset back yet, so it would be rebuilt from the rows anyway.
 }
 
 struct EmbeddingDataset::Itl
     : public MatrixView, public ColumnIndex {
-    Itl(MetricSpace metric)
-        : metric(metric), committed(lock, metric), uncommitted(nullptr)
+    Itl(const EmbeddingDatasetConfig & config)
+        : metric(config.metric), committed(lock, metric), uncommitted(nullptr)
     {
+        initIndex(config);
         initRoutes();
     }
 
     // TODO: make it loadable...
-    Itl(const std::string & address, MetricSpace metric)
-        : metric(metric), committed(lock, metric), uncommitted(nullptr), address(address)
+    Itl(const std::string & address, const EmbeddingDatasetConfig & config)
+        : metric(config.metric), committed(lock, metric), uncommitted(nullptr),
+          address(address)
     {
+        initIndex(config);
         initRoutes();
     }
 
     ~Itl()
     {
+        // Wait for any background rebuild of the tree, which refers to us.
+        // This thread helps to run it if it hasn't been started yet.
+        if (rebuildGroup != -1)
+            ML::Worker_Task::instance().run_until_finished(rebuildGroup);
         delete uncommitted.load();
     }
 
     MetricSpace metric;
 
+    /// Approximate index, if configured.  Rows are added to it on commit.
+    std::shared_ptr<ML::HnswIndex> hnsw;
+    int hnswEfSearch = 0;
+
+    /// Number of rows added one at a time to an empty approximate index
+    /// before we add rows in parallel, so that there is a graph to link to.
+    static constexpr size_t HNSW_SERIAL_ROWS = 1000;
+
+    void initIndex(const EmbeddingDatasetConfig & config)
+    {
+        switch (config.index) {
+        case EMBEDDING_INDEX_VPTREE:
+            break;
+        case EMBEDDING_INDEX_HNSW:
+            if (config.hnswNeighbours < 2)
+                throw HttpReturnException(400, "hnswNeighbours must be at "
+                                          "least 2 for embedding dataset");
+            if (config.hnswEfConstruction < 1 || config.hnswEfSearch < 1)
+                throw HttpReturnException(400, "hnswEfConstruction and "
+                                          "hnswEfSearch must be positive for "
+                                          "embedding dataset");
+            hnsw = std::make_shared<ML::HnswIndex>(config.hnswNeighbours,
+                                                   config.hnswEfConstruction);
+            hnswEfSearch = config.hnswEfSearch;
+            break;
+        default:
+            throw HttpReturnException(400, "Unknown embedding index type");
+        }
+    }
+
     GcLock lock;
     RcuProtected<EmbeddingDatasetRepr> committed;
 
@@ -265,6 +461,25 @@ struct EmbeddingDataset::Itl
     std::atomic<EmbeddingDatasetRepr *> uncommitted;
     std::string address;
 
+    /// Result of rebuilding the main vantage point tree in the background
+    struct RebuiltTree {
+        std::shared_ptr<const EmbeddingDatasetRepr::VantagePointTree> tree;
+        size_t numRows;
+    };
+
+    /// Rebuild of the main tree that is currently in progress, if any.
+    /// Protected by mutex.
+    std::future<RebuiltTree> rebuiltTree;
+
+    /// Worker task group that the rebuild runs in, or -1 if there is none.
+    /// Protected by mutex.
+    ML::Worker_Task::Id rebuildGroup = -1;
+
+    /// Minimum number of rows in the delta tree before the main tree is
+    /// rebuilt in the background.  The delta tree is also allowed to grow
+    /// to a quarter of the size of the main tree.
+    static constexpr size_t MIN_REBUILD_ROWS = 10000;
+
     RestRequestRouter router;
 
     void initRoutes()
@@ -827,69 +1042,130 @@ struct EmbeddingDataset::Itl
         if (!uncommitted)
             return;
 
-        for (unsigned j = 0;  j < (*uncommitted).columns.size();  ++j)
-            (*uncommitted).columns[j].resize((*uncommitted).rows.size());
+        EmbeddingDatasetRepr & repr = *uncommitted;
+        size_t numRows = repr.rows.size();
 
-        // Create the column index; this is a standard matrix inversion
+        for (unsigned j = 0;  j < repr.columns.size();  ++j)
+            repr.columns[j].resize(numRows);
+
+        // Create the column index; this is a standard matrix inversion.  Only
+        // rows added since the last commit need to be done.
         auto indexRow = [&] (size_t i)
             {
-                for (unsigned j = 0;  j < (*uncommitted).columns.size();  ++j)
-                    (*uncommitted).columns[j][i] = (*uncommitted).rows[i].coords[j];
+                for (unsigned j = 0;  j < repr.columns.size();  ++j)
+                    repr.columns[j][i] = repr.rows[i].coords[j];
             };
 
-        ML::run_in_parallel_blocked(0, (*uncommitted).rows.size(), indexRow);
-
-        // Create the vantage point tree
-        cerr << "creating vantage point tree" << endl;
-        ML::Timer timer;
-        
-        std::vector<int> items;
-        for (unsigned i = 0;  i < (*uncommitted).rows.size();  ++i) {
-            items.push_back(i);
-        }
+        ML::run_in_parallel_blocked(repr.indexedRows, numRows, indexRow);
 
-        // Function used to build the VP tree, that scans all of the items in
-        // parallel.
-        auto dist = [&] (int item, const std::vector<int> & items, int depth)
-            -> ML::distribution<float>
-            {
-                ExcAssertLessEqual(depth, 100);  // 2^100 items is enough
-
-                ML::distribution<float> result(items.size());
+        if (hnsw) {
+            // The approximate index is shared between versions, and rows
+            // are simply added to it.  Readers of the current version don't
+            // see the new rows since they limit their searches to the rows
+            // they know about.
+            hnsw->reserve(numRows);
 
-                auto doItem = [&] (int n)
+            ML::HnswIndex::ItemDistanceBatch itemDist
+                = [&] (int i, const int * others, size_t n, float * result)
                 {
-                    int i = items[n];
+                    repr.distBatch(i, others, n, result);
+                };
+            auto insertRow = [&] (size_t i) { hnsw->insert(i, itemDist); };
+
+            size_t serialEnd = repr.indexedRows;
+            if (hnsw->size() < HNSW_SERIAL_ROWS)
+                serialEnd = std::min(numRows,
+                                     repr.indexedRows + HNSW_SERIAL_ROWS
+                                     - hnsw->size());
+            for (size_t i = repr.indexedRows;  i < serialEnd;  ++i)
+                insertRow(i);
+            ML::run_in_parallel_blocked(serialEnd, numRows, insertRow);
+
+            repr.hnsw = hnsw;
+            repr.hnswEfSearch = hnswEfSearch;
+            repr.indexedRows = numRows;
+
+            committed.replace(uncommitted);
+            uncommitted = nullptr;
+
+            if (!address.empty()) {
+                cerr << "saving embedding" << endl;
+                committed()->save(address);
+            }
+            return;
+        }
 
-                    result[n] = (*uncommitted).dist(item, i);
+        // If a background rebuild of the main tree has finished, then
+        // switch over to it
+        if (rebuiltTree.valid()
+            && rebuiltTree.wait_for(std::chrono::seconds(0))
+               == std::future_status::ready) {
+            rebuildGroup = -1;
+            RebuiltTree rebuilt = rebuiltTree.get();
+            if (rebuilt.numRows > repr.mainTreeRows) {
+                repr.vpTree = std::move(rebuilt.tree);
+                repr.mainTreeRows = rebuilt.numRows;
+            }
+        }
 
-                    if (item == i)
-                        ExcAssertEqual(result[n], 0.0);
+        // Create the vantage point tree.  The first time, we index
+        // everything into the main tree.  After that, we only index the rows
+        // that aren't in the main tree.
+        cerr << "creating vantage point tree" << endl;
+        ML::Timer timer;
 
-                    if (!isfinite(result[n])) {
-                        cerr << "dist between " << i << " and " << item << " is "
-                             << result.back() << endl;
-                    }
-                    ExcAssert(isfinite(result[n]));
-                };
+        if (repr.mainTreeRows == 0) {
+            repr.vpTree.reset(repr.createTree(0, numRows));
+            repr.mainTreeRows = numRows;
+            repr.deltaTree.reset();
+        }
+        else {
+            repr.deltaTree.reset(repr.createTree(repr.mainTreeRows, numRows));
+        }
+        repr.indexedRows = numRows;
 
-                if (items.size() < 10000 || depth > 2) {
-                    for (unsigned n = 0;  n < items.size();  ++n)
-                        doItem(n);
-                }
-                else ML::run_in_parallel_blocked(0, items.size(), doItem);
-                
-                return result;
-            };
-        
-        // Create the VP tree for indexed lookups on distance
-        (*uncommitted).vpTree.reset(ML::VantagePointTreeT<int>::createParallel(items, dist));
+        cerr << "VP tree done in " << timer.elapsed() << " for "
+             << numRows - repr.mainTreeRows << " recent rows" << endl;
 
-        cerr << "VP tree done in " << timer.elapsed() << endl;
+        bool needsRebuild
+            = numRows - repr.mainTreeRows
+            >= std::max<size_t>(MIN_REBUILD_ROWS, repr.mainTreeRows / 4);
         
         committed.replace(uncommitted);
         uncommitted = nullptr;
 
+        // Once the delta tree gets too big, we rebuild the main tree over
+        // all of the rows in the background.  It will be picked up by the
+        // first commit after it has finished.
+        if (needsRebuild && !rebuiltTree.valid()) {
+            auto result = std::make_shared<std::promise<RebuiltTree> >();
+            rebuiltTree = result->get_future();
+
+            auto rebuild = [this, result] ()
+                {
+                    try {
+                        // Build from a copy, so that the GC lock is only
+                        // held while copying rather than deferring the
+                        // freeing of older versions for the whole build.
+                        std::unique_ptr<const EmbeddingDatasetRepr> repr
+                            (new EmbeddingDatasetRepr(*committed()));
+                        RebuiltTree rebuilt;
+                        rebuilt.numRows = repr->indexedRows;
+                        rebuilt.tree.reset(repr->createTree(0, rebuilt.numRows));
+                        result->set_value(std::move(rebuilt));
+                    } catch (...) {
+                        result->set_exception(std::current_exception());
+                    }
+                };
+
+            // It's background work, so queries go first
+            ML::Job_Class_Guard classGuard(ML::PRIORITY_LOW);
+            ML::Worker_Task & worker = ML::Worker_Task::instance();
+            rebuildGroup = worker.get_group(ML::NO_JOB, "embedding rebuild");
+            worker.add(rebuild, "rebuild", rebuildGroup);
+            worker.unlock_group(rebuildGroup);
+        }
+
         if (!address.empty()) {
             cerr << "saving embedding" << endl;
             committed()->save(address);
@@ -913,14 +1189,12 @@ struct EmbeddingDataset::Itl
         
         //const EmbeddingDatasetRepr::Row & row = repr->rows[it->second];
         
-        auto dist = [&] (int item) -> float
+        auto dist = [&] (const int * items, size_t n, float * result)
             {
-                float result = repr->dist(item, it->second);
-                ExcAssert(isfinite(result));
-                return result;
+                repr->distBatch(it->second, items, n, result);
             };
         
-        auto neighbours = repr->vpTree->search(dist, numNeighbours, INFINITY);
+        auto neighbours = repr->search(dist, numNeighbours, INFINITY);
 
         vector<tuple<RowName, RowHash, float> > result;
         for (auto & n: neighbours) {
@@ -966,14 +1240,12 @@ struct EmbeddingDataset::Itl
                 vals.at(it->second) = v.toDouble();
             }
 
-            auto dist = [&] (int item) -> float
+            auto dist = [&] (const int * items, size_t n, float * result)
             {
-                float result = repr->dist(item, vals);
-                ExcAssert(isfinite(result));
-                return result;
+                repr->distBatch(vals, items, n, result);
             };
 
-            auto neighbours = repr->vpTree->search(dist, numNeighbours, INFINITY);
+            auto neighbours = repr->search(dist, numNeighbours, INFINITY);
 
             //cerr << "neighbours = " << jsonEncode(neighbours) << endl;
             
@@ -1014,6 +1286,9 @@ struct EmbeddingDataset::Itl
     }
 };
 
+constexpr size_t EmbeddingDataset::Itl::MIN_REBUILD_ROWS;
+constexpr size_t EmbeddingDataset::Itl::HNSW_SERIAL_ROWS;
+
 
 /*****************************************************************************/
 /* EMBEDDING                                                                 */
@@ -1027,7 +1302,7 @@ EmbeddingDataset(MldbServer * owner,
 {
     this->datasetConfig = config.params.convert<EmbeddingDatasetConfig>();
 #if 1
-    itl.reset(new Itl(datasetConfig.metric));
+    itl.reset(new Itl(datasetConfig));
 #else // once persistence is done
 
     if (!config.address.empty()) {
@@ -1071,7 +1346,8 @@ void
 EmbeddingDataset::
 commit()
 {
-    return itl->commit();
+    itl->commit();
+    bumpCommitGeneration();
 }
     
 std::pair<Date, Date>
@@ -21,13 +21,29 @@ namespace MLDB {
 /* EMBEDDING DATASET CONFIG                                                  */
 /*****************************************************************************/
 
+/** Index used for nearest neighbour queries. */
+enum EmbeddingIndexType {
+    EMBEDDING_INDEX_VPTREE,  ///< Exact vantage point tree
+    EMBEDDING_INDEX_HNSW     ///< Approximate HNSW graph
+};
+
+DECLARE_ENUM_DESCRIPTION(EmbeddingIndexType);
+
 struct EmbeddingDatasetConfig {
     EmbeddingDatasetConfig()
-        : metric(METRIC_EUCLIDEAN)
+        : metric(METRIC_EUCLIDEAN),
+          index(EMBEDDING_INDEX_VPTREE),
+          hnswNeighbours(16),
+          hnswEfConstruction(200),
+          hnswEfSearch(100)
     {
     }
 
     MetricSpace metric;
+    EmbeddingIndexType index;
+    int hnswNeighbours;
+    int hnswEfConstruction;
+    int hnswEfSearch;
 };
 
 DECLARE_STRUCTURE_DESCRIPTION(EmbeddingDatasetConfig);
@@ -9,6 +9,7 @@
 
 #include "metric_space.h"
 #include "mldb/jml/stats/distribution_simd.h"
+#include "mldb/arch/simd_vector.h"
 #include "ml/value_descriptions.h"
 #include "mldb/types/basic_value_descriptions.h"
 #include "mldb/types/distribution_description.h"
@@ -23,6 +24,9 @@ namespace MLDB {
 
 DEFINE_ENUM_DESCRIPTION(MetricSpace);
 
+/// Number of distances calculated by each call to the batch kernels
+static constexpr size_t BATCH_SIZE = 256;
+
 MetricSpaceDescription::
 MetricSpaceDescription()
 {
@@ -65,10 +69,9 @@ void
 EuclideanDistanceMetric::
 addRow(int rowNum, const ML::distribution<float> & coords)
 {
-    //cerr << "addRow " << rowNum << endl;
-    ExcAssertEqual(rowNum, sum_dist.size());
-    sum_dist.push_back(coords.dotprod(coords));
-    ExcAssert(isfinite(sum_dist.back()));
+    // Nothing needs to be cached, since distances are calculated directly
+    // from the coordinates.
+    ExcAssert(isfinite(coords.dotprod(coords)));
 }
 
 float
@@ -76,7 +79,12 @@ EuclideanDistanceMetric::
 calc(const ML::distribution<float> & coords1,
      const ML::distribution<float> & coords2)
 {
-    return (coords2 - coords1).two_norm();
+    ExcAssertEqual(coords1.size(), coords2.size());
+    const float * p2 = coords2.data();
+    double distSquared;
+    ML::SIMD::vec_euclidean_sqr_batch_dp(coords1.data(), &p2, coords1.size(),
+                                         1, &distSquared);
+    return sqrt(distSquared);
 }
 
 float
@@ -87,46 +95,53 @@ dist(int rowNum1, int rowNum2,
 {
     ExcAssertEqual(coords1.size(), coords2.size());
 
-    if (rowNum1 == -1 || rowNum2 == -1) {
-        return calc(coords1, coords2);
-    }
-
-    // Make sure dist(x,y) == dist(y,x) irrespective of rounding
-    if (rowNum2 < rowNum1)
-        return dist(rowNum2, rowNum1, coords2, coords1);
-
-    // Make sure dist(x,x) == 0 irrespective of rounding
-    if (rowNum1 == rowNum2)
-        return 0.0;
+    const float * p2 = coords2.data();
+    float result;
+    distBatch(rowNum1, coords1, &rowNum2, &p2, 1, &result);
+    return result;
+}
 
-    /*  Given two points x and y, whose coordinates are coords[x] and
-        coords[y], this will calculate the euclidian distance
-        ||x - y|| = sqrt(sum_i (x[i] - y[i])^2)
-                  = sqrt(sum_i (x[i]^2 + y[i]^2 - 2 x[i]y[i]) )
-                  = sqrt(sum_i x[i]^2 + sum_i y[i]^2 - 2 sum x[i]y[i])
-                  = sqrt(||x||^2 + ||y||^2 - 2 x . y)
-            
-        Must satisfy the triangle inequality, so the sqrt is important.  We
-        also take pains to ensure that dist(x,y) === dist(y,x) *exactly*,
-        and that dist(x,x) == 0.
+void
+EuclideanDistanceMetric::
+distBatch(int rowNum1,
+          const ML::distribution<float> & coords1,
+          const int * rowNums2,
+          const float * const * coords2,
+          size_t n, float * result) const
+{
+    /*  We calculate ||x - y|| = sqrt(sum_i (x[i] - y[i])^2) directly,
+        rather than expanding it to sqrt(||x||^2 + ||y||^2 - 2 x . y) and
+        using the cached norms.  The batch kernel makes it as fast, and
+        there is no cancellation error for points that are close together.
+
+        Must satisfy the triangle inequality, so the sqrt is important.  The
+        kernel makes sure that dist(x,y) === dist(y,x) *exactly*, and
+        dist(x,x) == 0.
     */
-        
-    // Use the optimized version, since we know the sum
-    float dpResult = -2.0 * ML::SIMD::vec_dotprod_dp(&coords1[0],
-                                                     &coords2[0],
-                                                     coords1.size());
-    ExcAssert(isfinite(dpResult));
-
-
 
-    float distSquared = dpResult + sum_dist.at(rowNum1) + sum_dist.at(rowNum2);
-    ExcAssert(isfinite(distSquared));
-
-    // Deal with rounding errors
-    if (distSquared < 0.0)
-        distSquared = 0.0;
+    double distSquared[BATCH_SIZE];
+
+    for (size_t start = 0;  start < n;  start += BATCH_SIZE) {
+        size_t num = std::min(BATCH_SIZE, n - start);
+        ML::SIMD::vec_euclidean_sqr_batch_dp(coords1.data(), coords2 + start,
+                                             coords1.size(), num,
+                                             distSquared);
+
+        for (size_t i = 0;  i < num;  ++i) {
+            float & r = result[start + i];
+            if (rowNums2 && rowNum1 != -1 && rowNums2[start + i] == rowNum1)
+                r = 0.0;
+            else r = sqrt(distSquared[i]);
+            ExcAssert(isfinite(r));
+        }
+    }
+}
 
-    return sqrtf(distSquared);
+DistanceMetric *
+EuclideanDistanceMetric::
+clone() const
+{
+    return new EuclideanDistanceMetric(*this);
 }
 
 
@@ -205,43 +220,85 @@ dist(int rowNum1, int rowNum2,
 {
     ExcAssertEqual(coords1.size(), coords2.size());
 
-    if (rowNum1 == -1 || rowNum2 == -1) {
-        return calc(coords1, coords2);
-    }
-
-    // Make sure dist(x,y) == dist(y,x) irrespective of rounding
-    if (rowNum2 < rowNum1)
-        return dist(rowNum2, rowNum1, coords2, coords1);
-
-    // Make sure dist(x,x) == 0 irrespective of rounding
-    if (rowNum1 == rowNum2)
-        return 0.0;
-
-    if (!isfinite(two_norm_recip.at(rowNum1))
-        && !isfinite(two_norm_recip.at(rowNum2))) {
-        return 0.0;
-    }
-    if (!isfinite(two_norm_recip.at(rowNum1))
-        || !isfinite(two_norm_recip.at(rowNum2))) {
-        return 1.0;
-    }
+    const float * p2 = coords2.data();
+    float result;
+    distBatch(rowNum1, coords1, &rowNum2, &p2, 1, &result);
+    return result;
+}
 
-    float result = 1.0 - coords1.dotprod(coords2) * two_norm_recip.at(rowNum1) * two_norm_recip.at(rowNum2);
-    if (result < 0.0) {
-        result = 0.0;
-#if 0
-        cerr << "rowNum1 = " << rowNum1 << endl;
-        cerr << "rowNum2 = " << rowNum2 << endl;
-        cerr << "coords1 = " << coords1 << endl;
-        cerr << "coords2 = " << coords2 << endl;
-        cerr << "result = " << result << endl;
-#endif
+void
+CosineDistanceMetric::
+distBatch(int rowNum1,
+          const ML::distribution<float> & coords1,
+          const int * rowNums2,
+          const float * const * coords2,
+          size_t n, float * result) const
+{
+    size_t dims = coords1.size();
+
+    // Reciprocal of the two norm of a row, which is infinite for a zero
+    // vector, as in addRow().
+    auto getRecip = [&] (int rowNum, const float * coords) -> double
+        {
+            if (rowNum != -1)
+                return two_norm_recip.at(rowNum);
+            return 1.0 / sqrt(ML::SIMD::vec_twonorm_sqr_dp(coords, dims));
+        };
+
+    double recip1 = getRecip(rowNum1, coords1.data());
+    double dotprods[BATCH_SIZE];
+
+    for (size_t start = 0;  start < n;  start += BATCH_SIZE) {
+        size_t num = std::min(BATCH_SIZE, n - start);
+        ML::SIMD::vec_dotprod_batch_dp(coords1.data(), coords2 + start,
+                                       dims, num, dotprods);
+
+        for (size_t i = 0;  i < num;  ++i) {
+            int rowNum2 = rowNums2 ? rowNums2[start + i] : -1;
+            const float * c2 = coords2[start + i];
+            float & r = result[start + i];
+
+            // Make sure dist(x,x) == 0 irrespective of rounding
+            if (rowNum1 != -1 && rowNum1 == rowNum2) {
+                r = 0.0;
+                continue;
+            }
+
+            double recip2 = getRecip(rowNum2, c2);
+
+            if (!isfinite(recip1) && !isfinite(recip2)) {
+                r = 0.0;
+                continue;
+            }
+            if (!isfinite(recip1) || !isfinite(recip2)) {
+                r = 1.0;
+                continue;
+            }
+
+            // Make sure dist(x,y) == dist(y,x) irrespective of rounding, by
+            // always multiplying the reciprocals in the same order.
+            double r1 = recip1, r2 = recip2;
+            if (rowNum2 < rowNum1)
+                std::swap(r1, r2);
+
+            r = std::max(1.0 - dotprods[i] * r1 * r2, 0.0);
+
+            // As in calc(), identical vectors are at distance zero even if
+            // they aren't known rows
+            if (r != 0.0 && r < 1e-6
+                && std::equal(c2, c2 + dims, coords1.data()))
+                r = 0.0;
+
+            ExcAssert(isfinite(r));
+        }
     }
+}
 
-    ExcAssert(isfinite(result));
-    ExcAssertGreaterEqual(result, 0.0);
-
-    return result;
+DistanceMetric *
+CosineDistanceMetric::
+clone() const
+{
+    return new CosineDistanceMetric(*this);
 }
 
 
@@ -44,6 +44,23 @@ struct DistanceMetric {
                        const ML::distribution<float> & coords1,
                        const ML::distribution<float> & coords2) const = 0;
 
+    /** Calculate the distance between one row and each of n others, into
+        result.  rowNum1 has the same meaning as for dist(), and rowNums2
+        gives the row numbers of the others, or may be null if none of them
+        have a known number.  The result for each row is exactly that of
+        dist(), but this is much faster than calling dist() repeatedly.
+    */
+    virtual void distBatch(int rowNum1,
+                           const ML::distribution<float> & coords1,
+                           const int * rowNums2,
+                           const float * const * coords2,
+                           size_t n, float * result) const = 0;
+
+    /** Return a copy of this metric, including the information cached
+        about the rows that were already added.
+    */
+    virtual DistanceMetric * clone() const = 0;
+
     /** Factor for distance metric objects. */
     static DistanceMetric * create(MetricSpace space);
 };
@@ -61,9 +78,13 @@ struct EuclideanDistanceMetric: public DistanceMetric {
                const ML::distribution<float> & coords1,
                const ML::distribution<float> & coords2) const;
 
-    /// Pre cached ||vec||^2 for each row, to allow optimization of the
-    /// calculation.
-    std::vector<double> sum_dist;
+    void distBatch(int rowNum1,
+                   const ML::distribution<float> & coords1,
+                   const int * rowNums2,
+                   const float * const * coords2,
+                   size_t n, float * result) const;
+
+    DistanceMetric * clone() const;
 
     /// Static method to perform the calculation, with no caching
     static float calc(const ML::distribution<float> & coords1,
@@ -83,6 +104,14 @@ struct CosineDistanceMetric: public DistanceMetric {
                const ML::distribution<float> & coords1,
                const ML::distribution<float> & coords2) const;
 
+    void distBatch(int rowNum1,
+                   const ML::distribution<float> & coords1,
+                   const int * rowNums2,
+                   const float * const * coords2,
+                   size_t n, float * result) const;
+
+    DistanceMetric * clone() const;
+
     /// Pre-cached reciprocal of the two norm of each vector, to allow
     /// optimization of the calculation.
     std::vector<double> two_norm_recip;
@@ -16,11 +16,13 @@ LIBMLDB_BUILTIN_PLUGIN_SOURCES:= \
 	embedding.cc \
 	sqlite_dataset.cc \
 	sparse_matrix_dataset.cc \
+	write_ahead_log.cc \
 	text_line_dataset.cc \
 	script_procedure.cc \
 	script_function.cc \
 	permuter_procedure.cc \
 	csv_dataset.cc \
+	tabular_dataset.cc \
 	svm.cc \
 	feature_generators.cc \
 	external_python_procedure.cc \
@@ -17,7 +17,15 @@
 #include "mldb/types/any_impl.h"
 #include "mldb/arch/rcu_protected.h"
 #include "mldb/arch/timers.h"
+#include "mldb/arch/bitops.h"
+#include "mldb/arch/bit_range_ops.h"
+#include "mldb/arch/thread_specific.h"
 #include "mldb/jml/utils/worker_task.h"
+#include "mldb/jml/utils/file_functions.h"
+#include "mldb/jml/db/persistent.h"
+#include "write_ahead_log.h"
+#include <fstream>
+#include <sstream>
 
 
 using namespace std;
@@ -196,8 +204,12 @@ struct SparseMatrixDataset::Itl
         return std::make_shared<WriteTransaction>(view);
     }
 
-    /// Commit a set of writes to the database
-    void commitWrites(WriteTransaction & trans)
+    /** Commit a set of writes to the database.  If onCommitted is set,
+        it's called once the writes are in, before the root lock is
+        released, so that it's ordered with respect to other commits.
+    */
+    void commitWrites(WriteTransaction & trans,
+                      const std::function<void ()> & onCommitted = nullptr)
     {
         std::unique_lock<RootLock> guard(rootLock);
         ++epoch;
@@ -228,9 +240,16 @@ struct SparseMatrixDataset::Itl
         result->values = values->startReadTransaction();
 
         setDefaultTransaction(result);
+
+        if (onCommitted)
+            onCommitted();
     }
 
-    void optimize()
+    /** Merge everything written so far into its optimized form.  If
+        onOptimized is set, it's called with the root lock still held, when
+        the optimized form contains exactly what's been committed.
+    */
+    void optimize(const std::function<void ()> & onOptimized = nullptr)
     {
         //cerr << "optimize() on MutableSparseMatrixDataset" << endl;
         ML::Timer timer;
@@ -262,6 +281,17 @@ struct SparseMatrixDataset::Itl
         result->values = values->startReadTransaction();
 
         setDefaultTransaction(result);
+
+        if (onOptimized)
+            onOptimized();
+    }
+
+    /** Called when the dataset is committed.  Default optimizes the
+        storage of the data that's been recorded to date.
+    */
+    virtual void commit()
+    {
+        optimize();
     }
 
     Date decodeTs(int64_t ts) const
@@ -784,7 +814,7 @@ struct SparseMatrixDataset::Itl
 
 SparseMatrixDataset::
 SparseMatrixDataset(MldbServer * owner)
-    : Dataset(owner)
+    : Dataset(owner), visibleOnWrite(false)
 {
 }
     
@@ -806,7 +836,9 @@ recordRowItl(const RowName & rowName,
              const std::vector<std::tuple<ColumnName, CellValue, Date> > & vals)
 {
     validateNames(rowName, vals);
-    return itl->recordRow(rowName, vals);
+    itl->recordRow(rowName, vals);
+    if (visibleOnWrite)
+        bumpCommitGeneration();
 }
 
 void
@@ -814,7 +846,9 @@ SparseMatrixDataset::
 recordRows(const std::vector<std::pair<RowName, std::vector<std::tuple<ColumnName, CellValue, Date> > > > & rows)
 {
     validateNames(rows);
-    return itl->recordRows(rows);
+    itl->recordRows(rows);
+    if (visibleOnWrite)
+        bumpCommitGeneration();
 }
 
 KnownColumn
@@ -831,7 +865,8 @@ commit()
     // We call commit() when we're done with writing data.  We take advantage
     // of it to optimize the storage of the data that's been recorded to
     // date.
-    return itl->optimize();
+    itl->commit();
+    bumpCommitGeneration();
 }
     
 Date
@@ -878,6 +913,223 @@ enum CommitMode {
     WRITE_FAST
 };
 
+/*****************************************************************************/
+/* PACKED COLUMN                                                             */
+/*****************************************************************************/
+
+/** Immutable column of integers, each stored as its difference from the
+    smallest value in the column, bit-packed to the width of the largest
+    difference.  Timestamps, value indexes and tags are mostly close to
+    each other, so they pack to a fraction of their 64 bit width.
+*/
+
+struct PackedColumn {
+    PackedColumn()
+        : minValue(0), bits(0), numValues(0), storage(1)
+    {
+    }
+
+    PackedColumn(const std::vector<uint64_t> & values)
+        : minValue(0), bits(0), numValues(values.size())
+    {
+        if (!values.empty()) {
+            minValue = *std::min_element(values.begin(), values.end());
+            uint64_t maxValue = *std::max_element(values.begin(), values.end());
+            bits = maxValue == minValue
+                ? 0 : ML::highest_bit(maxValue - minValue) + 1;
+        }
+
+        // One extra word so that reading the last value can touch the
+        // word that follows it
+        storage.resize((bits * numValues + 63) / 64 + 1);
+        ML::Bit_Writer<uint64_t> writer(storage.data());
+        for (auto & v: values)
+            writer.write(v - minValue, bits);
+    }
+
+    uint64_t operator [] (size_t i) const
+    {
+        size_t bit = i * bits;
+        return minValue
+            + ML::extract_bit_range(storage.data() + bit / 64, bit % 64, bits);
+    }
+
+    size_t size() const
+    {
+        return numValues;
+    }
+
+    size_t memusage() const
+    {
+        return sizeof(*this) + storage.capacity() * sizeof(uint64_t);
+    }
+
+    void serialize(ML::DB::Store_Writer & store) const
+    {
+        store << minValue << bits << numValues << storage;
+    }
+
+    void reconstitute(ML::DB::Store_Reader & store)
+    {
+        store >> minValue >> bits >> numValues >> storage;
+        ExcAssertEqual(storage.size(), (bits * numValues + 63) / 64 + 1);
+    }
+
+    uint64_t minValue;
+    int bits;
+    uint64_t numValues;
+    std::vector<uint64_t> storage;
+};
+
+
+/*****************************************************************************/
+/* COMPACT ROWS                                                              */
+/*****************************************************************************/
+
+/** Immutable, sorted CSR (compressed sparse row) form of a set of rows,
+    which is what optimize() produces.  Rows are found by binary search on
+    the sorted row numbers, and their entries are the range given by the
+    offsets into the packed entry columns.
+
+    Only a few entries have metadata (the names in the values matrix), so
+    it's kept to the side, sorted by entry number.
+*/
+
+struct CompactRows {
+    typedef ML::compact_vector<std::string, 0, uint32_t> Metadata;
+
+    /// Sorted row numbers
+    std::vector<uint64_t> rowNums;
+
+    /// Entries of row i are [offsets[i], offsets[i + 1])
+    PackedColumn offsets;
+
+    /// Fields of the entries, one element per entry
+    PackedColumn rowcols;
+    PackedColumn timestamps;
+    PackedColumn vals;
+    PackedColumn tags;
+
+    /// Metadata for the entries that have any, by entry number
+    std::vector<std::pair<uint64_t, Metadata> > metadata;
+
+    size_t rowCount() const
+    {
+        return rowNums.size();
+    }
+
+    size_t entryCount() const
+    {
+        return rowcols.size();
+    }
+
+    /// Return the index of the given row, or -1 if it's not there
+    ssize_t findRow(uint64_t rowNum) const
+    {
+        auto it = std::lower_bound(rowNums.begin(), rowNums.end(), rowNum);
+        if (it == rowNums.end() || *it != rowNum)
+            return -1;
+        return it - rowNums.begin();
+    }
+
+    bool knownRow(uint64_t rowNum) const
+    {
+        return std::binary_search(rowNums.begin(), rowNums.end(), rowNum);
+    }
+
+    /// Call onEntry for each entry of the row at the given index
+    bool iterateRowIndex(size_t index,
+                         const std::function<bool (const BaseEntry & entry)> & onEntry) const
+    {
+        uint64_t begin = offsets[index], end = offsets[index + 1];
+
+        auto mit = std::lower_bound(metadata.begin(), metadata.end(), begin,
+                                    [] (const std::pair<uint64_t, Metadata> & m,
+                                        uint64_t entryNum)
+                                    {
+                                        return m.first < entryNum;
+                                    });
+
+        BaseEntry entry;
+        for (uint64_t i = begin;  i < end;  ++i) {
+            entry.rowcol = rowcols[i];
+            entry.timestamp = timestamps[i];
+            entry.val = vals[i];
+            entry.tag = tags[i];
+            entry.metadata.clear();
+            if (mit != metadata.end() && mit->first == i) {
+                entry.metadata = mit->second;
+                ++mit;
+            }
+            if (!onEntry(entry))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool iterateRow(uint64_t rowNum,
+                    const std::function<bool (const BaseEntry & entry)> & onEntry) const
+    {
+        ssize_t index = findRow(rowNum);
+        if (index == -1)
+            return true;
+        return iterateRowIndex(index, onEntry);
+    }
+
+    size_t memusage() const
+    {
+        size_t result = sizeof(*this)
+            + rowNums.capacity() * sizeof(uint64_t)
+            + offsets.memusage() + rowcols.memusage()
+            + timestamps.memusage() + vals.memusage() + tags.memusage();
+        for (auto & m: metadata) {
+            result += sizeof(m);
+            for (auto & s: m.second)
+                result += s.capacity();
+        }
+        return result;
+    }
+
+    void serialize(ML::DB::Store_Writer & store) const
+    {
+        store << rowNums;
+        offsets.serialize(store);
+        rowcols.serialize(store);
+        timestamps.serialize(store);
+        vals.serialize(store);
+        tags.serialize(store);
+        store << ML::DB::compact_size_t(metadata.size());
+        for (auto & m: metadata) {
+            store << m.first << ML::DB::compact_size_t(m.second.size());
+            for (auto & s: m.second)
+                store << s;
+        }
+    }
+
+    void reconstitute(ML::DB::Store_Reader & store)
+    {
+        store >> rowNums;
+        offsets.reconstitute(store);
+        rowcols.reconstitute(store);
+        timestamps.reconstitute(store);
+        vals.reconstitute(store);
+        tags.reconstitute(store);
+        ML::DB::compact_size_t numMetadata(store);
+        metadata.resize(numMetadata);
+        for (auto & m: metadata) {
+            store >> m.first;
+            ML::DB::compact_size_t n(store);
+            m.second.resize(n);
+            for (auto & s: m.second)
+                store >> s;
+        }
+
+        ExcAssertEqual(offsets.size(), rowNums.size() + 1);
+    }
+};
+
+
 /*****************************************************************************/
 /* MUTABLE BASE MATRIX                                                       */
 /*****************************************************************************/
@@ -891,6 +1143,16 @@ struct MutableBaseData {
 
     typedef std::unordered_map<uint64_t, ML::compact_vector<BaseEntry, 1> > RowsEntry;
 
+    /** Maximum number of layers that WRITE_FAST mode will stack up before
+        it merges them like READ_FAST does.  Readers look at every layer,
+        so this bounds how slow reads can get between commits.
+    */
+    enum { MAX_READABLE_LAYERS = 32 };
+
+    /** The rows are made up of the compacted rows from the last optimize(),
+        followed by layers of rows written since, oldest first.  A row's
+        entries are those of each, in that order.
+    */
     struct Rows {
         Rows()
             : cachedRowCount(-1)
@@ -898,19 +1160,22 @@ struct MutableBaseData {
         }
 
         Rows(Rows && other) noexcept
-            : entries(std::move(other.entries)),
+            : compacted(std::move(other.compacted)),
+              entries(std::move(other.entries)),
               cachedRowCount(other.cachedRowCount.load())
         {
         }
 
         Rows(const Rows & other)
-            : entries(other.entries),
+            : compacted(other.compacted),
+              entries(other.entries),
               cachedRowCount(other.cachedRowCount.load())
         {
         }
 
         Rows & operator = (Rows && other) noexcept
         {
+            this->compacted = std::move(other.compacted);
             this->entries = std::move(other.entries);
             this->cachedRowCount = other.cachedRowCount.load();
             return *this;
@@ -918,18 +1183,26 @@ struct MutableBaseData {
 
         Rows & operator = (const Rows & other)
         {
+            this->compacted = other.compacted;
             this->entries = other.entries;
             this->cachedRowCount = other.cachedRowCount.load();
             return *this;
         }
 
+        /// Rows as of the last optimize(); null if it never happened
+        std::shared_ptr<const CompactRows> compacted;
+
+        /// Layers written since the last optimize()
         std::vector<std::shared_ptr<const RowsEntry> > entries;
         mutable std::atomic<int64_t> cachedRowCount;
         mutable std::mutex rowCountMutex;
-        
+
         bool iterateRow(uint64_t rowNum,
                         const std::function<bool (const BaseEntry & entry)> & onEntry) const
         {
+            if (compacted && !compacted->iterateRow(rowNum, onEntry))
+                return false;
+
             for (auto & e: entries) {
                 auto it = e->find(rowNum);
                 if (it != e->end()) {
@@ -943,20 +1216,50 @@ struct MutableBaseData {
             return true;
         }
 
-        bool iterateRows(const std::function<bool (uint64_t row)> & onRow) const
+        /// Sorted, unique row numbers in the layers but not in compacted
+        std::vector<uint64_t> uncompactedRows() const
         {
-            std::vector<uint64_t> allRows;
+            std::vector<uint64_t> result;
 
             for (auto & e: entries) {
                 for (auto & r: *e) {
-                    allRows.emplace_back(r.first);
+                    if (!compacted || !compacted->knownRow(r.first))
+                        result.emplace_back(r.first);
                 }
             }
 
-            std::sort(allRows.begin(), allRows.end());
-            auto end = std::unique(allRows.begin(), allRows.end());
-            for (auto it = allRows.begin(); it != end;  ++it) {
-                if (!onRow(*it))
+            std::sort(result.begin(), result.end());
+            result.erase(std::unique(result.begin(), result.end()),
+                         result.end());
+            return result;
+        }
+
+        bool iterateRows(const std::function<bool (uint64_t row)> & onRow) const
+        {
+            static const std::vector<uint64_t> none;
+            const std::vector<uint64_t> & compactedRows
+                = compacted ? compacted->rowNums : none;
+
+            if (entries.empty()) {
+                // Already sorted and unique
+                for (auto & r: compactedRows) {
+                    if (!onRow(r))
+                        return false;
+                }
+                return true;
+            }
+
+            // Merge the two sorted, disjoint lists of rows
+            std::vector<uint64_t> newRows = uncompactedRows();
+            auto it1 = compactedRows.begin(), end1 = compactedRows.end();
+            auto it2 = newRows.begin(), end2 = newRows.end();
+
+            while (it1 != end1 || it2 != end2) {
+                uint64_t row;
+                if (it2 == end2 || (it1 != end1 && *it1 < *it2))
+                    row = *it1++;
+                else row = *it2++;
+                if (!onRow(row))
                     return false;
             }
 
@@ -965,56 +1268,52 @@ struct MutableBaseData {
 
         bool knownRow(uint64_t rowNum) const
         {
+            if (compacted && compacted->knownRow(rowNum))
+                return true;
             for (auto & e: entries) {
                 if (e->count(rowNum))
                     return true;
             }
             return false;
         }
-        
+
         size_t rowCount() const
         {
+            size_t numCompacted = compacted ? compacted->rowCount() : 0;
             if (entries.empty())
-                return 0;
-            if (entries.size() == 1)
+                return numCompacted;
+            if (entries.size() == 1 && !numCompacted)
                 return entries.back()->size();
             int64_t r = cachedRowCount.load();
             if (r != -1)
                 return r;
 
-            // TODO: this is slow, but at least correct
             std::unique_lock<std::mutex> guard(rowCountMutex);
-            std::vector<uint64_t> allRows;
-
-            for (auto & e: entries) {
-                for (auto & r: *e) {
-                    allRows.emplace_back(r.first);
-                }
-            }
-
-            std::sort(allRows.begin(), allRows.end());
-
-            int64_t rowCount = std::unique(allRows.begin(), allRows.end())
-                - allRows.begin();
+            int64_t rowCount = numCompacted + uncompactedRows().size();
             cachedRowCount = rowCount;
             return rowCount;
         }
 
+        /** Merge the compacted rows, the layers and the given writes into a
+            new set of compacted rows.
+        */
         Rows optimize(std::vector<std::shared_ptr<RowsEntry> > & nonReadableWrites) const
         {
             Rows result;
 
-            RowsEntry newEntries;
+            if (entries.empty() && nonReadableWrites.empty() && compacted) {
+                // Nothing has changed
+                result.compacted = compacted;
+                return std::move(result);
+            }
 
-            if (!entries.empty()) {
-                newEntries = *entries.front();
+            // Gather everything that's not compacted yet, in order
+            RowsEntry newEntries;
 
-                for (unsigned i = 1;  i < entries.size();  ++i) {
-                    auto & e = entries[i];
-                    for (auto & v: *e) {
-                        auto & vec = newEntries[v.first];
-                        vec.insert(vec.end(), v.second.begin(), v.second.end());
-                    }
+            for (auto & e: entries) {
+                for (auto & v: *e) {
+                    auto & vec = newEntries[v.first];
+                    vec.insert(vec.end(), v.second.begin(), v.second.end());
                 }
             }
 
@@ -1031,61 +1330,186 @@ struct MutableBaseData {
 
             nonReadableWrites.clear();
 
-            result.entries.emplace_back(new RowsEntry(std::move(newEntries)));
+            result.compacted = compact(compacted.get(), newEntries);
             return std::move(result);
         }
 
-        struct Stream {       
+        /** Build compacted rows from the old compacted rows (which may be
+            null) followed by the new entries.
+        */
+        static std::shared_ptr<const CompactRows>
+        compact(const CompactRows * old, const RowsEntry & newEntries)
+        {
+            std::vector<uint64_t> newRows;
+            newRows.reserve(newEntries.size());
+            for (auto & r: newEntries)
+                newRows.push_back(r.first);
+            std::sort(newRows.begin(), newRows.end());
+
+            size_t numEntries = old ? old->entryCount() : 0;
+            for (auto & r: newEntries)
+                numEntries += r.second.size();
+
+            auto result = std::make_shared<CompactRows>();
+            std::vector<uint64_t> offsets, rowcols, timestamps, vals, tags;
+            result->rowNums.reserve(newRows.size() + (old ? old->rowCount() : 0));
+            offsets.reserve(result->rowNums.capacity() + 1);
+            rowcols.reserve(numEntries);
+            timestamps.reserve(numEntries);
+            vals.reserve(numEntries);
+            tags.reserve(numEntries);
+
+            auto addEntry = [&] (const BaseEntry & entry)
+                {
+                    if (!entry.metadata.empty())
+                        result->metadata.emplace_back(rowcols.size(),
+                                                      entry.metadata);
+                    rowcols.push_back(entry.rowcol);
+                    timestamps.push_back(entry.timestamp);
+                    vals.push_back(entry.val);
+                    tags.push_back(entry.tag);
+                    return true;
+                };
+
+            size_t i = 0, numOld = old ? old->rowCount() : 0;
+            auto it = newRows.begin();
+
+            while (i < numOld || it != newRows.end()) {
+                uint64_t rowNum;
+                if (it == newRows.end()
+                    || (i < numOld && old->rowNums[i] <= *it))
+                    rowNum = old->rowNums[i];
+                else rowNum = *it;
+
+                result->rowNums.push_back(rowNum);
+                offsets.push_back(rowcols.size());
+
+                if (i < numOld && old->rowNums[i] == rowNum)
+                    old->iterateRowIndex(i++, addEntry);
+
+                if (it != newRows.end() && *it == rowNum) {
+                    for (auto & entry: newEntries.find(rowNum)->second)
+                        addEntry(entry);
+                    ++it;
+                }
+            }
+
+            offsets.push_back(rowcols.size());
+
+            result->offsets = PackedColumn(offsets);
+            result->rowcols = PackedColumn(rowcols);
+            result->timestamps = PackedColumn(timestamps);
+            result->vals = PackedColumn(vals);
+            result->tags = PackedColumn(tags);
+
+            return result;
+        }
+
+        /** Add a layer to the given ones, merging layers so that each is
+            at most half the size of the one before.  That makes an
+            insertion have an amortized constant cost while keeping the
+            number of layers logarithmic in the number of rows.
+        */
+        static std::vector<std::shared_ptr<const RowsEntry> >
+        addTiered(const std::vector<std::shared_ptr<const RowsEntry> > & oldEntries,
+                  std::shared_ptr<RowsEntry> written)
+        {
+            std::shared_ptr<RowsEntry> current = std::move(written);
+
+            std::vector<std::shared_ptr<const RowsEntry> >
+                newRows;
+
+            /* This loop maintains the invariant that:
+               - Entries are in decreasing order of size
+               - Each entry is at most 1/2 the size of the precedent
+
+               It's done that way so that an insertion has an amortized
+               constant cost.
+            */
+
+            for (int i = oldEntries.size() - 1;  i >= 0;  --i) {
+                // Two choices here: either we a) merge "current" with
+                // the existing value, or b) write the existing value and
+                // then current
+
+                std::shared_ptr<const RowsEntry> rows
+                    = oldEntries[i];
+
+                // If we are balanced or were previously balanced then
+                // continue
+                if (!current) {
+                    newRows.push_back(rows);
+                    continue;
+                }
+
+                double ratio = 1.0 * current->size() / rows->size();
+                if (ratio <= 0.5) {
+                    newRows.emplace_back(std::move(current));
+                    current.reset();
+                    newRows.push_back(rows);
+                    continue;
+                }
+
+                // Otherwise, merge the two together
+                auto merged = std::make_shared<RowsEntry>(*rows);
+
+                for (auto & rowIn: *current) {
+                    auto & rowOut = (*merged)[rowIn.first];
+                    rowOut.insert(rowOut.end(),
+                                  std::make_move_iterator(rowIn.second.begin()),
+                                  std::make_move_iterator(rowIn.second.end()));
+                }
+
+                current = merged;
+            }
+
+            if (current)
+                newRows.emplace_back(std::move(current));
+
+            // Put them back in order of size
+            std::reverse(newRows.begin(), newRows.end());
+
+            return newRows;
+        }
+
+        /** Streams through the row numbers of the compacted rows.  Only
+            valid when there are no layers on top of them.
+        */
+        struct Stream {
 
-            Stream(const MutableBaseData::Rows* source) : source(source)
+            Stream(const MutableBaseData::Rows* source) : source(source), pos(0)
             {
             }
 
             void initAt(size_t start)
             {
-                entriesIter = source->entries.begin();
-               
-                subIter = (*entriesIter)->begin();
-                size_t count = 0;
-                while (start - count > (*entriesIter)->size())
-                {
-                    count += (*entriesIter)->size();
-                    ++entriesIter;
-                    subIter = (*entriesIter)->begin();
-                };
-
-                //should we switch to an ordered map?
-                while (count < start)
-                {
-                    ++count;
-                    ++subIter;
-                };
+                pos = start;
             }
 
             virtual uint64_t next()
             {
-                uint64_t value = subIter->first;
-                subIter++;
-                if (subIter == (*entriesIter)->end())  {
-                    ++entriesIter;
-                    if (entriesIter != source->entries.end())  {
-                        subIter = (*entriesIter)->begin();
-                    }
-                }
-
-                return value;
+                return source->compacted->rowNums[pos++];
             }
 
-            std::vector<std::shared_ptr<const RowsEntry> >::const_iterator entriesIter;
-            RowsEntry::const_iterator subIter;
             const MutableBaseData::Rows* source;
+            size_t pos;
         };
 
         bool isSingleReadEntry() const
         {
-            return entries.size() == 1;
+            return compacted && entries.empty();
         }
 
+        size_t memusage() const
+        {
+            size_t result = compacted ? compacted->memusage() : 0;
+            for (auto & e: entries) {
+                result += e->size() * (sizeof(RowsEntry::value_type) + 16);
+                for (auto & r: *e)
+                    result += r.second.size() * sizeof(BaseEntry);
+            }
+            return result;
+        }
     };
 
     struct Repr {
@@ -1111,6 +1535,22 @@ struct MutableBaseData {
         repr.replace(newRepr.release());
     }
 
+    /** Replace everything with the given compacted rows, which are readable
+        straight away.  Used when loading a snapshot.
+    */
+    void load(std::shared_ptr<const CompactRows> rows)
+    {
+        std::unique_lock<std::mutex> guard(mutex);
+
+        std::unique_ptr<std::shared_ptr<Repr> > newRepr
+            (new std::shared_ptr<Repr>);
+        newRepr->reset(new Repr());
+        (**newRepr).rows.compacted = std::move(rows);
+
+        nonReadableWrites.clear();
+        repr.replace(newRepr.release());
+    }
+
     /** Insert the given set of rows very quickly, but in a way that they
         will not be available for reading until the next commit()
         operation has completed.
@@ -1130,17 +1570,20 @@ struct MutableBaseData {
 
         auto r = this->repr();
         const Rows & oldRows = (*r)->rows;
-        
-        std::vector<std::shared_ptr<const RowsEntry> >
+
+        std::vector<std::shared_ptr<const RowsEntry> > newRows;
+        if (oldRows.entries.size() < MAX_READABLE_LAYERS) {
             newRows = oldRows.entries;
-        newRows.emplace_back(std::move(written));
+            newRows.emplace_back(std::move(written));
+        }
+        else newRows = Rows::addTiered(oldRows.entries, std::move(written));
 
         std::unique_ptr<std::shared_ptr<Repr> > newRepr
             (new std::shared_ptr<Repr>);
         newRepr->reset(new Repr());
 
+        (**newRepr).rows.compacted = oldRows.compacted;
         (**newRepr).rows.entries = std::move(newRows);
-        (**newRepr).rows.cachedRowCount = oldRows.cachedRowCount.load();
 
         this->repr.replace(newRepr.release());
     }
@@ -1153,82 +1596,17 @@ struct MutableBaseData {
         // Only one balancing at a time
         std::unique_lock<std::mutex> guard(this->mutex);
 
-        ML::Timer timer;
-
         // Get a reference to the data
         auto r = this->repr();
         const Rows & oldRows = (*r)->rows;
-        
-        std::shared_ptr<RowsEntry> current = written;
-
-        std::vector<std::shared_ptr<const RowsEntry> >
-            newRows;
-        
-        /* This loop maintains the invariant that:
-           - Entries are in decreasing order of size
-           - Each entry is at most 1/2 the size of the precedent
-
-           It's done that way so that an insertion has an amortized
-           constant cost.
-        */
-           
-        for (int i = oldRows.entries.size() - 1;  i >= 0;  --i) {
-            // Two choices here: either we a) merge "current" with
-            // the existing value, or b) write the existing value and
-            // then current
-
-            std::shared_ptr<const RowsEntry> rows
-                = oldRows.entries[i];
-
-            // If we are balanced or were previously balanced then
-            // continue
-            if (!current) {
-                newRows.push_back(rows);
-                continue;
-            }
-
-            double ratio = 1.0 * current->size() / rows->size();
-            if (ratio <= 0.5) {
-                newRows.emplace_back(std::move(current));
-                current.reset();
-                newRows.push_back(rows);
-                continue;
-            }
-
-            // Otherwise, merge the two together
-            auto merged = std::make_shared<RowsEntry>(*rows);
-
-            for (auto & rowIn: *current) {
-                auto & rowOut = (*merged)[rowIn.first];
-                rowOut.insert(rowOut.end(),
-                              std::make_move_iterator(rowIn.second.begin()),
-                              std::make_move_iterator(rowIn.second.end()));
-            }
-            
-            //cerr << "merging " << current->size() << " and " << rows->size()
-            //     << " yielded " << merged->size() << " with ratio " << ratio
-            //     << endl;
-
-            current = merged;
-        }
-
-        if (current)
-            newRows.emplace_back(std::move(current));
-
-        // Put them back in order of size
-        std::reverse(newRows.begin(), newRows.end());
-
-        //for (unsigned i = 0;  i < newRows.size();  ++i) {
-        //    cerr << "Rows entry " << i << " has " << newRows[i]->size()
-        //         << endl;
-        //}
 
         std::unique_ptr<std::shared_ptr<Repr> > newRepr
             (new std::shared_ptr<Repr>);
         newRepr->reset(new Repr());
 
-        (**newRepr).rows.entries = std::move(newRows);
-        (**newRepr).rows.cachedRowCount = oldRows.cachedRowCount.load();
+        (**newRepr).rows.compacted = oldRows.compacted;
+        (**newRepr).rows.entries
+            = Rows::addTiered(oldRows.entries, std::move(written));
 
         this->repr.replace(newRepr.release());
     }
@@ -1491,7 +1869,8 @@ MutableSparseMatrixDatasetConfig::
 MutableSparseMatrixDatasetConfig()
     : timeQuantumSeconds(1.0),
       consistencyLevel(WT_READ_AFTER_COMMIT),
-      favor(TF_FAVOR_READS)
+      favor(TF_FAVOR_READS),
+      snapshotThresholdBytes(64 * 1024 * 1024)
 {
 }
 
@@ -1518,8 +1897,116 @@ MutableSparseMatrixDatasetConfigDescription()
              "Whether to favor reads or writes.  Only has effect for when "
              "`consistencyLevel` is set to `consistentAfterWrite`.",
              TF_FAVOR_READS);
+    addField("dataFileUrl", &MutableSparseMatrixDatasetConfig::dataFileUrl,
+             "URI (must be file://) of the file to persist the dataset to.  "
+             "Every write is logged before it's acknowledged, and the "
+             "dataset is reloaded from the file and its log when it's "
+             "created again with the same URI.  If empty, the dataset "
+             "lives only in memory.");
+    addField("snapshotThresholdBytes",
+             &MutableSparseMatrixDatasetConfig::snapshotThresholdBytes,
+             "When the dataset is persisted, a `commit()` writes the whole "
+             "dataset to `dataFileUrl` and truncates the log once the log "
+             "has grown past this many bytes.  Smaller values make "
+             "recovery faster at the expense of more frequent snapshots.  "
+             "0 writes a snapshot on every commit.",
+             (uint64_t)(64 * 1024 * 1024));
 }
 
+/*****************************************************************************/
+/* PERSISTENCE                                                               */
+/*****************************************************************************/
+
+namespace {
+
+typedef std::vector<std::pair<RowName, std::vector<std::tuple<ColumnName, CellValue, Date> > > > RecordedRows;
+
+const std::string SNAPSHOT_MAGIC = "MLDBSPSN";
+const uint32_t SNAPSHOT_VERSION = 2;
+
+void serializeCoord(ML::DB::Store_Writer & store, const Coord & coord)
+{
+    store << std::string(coord.data(), coord.dataLength());
+}
+
+Coord reconstituteCoord(ML::DB::Store_Reader & store)
+{
+    std::string str;
+    store >> str;
+    return Coord(str.data(), str.length());
+}
+
+/** Encode a recordRows() call as a write ahead log record.  The raw values
+    are logged rather than their encoded form, so that replaying it goes
+    through exactly the same path as the original write.
+*/
+std::string encodeLogRecord(const RecordedRows & rows)
+{
+    std::ostringstream stream;
+    {
+        ML::DB::Store_Writer store(stream);
+        store << ML::DB::compact_size_t(rows.size());
+        for (auto & r: rows) {
+            serializeCoord(store, r.first);
+            store << ML::DB::compact_size_t(r.second.size());
+            for (auto & v: r.second) {
+                serializeCoord(store, std::get<0>(v));
+                std::get<1>(v).serialize(store);
+                store << std::get<2>(v).secondsSinceEpoch();
+            }
+        }
+    }
+    return stream.str();
+}
+
+RecordedRows decodeLogRecord(const char * data, size_t len)
+{
+    ML::DB::Store_Reader store(data, len);
+    RecordedRows result;
+
+    ML::DB::compact_size_t numRows(store);
+    result.resize(numRows);
+    for (auto & r: result) {
+        r.first = reconstituteCoord(store);
+        ML::DB::compact_size_t numValues(store);
+        r.second.reserve(numValues);
+        for (size_t i = 0;  i < numValues;  ++i) {
+            ColumnName column = reconstituteCoord(store);
+            CellValue value;
+            value.reconstitute(store);
+            double ts;
+            store >> ts;
+            r.second.emplace_back(std::move(column), std::move(value),
+                                  Date::fromSecondsSinceEpoch(ts));
+        }
+    }
+
+    return result;
+}
+
+/** Rows are snapshotted just after an optimize(), so they are all in
+    compacted form.
+*/
+void serializeRows(ML::DB::Store_Writer & store,
+                   const MutableBaseData::Rows & rows)
+{
+    ExcAssert(rows.entries.empty());
+    if (rows.compacted)
+        rows.compacted->serialize(store);
+    else MutableBaseData::Rows::compact(nullptr, {})->serialize(store);
+}
+
+std::shared_ptr<const CompactRows>
+reconstituteRows(ML::DB::Store_Reader & store)
+{
+    auto result = std::make_shared<CompactRows>();
+    result->reconstitute(store);
+    return result;
+}
+
+} // file scope
+
+
 /*****************************************************************************/
 /* MUTABLE SPARSE MATRIX DATASET                                             */
 /*****************************************************************************/
@@ -1529,22 +2016,337 @@ struct MutableSparseMatrixDataset::Itl
 
     GcLock gc;
 
-    Itl(double timeQuantumSeconds,
-        WriteTransactionLevel consistencyLevel,
-        TransactionFavor favor) 
+    Itl(const MutableSparseMatrixDatasetConfig & config)
+        : snapshotThresholdBytes(config.snapshotThresholdBytes)
     {
-        CommitMode mode;
-        if (consistencyLevel == WT_READ_AFTER_COMMIT)
+        if (config.consistencyLevel == WT_READ_AFTER_COMMIT)
             mode = READ_ON_COMMIT;
-        else if (favor == TF_FAVOR_READS)
+        else if (config.favor == TF_FAVOR_READS)
             mode = READ_FAST;
         else mode = WRITE_FAST;
 
-        SparseMatrixDataset::Itl::timeQuantumSeconds = timeQuantumSeconds;
+        matrixData = std::make_shared<MutableBaseMatrix>(gc, mode);
+        inverseData = std::make_shared<MutableBaseMatrix>(gc, mode);
+        valuesData = std::make_shared<MutableBaseMatrix>(gc, mode);
+
+        SparseMatrixDataset::Itl::timeQuantumSeconds = config.timeQuantumSeconds;
         init(std::make_shared<MutableBaseMatrix>(gc, mode),
-             std::make_shared<MutableBaseMatrix>(gc, mode),
-             std::make_shared<MutableBaseMatrix>(gc, mode),
-             std::make_shared<MutableBaseMatrix>(gc, mode));
+             matrixData, inverseData, valuesData);
+
+        if (!config.dataFileUrl.empty())
+            open(config.dataFileUrl);
+    }
+
+    CommitMode mode;
+    std::shared_ptr<MutableBaseMatrix> matrixData;
+    std::shared_ptr<MutableBaseMatrix> inverseData;
+    std::shared_ptr<MutableBaseMatrix> valuesData;
+
+    /** Number of cells a thread's write buffer holds before it's
+        published into the matrices.
+    */
+    enum { WRITE_BUFFER_CELLS = 65536 };
+
+    /** Writes made by one thread in consistentAfterCommit mode.  As they
+        won't be readable until the next commit anyway, they don't need
+        to go through the root lock on each call; instead they build up in
+        a write transaction that's owned by the thread, and that's
+        published in one go when it's big enough or on commit.  Row,
+        column and value names are only recorded once per buffer, however
+        many times they're written.
+    */
+    struct WriteBuffer {
+        WriteBuffer()
+            : numCells(0)
+        {
+        }
+
+        /// Only contended when commit() publishes the buffer
+        std::mutex mutex;
+        std::shared_ptr<WriteTransaction> trans;
+        size_t numCells;
+    };
+
+    /// Each thread's reference to its write buffer
+    struct WriteBufferHandle {
+        std::shared_ptr<WriteBuffer> buffer;
+    };
+
+    ML::ThreadSpecificInstanceInfo<WriteBufferHandle, Itl> threadWriteBuffers;
+
+    /** All of the write buffers, so that commit() can publish them.  A
+        buffer stays here after its thread exits until it's published.
+    */
+    std::vector<std::shared_ptr<WriteBuffer> > writeBuffers;
+    std::mutex writeBuffersMutex;
+
+    WriteBuffer & getWriteBuffer()
+    {
+        auto handle = threadWriteBuffers.get();
+        if (!handle->buffer) {
+            handle->buffer = std::make_shared<WriteBuffer>();
+            std::unique_lock<std::mutex> guard(writeBuffersMutex);
+            writeBuffers.push_back(handle->buffer);
+        }
+        return *handle->buffer;
+    }
+
+    /// Publish the buffer's writes.  Its mutex must be held.
+    void publishWriteBuffer(WriteBuffer & buffer)
+    {
+        if (!buffer.trans)
+            return;
+        commitWrites(*buffer.trans);
+        buffer.trans.reset();
+        buffer.numCells = 0;
+    }
+
+    void recordRowsBuffered(const RecordedRows & rows)
+    {
+        // Check up front, so that a bad row doesn't leave the rows before
+        // it half-recorded in the buffer
+        for (auto & r: rows) {
+            if (r.first == RowName())
+                throw HttpReturnException(400, "Datasets don't accept empty row names");
+        }
+
+        WriteBuffer & buffer = getWriteBuffer();
+        std::unique_lock<std::mutex> guard(buffer.mutex);
+
+        if (!buffer.trans)
+            buffer.trans = getWriteTransaction(**defaultTransaction());
+
+        for (auto & r: rows) {
+            recordRowTrans(r.first, r.second, *buffer.trans);
+            buffer.numCells += r.second.size();
+        }
+
+        if (buffer.numCells >= WRITE_BUFFER_CELLS)
+            publishWriteBuffer(buffer);
+    }
+
+    /** Publish every thread's write buffer, and forget about those whose
+        thread has exited.
+    */
+    void publishWriteBuffers()
+    {
+        std::vector<std::shared_ptr<WriteBuffer> > buffers;
+        {
+            std::unique_lock<std::mutex> guard(writeBuffersMutex);
+            buffers = writeBuffers;
+        }
+
+        for (auto & b: buffers) {
+            std::unique_lock<std::mutex> guard(b->mutex);
+            publishWriteBuffer(*b);
+        }
+        buffers.clear();
+
+        std::unique_lock<std::mutex> guard(writeBuffersMutex);
+        writeBuffers.erase(std::remove_if(writeBuffers.begin(),
+                                          writeBuffers.end(),
+                                          [] (const std::shared_ptr<WriteBuffer> & b)
+                                          {
+                                              return b.use_count() == 1;
+                                          }),
+                           writeBuffers.end());
+    }
+
+    /// Where the snapshot is written; the log lives beside it.  Empty
+    /// when the dataset isn't persisted.
+    std::string snapshotPath;
+
+    /// Log of writes since the last snapshot
+    std::unique_ptr<WriteAheadLog> log;
+
+    /// Log size above which a commit writes a new snapshot
+    uint64_t snapshotThresholdBytes;
+
+    /// Only one snapshot is written at a time
+    std::mutex snapshotMutex;
+
+    /// State captured for a snapshot
+    struct Snapshot {
+        uint64_t lastSeq;      ///< Last log record included
+        uint64_t nextSegment;  ///< First log segment not included
+        std::shared_ptr<MutableBaseData::Repr> matrix, inverse, values;
+    };
+
+    /** Load the snapshot, if there is one, then replay the log written
+        since it was taken.  Recovery only needs to read the snapshot and
+        the tail of the log that follows it.
+    */
+    void open(const Url & url)
+    {
+        if (url.scheme() != "file")
+            throw HttpReturnException(400, "sparse.mutable dataset requires "
+                                      "file:// URI for dataFileUrl, passed '"
+                                      + url.toUtf8String() + "'");
+
+        snapshotPath = url.path();
+
+        uint64_t lastSeq = 0, firstSegment = 0;
+        if (ML::fileExists(snapshotPath))
+            std::tie(lastSeq, firstSegment) = loadSnapshot();
+
+        log.reset(new WriteAheadLog(snapshotPath + ".log"));
+
+        ML::Timer timer;
+        size_t numReplayed = 0;
+
+        log->replay(firstSegment, lastSeq,
+                    [&] (uint64_t seq, const char * data, size_t len)
+                    {
+                        SparseMatrixDataset::Itl::recordRows
+                            (decodeLogRecord(data, len));
+                        ++numReplayed;
+                    });
+
+        if (numReplayed > 0)
+            cerr << "replayed " << numReplayed << " log records for "
+                 << snapshotPath << " in " << timer.elapsed() << endl;
+
+        // Make everything that was recovered readable
+        optimize();
+    }
+
+    /** Load the snapshot, returning the sequence number of the last log
+        record it contains and the first log segment that follows it.
+    */
+    std::pair<uint64_t, uint64_t> loadSnapshot()
+    {
+        ML::DB::Store_Reader store(snapshotPath);
+
+        std::string magic;
+        uint32_t version;
+        store >> magic >> version;
+        if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION)
+            throw HttpReturnException(400, "File '" + snapshotPath
+                                      + "' is not a sparse.mutable snapshot",
+                                      "magic", magic,
+                                      "version", version);
+
+        uint64_t lastSeq, nextSegment;
+        double snapshotTimeQuantum;
+        store >> lastSeq >> nextSegment >> snapshotTimeQuantum;
+
+        if (snapshotTimeQuantum != timeQuantumSeconds)
+            throw HttpReturnException(400, "sparse.mutable snapshot '"
+                                      + snapshotPath + "' was written with "
+                                      "a different timeQuantumSeconds",
+                                      "snapshotTimeQuantumSeconds",
+                                      snapshotTimeQuantum,
+                                      "timeQuantumSeconds",
+                                      timeQuantumSeconds);
+
+        matrixData->data->load(reconstituteRows(store));
+        inverseData->data->load(reconstituteRows(store));
+        valuesData->data->load(reconstituteRows(store));
+
+        return { lastSeq, nextSegment };
+    }
+
+    /** Write the snapshot to a temporary file and atomically move it into
+        place.  Until the rename, the old snapshot and the log are still
+        valid.
+    */
+    void writeSnapshot(const Snapshot & snapshot)
+    {
+        std::string tmpPath = snapshotPath + ".tmp";
+
+        {
+            std::ofstream stream(tmpPath, std::ios::binary | std::ios::trunc);
+            {
+                ML::DB::Store_Writer store(stream);
+                store << SNAPSHOT_MAGIC << SNAPSHOT_VERSION
+                      << snapshot.lastSeq << snapshot.nextSegment
+                      << timeQuantumSeconds;
+                serializeRows(store, snapshot.matrix->rows);
+                serializeRows(store, snapshot.inverse->rows);
+                serializeRows(store, snapshot.values->rows);
+            }
+            stream.close();
+            if (!stream)
+                throw HttpReturnException(500, "Error writing sparse.mutable "
+                                          "snapshot '" + tmpPath + "'");
+        }
+
+        ML::syncFile(tmpPath);
+        if (::rename(tmpPath.c_str(), snapshotPath.c_str()) == -1)
+            throw ML::Exception(errno, "renaming snapshot to " + snapshotPath);
+        syncParentDirectory(snapshotPath);
+    }
+
+    virtual void
+    recordRow(const RowName & rowName,
+              const std::vector<std::tuple<ColumnName, CellValue, Date> > & vals)
+    {
+        if (!log && mode != READ_ON_COMMIT)
+            return SparseMatrixDataset::Itl::recordRow(rowName, vals);
+        recordRows({ { rowName, vals } });
+    }
+
+    virtual void
+    recordRows(const RecordedRows & rows)
+    {
+        if (!log && mode == READ_ON_COMMIT)
+            return recordRowsBuffered(rows);
+        if (!log)
+            return SparseMatrixDataset::Itl::recordRows(rows);
+
+        std::string record = encodeLogRecord(rows);
+
+        std::shared_ptr<WriteTransaction> trans
+            = getWriteTransaction(**defaultTransaction());
+        for (auto & r: rows)
+            recordRowTrans(r.first, r.second, *trans);
+
+        // The log record is appended under the root lock, so the order
+        // of the log is the order in which the writes were applied.  The
+        // fsync is done after it's released so that concurrent writers
+        // share it.
+        uint64_t seq = 0;
+        commitWrites(*trans, [&] () { seq = log->append(record); });
+        log->sync(seq);
+    }
+
+    virtual void commit()
+    {
+        publishWriteBuffers();
+
+        if (!log) {
+            optimize();
+            return;
+        }
+
+        std::unique_lock<std::mutex> guard(snapshotMutex);
+
+        Snapshot snapshot;
+        bool takeSnapshot = false;
+
+        optimize([&] ()
+                 {
+                     // No writes can come in between capturing the data
+                     // and rotating the log, as we hold the root lock.
+                     if (log->bytesSinceRotate() < snapshotThresholdBytes)
+                         return;
+                     takeSnapshot = true;
+                     snapshot.lastSeq = log->lastSequence();
+                     snapshot.nextSegment = log->rotate();
+                     snapshot.matrix = *matrixData->data->repr();
+                     snapshot.inverse = *inverseData->data->repr();
+                     snapshot.values = *valuesData->data->repr();
+                 });
+
+        if (!takeSnapshot)
+            return;
+
+        ML::Timer timer;
+        writeSnapshot(snapshot);
+        log->removeSegmentsBefore(snapshot.nextSegment);
+
+        cerr << "wrote snapshot " << snapshotPath << " in "
+             << timer.elapsed() << endl;
     }
 };
 
@@ -1557,7 +2359,11 @@ MutableSparseMatrixDataset(MldbServer * owner,
     : SparseMatrixDataset(owner)
 {
     auto params = config.params.convert<MutableSparseMatrixDatasetConfig>();
-    itl.reset(new Itl(params.timeQuantumSeconds, params.consistencyLevel, params.favor));
+    itl.reset(new Itl(params));
+
+    // Writes are seen straight away, so anything bound against the data
+    // as it was before is stale
+    visibleOnWrite = params.consistencyLevel == WT_READ_AFTER_WRITE;
 }
 
 static RegisterDatasetType<MutableSparseMatrixDataset,
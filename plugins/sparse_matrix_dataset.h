@@ -10,6 +10,7 @@
 
 
 #include "mldb/types/value_description.h"
+#include "mldb/types/url.h"
 #include "mldb/core/dataset.h"
 
 
@@ -60,6 +61,10 @@ protected:
     struct Itl;
     std::shared_ptr<Itl> itl;
     SparseMatrixDataset(MldbServer * owner);
+
+    /// Are writes visible before a commit?  If so, each write changes the
+    /// commit generation.
+    bool visibleOnWrite;
 };
 
 
@@ -93,6 +98,12 @@ struct MutableSparseMatrixDatasetConfig
 
     /// Transaction favor.  When reads and writes are mixed, which do we favor?
     TransactionFavor favor;
+
+    /// File to persist to; empty means the dataset only lives in memory
+    Url dataFileUrl;
+
+    /// Bytes of write ahead log after which a commit writes a snapshot
+    uint64_t snapshotThresholdBytes;
 };
 
 DECLARE_STRUCTURE_DESCRIPTION(MutableSparseMatrixDatasetConfig);
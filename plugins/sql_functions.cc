@@ -13,6 +13,8 @@
 #include "mldb/jml/utils/worker_task.h"
 #include "mldb/server/function_contexts.h"
 #include "mldb/server/bound_queries.h"
+#include "mldb/server/dataset_collection.h"
+#include "mldb/server/query_plan_cache.h"
 #include "mldb/sql/table_expression_operations.h"
 #include "mldb/sql/join_utils.h"
 #include "mldb/sql/execution_pipeline.h"
@@ -91,12 +93,19 @@ getStatus() const
     return result;
 }
 
-/** Structure that does all the work of the SQL expression function. */
-struct SqlQueryFunctionApplier: public FunctionApplier {
-    SqlQueryFunctionApplier(const SqlQueryFunction * function,
-                            const SqlQueryFunctionConfig & config)
-        : FunctionApplier(function), function(function)
+/** Pipeline of the function's query, bound against the dataset it reads
+    from.  Applying the function only reads the bound pipeline, so a plan
+    can be shared by all of the appliers of the function.
+*/
+struct SqlQueryFunction::Plan {
+    Plan(const SqlQueryFunction * function,
+         const SqlQueryFunctionConfig & config,
+         std::shared_ptr<Dataset> from)
+        : from(std::move(from)),
+          generation(this->from ? this->from->getCommitGeneration() : 0)
     {
+        RecordBindingDependencies recordDependencies(dependencies);
+
         // Called when we bind a parameter, to get its information
         auto getParamInfo = [&] (const Utf8String & paramName)
             {
@@ -152,6 +161,76 @@ struct SqlQueryFunctionApplier: public FunctionApplier {
         }
     }
 
+    /// Dataset that FROM refers to by name, or null if it's anything else
+    std::shared_ptr<Dataset> from;
+
+    /// Commit generation of that dataset when the pipeline was bound
+    uint64_t generation;
+
+    /// Functions and datasets that binding looked up
+    BindingDependencies dependencies;
+
+    std::shared_ptr<PipelineElement> pipeline;
+    std::shared_ptr<BoundPipelineElement> boundPipeline;
+    FunctionInfo info;
+};
+
+std::shared_ptr<const SqlQueryFunction::Plan>
+SqlQueryFunction::
+getPlan() const
+{
+    // The plan can only be reused if we know which dataset it reads from.
+    // The generation is read before binding, so that a commit that happens
+    // while we bind makes the plan stale rather than wrong.
+    std::shared_ptr<Dataset> from;
+    auto fromExpr = dynamic_cast<const DatasetExpression *>
+        (functionConfig.query.stm->from.get());
+    if (fromExpr && fromExpr->config.empty()) {
+        from = std::static_pointer_cast<Dataset>
+            (server->datasets->tryGetExistingEntry(fromExpr->datasetName));
+    }
+
+    if (from) {
+        std::shared_ptr<const Plan> current;
+        {
+            std::unique_lock<std::mutex> guard(planMutex);
+            current = plan;
+        }
+
+        // Checking the dependencies looks them up, so it's done without
+        // holding the lock
+        if (current && current->from == from
+            && current->generation == from->getCommitGeneration()
+            && current->dependencies.current(server)) {
+            server->queryPlanCache->recordFunctionBind(true /* hit */);
+            return current;
+        }
+    }
+
+    auto result = std::make_shared<const Plan>(this, functionConfig, from);
+
+    if (from && !result->dependencies.unrepeatable) {
+        server->queryPlanCache->recordFunctionBind(false /* hit */);
+        std::shared_ptr<const Plan> previous;  // destroyed after unlock
+        std::unique_lock<std::mutex> guard(planMutex);
+        previous = std::move(plan);
+        plan = result;
+    }
+
+    return result;
+}
+
+/** Structure that does all the work of the SQL expression function. */
+struct SqlQueryFunctionApplier: public FunctionApplier {
+    SqlQueryFunctionApplier(const SqlQueryFunction * function,
+                            std::shared_ptr<const SqlQueryFunction::Plan> plan)
+        : FunctionApplier(function), function(function),
+          plan(std::move(plan)),
+          boundPipeline(this->plan->boundPipeline)
+    {
+        this->info = this->plan->info;
+    }
+
     virtual ~SqlQueryFunctionApplier()
     {
     }
@@ -191,69 +270,72 @@ struct SqlQueryFunctionApplier: public FunctionApplier {
             ssize_t limit = function->functionConfig.query.stm->limit;
             ssize_t offset = function->functionConfig.query.stm->offset;
 
-            auto output = executor->take();
-            for (size_t n = 0;
-                 output && (limit == -1 || n < limit + offset);
-                 output = executor->take(), ++n) {
+            size_t n = 0;
+
+            // Take the output in batches, as we want all of it
+            auto onOutput = [&] (std::shared_ptr<PipelineResults> & output)
+                {
+                    if (limit != -1 && n >= limit + offset)
+                        return false;
 
-                if (output) {
                     // MLDB-1329 band-aid fix.  This appears to break a circlar
                     // reference chain that stops the elements from being
                     // released.
                     output->group.clear();
-                }
-
-                if (n < offset) {
-                    continue;
-                }
-
-                ColumnName foundCol;
-                ExpressionValue foundVal;
-                int numFoundCol = 0;
-                int numFoundVal = 0;
-
-                auto onVal = [&] (ColumnName & col,
-                                  ExpressionValue & val)
-                    {
-                        if (col == ColumnName("column")) {
-                            foundCol = ColumnName(val.getAtom().toUtf8String());
-                            ++numFoundCol;
-                        }
-                        else if (col == ColumnName("value")) {
-                            foundVal = std::move(val);
-                            ++numFoundVal;
-                        }
-                        else {
-                            throw HttpReturnException
-                                (400, "Rows returned from NAMED_COLUMNS SQL "
-                                 "query can only contain 'column' and 'value' "
-                                 "columns",
-                                 "unknownColumn", col,
-                                 "unknownColumnValue", val);
-                        }
 
+                    if (n++ < offset)
                         return true;
-                    };
 
-                output->values.back().forEachColumnDestructive(onVal);
-
-                if (numFoundCol != 1 || numFoundVal != 1) {
-                    throw HttpReturnException
-                        (400, "Rows returned from NAMED_COLUMNS SQL query "
-                         "must contain exactly one 'column' and one "
-                         "'value' column",
-                         "numTimesFoundColumn", numFoundCol,
-                         "numTimesFoundValue", numFoundVal);
-                }
+                    ColumnName foundCol;
+                    ExpressionValue foundVal;
+                    int numFoundCol = 0;
+                    int numFoundVal = 0;
+
+                    auto onVal = [&] (ColumnName & col,
+                                      ExpressionValue & val)
+                        {
+                            if (col == ColumnName("column")) {
+                                foundCol = ColumnName(val.getAtom().toUtf8String());
+                                ++numFoundCol;
+                            }
+                            else if (col == ColumnName("value")) {
+                                foundVal = std::move(val);
+                                ++numFoundVal;
+                            }
+                            else {
+                                throw HttpReturnException
+                                    (400, "Rows returned from NAMED_COLUMNS SQL "
+                                     "query can only contain 'column' and 'value' "
+                                     "columns",
+                                     "unknownColumn", col,
+                                     "unknownColumnValue", val);
+                            }
+
+                            return true;
+                        };
+
+                    output->values.back().forEachColumnDestructive(onVal);
+
+                    if (numFoundCol != 1 || numFoundVal != 1) {
+                        throw HttpReturnException
+                            (400, "Rows returned from NAMED_COLUMNS SQL query "
+                             "must contain exactly one 'column' and one "
+                             "'value' column",
+                             "numTimesFoundColumn", numFoundCol,
+                             "numTimesFoundValue", numFoundVal);
+                    }
                 
-                if (foundCol == ColumnName()) {
-                    throw HttpReturnException
-                        (400, "Empty or null column names cannot be "
-                         "returned from NAMED_COLUMNS sql query");
-                }
+                    if (foundCol == ColumnName()) {
+                        throw HttpReturnException
+                            (400, "Empty or null column names cannot be "
+                             "returned from NAMED_COLUMNS sql query");
+                    }
 
-                row.emplace_back(std::move(foundCol), std::move(foundVal));
-            }
+                    row.emplace_back(std::move(foundCol), std::move(foundVal));
+                    return true;
+                };
+
+            executor->takeAll(onOutput);
 
             FunctionOutput result;
 
@@ -267,8 +349,7 @@ struct SqlQueryFunctionApplier: public FunctionApplier {
     }
 
     const SqlQueryFunction * function;
-    std::shared_ptr<Dataset> from;
-    std::shared_ptr<PipelineElement> pipeline;
+    std::shared_ptr<const SqlQueryFunction::Plan> plan;
     std::shared_ptr<BoundPipelineElement> boundPipeline;
 };
 
@@ -278,7 +359,7 @@ bind(SqlBindingScope & outerContext,
      const FunctionValues & input) const
 {
     std::unique_ptr<SqlQueryFunctionApplier> result
-        (new SqlQueryFunctionApplier(this, functionConfig));
+        (new SqlQueryFunctionApplier(this, getPlan()));
 
     // Check that these input values can provide everything needed for the result
     input.checkCompatibleAsInputTo(result->info.input);
@@ -299,8 +380,7 @@ FunctionInfo
 SqlQueryFunction::
 getFunctionInfo() const
 {
-    SqlQueryFunctionApplier applier(this, functionConfig);
-    return applier.info;
+    return getPlan()->info;
 }
 
 static RegisterFunctionType<SqlQueryFunction, SqlQueryFunctionConfig>
@@ -17,6 +17,7 @@
 // TODO: hide these from the .h file
 #include "mldb/server/dataset_context.h"
 #include "mldb/server/function_contexts.h"
+#include <mutex>
 
 
 namespace Datacratic {
@@ -71,6 +72,18 @@ struct SqlQueryFunction: public Function {
     virtual FunctionInfo getFunctionInfo() const;
 
     SqlQueryFunctionConfig functionConfig;
+
+    struct Plan;
+
+private:
+    /** Return the bound pipeline of the query.  The one from the last
+        call is reused if FROM is a named dataset that's still the same
+        object, and hasn't been committed to since.
+    */
+    std::shared_ptr<const Plan> getPlan() const;
+
+    mutable std::mutex planMutex;
+    mutable std::shared_ptr<const Plan> plan;
 };
 
 
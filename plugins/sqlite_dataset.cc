@@ -751,7 +751,8 @@ void
 SqliteSparseDataset::
 commit()
 {
-    return itl->commit();
+    itl->commit();
+    bumpCommitGeneration();
 }
     
 std::pair<Date, Date>
@@ -22,6 +22,7 @@
 #include "sql/execution_pipeline.h"
 #include "server/function_contexts.h"
 #include "server/bound_queries.h"
+#include "server/per_thread_accumulator.h"
 #include "mldb/http/http_exception.h"
 #include "mldb/jml/db/persistent.h"
 #include "mldb/types/jml_serialization.h"
@@ -629,16 +630,23 @@ run(const ProcedureRunConfig & run,
             return onProgress(value);
         };
 
-    int num_req = 0;
+    std::atomic<int> num_req(0);
     Date start = Date::now();
 
+    // The counts don't depend on the order of the rows, so each thread
+    // accumulates its own, keyed by column name so that we only make a
+    // string once per word.  They are merged at the end.
+    typedef ShardedMap<ColumnName, StatsTable::BucketCounts> ThreadCounts;
+    PerThreadAccumulator<ThreadCounts> accum;
+
     auto aggregator = [&] (NamedRowValue & row_,
                            const std::vector<ExpressionValue> & extraVals)
         {
             MatrixNamedRow row = row_.flattenDestructive();
-            if(num_req++ % 10000 == 0) {
+            int n = num_req++;
+            if(n % 10000 == 0) {
                 double secs = Date::now().secondsSinceEpoch() - start.secondsSinceEpoch();
-                string progress = ML::format("done %d. %0.4f/sec", num_req, num_req / secs);
+                string progress = ML::format("done %d. %0.4f/sec", n, n / secs);
                 onProgress2(progress);
                 cerr << progress << endl;
             }
@@ -648,9 +656,15 @@ run(const ProcedureRunConfig & run,
                 CellValue outcome = extraVals.at(lbl_idx).getAtom();
                 encodedLabels.push_back( !outcome.empty() && outcome.isTrue() );
             }
-  
+
+            ThreadCounts & counts = accum.get();
             for(const std::tuple<ColumnName, CellValue, Date> & col : row.columns) {
-                statsTable.increment(CellValue(get<0>(col).toUtf8String()), encodedLabels);
+                StatsTable::BucketCounts & bucket = counts[get<0>(col)];
+                if (bucket.second.empty())
+                    bucket.second.resize(encodedLabels.size());
+                bucket.first++;
+                for(int i=0; i<encodedLabels.size(); i++)
+                    bucket.second[i] += encodedLabels[i];
             }
 
             return true;
@@ -663,14 +677,45 @@ run(const ProcedureRunConfig & run,
     for(const pair<string, std::shared_ptr<SqlExpression>> & lbl : runProcConf.outcomes)
         extra.push_back(lbl.second);
 
-    iterateDataset(runProcConf.trainingData.stm->select,
-                   *boundDataset.dataset, boundDataset.asName, 
-                   runProcConf.trainingData.stm->when, 
-                   *runProcConf.trainingData.stm->where,
-                   extra,
-                   aggregator, runProcConf.trainingData.stm->orderBy,
-                   runProcConf.trainingData.stm->offset,
-                   runProcConf.trainingData.stm->limit);
+    // If no order by or limit, the order doesn't matter and the rows can
+    // be processed in parallel
+    auto & stm = runProcConf.trainingData.stm;
+    if (stm->limit == -1 && stm->offset == 0)
+        stm->orderBy.clauses.clear();
+
+    BoundSelectQuery(stm->select, *boundDataset.dataset,
+                     boundDataset.asName, stm->when, *stm->where,
+                     stm->orderBy, extra,
+                     false /* implicit order by row hash */)
+        .execute(aggregator, stm->offset, stm->limit, nullptr /* progress */);
+
+    // Merge the counts of each thread, one shard at a time, and then
+    // into the (ordered) table
+    std::vector<std::vector<std::pair<Utf8String, StatsTable::BucketCounts> > >
+        shardCounts(ThreadCounts::NUM_SHARDS);
+
+    auto mergeCounts = [] (StatsTable::BucketCounts & into,
+                           const StatsTable::BucketCounts & from)
+        {
+            into.first += from.first;
+            for (unsigned i = 0;  i < from.second.size();  ++i)
+                into.second[i] += from.second[i];
+        };
+
+    auto onShard = [&] (int shard, ThreadCounts::Shard & counts)
+        {
+            auto & result = shardCounts[shard];
+            result.reserve(counts.size());
+            for (auto & c: counts)
+                result.emplace_back(c.first.toUtf8String(), std::move(c.second));
+        };
+
+    mergeShards(accum, mergeCounts, onShard);
+
+    for (auto & c: shardCounts) {
+        for (auto & bucket: c)
+            statsTable.counts.emplace(std::move(bucket));
+    }
 
 
     // save if required
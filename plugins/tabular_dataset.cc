@@ -7,4 +7,1865 @@
 */
 
 #include "tabular_dataset.h"
+#include "mldb/jml/db/persistent.h"
+#include "mldb/jml/utils/floating_point.h"
+#include "mldb/jml/utils/worker_task.h"
+#include "mldb/sql/sql_expression_operations.h"
+#include "mldb/types/jml_serialization.h"
+#include "mldb/vfs/filter_streams.h"
+#include "mldb/vfs/fs_utils.h"
+#include "mldb/ext/jsoncpp/json.h"
+#include <boost/algorithm/string/predicate.hpp>
 
+
+using namespace std;
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* SERIALIZATION UTILITIES                                                   */
+/*****************************************************************************/
+
+namespace {
+
+/// Magic string that starts each tabular file
+static const std::string TABULAR_MAGIC = "MLDB tabular dataset";
+
+/// Version of the tabular file format.  Version 2 added zone maps.
+static constexpr int TABULAR_VERSION = 2;
+
+/// Alignment of bulk data within the file, so that it can be used in place
+static constexpr size_t TABULAR_ALIGNMENT = 8;
+
+/// Tags used to identify frozen column types in a serialized file
+enum FrozenColumnTag {
+    FROZEN_NAIVE = 1,
+    FROZEN_TABLE = 2,
+    FROZEN_INTEGER = 3,
+    FROZEN_DOUBLE = 4,
+    FROZEN_STRING = 5,
+    FROZEN_RUN_LENGTH = 6
+};
+
+void writeAlignment(ML::DB::Store_Writer & store)
+{
+    static const char zeros[TABULAR_ALIGNMENT] = { 0 };
+    size_t misalignment = store.offset() % TABULAR_ALIGNMENT;
+    if (misalignment)
+        store.save_binary(zeros, TABULAR_ALIGNMENT - misalignment);
+}
+
+void readAlignment(ML::DB::Store_Reader & store)
+{
+    size_t misalignment = store.offset() % TABULAR_ALIGNMENT;
+    if (misalignment)
+        store.skip(TABULAR_ALIGNMENT - misalignment);
+}
+
+/** Write a block of bulk data, aligned so that it can be used in place
+    when the file is memory mapped.  The data is written in native byte
+    order.
+*/
+void writeBulk(ML::DB::Store_Writer & store, const void * data, size_t bytes)
+{
+    store << (uint64_t)bytes;
+    writeAlignment(store);
+    store.save_binary(data, bytes);
+}
+
+/** Read a block of bulk data written by writeBulk().  If mapping is set,
+    then the data is referenced in place within the mapped file and the
+    returned pointer keeps the mapping alive.  Otherwise it is copied into
+    freshly allocated memory.
+*/
+template<typename T>
+std::shared_ptr<const T>
+readBulk(ML::DB::Store_Reader & store,
+         const std::shared_ptr<const void> & mapping,
+         size_t & bytes)
+{
+    uint64_t sz;
+    store >> sz;
+    bytes = sz;
+    readAlignment(store);
+
+    if (mapping) {
+        store.must_have(bytes);
+        std::shared_ptr<const T> result(mapping, (const T *)store.pos());
+        store.skip(bytes);
+        return result;
+    }
+
+    // One extra element so that bit extractors can safely read the word
+    // following the last one, as they can do within a mapped file.
+    size_t numElements = (bytes + sizeof(T) - 1) / sizeof(T) + 1;
+    T * data = new T[numElements]();
+    std::shared_ptr<const T> result(data, [] (T * p) { delete[] p; });
+    store.load_binary(data, bytes);
+    return result;
+}
+
+/** Bit-pack the given values into a newly allocated array of words, with
+    each value taking the given number of bits.  numWords is set to the
+    number of words needed to hold the values; one extra zeroed word is
+    allocated past the end so that bit extractors can read it safely.
+*/
+template<typename Word, typename Values>
+std::shared_ptr<const Word>
+bitPack(const Values & values, int bits, size_t & numWords)
+{
+    static constexpr int WORD_BITS = sizeof(Word) * 8;
+    numWords = (bits * values.size() + WORD_BITS - 1) / WORD_BITS;
+    Word * data = new Word[numWords + 1]();
+    std::shared_ptr<const Word> result(data, [] (Word * p) { delete[] p; });
+
+    ML::Bit_Writer<Word> writer(data);
+    for (auto & v: values)
+        writer.write(v, bits);
+
+    return result;
+}
+
+/// Number of bits needed to represent any integer in [0, maxValue]
+int bitsFor(uint64_t maxValue)
+{
+    return maxValue == 0 ? 1 : ML::highest_bit(maxValue) + 1;
+}
+
+/// Approximate memory used by a table of values, including out of line
+/// storage of long strings
+size_t tableMemusage(const std::vector<CellValue> & table)
+{
+    size_t result = table.size() * sizeof(CellValue);
+    for (auto & v: table) {
+        if (v.isString() && v.toStringLength() > 12)
+            result += v.toStringLength() + 16;
+    }
+    return result;
+}
+
+/// Convert a value for the typed numeric interface.  Returns false if
+/// the value is not a number or null.
+inline bool toDoubleOrNull(const CellValue & val, double & result,
+                           bool & isNull)
+{
+    isNull = val.empty();
+    if (isNull)
+        return true;
+    if (!val.isNumber())
+        return false;
+    result = val.toDouble();
+    return true;
+}
+
+/** Call onRun for each run of equal consecutive keys, as produced by
+    calling getKey(row) for each row in [0, numRows).  The value passed
+    to onRun is obtained from the key of the first row of the run by
+    calling getValue.  Used by frozen columns that store a per-row index,
+    as comparing indexes is much cheaper than comparing CellValues.
+*/
+template<typename GetKey, typename GetValue>
+bool forEachKeyRun(uint32_t numRows, GetKey && getKey, GetValue && getValue,
+                   const FrozenColumn::OnRun & onRun)
+{
+    if (numRows == 0)
+        return true;
+
+    auto current = getKey(0);
+    uint32_t runStart = 0;
+    for (uint32_t i = 1;  i < numRows;  ++i) {
+        auto key = getKey(i);
+        if (key == current)
+            continue;
+        if (!onRun(getValue(current), runStart, i - runStart))
+            return false;
+        current = key;
+        runStart = i;
+    }
+
+    return onRun(getValue(current), runStart, numRows - runStart);
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* COLUMN TYPES                                                              */
+/*****************************************************************************/
+
+void
+ColumnTypes::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << hasNulls << hasIntegers << minNegativeInteger
+          << maxPositiveInteger << hasReals << hasStrings << hasOther;
+}
+
+void
+ColumnTypes::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    store >> hasNulls >> hasIntegers >> minNegativeInteger
+          >> maxPositiveInteger >> hasReals >> hasStrings >> hasOther;
+}
+
+
+/*****************************************************************************/
+/* COLUMN ZONE MAP                                                           */
+/*****************************************************************************/
+
+constexpr size_t ColumnZoneMap::MAX_DISTINCT;
+
+void
+ColumnZoneMap::
+init(const std::vector<CellValue> & distinctValues)
+{
+    *this = ColumnZoneMap();
+
+    bool ordered = true;
+    for (auto & v: distinctValues) {
+        if (v.empty()) {
+            hasNulls = true;
+            continue;
+        }
+
+        ++numDistinct;
+
+        // NaN doesn't compare, so min and max would be meaningless
+        if (v.isNumber() && std::isnan(v.toDouble()))
+            ordered = false;
+
+        if (!hasMinMax) {
+            minValue = maxValue = v;
+            hasMinMax = true;
+            continue;
+        }
+        if (v < minValue)
+            minValue = v;
+        if (maxValue < v)
+            maxValue = v;
+    }
+
+    if (!ordered) {
+        hasMinMax = false;
+        minValue = maxValue = CellValue();
+    }
+
+    if (numDistinct <= MAX_DISTINCT) {
+        for (auto & v: distinctValues) {
+            if (!v.empty())
+                this->distinctValues.push_back(v);
+        }
+    }
+}
+
+bool
+ColumnZoneMap::
+mayContainEqual(const CellValue & val) const
+{
+    if (numDistinct == 0)
+        return false;
+    if (numDistinct <= MAX_DISTINCT) {
+        return std::find(distinctValues.begin(), distinctValues.end(), val)
+            != distinctValues.end();
+    }
+    if (hasMinMax)
+        return !(val < minValue) && !(maxValue < val);
+    return true;
+}
+
+bool
+ColumnZoneMap::
+mayContainLess(const CellValue & val, bool orEqual) const
+{
+    if (numDistinct == 0)
+        return false;
+    if (!hasMinMax)
+        return true;
+    return orEqual ? !(val < minValue) : minValue < val;
+}
+
+bool
+ColumnZoneMap::
+mayContainGreater(const CellValue & val, bool orEqual) const
+{
+    if (numDistinct == 0)
+        return false;
+    if (!hasMinMax)
+        return true;
+    return orEqual ? !(maxValue < val) : val < maxValue;
+}
+
+void
+ColumnZoneMap::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << hasMinMax << minValue << maxValue << hasNulls << numDistinct
+          << distinctValues;
+}
+
+void
+ColumnZoneMap::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    store >> hasMinMax >> minValue >> maxValue >> hasNulls >> numDistinct
+          >> distinctValues;
+}
+
+
+/*****************************************************************************/
+/* NAIVE AND TABLE FROZEN COLUMNS                                            */
+/*****************************************************************************/
+
+void
+NaiveFrozenColumn::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << (unsigned char)FROZEN_NAIVE << vals;
+}
+
+TableFrozenColumn::
+TableFrozenColumn(ML::DB::Store_Reader & store,
+                  const std::shared_ptr<const void> & mapping)
+{
+    // Tag has already been read by FrozenColumn::reconstitute()
+    store >> indexBits >> numEntries >> table;
+    size_t bytes;
+    storage = readBulk<uint32_t>(store, mapping, bytes);
+    if (bytes != (indexBits * numEntries + 31) / 32 * 4)
+        throw HttpReturnException(400, "Wrong size for table frozen column "
+                                  "in tabular dataset file",
+                                  "bytes", bytes,
+                                  "indexBits", indexBits,
+                                  "numEntries", numEntries);
+}
+
+void
+TableFrozenColumn::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << (unsigned char)FROZEN_TABLE << indexBits << numEntries << table;
+    size_t numWords = (indexBits * numEntries + 31) / 32;
+    writeBulk(store, storage.get(), numWords * 4);
+}
+
+bool
+TableFrozenColumn::
+forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const
+{
+    std::vector<size_t> counts(table.size());
+    ML::Bit_Extractor<uint32_t> bits(storage.get());
+    for (uint32_t i = 0;  i < numEntries;  ++i)
+        counts[bits.extract<uint32_t>(indexBits)] += 1;
+
+    for (size_t i = 0;  i < table.size();  ++i) {
+        if (counts[i] && !fn(table[i], counts[i]))
+            return false;
+    }
+
+    return true;
+}
+
+void
+TableFrozenColumn::
+getRange(uint32_t startRow, uint32_t numRows, CellValue * out) const
+{
+    ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+    ML::Bit_Extractor<uint32_t> bits(storage.get());
+    bits.advance((size_t)startRow * indexBits);
+    for (uint32_t i = 0;  i < numRows;  ++i)
+        out[i] = table[bits.extract<uint32_t>(indexBits)];
+}
+
+bool
+TableFrozenColumn::
+getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                 double * values, bool * isNull) const
+{
+    ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+
+    // Convert the table once; then each row is just a lookup
+    std::vector<double> tableValues(table.size());
+    std::unique_ptr<bool[]> tableNulls(new bool[table.size()]);
+    for (size_t i = 0;  i < table.size();  ++i) {
+        if (!toDoubleOrNull(table[i], tableValues[i], tableNulls[i]))
+            return false;
+    }
+
+    ML::Bit_Extractor<uint32_t> bits(storage.get());
+    bits.advance((size_t)startRow * indexBits);
+    for (uint32_t i = 0;  i < numRows;  ++i) {
+        uint32_t index = bits.extract<uint32_t>(indexBits);
+        values[i] = tableValues[index];
+        isNull[i] = tableNulls[index];
+    }
+    return true;
+}
+
+bool
+TableFrozenColumn::
+forEachRun(const OnRun & onRun) const
+{
+    ML::Bit_Extractor<uint32_t> bits(storage.get());
+    return forEachKeyRun(numEntries,
+                         [&] (uint32_t) { return bits.extract<uint32_t>(indexBits); },
+                         [&] (uint32_t index) -> const CellValue & { return table[index]; },
+                         onRun);
+}
+
+std::vector<uint32_t>
+TableFrozenColumn::
+findRows(const std::function<bool (const CellValue &)> & pred) const
+{
+    std::vector<char> matches(table.size());
+    bool anyMatch = false;
+    for (size_t i = 0;  i < table.size();  ++i)
+        anyMatch |= matches[i] = pred(table[i]);
+
+    std::vector<uint32_t> result;
+    if (!anyMatch)
+        return result;
+
+    ML::Bit_Extractor<uint32_t> bits(storage.get());
+    for (uint32_t i = 0;  i < numEntries;  ++i) {
+        if (matches[bits.extract<uint32_t>(indexBits)])
+            result.push_back(i);
+    }
+    return result;
+}
+
+
+/*****************************************************************************/
+/* INTEGER FROZEN COLUMN                                                     */
+/*****************************************************************************/
+
+/** Frozen column for columns of integers, and possibly nulls.  Each value
+    is stored bit-packed as its offset from the minimum value in the
+    column.  If there are nulls, they are stored as zero and the offsets
+    are shifted up by one.
+*/
+struct IntegerFrozenColumn: public FrozenColumn {
+
+    IntegerFrozenColumn(const std::vector<int> & indexes,
+                        const std::vector<CellValue> & table,
+                        int64_t minValue, int numBits, bool hasNulls)
+        : numEntries(indexes.size()), numBits(numBits),
+          hasNulls(hasNulls), minValue(minValue)
+    {
+        std::vector<uint64_t> offsets(indexes.size());
+        for (size_t i = 0;  i < indexes.size();  ++i)
+            offsets[i] = encode(table[indexes[i]]);
+        storage = bitPack<uint64_t>(offsets, numBits, numWords);
+    }
+
+    IntegerFrozenColumn(ML::DB::Store_Reader & store,
+                        const std::shared_ptr<const void> & mapping)
+    {
+        store >> numEntries >> numBits >> hasNulls >> minValue;
+        size_t bytes;
+        storage = readBulk<uint64_t>(store, mapping, bytes);
+        numWords = bytes / sizeof(uint64_t);
+    }
+
+    uint64_t encode(const CellValue & val) const
+    {
+        if (val.empty())
+            return 0;
+        return uint64_t(val.toInt()) - uint64_t(minValue) + hasNulls;
+    }
+
+    CellValue decode(uint64_t offset) const
+    {
+        if (hasNulls) {
+            if (offset == 0)
+                return CellValue();
+            offset -= 1;
+        }
+        return CellValue(int64_t(offset + uint64_t(minValue)));
+    }
+
+    virtual CellValue get(uint32_t rowIndex) const
+    {
+        ML::Bit_Extractor<uint64_t> bits(storage.get());
+        bits.advance((size_t)rowIndex * numBits);
+        return decode(bits.extract<uint64_t>(numBits));
+    }
+
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+        ML::Bit_Extractor<uint64_t> bits(storage.get());
+        bits.advance((size_t)startRow * numBits);
+        for (uint32_t i = 0;  i < numRows;  ++i)
+            out[i] = decode(bits.extract<uint64_t>(numBits));
+    }
+
+    virtual bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                                  double * values, bool * isNull) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+        ML::Bit_Extractor<uint64_t> bits(storage.get());
+        bits.advance((size_t)startRow * numBits);
+        uint64_t base = uint64_t(minValue) - hasNulls;
+        for (uint32_t i = 0;  i < numRows;  ++i) {
+            uint64_t offset = bits.extract<uint64_t>(numBits);
+            isNull[i] = hasNulls && offset == 0;
+            values[i] = int64_t(offset + base);
+        }
+        return true;
+    }
+
+    virtual bool forEachRun(const OnRun & onRun) const
+    {
+        ML::Bit_Extractor<uint64_t> bits(storage.get());
+        return forEachKeyRun(numEntries,
+                             [&] (uint32_t) { return bits.extract<uint64_t>(numBits); },
+                             [&] (uint64_t offset) { return decode(offset); },
+                             onRun);
+    }
+
+    virtual size_t size() const
+    {
+        return numEntries;
+    }
+
+    virtual size_t getIndexBits() const
+    {
+        return numBits;
+    }
+
+    virtual size_t memusage() const
+    {
+        return sizeof(*this) + numWords * sizeof(uint64_t);
+    }
+
+    virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const
+    {
+        // We don't keep a table, so we need to scan the values
+        std::vector<uint64_t> offsets(numEntries);
+        ML::Bit_Extractor<uint64_t> bits(storage.get());
+        for (auto & o: offsets)
+            o = bits.extract<uint64_t>(numBits);
+        std::sort(offsets.begin(), offsets.end());
+
+        for (size_t i = 0;  i < offsets.size();  /* no inc */) {
+            size_t j = i + 1;
+            while (j < offsets.size() && offsets[j] == offsets[i])
+                ++j;
+            if (!fn(decode(offsets[i]), j - i))
+                return false;
+            i = j;
+        }
+
+        return true;
+    }
+
+    virtual void serialize(ML::DB::Store_Writer & store) const
+    {
+        store << (unsigned char)FROZEN_INTEGER << numEntries << numBits
+              << hasNulls << minValue;
+        writeBulk(store, storage.get(), numWords * sizeof(uint64_t));
+    }
+
+    std::shared_ptr<const uint64_t> storage;
+    size_t numWords;
+    uint32_t numEntries;
+    int numBits;
+    bool hasNulls;
+    int64_t minValue;
+};
+
+
+/*****************************************************************************/
+/* DOUBLE FROZEN COLUMN                                                      */
+/*****************************************************************************/
+
+/** Frozen column for columns of numbers that can all be represented
+    exactly as doubles (and possibly nulls), with many distinct values.
+    The values are stored in a dense array; nulls are stored as a NaN
+    with a payload that can't be produced by arithmetic.
+*/
+struct DoubleFrozenColumn: public FrozenColumn {
+
+    static constexpr uint64_t NULL_BITS = 0x7ff4000000000001ULL;
+
+    DoubleFrozenColumn(const std::vector<int> & indexes,
+                       const std::vector<CellValue> & table)
+        : numEntries(indexes.size())
+    {
+        std::vector<double> tableVals(table.size());
+        for (size_t i = 0;  i < table.size();  ++i) {
+            if (table[i].empty())
+                tableVals[i] = ML::reinterpret_as_double(NULL_BITS);
+            else tableVals[i] = table[i].toDouble();
+        }
+
+        double * data = new double[numEntries + 1]();
+        storage = std::shared_ptr<const double>(data, [] (double * p) { delete[] p; });
+        for (size_t i = 0;  i < numEntries;  ++i)
+            data[i] = tableVals[indexes[i]];
+    }
+
+    DoubleFrozenColumn(ML::DB::Store_Reader & store,
+                       const std::shared_ptr<const void> & mapping)
+    {
+        store >> numEntries;
+        size_t bytes;
+        storage = readBulk<double>(store, mapping, bytes);
+        if (bytes != numEntries * sizeof(double))
+            throw HttpReturnException(400, "Wrong size for double frozen "
+                                      "column in tabular dataset file");
+    }
+
+    /// Can the given value be stored in this column type?
+    static bool canStore(const CellValue & val)
+    {
+        if (val.empty())
+            return true;
+        if (!val.isNumber() || !val.isExactDouble())
+            return false;
+        return ML::reinterpret_as_int(val.toDouble()) != NULL_BITS;
+    }
+
+    static bool isNull(double d)
+    {
+        return ML::reinterpret_as_int(d) == NULL_BITS;
+    }
+
+    virtual CellValue get(uint32_t rowIndex) const
+    {
+        double d = storage.get()[rowIndex];
+        if (isNull(d))
+            return CellValue();
+        return CellValue(d);
+    }
+
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+        const double * data = storage.get() + startRow;
+        for (uint32_t i = 0;  i < numRows;  ++i) {
+            if (isNull(data[i]))
+                out[i] = CellValue();
+            else out[i] = data[i];
+        }
+    }
+
+    virtual bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                                  double * values, bool * isNull) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+        const double * data = storage.get() + startRow;
+        std::copy(data, data + numRows, values);
+        for (uint32_t i = 0;  i < numRows;  ++i)
+            isNull[i] = this->isNull(data[i]);
+        return true;
+    }
+
+    virtual size_t size() const
+    {
+        return numEntries;
+    }
+
+    virtual size_t getIndexBits() const
+    {
+        return 64;
+    }
+
+    virtual size_t memusage() const
+    {
+        return sizeof(*this) + numEntries * sizeof(double);
+    }
+
+    virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const
+    {
+        std::vector<uint64_t> vals(numEntries);
+        for (size_t i = 0;  i < numEntries;  ++i)
+            vals[i] = ML::reinterpret_as_int(storage.get()[i]);
+        std::sort(vals.begin(), vals.end());
+
+        for (size_t i = 0;  i < vals.size();  /* no inc */) {
+            size_t j = i + 1;
+            while (j < vals.size() && vals[j] == vals[i])
+                ++j;
+            double d = ML::reinterpret_as_double(vals[i]);
+            if (!fn(isNull(d) ? CellValue() : CellValue(d), j - i))
+                return false;
+            i = j;
+        }
+
+        return true;
+    }
+
+    virtual void serialize(ML::DB::Store_Writer & store) const
+    {
+        store << (unsigned char)FROZEN_DOUBLE << numEntries;
+        writeBulk(store, storage.get(), numEntries * sizeof(double));
+    }
+
+    std::shared_ptr<const double> storage;
+    uint32_t numEntries;
+};
+
+
+/*****************************************************************************/
+/* STRING FROZEN COLUMN                                                      */
+/*****************************************************************************/
+
+/** Frozen column for columns of strings (and possibly nulls).  The
+    distinct strings are stored contiguously in a single character
+    buffer with an array of offsets, rather than as a table of separately
+    allocated CellValues, and each row stores a bit-packed index into
+    them.  The top bit of each offset tells us if the string is UTF-8
+    rather than pure ASCII.  Nulls are stored as an index one past the
+    last string.
+*/
+struct StringFrozenColumn: public FrozenColumn {
+
+    static constexpr uint32_t UTF8_FLAG = 1U << 31;
+
+    StringFrozenColumn(const std::vector<int> & indexes,
+                       const std::vector<CellValue> & table)
+        : numEntries(indexes.size()), numStrings(0)
+    {
+        // Strings get a new number; null gets numStrings
+        std::vector<uint32_t> remap(table.size());
+        size_t totalLength = 0;
+        for (size_t i = 0;  i < table.size();  ++i) {
+            if (!table[i].empty()) {
+                remap[i] = numStrings++;
+                totalLength += table[i].toStringLength();
+            }
+        }
+        for (size_t i = 0;  i < table.size();  ++i) {
+            if (table[i].empty())
+                remap[i] = numStrings;
+        }
+
+        if (totalLength >= UTF8_FLAG)
+            throw HttpReturnException(500, "Too many characters for string "
+                                      "frozen column");
+
+        numChars = totalLength;
+        uint32_t * offsetData = new uint32_t[numStrings + 2]();
+        offsets = std::shared_ptr<const uint32_t>
+            (offsetData, [] (uint32_t * p) { delete[] p; });
+        char * charData = new char[numChars + 1]();
+        chars = std::shared_ptr<const char>
+            (charData, [] (char * p) { delete[] p; });
+
+        uint32_t n = 0, ofs = 0;
+        for (auto & v: table) {
+            if (v.empty())
+                continue;
+            uint32_t len = v.toStringLength();
+            std::copy(v.stringChars(), v.stringChars() + len, charData + ofs);
+            offsetData[n++] = ofs | (v.isUtf8String() ? UTF8_FLAG : 0);
+            ofs += len;
+        }
+        offsetData[n] = ofs;
+
+        indexBits = bitsFor(numStrings);
+        std::vector<uint32_t> remapped(indexes.size());
+        for (size_t i = 0;  i < indexes.size();  ++i)
+            remapped[i] = remap[indexes[i]];
+        storage = bitPack<uint32_t>(remapped, indexBits, numWords);
+    }
+
+    StringFrozenColumn(ML::DB::Store_Reader & store,
+                       const std::shared_ptr<const void> & mapping)
+    {
+        store >> numEntries >> numStrings >> indexBits;
+        size_t bytes;
+        storage = readBulk<uint32_t>(store, mapping, bytes);
+        numWords = bytes / sizeof(uint32_t);
+        offsets = readBulk<uint32_t>(store, mapping, bytes);
+        if (bytes != (numStrings + 1) * sizeof(uint32_t))
+            throw HttpReturnException(400, "Wrong size for string frozen "
+                                      "column in tabular dataset file");
+        chars = readBulk<char>(store, mapping, numChars);
+    }
+
+    /// Can the given value be stored in this column type?
+    static bool canStore(const CellValue & val)
+    {
+        return val.empty() || val.isString();
+    }
+
+    CellValue getString(uint32_t index) const
+    {
+        if (index == numStrings)
+            return CellValue();
+        uint32_t start = offsets.get()[index];
+        uint32_t end = offsets.get()[index + 1] & ~UTF8_FLAG;
+        bool isUtf8 = start & UTF8_FLAG;
+        start &= ~UTF8_FLAG;
+        return CellValue(chars.get() + start, end - start,
+                         isUtf8
+                         ? STRING_IS_VALID_UTF8_NOT_ASCII
+                         : STRING_IS_VALID_ASCII);
+    }
+
+    virtual CellValue get(uint32_t rowIndex) const
+    {
+        ML::Bit_Extractor<uint32_t> bits(storage.get());
+        bits.advance((size_t)rowIndex * indexBits);
+        return getString(bits.extract<uint32_t>(indexBits));
+    }
+
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+        ML::Bit_Extractor<uint32_t> bits(storage.get());
+        bits.advance((size_t)startRow * indexBits);
+        for (uint32_t i = 0;  i < numRows;  ++i)
+            out[i] = getString(bits.extract<uint32_t>(indexBits));
+    }
+
+    virtual bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                                  double * values, bool * isNull) const
+    {
+        // Only numeric if it's entirely null
+        if (numStrings != 0)
+            return false;
+        std::fill(isNull, isNull + numRows, true);
+        return true;
+    }
+
+    virtual bool forEachRun(const OnRun & onRun) const
+    {
+        ML::Bit_Extractor<uint32_t> bits(storage.get());
+        return forEachKeyRun(numEntries,
+                             [&] (uint32_t) { return bits.extract<uint32_t>(indexBits); },
+                             [&] (uint32_t index) { return getString(index); },
+                             onRun);
+    }
+
+    virtual std::vector<uint32_t>
+    findRows(const std::function<bool (const CellValue &)> & pred) const
+    {
+        std::vector<char> matches(numStrings + 1);
+        bool anyMatch = false;
+        for (uint32_t i = 0;  i <= numStrings;  ++i)
+            anyMatch |= matches[i] = pred(getString(i));
+
+        std::vector<uint32_t> result;
+        if (!anyMatch)
+            return result;
+
+        ML::Bit_Extractor<uint32_t> bits(storage.get());
+        for (uint32_t i = 0;  i < numEntries;  ++i) {
+            if (matches[bits.extract<uint32_t>(indexBits)])
+                result.push_back(i);
+        }
+        return result;
+    }
+
+    virtual size_t size() const
+    {
+        return numEntries;
+    }
+
+    virtual size_t getIndexBits() const
+    {
+        return indexBits;
+    }
+
+    virtual size_t memusage() const
+    {
+        return sizeof(*this)
+            + numWords * sizeof(uint32_t)
+            + (numStrings + 1) * sizeof(uint32_t)
+            + numChars;
+    }
+
+    virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const
+    {
+        std::vector<size_t> counts(numStrings + 1);
+        ML::Bit_Extractor<uint32_t> bits(storage.get());
+        for (size_t i = 0;  i < numEntries;  ++i)
+            counts[bits.extract<uint32_t>(indexBits)] += 1;
+
+        for (uint32_t i = 0;  i <= numStrings;  ++i) {
+            if (counts[i] && !fn(getString(i), counts[i]))
+                return false;
+        }
+
+        return true;
+    }
+
+    virtual void serialize(ML::DB::Store_Writer & store) const
+    {
+        store << (unsigned char)FROZEN_STRING << numEntries << numStrings
+              << indexBits;
+        writeBulk(store, storage.get(), numWords * sizeof(uint32_t));
+        writeBulk(store, offsets.get(), (numStrings + 1) * sizeof(uint32_t));
+        writeBulk(store, chars.get(), numChars);
+    }
+
+    std::shared_ptr<const uint32_t> storage;
+    size_t numWords;
+    std::shared_ptr<const uint32_t> offsets;
+    std::shared_ptr<const char> chars;
+    size_t numChars;
+    uint32_t numEntries;
+    uint32_t numStrings;
+    int indexBits;
+};
+
+
+/*****************************************************************************/
+/* RUN LENGTH FROZEN COLUMN                                                  */
+/*****************************************************************************/
+
+/** Frozen column for columns where values come in long runs of the same
+    value, for example sorted columns or the per-row timestamps of a CSV
+    file.  We store the starting row of each run and a bit-packed index
+    into a table of values for each run.
+*/
+struct RunLengthFrozenColumn: public FrozenColumn {
+
+    RunLengthFrozenColumn(const std::vector<int> & indexes,
+                          std::vector<CellValue> table_)
+        : numEntries(indexes.size()), table(std::move(table_))
+    {
+        std::vector<uint32_t> starts;
+        std::vector<uint32_t> values;
+        for (size_t i = 0;  i < indexes.size();  ++i) {
+            if (i == 0 || indexes[i] != indexes[i - 1]) {
+                starts.push_back(i);
+                values.push_back(indexes[i]);
+            }
+        }
+
+        numRuns = starts.size();
+        uint32_t * startData = new uint32_t[numRuns + 1]();
+        std::copy(starts.begin(), starts.end(), startData);
+        runStarts = std::shared_ptr<const uint32_t>
+            (startData, [] (uint32_t * p) { delete[] p; });
+
+        indexBits = bitsFor(table.size());
+        runValues = bitPack<uint32_t>(values, indexBits, numWords);
+    }
+
+    RunLengthFrozenColumn(ML::DB::Store_Reader & store,
+                          const std::shared_ptr<const void> & mapping)
+    {
+        store >> numEntries >> numRuns >> indexBits >> table;
+        size_t bytes;
+        runStarts = readBulk<uint32_t>(store, mapping, bytes);
+        if (bytes != numRuns * sizeof(uint32_t))
+            throw HttpReturnException(400, "Wrong size for run length frozen "
+                                      "column in tabular dataset file");
+        runValues = readBulk<uint32_t>(store, mapping, bytes);
+        numWords = bytes / sizeof(uint32_t);
+    }
+
+    /// Return the number of runs that the given indexes would make
+    static size_t countRuns(const std::vector<int> & indexes)
+    {
+        size_t result = 0;
+        for (size_t i = 0;  i < indexes.size();  ++i)
+            result += (i == 0 || indexes[i] != indexes[i - 1]);
+        return result;
+    }
+
+    /// Return the run number containing the given row
+    uint32_t getRun(uint32_t rowIndex) const
+    {
+        const uint32_t * start = runStarts.get();
+        return std::upper_bound(start, start + numRuns, rowIndex) - start - 1;
+    }
+
+    uint32_t getRunValue(uint32_t run) const
+    {
+        ML::Bit_Extractor<uint32_t> bits(runValues.get());
+        bits.advance((size_t)run * indexBits);
+        return bits.extract<uint32_t>(indexBits);
+    }
+
+    /// Return the row one past the end of the given run
+    uint32_t getRunEnd(uint32_t run) const
+    {
+        return run == numRuns - 1 ? numEntries : runStarts.get()[run + 1];
+    }
+
+    virtual CellValue get(uint32_t rowIndex) const
+    {
+        ExcAssertLess(rowIndex, numEntries);
+        return table[getRunValue(getRun(rowIndex))];
+    }
+
+    /** Call onRun(value, start, n) for each run or part of a run that
+        overlaps [startRow, startRow + numRows), with start relative to
+        startRow.
+    */
+    template<typename Fn>
+    bool forEachRunInRange(uint32_t startRow, uint32_t numRows, Fn && onRun) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, numEntries);
+        if (numRows == 0)
+            return true;
+
+        uint32_t endRow = startRow + numRows;
+        uint32_t run = getRun(startRow);
+        ML::Bit_Extractor<uint32_t> bits(runValues.get());
+        bits.advance((size_t)run * indexBits);
+
+        for (uint32_t row = startRow;  row < endRow;  ++run) {
+            uint32_t end = std::min(getRunEnd(run), endRow);
+            if (!onRun(table[bits.extract<uint32_t>(indexBits)],
+                       row - startRow, end - row))
+                return false;
+            row = end;
+        }
+
+        return true;
+    }
+
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const
+    {
+        forEachRunInRange(startRow, numRows,
+                          [&] (const CellValue & val, uint32_t start, uint32_t n)
+                          {
+                              std::fill(out + start, out + start + n, val);
+                              return true;
+                          });
+    }
+
+    virtual bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                                  double * values, bool * isNull) const
+    {
+        return forEachRunInRange
+            (startRow, numRows,
+             [&] (const CellValue & val, uint32_t start, uint32_t n)
+             {
+                 double d = 0;
+                 bool null;
+                 if (!toDoubleOrNull(val, d, null))
+                     return false;
+                 std::fill(values + start, values + start + n, d);
+                 std::fill(isNull + start, isNull + start + n, null);
+                 return true;
+             });
+    }
+
+    virtual bool forEachRun(const OnRun & onRun) const
+    {
+        // Our runs are maximal, since they were built by comparing indexes
+        return forEachRunInRange(0, numEntries, onRun);
+    }
+
+    virtual size_t size() const
+    {
+        return numEntries;
+    }
+
+    virtual size_t getIndexBits() const
+    {
+        return indexBits;
+    }
+
+    virtual size_t memusage() const
+    {
+        return sizeof(*this)
+            + numRuns * sizeof(uint32_t)
+            + numWords * sizeof(uint32_t)
+            + tableMemusage(table);
+    }
+
+    virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const
+    {
+        std::vector<size_t> counts(table.size());
+        for (uint32_t i = 0;  i < numRuns;  ++i)
+            counts[getRunValue(i)] += getRunEnd(i) - runStarts.get()[i];
+
+        for (size_t i = 0;  i < table.size();  ++i) {
+            if (counts[i] && !fn(table[i], counts[i]))
+                return false;
+        }
+
+        return true;
+    }
+
+    virtual void serialize(ML::DB::Store_Writer & store) const
+    {
+        store << (unsigned char)FROZEN_RUN_LENGTH << numEntries << numRuns
+              << indexBits << table;
+        writeBulk(store, runStarts.get(), numRuns * sizeof(uint32_t));
+        writeBulk(store, runValues.get(), numWords * sizeof(uint32_t));
+    }
+
+    uint32_t numEntries;
+    uint32_t numRuns;
+    int indexBits;
+    std::shared_ptr<const uint32_t> runStarts;
+    std::shared_ptr<const uint32_t> runValues;
+    size_t numWords;
+    std::vector<CellValue> table;
+};
+
+
+/*****************************************************************************/
+/* FROZEN COLUMN                                                             */
+/*****************************************************************************/
+
+void
+FrozenColumn::
+getRange(uint32_t startRow, uint32_t numRows, CellValue * out) const
+{
+    for (uint32_t i = 0;  i < numRows;  ++i)
+        out[i] = get(startRow + i);
+}
+
+bool
+FrozenColumn::
+getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                 double * values, bool * isNull) const
+{
+    for (uint32_t i = 0;  i < numRows;  ++i) {
+        if (!toDoubleOrNull(get(startRow + i), values[i], isNull[i]))
+            return false;
+    }
+    return true;
+}
+
+bool
+FrozenColumn::
+forEachRun(const OnRun & onRun) const
+{
+    // Decode a block at a time, and coalesce equal neighbouring values
+    size_t sz = size();
+    std::vector<CellValue> block
+        (std::min<size_t>(sz, TabularDatasetColumn::SCAN_BLOCK_SIZE));
+    CellValue current;
+    uint32_t runStart = 0;
+
+    for (size_t i = 0;  i < sz;  i += block.size()) {
+        size_t n = std::min(sz - i, block.size());
+        getRange(i, n, block.data());
+        for (size_t j = 0;  j < n;  ++j) {
+            if (i + j == 0) {
+                current = std::move(block[j]);
+                continue;
+            }
+            if (block[j] == current)
+                continue;
+            if (!onRun(current, runStart, i + j - runStart))
+                return false;
+            current = std::move(block[j]);
+            runStart = i + j;
+        }
+    }
+
+    if (sz == 0)
+        return true;
+    return onRun(current, runStart, sz - runStart);
+}
+
+std::vector<uint32_t>
+FrozenColumn::
+findRows(const std::function<bool (const CellValue &)> & pred) const
+{
+    std::vector<uint32_t> result;
+    auto onRun = [&] (const CellValue & val, uint32_t start, uint32_t n)
+        {
+            if (pred(val)) {
+                for (uint32_t i = 0;  i < n;  ++i)
+                    result.push_back(start + i);
+            }
+            return true;
+        };
+    forEachRun(onRun);
+    return result;
+}
+
+std::shared_ptr<FrozenColumn>
+FrozenColumn::
+reconstitute(ML::DB::Store_Reader & store,
+             const std::shared_ptr<const void> & mapping)
+{
+    unsigned char tag;
+    store >> tag;
+
+    switch (tag) {
+    case FROZEN_NAIVE: {
+        std::vector<CellValue> vals;
+        store >> vals;
+        return std::make_shared<NaiveFrozenColumn>(std::move(vals));
+    }
+    case FROZEN_TABLE:
+        return std::make_shared<TableFrozenColumn>(store, mapping);
+    case FROZEN_INTEGER:
+        return std::make_shared<IntegerFrozenColumn>(store, mapping);
+    case FROZEN_DOUBLE:
+        return std::make_shared<DoubleFrozenColumn>(store, mapping);
+    case FROZEN_STRING:
+        return std::make_shared<StringFrozenColumn>(store, mapping);
+    case FROZEN_RUN_LENGTH:
+        return std::make_shared<RunLengthFrozenColumn>(store, mapping);
+    default:
+        throw HttpReturnException(400, "Unknown frozen column type in "
+                                  "tabular dataset file",
+                                  "tag", (int)tag);
+    }
+}
+
+
+/*****************************************************************************/
+/* TABULAR DATASET COLUMN                                                    */
+/*****************************************************************************/
+
+constexpr size_t TabularDatasetColumn::SCAN_BLOCK_SIZE;
+
+void
+TabularDatasetColumn::
+freeze()
+{
+    // Figure out which representations could be used, and estimate the
+    // memory usage of each so that we can choose the most compact.
+    size_t numEntries = indexes.size();
+    size_t tableBytes = tableMemusage(indexedVals);
+    int tableBits = ML::highest_bit(indexedVals.size()) + 1;
+
+    size_t bestBytes = tableBits * numEntries / 8 + tableBytes;
+    std::function<FrozenColumn * ()> best = [&] ()
+        {
+            return new TableFrozenColumn(indexes, std::move(indexedVals));
+        };
+
+    auto consider = [&] (size_t bytes, std::function<FrozenColumn * ()> create)
+        {
+            if (bytes < bestBytes) {
+                bestBytes = bytes;
+                best = std::move(create);
+            }
+        };
+
+    size_t numRuns = RunLengthFrozenColumn::countRuns(indexes);
+    consider(numRuns * (32 + tableBits) / 8 + tableBytes,
+             [&] ()
+             {
+                 return new RunLengthFrozenColumn(indexes,
+                                                  std::move(indexedVals));
+             });
+
+    if (!columnTypes.hasReals && !columnTypes.hasStrings
+        && !columnTypes.hasOther && !indexedVals.empty()) {
+        // Integers and nulls only.  Find the range of the values; we can
+        // only deal with those that fit in a signed 64 bit integer.
+        bool fits = true;
+        int64_t minValue = std::numeric_limits<int64_t>::max();
+        int64_t maxValue = std::numeric_limits<int64_t>::min();
+        for (auto & v: indexedVals) {
+            if (v.empty())
+                continue;
+            if (!v.isInt64()) {
+                fits = false;
+                break;
+            }
+            minValue = std::min(minValue, v.toInt());
+            maxValue = std::max(maxValue, v.toInt());
+        }
+
+        uint64_t range = uint64_t(maxValue) - uint64_t(minValue);
+        if (!columnTypes.hasIntegers) {
+            // All nulls
+            minValue = maxValue = range = 0;
+        }
+        if (fits && range < (1ULL << 62)) {
+            int numBits = bitsFor(range + columnTypes.hasNulls);
+            consider(numBits * numEntries / 8,
+                     [&] ()
+                     {
+                         return new IntegerFrozenColumn
+                             (indexes, indexedVals, minValue, numBits,
+                              columnTypes.hasNulls);
+                     });
+        }
+    }
+
+    if (!columnTypes.hasStrings && !columnTypes.hasOther
+        && std::all_of(indexedVals.begin(), indexedVals.end(),
+                       DoubleFrozenColumn::canStore)) {
+        consider(numEntries * sizeof(double),
+                 [&] ()
+                 {
+                     return new DoubleFrozenColumn(indexes, indexedVals);
+                 });
+    }
+
+    if (!columnTypes.hasIntegers && !columnTypes.hasReals
+        && !columnTypes.hasOther
+        && std::all_of(indexedVals.begin(), indexedVals.end(),
+                       StringFrozenColumn::canStore)) {
+        size_t numChars = 0;
+        for (auto & v: indexedVals) {
+            if (!v.empty())
+                numChars += v.toStringLength();
+        }
+        if (numChars < StringFrozenColumn::UTF8_FLAG) {
+            consider(tableBits * numEntries / 8
+                     + (indexedVals.size() + 1) * sizeof(uint32_t)
+                     + numChars,
+                     [&] ()
+                     {
+                         return new StringFrozenColumn(indexes, indexedVals);
+                     });
+        }
+    }
+
+    frozen.reset(best());
+    zoneMap.init(indexedVals);
+    indexes = std::vector<int>();
+    indexedVals = std::vector<CellValue>();
+    valueIndex = ML::Lightweight_Hash<uint64_t, int>();
+    lastValue = CellValue();
+}
+
+void
+TabularDatasetColumn::
+serialize(ML::DB::Store_Writer & store) const
+{
+    ExcAssert(frozen);
+    columnTypes.serialize(store);
+    zoneMap.serialize(store);
+    frozen->serialize(store);
+}
+
+void
+TabularDatasetColumn::
+reconstitute(ML::DB::Store_Reader & store,
+             const std::shared_ptr<const void> & mapping)
+{
+    columnTypes.reconstitute(store);
+    zoneMap.reconstitute(store);
+    frozen = FrozenColumn::reconstitute(store, mapping);
+}
+
+
+/*****************************************************************************/
+/* TABULAR DATASET CHUNK                                                     */
+/*****************************************************************************/
+
+TabularDatasetChunk::
+TabularDatasetChunk(ML::DB::Store_Reader & store,
+                    const std::shared_ptr<const void> & mapping)
+{
+    store >> chunkNumber >> chunkLineNumber >> lineNumber
+          >> numColumns >> numRows >> numLines;
+
+    size_t numRowNames;
+    store >> numRowNames;
+    rowNames.reserve(numRowNames);
+    for (size_t i = 0;  i < numRowNames;  ++i) {
+        Utf8String name;
+        store >> name;
+        rowNames.emplace_back(std::move(name));
+    }
+
+    timestamps.reconstitute(store, mapping);
+
+    columns.resize(numColumns);
+    for (auto & c: columns)
+        c.reconstitute(store, mapping);
+}
+
+void
+TabularDatasetChunk::
+serialize(ML::DB::Store_Writer & store) const
+{
+    store << chunkNumber << chunkLineNumber << lineNumber
+          << numColumns << numRows << numLines;
+
+    store << rowNames.size();
+    for (auto & n: rowNames)
+        store << n.toUtf8String();
+
+    timestamps.serialize(store);
+    for (auto & c: columns)
+        c.serialize(store);
+}
+
+
+/*****************************************************************************/
+/* TABULAR DATA STORE                                                        */
+/*****************************************************************************/
+
+namespace {
+
+/// Entry of the row index, as it's written to the file
+struct RowIndexEntry {
+    uint64_t rowHash;
+    int32_t chunk;
+    int32_t row;
+};
+
+/** Comparison between a column and constants that can be evaluated
+    directly against the frozen columns and zone maps of each chunk.
+*/
+struct TabularPredicate {
+    enum Op {
+        EQUAL,
+        LESS,
+        LESS_EQUAL,
+        GREATER,
+        GREATER_EQUAL,
+        IN
+    };
+
+    int columnNum;
+    Op op;
+    std::vector<CellValue> values;  ///< One value, or the IN list
+
+    /// Does the value match?  This follows the SQL semantics, where any
+    /// comparison with a null is false.
+    bool matches(const CellValue & val) const
+    {
+        if (val.empty())
+            return false;
+
+        switch (op) {
+        case EQUAL:          return val == values[0];
+        case LESS:           return val < values[0];
+        case LESS_EQUAL:     return val <= values[0];
+        case GREATER:        return val > values[0];
+        case GREATER_EQUAL:  return val >= values[0];
+        case IN:
+            return std::find(values.begin(), values.end(), val)
+                != values.end();
+        }
+
+        throw HttpReturnException(500, "Unknown tabular predicate op");
+    }
+
+    /// Could any row in a chunk with the given zone map match?
+    bool mayMatch(const ColumnZoneMap & zone) const
+    {
+        switch (op) {
+        case EQUAL:          return zone.mayContainEqual(values[0]);
+        case LESS:           return zone.mayContainLess(values[0], false);
+        case LESS_EQUAL:     return zone.mayContainLess(values[0], true);
+        case GREATER:        return zone.mayContainGreater(values[0], false);
+        case GREATER_EQUAL:  return zone.mayContainGreater(values[0], true);
+        case IN:
+            for (auto & v: values) {
+                if (zone.mayContainEqual(v))
+                    return true;
+            }
+            return false;
+        }
+
+        throw HttpReturnException(500, "Unknown tabular predicate op");
+    }
+};
+
+/// Return the atom value of a constant expression, or false if it isn't
+/// a constant atom
+bool getConstantAtom(const SqlExpression & expr, CellValue & result)
+{
+    if (!expr.isConstant())
+        return false;
+    ExpressionValue val = expr.constantValue();
+    if (!val.isAtom())
+        return false;
+    result = val.getAtom();
+    return true;
+}
+
+/// Return the number of the column read by the expression, or -1 if it
+/// doesn't read a known column
+int getColumnNum(const TabularDataStore & store, const SqlExpression & expr)
+{
+    auto variable = dynamic_cast<const ReadVariableExpression *>(&expr);
+    if (!variable)
+        return -1;
+    ColumnName columnName(variable->variableName.rawString());
+    auto it = store.columnIndex.find(columnName);
+    if (it == store.columnIndex.end())
+        return -1;
+    return it->second;
+}
+
+/// Extract a single predicate from the expression, returning false if it
+/// isn't of a supported form
+bool getPredicate(const TabularDataStore & store,
+                  const SqlExpression & expr,
+                  TabularPredicate & pred)
+{
+    if (auto comparison = dynamic_cast<const ComparisonExpression *>(&expr)) {
+        // Normalize to column op constant, flipping the operator if the
+        // constant is on the left
+        bool flipped = false;
+        pred.columnNum = getColumnNum(store, *comparison->lhs);
+        CellValue constant;
+        if (pred.columnNum == -1 || !getConstantAtom(*comparison->rhs, constant)) {
+            pred.columnNum = getColumnNum(store, *comparison->rhs);
+            if (pred.columnNum == -1
+                || !getConstantAtom(*comparison->lhs, constant))
+                return false;
+            flipped = true;
+        }
+
+        const std::string & op = comparison->op;
+        if (op == "=" || op == "==")
+            pred.op = TabularPredicate::EQUAL;
+        else if (op == "<")
+            pred.op = flipped ? TabularPredicate::GREATER : TabularPredicate::LESS;
+        else if (op == "<=")
+            pred.op = flipped ? TabularPredicate::GREATER_EQUAL : TabularPredicate::LESS_EQUAL;
+        else if (op == ">")
+            pred.op = flipped ? TabularPredicate::LESS : TabularPredicate::GREATER;
+        else if (op == ">=")
+            pred.op = flipped ? TabularPredicate::LESS_EQUAL : TabularPredicate::GREATER_EQUAL;
+        else return false;
+
+        // A comparison with null is never true; an empty IN list has the
+        // same effect
+        if (constant.empty())
+            pred.op = TabularPredicate::IN;
+        else pred.values.emplace_back(std::move(constant));
+        return true;
+    }
+
+    if (auto in = dynamic_cast<const InExpression *>(&expr)) {
+        if (in->kind != InExpression::TUPLE || in->isnegative || !in->tuple)
+            return false;
+        pred.columnNum = getColumnNum(store, *in->expr);
+        if (pred.columnNum == -1)
+            return false;
+        pred.op = TabularPredicate::IN;
+        for (auto & clause: in->tuple->clauses) {
+            CellValue constant;
+            if (!getConstantAtom(*clause, constant))
+                return false;
+            // Nulls in the list never match anything
+            if (!constant.empty())
+                pred.values.emplace_back(std::move(constant));
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/// Extract the predicates from an AND of supported predicates, returning
+/// false if any part of it isn't supported
+bool getPredicates(const TabularDataStore & store,
+                   const SqlExpression & expr,
+                   std::vector<TabularPredicate> & preds)
+{
+    auto boolean = dynamic_cast<const BooleanOperatorExpression *>(&expr);
+    if (boolean && boolean->op == "AND")
+        return getPredicates(store, *boolean->lhs, preds)
+            && getPredicates(store, *boolean->rhs, preds);
+
+    TabularPredicate pred;
+    if (!getPredicate(store, expr, pred))
+        return false;
+    preds.emplace_back(std::move(pred));
+    return true;
+}
+
+} // file scope
+
+bool
+TabularDataStore::
+forEachNumericBlock(const std::vector<ColumnName> & columns,
+                    const OnNumericBlock & onBlock) const
+{
+    std::vector<int> columnNums;
+    for (auto & c: columns) {
+        auto it = columnIndex.find(c);
+        if (it == columnIndex.end())
+            return false;
+        columnNums.push_back(it->second);
+    }
+
+    // Nothing can be passed to onBlock until we know that every chunk
+    // can be decoded
+    for (auto & chunk: chunks) {
+        for (int c: columnNums) {
+            const ColumnTypes & types = chunk.columns[c].columnTypes;
+            if (types.hasStrings || types.hasOther)
+                return false;
+        }
+    }
+
+    std::vector<std::vector<double> > values(columns.size());
+    std::vector<std::unique_ptr<bool[]> > isNull(columns.size());
+    std::vector<const double *> valuePtrs(columns.size());
+    std::vector<const bool *> isNullPtrs(columns.size());
+    std::vector<Date> ts;
+
+    for (auto & chunk: chunks) {
+        size_t numRows = chunk.rowCount();
+        if (numRows == 0)
+            continue;
+
+        ts.resize(numRows);
+        chunk.timestamps.forEachRun([&] (const CellValue & val,
+                                         uint32_t start, uint32_t n)
+                                    {
+                                        std::fill(ts.begin() + start,
+                                                  ts.begin() + start + n,
+                                                  val.toTimestamp());
+                                        return true;
+                                    });
+
+        for (size_t i = 0;  i < columns.size();  ++i) {
+            values[i].resize(numRows);
+            isNull[i].reset(new bool[numRows]);
+            if (!chunk.columns[columnNums[i]]
+                .getRangeAsDouble(0, numRows, values[i].data(), isNull[i].get()))
+                throw HttpReturnException(500, "Numeric column couldn't be "
+                                          "decoded as doubles",
+                                          "column", columns[i]);
+            valuePtrs[i] = values[i].data();
+            isNullPtrs[i] = isNull[i].get();
+        }
+
+        onBlock(numRows, valuePtrs.data(), isNullPtrs.data(), ts.data());
+    }
+
+    return true;
+}
+
+std::atomic<uint64_t> TabularDataStore::numChunksSkipped(0);
+std::atomic<uint64_t> TabularDataStore::numChunksScanned(0);
+
+GenerateRowsWhereFunction
+TabularDataStore::
+generateRowsWhere(const SqlBindingScope & context,
+                  const SqlExpression & where,
+                  ssize_t offset,
+                  ssize_t limit) const
+{
+    std::vector<TabularPredicate> preds;
+    if (!getPredicates(*this, where, preds))
+        return GenerateRowsWhereFunction();
+
+    auto exec = [=] (ssize_t numToGenerate, Any token,
+                     const BoundParameters & params)
+        -> std::pair<std::vector<RowName>, Any>
+        {
+            std::vector<std::vector<uint32_t> > chunkRows(chunks.size());
+
+            auto doChunk = [&] (int i)
+            {
+                const TabularDatasetChunk & chunk = chunks[i];
+
+                // Skip the chunk entirely if any zone map rules it out
+                for (auto & p: preds) {
+                    if (!p.mayMatch(chunk.columns[p.columnNum].zoneMap)) {
+                        ++numChunksSkipped;
+                        return;
+                    }
+                }
+
+                ++numChunksScanned;
+
+                std::vector<uint32_t> rows;
+                for (size_t j = 0;  j < preds.size();  ++j) {
+                    const TabularPredicate & p = preds[j];
+                    auto matching = chunk.columns[p.columnNum].frozen
+                        ->findRows([&] (const CellValue & val)
+                                   {
+                                       return p.matches(val);
+                                   });
+                    if (j == 0) {
+                        rows = std::move(matching);
+                    }
+                    else {
+                        std::vector<uint32_t> both;
+                        std::set_intersection(rows.begin(), rows.end(),
+                                              matching.begin(), matching.end(),
+                                              std::back_inserter(both));
+                        rows = std::move(both);
+                    }
+                    if (rows.empty())
+                        return;
+                }
+
+                chunkRows[i] = std::move(rows);
+            };
+
+            ML::run_in_parallel(0, chunks.size(), doChunk);
+
+            size_t total = 0;
+            for (auto & r: chunkRows)
+                total += r.size();
+
+            std::vector<RowName> result;
+            result.reserve(total);
+            for (size_t i = 0;  i < chunks.size();  ++i) {
+                for (uint32_t r: chunkRows[i])
+                    result.emplace_back(chunks[i].rowNames[r]);
+            }
+
+            return { std::move(result), Any() };
+        };
+
+    return { exec, "tabular predicate with zone maps " + where.print().rawString() };
+}
+
+void
+TabularDataStore::
+save(const std::string & filename, const Json::Value & metadata) const
+{
+    // Local files are written under a temporary name and moved into place
+    // once complete, so that a reader never sees a partly written file.
+    // Other filesystems only make an object visible once it's closed.
+    bool local = getUriScheme(filename) == "file";
+    std::string writeFilename = local ? filename + ".tmp" : filename;
+
+    // The temporary name hides the compression implied by the extension
+    std::string compression;
+    for (std::string ext: { "gz", "bz2", "xz", "lz4" }) {
+        if (boost::ends_with(filename, "." + ext))
+            compression = ext;
+    }
+
+    ML::filter_ostream stream(writeFilename, std::ios_base::out, compression);
+    ML::DB::Store_Writer store(stream);
+
+    store << TABULAR_MAGIC << TABULAR_VERSION << metadata.toStringNoNewLine();
+
+    store << rowCount << earliestTs << latestTs;
+
+    store << columnNames.size();
+    for (auto & c: columnNames)
+        store << c.toUtf8String();
+
+    store << chunks.size();
+    for (auto & c: chunks)
+        c.serialize(store);
+
+    std::vector<RowIndexEntry> entries;
+    entries.reserve(rowIndex.size());
+    for (auto & e: rowIndex)
+        entries.push_back({ e.first.hash(), e.second.first, e.second.second });
+    store << entries.size();
+    writeBulk(store, entries.data(), entries.size() * sizeof(RowIndexEntry));
+
+    stream.close();
+
+    if (local
+        && ::rename(getUriPath(writeFilename).c_str(),
+                    getUriPath(filename).c_str()) == -1)
+        throw ML::Exception(errno, "renaming tabular dataset file to "
+                            + filename);
+}
+
+bool
+TabularDataStore::
+load(const std::string & filename,
+     const std::function<bool (const Json::Value &)> & onMetadata)
+{
+    // Ask for a memory mappable stream if possible.  The stream needs
+    // to outlive any columns that reference its memory in place.
+    auto stream = std::make_shared<ML::filter_istream>
+        (filename, std::map<std::string, std::string>({ { "mapped", "true" } }));
+
+    const char * mappedStart;
+    size_t mappedLength;
+    std::tie(mappedStart, mappedLength) = stream->mapped();
+
+    std::shared_ptr<const void> newMapping;
+    ML::DB::Store_Reader store;
+    if (mappedStart) {
+        newMapping = stream;
+        store.open(mappedStart, mappedLength);
+    }
+    else {
+        store.open(*stream);
+    }
+
+    std::string magic;
+    store >> magic;
+    if (magic != TABULAR_MAGIC)
+        throw HttpReturnException(400, "File is not a tabular dataset file",
+                                  "filename", filename);
+
+    int version;
+    store >> version;
+    if (version != TABULAR_VERSION) {
+        // Written by another version of the code; it will need to be
+        // regenerated
+        cerr << "tabular dataset file " << filename << " has version "
+             << version << " but we need version " << TABULAR_VERSION
+             << endl;
+        return false;
+    }
+
+    std::string metadataStr;
+    store >> metadataStr;
+    if (!onMetadata(Json::parse(metadataStr)))
+        return false;
+
+    // Everything is read into temporaries first, so that a file that is
+    // truncated or corrupt leaves the store as it was
+    int64_t newRowCount;
+    Date newEarliestTs, newLatestTs;
+    store >> newRowCount >> newEarliestTs >> newLatestTs;
+
+    size_t numColumns;
+    store >> numColumns;
+    std::vector<ColumnName> newColumnNames;
+    std::vector<ColumnHash> newColumnHashes;
+    ML::Lightweight_Hash<ColumnHash, int> newColumnIndex;
+    for (size_t i = 0;  i < numColumns;  ++i) {
+        Utf8String name;
+        store >> name;
+        newColumnNames.emplace_back(std::move(name));
+        ColumnHash ch(newColumnNames.back());
+        newColumnIndex[ch] = i;
+        newColumnHashes.push_back(ch);
+    }
+
+    size_t numChunks;
+    store >> numChunks;
+    std::vector<TabularDatasetChunk> newChunks;
+    newChunks.reserve(numChunks);
+    for (size_t i = 0;  i < numChunks;  ++i)
+        newChunks.emplace_back(store, newMapping);
+
+    size_t numEntries;
+    store >> numEntries;
+    size_t bytes;
+    auto entries = readBulk<RowIndexEntry>(store, newMapping, bytes);
+    if (bytes != numEntries * sizeof(RowIndexEntry))
+        throw HttpReturnException(400, "Wrong size for row index in tabular "
+                                  "dataset file",
+                                  "filename", filename);
+
+    ML::Lightweight_Hash<RowHash, std::pair<int, int> > newRowIndex;
+    newRowIndex.reserve(4 * numEntries / 3);
+    for (size_t i = 0;  i < numEntries;  ++i) {
+        const RowIndexEntry & e = entries.get()[i];
+        newRowIndex[RowHash(e.rowHash)] = { e.chunk, e.row };
+    }
+
+    rowCount = newRowCount;
+    earliestTs = newEarliestTs;
+    latestTs = newLatestTs;
+    columnNames = std::move(newColumnNames);
+    columnHashes = std::move(newColumnHashes);
+    columnIndex = std::move(newColumnIndex);
+    chunks = std::move(newChunks);
+    rowIndex = std::move(newRowIndex);
+    this->filename = filename;
+    mapping = std::move(newMapping);
+
+    return true;
+}
+
+} // namespace MLDB
+} // namespace Datacratic
@@ -12,10 +12,16 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
 #include "mldb/arch/bit_range_ops.h"
 #include "mldb/jml/utils/lightweight_hash.h"
+#include "mldb/jml/db/persistent_fwd.h"
 #include "mldb/http/http_exception.h"
 #include "mldb/types/hash_wrapper_description.h"
+#include "mldb/core/dataset.h"
+#include "mldb/sql/cell_value.h"
+#include "mldb/sql/sql_expression.h"
+#include "mldb/types/basic_value_descriptions.h"
 #include "mldb/sql/cell_value_impl.h"
 
 namespace Datacratic {
@@ -110,6 +116,10 @@ struct ColumnTypes {
             return std::make_shared<AtomValueInfo>();
         }
     }
+
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+
     bool hasNulls;
 
     bool hasIntegers;
@@ -121,6 +131,50 @@ struct ColumnTypes {
     bool hasOther;  // timestamps, intervals, blobs, etc
 };
 
+/** Summary of the values of one column within one chunk, recorded when
+    the column is frozen.  Predicates consult it to skip chunks that
+    can't possibly contain a matching row.  Nulls never match a
+    comparison, so only the non-null values are summarized.
+*/
+struct ColumnZoneMap {
+    ColumnZoneMap()
+        : hasMinMax(false), hasNulls(false), numDistinct(0)
+    {
+    }
+
+    /// Maximum number of distinct values for which we keep the full set
+    static constexpr size_t MAX_DISTINCT = 16;
+
+    /// Initialize from the distinct values of the column in the chunk
+    void init(const std::vector<CellValue> & distinctValues);
+
+    /// Could the chunk contain a value equal to val?
+    bool mayContainEqual(const CellValue & val) const;
+
+    /// Could the chunk contain a value less than (or equal to) val?
+    bool mayContainLess(const CellValue & val, bool orEqual) const;
+
+    /// Could the chunk contain a value greater than (or equal to) val?
+    bool mayContainGreater(const CellValue & val, bool orEqual) const;
+
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+
+    /// False if there are no non-null values, or if they can't be ordered
+    /// (for example a NaN is present), in which case min and max are unset
+    bool hasMinMax;
+    CellValue minValue;
+    CellValue maxValue;
+
+    bool hasNulls;
+
+    /// Number of distinct non-null values
+    uint32_t numDistinct;
+
+    /// The distinct non-null values, if there are at most MAX_DISTINCT
+    std::vector<CellValue> distinctValues;
+};
+
 /// Base class for a frozen column
 struct FrozenColumn {
     virtual ~FrozenColumn()
@@ -136,6 +190,59 @@ struct FrozenColumn {
     virtual size_t memusage() const = 0;
 
     virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const = 0;
+
+    /** Decode the values of rows [startRow, startRow + numRows) into the
+        given output buffer, which must have space for numRows values.
+        This amortizes the virtual call and the position calculation
+        over the whole range, and is what scans should use in preference
+        to get().  The default implementation calls get() for each row.
+    */
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const;
+
+    /** Decode the values of rows [startRow, startRow + numRows) as
+        doubles into values, and set isNull for the rows that are null
+        (whose value is then undefined).  Returns false, leaving the
+        buffers undefined, if the column contains something other than
+        numbers and nulls.  Numeric aggregates use this, as no CellValue
+        is constructed.
+    */
+    virtual bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                                  double * values, bool * isNull) const;
+
+    typedef std::function<bool (const CellValue & value,
+                                uint32_t startRow, uint32_t numRows)>
+        OnRun;
+
+    /** Call the given function once for each maximal run of consecutive
+        rows with the same value, in row order.  Stops and returns false
+        as soon as the function returns false.  Columns with long runs
+        can answer this without decoding each row.
+    */
+    virtual bool forEachRun(const OnRun & onRun) const;
+
+    /** Return, in increasing order, the rows whose value matches the
+        given predicate.  Encodings that store an index into a table of
+        values evaluate the predicate once per distinct value and then
+        only compare indexes; the default evaluates it once per run.
+    */
+    virtual std::vector<uint32_t>
+    findRows(const std::function<bool (const CellValue &)> & pred) const;
+
+    /** Serialize the column to the given store.  The first thing written
+        is the column type's tag, which is used by reconstitute() to know
+        which kind of column to create.
+    */
+    virtual void serialize(ML::DB::Store_Writer & store) const = 0;
+
+    /** Reconstitute a column that was written by serialize().  If mapping
+        is non-null, then the store is reading directly from a memory
+        mapped file which is kept alive by mapping, and bulk data will
+        be referenced in place rather than copied.
+    */
+    static std::shared_ptr<FrozenColumn>
+    reconstitute(ML::DB::Store_Reader & store,
+                 const std::shared_ptr<const void> & mapping);
 };
 
 /// Naive frozen column that gets its values from a pure
@@ -150,6 +257,14 @@ struct NaiveFrozenColumn: public FrozenColumn {
     {
         return vals.at(rowIndex);
     }
+
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const
+    {
+        ExcAssertLessEqual((size_t)startRow + numRows, vals.size());
+        std::copy(vals.begin() + startRow, vals.begin() + startRow + numRows,
+                  out);
+    }
         
     std::vector<CellValue> vals;
 
@@ -178,6 +293,8 @@ struct NaiveFrozenColumn: public FrozenColumn {
 
         return true;
     }
+
+    virtual void serialize(ML::DB::Store_Writer & store) const;
 };
 
 /// Frozen column that finds each value in a lookup table
@@ -198,6 +315,10 @@ struct TableFrozenColumn: public FrozenColumn {
         }
     }
 
+    /// Reconstitute; see FrozenColumn::reconstitute()
+    TableFrozenColumn(ML::DB::Store_Reader & store,
+                      const std::shared_ptr<const void> & mapping);
+
     virtual size_t getIndexBits() const
     {
         return indexBits;
@@ -223,15 +344,20 @@ struct TableFrozenColumn: public FrozenColumn {
             + table.capacity() * sizeof(CellValue);  // todo: usage of each
     }
 
-    virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const
-    {
-        for (auto & v: table) {
-            if (!fn(v, 1 /* todo: real count */))
-                return false;
-        }
+    virtual bool forEachDistinctValue(std::function<bool (const CellValue &, size_t)> fn) const;
 
-        return true;
-    }
+    virtual void getRange(uint32_t startRow, uint32_t numRows,
+                          CellValue * out) const;
+
+    virtual bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                                  double * values, bool * isNull) const;
+
+    virtual bool forEachRun(const OnRun & onRun) const;
+
+    virtual std::vector<uint32_t>
+    findRows(const std::function<bool (const CellValue &)> & pred) const;
+
+    virtual void serialize(ML::DB::Store_Writer & store) const;
 
     std::shared_ptr<const uint32_t> storage;
     uint32_t indexBits;
@@ -295,16 +421,15 @@ struct TabularDatasetColumn {
     ML::Lightweight_Hash<uint64_t, int> valueIndex;
     CellValue lastValue;
     ColumnTypes columnTypes;
+    ColumnZoneMap zoneMap;
     std::shared_ptr<FrozenColumn> frozen;
 
-    void freeze()
-    {
-        frozen.reset(new TableFrozenColumn(indexes, std::move(indexedVals)));
-        indexes = std::vector<int>();
-        indexedVals = std::vector<CellValue>();
-        valueIndex = ML::Lightweight_Hash<uint64_t, int>();
-        lastValue = CellValue();
-    }
+    /** Freeze the column into its final, immutable representation.  The
+        most compact of the frozen column types that can represent the
+        values (as told by columnTypes) is chosen, and the zone map is
+        recorded.
+    */
+    void freeze();
 
     size_t memusage() const
     {
@@ -321,24 +446,54 @@ struct TabularDatasetColumn {
         return frozen->get(index);
     }
 
+    /// Number of rows decoded at once by the block-wise scans
+    static constexpr size_t SCAN_BLOCK_SIZE = 1024;
+
     template<typename Fn>
     bool forEach(Fn && fn) const
     {
         ExcAssert(frozen);
         size_t sz = frozen->size();
-        for (size_t i = 0;  i < sz;  ++i) {
-            if (!fn(i, std::move(frozen->get(i))))
-                return false;
+        std::vector<CellValue> block(std::min(sz, SCAN_BLOCK_SIZE));
+        for (size_t i = 0;  i < sz;  i += block.size()) {
+            size_t n = std::min(sz - i, block.size());
+            frozen->getRange(i, n, block.data());
+            for (size_t j = 0;  j < n;  ++j) {
+                if (!fn(i + j, std::move(block[j])))
+                    return false;
+            }
         } 
         return true;
     }
 
+    /// See FrozenColumn::getRangeAsDouble()
+    bool getRangeAsDouble(uint32_t startRow, uint32_t numRows,
+                          double * values, bool * isNull) const
+    {
+        ExcAssert(frozen);
+        return frozen->getRangeAsDouble(startRow, numRows, values, isNull);
+    }
+
+    template<typename Fn>
+    bool forEachRun(Fn && fn) const
+    {
+        ExcAssert(frozen);
+        return frozen->forEachRun(fn);
+    }
+
     template<typename Fn>
     bool forEachDistinctValue(Fn && fn) const
     {
         ExcAssert(frozen);
         return frozen->forEachDistinctValue(fn);
     }
+
+    /// Serialize a frozen column
+    void serialize(ML::DB::Store_Writer & store) const;
+
+    /// Reconstitute a frozen column; see FrozenColumn::reconstitute()
+    void reconstitute(ML::DB::Store_Reader & store,
+                      const std::shared_ptr<const void> & mapping);
 };
 
 struct TabularDatasetChunk {
@@ -361,6 +516,10 @@ struct TabularDatasetChunk {
             columns[i].reserve(reservedSize);
     }
 
+    /// Reconstitute a frozen chunk; see FrozenColumn::reconstitute()
+    TabularDatasetChunk(ML::DB::Store_Reader & store,
+                        const std::shared_ptr<const void> & mapping);
+
     TabularDatasetChunk(TabularDatasetChunk && other) noexcept
     : chunkNumber(-1), chunkLineNumber(-1), lineNumber(-1),
         numColumns(-1), numRows(0), numLines(0)
@@ -409,6 +568,9 @@ struct TabularDatasetChunk {
         return result;
     }
 
+    /// Serialize a frozen chunk
+    void serialize(ML::DB::Store_Writer & store) const;
+
     /// Which chunk number is this associated with?
     int64_t chunkNumber;
 
@@ -448,11 +610,41 @@ struct TabularDatasetChunk {
     void addToColumn(int columnIndex,
                      std::vector<std::tuple<RowName, CellValue, Date> > & rows) const
     {
-        for (unsigned i = 0;  i < numRows;  ++i) {
-            rows.emplace_back(rowNames[i],
-                              columns[columnIndex][i],
-                              timestamps[i].toTimestamp());
-        }
+        // Timestamps are nearly always a single run, so it's much
+        // cheaper to expand them run by run than to decode each one.
+        std::vector<Date> ts(numRows);
+        timestamps.forEachRun([&] (const CellValue & val,
+                                   uint32_t start, uint32_t n)
+                              {
+                                  std::fill(ts.begin() + start,
+                                            ts.begin() + start + n,
+                                            val.toTimestamp());
+                                  return true;
+                              });
+
+        rows.reserve(rows.size() + numRows);
+        columns[columnIndex].forEach([&] (size_t i, CellValue val)
+                                     {
+                                         rows.emplace_back(rowNames[i],
+                                                           std::move(val),
+                                                           ts[i]);
+                                         return true;
+                                     });
+    }
+
+    /// Add the values of the given column to the output, ignoring
+    /// timestamps, for those that match the filter (if any)
+    void addToColumnValues(int columnIndex,
+                           const std::function<bool (const CellValue &)> & filter,
+                           std::vector<std::tuple<RowName, CellValue> > & rows) const
+    {
+        columns[columnIndex].forEach([&] (size_t i, CellValue val)
+                                     {
+                                         if (!filter || filter(val))
+                                             rows.emplace_back(rowNames[i],
+                                                               std::move(val));
+                                         return true;
+                                     });
     }
 };
 
@@ -524,6 +716,30 @@ struct TabularDataStore: public ColumnIndex, public MatrixView {
     std::string filename;
     Date earliestTs, latestTs;
 
+    /// Keeps alive the memory mapped file that chunks were loaded from, if any
+    std::shared_ptr<const void> mapping;
+
+    /** Save the frozen contents of the store to the given file, in a
+        versioned binary format that can be memory mapped by load().  The
+        metadata is saved in the header and can be used by the loader
+        to verify that the file corresponds to what it expects.  A local
+        file is replaced atomically, so it's never seen half written.
+    */
+    void save(const std::string & filename,
+              const Json::Value & metadata) const;
+
+    /** Load the store from a file written by save().  The onMetadata
+        function is called with the saved metadata before anything else
+        is loaded; if it returns false, loading is abandoned and false is
+        returned; the same happens if the file was written by a different
+        version of the format.  If the file can be memory mapped, then
+        the column data is used in place and paged in lazily rather than
+        being read up front.  If the file can't be read, an exception is
+        thrown and the store is left unchanged.
+    */
+    bool load(const std::string & filename,
+              const std::function<bool (const Json::Value &)> & onMetadata);
+
     // Return the value of the column for all rows
     virtual MatrixColumn getColumn(const ColumnName & column) const
     {
@@ -537,6 +753,7 @@ struct TabularDataStore: public ColumnIndex, public MatrixView {
         MatrixColumn result;
         result.columnHash = result.columnName = column;
 
+        result.rows.reserve(rowCount);
         for (unsigned i = 0;  i < chunks.size();  ++i) {
             chunks[i].addToColumn(it->second, result.rows);
         }
@@ -544,11 +761,40 @@ struct TabularDataStore: public ColumnIndex, public MatrixView {
         return result;
     }
 
+    // Return the value of the column for all rows in chunk order, decoded
+    // block-wise
+    virtual std::vector<std::tuple<RowName, CellValue> >
+    getColumnValues(const ColumnName & column,
+                    const std::function<bool (const CellValue &)> & filter = nullptr) const
+    {
+        auto it = columnIndex.find(column);
+        if (it == columnIndex.end()) {
+            throw HttpReturnException(400, "Tabular dataset contains no column with given hash",
+                                      "columnHash", column,
+                                      "knownColumns", columnNames);
+        }
+
+        std::vector<std::tuple<RowName, CellValue> > result;
+        if (!filter)
+            result.reserve(rowCount);
+        for (auto & c: chunks)
+            c.addToColumnValues(it->second, filter, result);
+
+        return result;
+    }
+
     virtual uint64_t getColumnRowCount(const ColumnName & column) const
     {
         return rowCount;
     }
 
+    /** Decode the columns a chunk at a time with getRangeAsDouble(), if
+        the column types recorded for every chunk say that they only hold
+        numbers and nulls.
+    */
+    virtual bool forEachNumericBlock(const std::vector<ColumnName> & columns,
+                                     const OnNumericBlock & onBlock) const;
+
     virtual bool knownColumn(const ColumnName & column) const
     {
         return columnIndex.count(column);
@@ -722,7 +968,7 @@ struct TabularDataStore: public ColumnIndex, public MatrixView {
                 {
                     if (!value.isNumber())
                         isNumeric = false;
-                    stats.values[value].rowCount_ += 1;
+                    stats.values[value].rowCount_ += rowCount;
                     return true;
                 };
                                 
@@ -749,15 +995,24 @@ struct TabularDataStore: public ColumnIndex, public MatrixView {
         return { earliestTs, latestTs };
     }
 
+    /** Generate the rows matching the where clause directly from the
+        frozen columns, if it's a conjunction of comparisons between a
+        column and constants (=, <, <=, >, >= or IN (...)).  The zone
+        maps are used to skip chunks that can't match.  Returns an empty
+        function for any other where clause, so that the caller can
+        fall back to the generic implementation.
+    */
     GenerateRowsWhereFunction
     generateRowsWhere(const SqlBindingScope & context,
                       const SqlExpression & where,
                       ssize_t offset,
-                      ssize_t limit) const
-    {
-        GenerateRowsWhereFunction result;
-        return result;
-    }
+                      ssize_t limit) const;
+
+    /// Number of chunks that generateRowsWhere() has skipped using the
+    /// zone maps, and number that it has scanned, by this process, so
+    /// that tests can check that chunks really were skipped
+    static std::atomic<uint64_t> numChunksSkipped;
+    static std::atomic<uint64_t> numChunksScanned;
 };
 
 
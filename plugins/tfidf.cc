@@ -20,6 +20,8 @@
 #include "mldb/ml/value_descriptions.h"
 #include "mldb/sql/sql_expression.h"
 #include "mldb/server/analytics.h"
+#include "mldb/server/bound_queries.h"
+#include "mldb/server/per_thread_accumulator.h"
 #include "mldb/types/any_impl.h"
 #include "mldb/types/optional_description.h"
 #include "mldb/vfs/filter_streams.h"
@@ -192,28 +194,61 @@ run(const ProcedureRunConfig & run,
 
     auto boundDataset = runProcConf.trainingData.stm->from->bind(context);
 
-    //This will cummulate the number of documents each word is in 
-    std::unordered_map<Utf8String, uint64_t> dfs;
+    // Each thread counts the number of documents each word is in, keyed
+    // by column name so that we only make a string once per word
+    typedef ShardedMap<ColumnName, uint64_t> ThreadDfs;
+    PerThreadAccumulator<ThreadDfs> accum;
 
-    auto aggregator = [&] (NamedRowValue & row_)
+    auto aggregator = [&] (NamedRowValue & row_,
+                           const std::vector<ExpressionValue> & calc)
         {
             MatrixNamedRow row = row_.flattenDestructive();
+            ThreadDfs & threadDfs = accum.get();
             for (auto& col : row.columns) {            
-                Utf8String word = get<0>(col).toUtf8String();
-                dfs[word] += 1;               
+                threadDfs[get<0>(col)] += 1;
             }
 
             return true;
         };
 
-    iterateDataset(runProcConf.trainingData.stm->select, *boundDataset.dataset, boundDataset.asName, 
-                   runProcConf.trainingData.stm->when,
-                   *runProcConf.trainingData.stm->where,
-                   aggregator,
-                   runProcConf.trainingData.stm->orderBy,
-                   runProcConf.trainingData.stm->offset,
-                   runProcConf.trainingData.stm->limit,
-                   onProgress);     
+    // If no order by or limit, the order doesn't matter and the documents
+    // can be processed in parallel
+    auto & stm = runProcConf.trainingData.stm;
+    if (stm->limit == -1 && stm->offset == 0)
+        stm->orderBy.clauses.clear();
+
+    BoundSelectQuery(stm->select, *boundDataset.dataset,
+                     boundDataset.asName, stm->when, *stm->where,
+                     stm->orderBy, {} /* calc */,
+                     false /* implicit order by row hash */)
+        .execute(aggregator, stm->offset, stm->limit, onProgress);
+
+    // Merge the per thread counts, one shard at a time
+    std::vector<std::vector<std::pair<Utf8String, uint64_t> > >
+        shardDfs(ThreadDfs::NUM_SHARDS);
+
+    auto onShard = [&] (int shard, ThreadDfs::Shard & counts)
+        {
+            auto & result = shardDfs[shard];
+            result.reserve(counts.size());
+            for (auto & c: counts)
+                result.emplace_back(c.first.toUtf8String(), c.second);
+        };
+
+    mergeShards(accum,
+                [] (uint64_t & into, uint64_t from) { into += from; },
+                onShard);
+
+    size_t numWords = 0;
+    for (auto & d: shardDfs)
+        numWords += d.size();
+
+    std::unordered_map<Utf8String, uint64_t> dfs;
+    dfs.reserve(numWords);
+    for (auto & d: shardDfs) {
+        for (auto & df: d)
+            dfs.emplace(std::move(df.first), df.second);
+    }
 
     bool saved = false;
     if (!runProcConf.modelFileUrl.empty()) {
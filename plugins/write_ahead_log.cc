@@ -0,0 +1,370 @@
+/** write_ahead_log.cc
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Append-only log of records on local disk, with grouped fsyncs.
+*/
+
+#include "write_ahead_log.h"
+#include "mldb/arch/exception.h"
+#include "mldb/base/exc_assert.h"
+#include "mldb/jml/utils/file_functions.h"
+#include "mldb/jml/utils/guard.h"
+#include <boost/crc.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+
+using namespace std;
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* WRITE AHEAD LOG                                                           */
+/*****************************************************************************/
+
+namespace {
+
+/** Each record is framed by this header, followed by the data. */
+struct RecordHeader {
+    uint32_t length;     ///< Length of the data
+    uint32_t checksum;   ///< CRC32 of the sequence number and the data
+    uint64_t seq;        ///< Sequence number of the record
+};
+
+static_assert(sizeof(RecordHeader) == 16, "unexpected record header size");
+
+uint32_t checksum(uint64_t seq, const char * data, size_t len)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(&seq, sizeof(seq));
+    crc.process_bytes(data, len);
+    return crc.checksum();
+}
+
+} // file scope
+
+void syncParentDirectory(const std::string & filename)
+{
+    std::string copy = filename;
+    std::string dir = dirname(&copy[0]);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+        throw ML::Exception(errno, "opening directory " + dir);
+    ML::Call_Guard guard([=] () { ::close(fd); });
+    if (::fsync(fd) == -1)
+        throw ML::Exception(errno, "fsync of directory " + dir);
+}
+
+WriteAheadLog::
+WriteAheadLog(std::string basePath)
+    : basePath(std::move(basePath)),
+      fd(-1), segment(0), firstSegment(0), bytesInSegment(0),
+      durableBytesInSegment(0), appendedSeq(0), durableSeq(0), syncing(false)
+{
+}
+
+WriteAheadLog::
+~WriteAheadLog()
+{
+    if (fd == -1)
+        return;
+
+    // Anything still buffered belongs to a writer that didn't wait for
+    // it; make a best effort to keep it.
+    try {
+        if (!buffer.empty() && failure.empty())
+            writeAndSync(fd, buffer);
+    } catch (const std::exception & exc) {
+        cerr << "error flushing write ahead log " << basePath << ": "
+             << exc.what() << endl;
+    }
+    ::close(fd);
+}
+
+std::string
+WriteAheadLog::
+segmentPath(uint64_t segment) const
+{
+    return basePath + "." + std::to_string(segment);
+}
+
+void
+WriteAheadLog::
+replay(uint64_t firstSegment, uint64_t afterSeq,
+       const OnRecord & onRecord)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    ExcAssertEqual(fd, -1);
+
+    uint64_t lastSeq = afterSeq;
+    uint64_t current = firstSegment;
+
+    for (;;) {
+        std::string path = segmentPath(current);
+        if (!ML::fileExists(path))
+            break;
+
+        bool isLast = !ML::fileExists(segmentPath(current + 1));
+
+        std::string contents;
+        {
+            std::ifstream stream(path, std::ios::binary);
+            std::ostringstream read;
+            read << stream.rdbuf();
+            contents = read.str();
+        }
+
+        size_t pos = 0;
+        while (pos < contents.size()) {
+            RecordHeader header;
+            bool valid = pos + sizeof(header) <= contents.size();
+            const char * data = nullptr;
+            if (valid) {
+                std::memcpy(&header, contents.data() + pos, sizeof(header));
+                data = contents.data() + pos + sizeof(header);
+                valid = header.length <= contents.size() - pos - sizeof(header)
+                    && header.checksum == checksum(header.seq, data, header.length);
+            }
+
+            if (!valid) {
+                if (!isLast)
+                    throw ML::Exception("write ahead log segment " + path
+                                        + " is damaged before its end");
+
+                // The end of the last segment was being written when we
+                // stopped; the writer never had its sync acknowledged.
+                cerr << "truncating write ahead log " << path << " from "
+                     << contents.size() << " to " << pos << " bytes" << endl;
+                if (::truncate(path.c_str(), pos) == -1)
+                    throw ML::Exception(errno, "truncating " + path);
+                contents.resize(pos);
+                break;
+            }
+
+            if (header.seq > lastSeq) {
+                onRecord(header.seq, data, header.length);
+                lastSeq = header.seq;
+            }
+
+            pos += sizeof(header) + header.length;
+        }
+
+        if (isLast)
+            break;
+        ++current;
+    }
+
+    this->firstSegment = firstSegment;
+    appendedSeq = durableSeq = lastSeq;
+    openSegment(current);
+}
+
+void
+WriteAheadLog::
+openSegment(uint64_t segment)
+{
+    std::string path = segmentPath(segment);
+    bool existed = ML::fileExists(path);
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        throw ML::Exception(errno, "opening write ahead log " + path);
+
+    this->segment = segment;
+    bytesInSegment = durableBytesInSegment = ML::get_file_size(fd);
+
+    if (!existed)
+        syncParentDirectory(path);
+}
+
+uint64_t
+WriteAheadLog::
+append(const std::string & record)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    checkNotFailed();
+    ExcAssertNotEqual(fd, -1);
+
+    RecordHeader header;
+    header.length = record.size();
+    header.seq = ++appendedSeq;
+    header.checksum = checksum(header.seq, record.data(), record.size());
+
+    buffer.append((const char *)&header, sizeof(header));
+    buffer.append(record);
+    bytesInSegment += sizeof(header) + record.size();
+
+    return header.seq;
+}
+
+void
+WriteAheadLog::
+writeAndSync(int fd, const std::string & data)
+{
+    const char * p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t res = ::write(fd, p, left);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            throw ML::Exception(errno, "writing write ahead log " + basePath);
+        }
+        p += res;
+        left -= res;
+    }
+
+    if (::fdatasync(fd) == -1)
+        throw ML::Exception(errno, "syncing write ahead log " + basePath);
+}
+
+void
+WriteAheadLog::
+checkNotFailed() const
+{
+    if (!failure.empty())
+        throw ML::Exception("write ahead log " + basePath
+                            + " failed and can't be written: " + failure);
+}
+
+void
+WriteAheadLog::
+fail(const std::string & error)
+{
+    if (!failure.empty())
+        return;
+
+    failure = error;
+    buffer.clear();
+
+    // A failed write may have left part of a record behind; take it out
+    // so that replay doesn't stop there, and nothing that was never
+    // acknowledged comes back.
+    if (fd != -1 && ::ftruncate(fd, durableBytesInSegment) == -1)
+        cerr << "error truncating write ahead log " << segmentPath(segment)
+             << " after failure: " << strerror(errno) << endl;
+    bytesInSegment = durableBytesInSegment;
+}
+
+void
+WriteAheadLog::
+sync(uint64_t seq)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+
+    while (durableSeq < seq) {
+        // Our record may have been lost with the write that failed
+        checkNotFailed();
+
+        if (syncing) {
+            // Someone else is writing; they may take our record with them
+            cond.wait(guard);
+            continue;
+        }
+
+        // We become the leader, and write out everything buffered to date
+        // on behalf of everyone waiting.
+        syncing = true;
+        std::string toWrite;
+        toWrite.swap(buffer);
+        uint64_t upTo = appendedSeq;
+        uint64_t upToBytes = bytesInSegment;
+        int fd = this->fd;
+
+        guard.unlock();
+        try {
+            writeAndSync(fd, toWrite);
+        } catch (const std::exception & exc) {
+            guard.lock();
+            fail(exc.what());
+            syncing = false;
+            cond.notify_all();
+            throw;
+        }
+        guard.lock();
+
+        syncing = false;
+        durableSeq = upTo;
+        durableBytesInSegment = upToBytes;
+        cond.notify_all();
+    }
+}
+
+uint64_t
+WriteAheadLog::
+rotate()
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    ExcAssertNotEqual(fd, -1);
+
+    while (syncing)
+        cond.wait(guard);
+
+    checkNotFailed();
+
+    if (!buffer.empty()) {
+        try {
+            writeAndSync(fd, buffer);
+        } catch (const std::exception & exc) {
+            fail(exc.what());
+            cond.notify_all();
+            throw;
+        }
+        buffer.clear();
+    }
+    durableSeq = appendedSeq;
+    cond.notify_all();
+
+    ::close(fd);
+    fd = -1;
+    openSegment(segment + 1);
+    return segment;
+}
+
+void
+WriteAheadLog::
+removeSegmentsBefore(uint64_t segment)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    ExcAssertLessEqual(segment, this->segment);
+
+    for (uint64_t s = firstSegment;  s < segment;  ++s) {
+        std::string path = segmentPath(s);
+        if (::unlink(path.c_str()) == -1 && errno != ENOENT)
+            throw ML::Exception(errno, "removing write ahead log " + path);
+    }
+
+    if (segment > firstSegment) {
+        firstSegment = segment;
+        syncParentDirectory(segmentPath(segment));
+    }
+}
+
+uint64_t
+WriteAheadLog::
+lastSequence() const
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    return appendedSeq;
+}
+
+uint64_t
+WriteAheadLog::
+bytesSinceRotate() const
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    return bytesInSegment;
+}
+
+} // namespace MLDB
+} // namespace Datacratic
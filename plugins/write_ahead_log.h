@@ -0,0 +1,147 @@
+/** write_ahead_log.h                                              -*- C++ -*-
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Append-only log of records on local disk, with grouped fsyncs.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* WRITE AHEAD LOG                                                           */
+/*****************************************************************************/
+
+/** Log of opaque records, used to make writes to an in-memory structure
+    durable before it's written out as a whole.
+
+    The log is a series of numbered segment files, basePath.0, basePath.1,
+    etc.  Each record has a sequence number, which increases across
+    segments, and a checksum that allows a record that was only partly
+    written before a crash to be detected and dropped.
+
+    Records are appended to an in-memory buffer, and made durable by
+    sync().  Writers that call sync() at the same time share a single
+    write and fdatasync() of everything buffered to date, so that the
+    cost of the fsync is spread over all of them.
+
+    Once the structure has been written out (a snapshot) the log is
+    rotated, and segments before the rotation can be removed once the
+    snapshot is durable.
+
+    If writing to the log fails, the segment is truncated back to the end
+    of the last record that was synced, and the log is marked as failed:
+    everything appended since then is lost, and every later call throws.
+*/
+
+struct WriteAheadLog {
+    /** Create a log with segments under the given path.  It must be a
+        local file path.  replay() must be called before appending.
+    */
+    WriteAheadLog(std::string basePath);
+
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    void operator = (const WriteAheadLog &) = delete;
+
+    typedef std::function<void (uint64_t seq, const char * data, size_t len)>
+        OnRecord;
+
+    /** Read the existing segments, starting at firstSegment, and pass
+        the records with a sequence number above afterSeq to onRecord
+        in order.  A damaged record at the end of the last segment is
+        truncated away; anywhere else, it's an error.
+
+        The log is then opened for appending to its last segment, with
+        sequence numbers following both afterSeq and the last record.
+    */
+    void replay(uint64_t firstSegment, uint64_t afterSeq,
+                const OnRecord & onRecord);
+
+    /** Buffer the given record, returning its sequence number.  It's
+        not durable until sync() has been called for it.
+    */
+    uint64_t append(const std::string & record);
+
+    /** Return once the record with the given sequence number, and all
+        before it, are on disk.
+    */
+    void sync(uint64_t seq);
+
+    /** Make everything appended so far durable, and start a new segment.
+        Returns the number of the new segment; all records so far are in
+        the segments before it.
+    */
+    uint64_t rotate();
+
+    /** Delete the segments before the given one, which must have been
+        returned by rotate().
+    */
+    void removeSegmentsBefore(uint64_t segment);
+
+    /// Sequence number of the last record appended
+    uint64_t lastSequence() const;
+
+    /// Number of bytes appended since the log was opened or last rotated
+    uint64_t bytesSinceRotate() const;
+
+    /// Path of the file for the given segment
+    std::string segmentPath(uint64_t segment) const;
+
+private:
+    /// Open the given segment for appending.  Mutex must be held.
+    void openSegment(uint64_t segment);
+
+    /// Write out the given data and sync it
+    void writeAndSync(int fd, const std::string & data);
+
+    /// Throw if the log has failed.  Mutex must be held.
+    void checkNotFailed() const;
+
+    /// Mark the log as failed after an error writing it, removing anything
+    /// written since the last successful sync.  Mutex must be held.
+    void fail(const std::string & error);
+
+    std::string basePath;
+
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+
+    int fd;
+    uint64_t segment;
+    uint64_t firstSegment;
+    uint64_t bytesInSegment;
+
+    /// Size of the segment file up to the last record that was synced
+    uint64_t durableBytesInSegment;
+
+    /// Records appended but not yet written
+    std::string buffer;
+    uint64_t appendedSeq;
+    uint64_t durableSeq;
+
+    /// Is a thread currently writing out the buffer?
+    bool syncing;
+
+    /// Error that made the log fail, or empty if it hasn't
+    std::string failure;
+};
+
+/** Sync the directory containing the given file, so that creating,
+    renaming or removing the file is durable.
+*/
+void syncParentDirectory(const std::string & filename);
+
+} // namespace MLDB
+} // namespace Datacratic
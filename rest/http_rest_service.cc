@@ -207,6 +207,16 @@ finishResponse()
     responseSent_ = true;
 }
 
+void
+HttpRestConnection::
+abortResponse(const std::string & error)
+{
+    // No final chunk, and no recycling; the client sees the connection
+    // close before the end of the response
+    http->send("", HttpLegacySocketHandler::NEXT_CLOSE);
+    responseSent_ = true;
+}
+
 std::shared_ptr<RestConnection>
 HttpRestConnection::
 capture(std::function<void ()> onDisconnect)
@@ -105,6 +105,9 @@ struct HttpRestConnection: public RestConnection {
     /** Finish the response, recycling or closing the connection. */
     virtual void finishResponse();
 
+    /** Close the connection without finishing the response. */
+    virtual void abortResponse(const std::string & error);
+
     /** Send the given error string back on the connection. */
     virtual void sendErrorResponse(int responseCode,
                                    std::string error,
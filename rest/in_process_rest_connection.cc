@@ -92,6 +92,15 @@ finishResponse()
 {
 }
 
+void InProcessRestConnection::
+abortResponse(const std::string & error)
+{
+    // Nothing has gone to the caller yet, so it can get a proper error
+    // instead of the partial response
+    sendErrorResponse(500, error, "text/plain");
+    this->headers.clear();
+}
+
 /** Send the given error string back on the connection. */
 void InProcessRestConnection::
 sendErrorResponse(int responseCode,
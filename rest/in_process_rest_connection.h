@@ -54,6 +54,9 @@ struct InProcessRestConnection: public HttpRestConnection {
 
     virtual void finishResponse();
 
+    /** Replaces whatever was sent with a 500 error. */
+    virtual void abortResponse(const std::string & error);
+
     /** Send the given error string back on the connection. */
     virtual void sendErrorResponse(int responseCode,
                                    std::string error,
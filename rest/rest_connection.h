@@ -84,6 +84,13 @@ struct RestConnection {
     /** Finish the response, recycling or closing the connection. */
     virtual void finishResponse() = 0;
 
+    /** Give up on a response that has already been started, closing the
+        connection without finishing the response so that the client can
+        tell that what it received was cut short.  The error is for
+        connections that can report it.
+    */
+    virtual void abortResponse(const std::string & error) = 0;
+
     /** Send the given error string back on the connection. */
     virtual void sendErrorResponse(int responseCode,
                                    std::string error,
@@ -218,6 +218,16 @@ finishResponse()
     itl->responseSent = true;
 }
 
+void
+RestServiceEndpoint::ConnectionId::
+abortResponse(const std::string & error)
+{
+    // No final chunk, and no recycling; the client sees the connection
+    // close before the end of the response
+    itl->http->send("", HttpLegacySocketHandler::NEXT_CLOSE);
+    itl->responseSent = true;
+}
+
 std::shared_ptr<RestConnection>
 RestServiceEndpoint::ConnectionId::
 capture(std::function<void ()> onDisconnect)
@@ -316,7 +316,7 @@ getEmbedding(const SelectStatement & stm,
 }
 
 std::vector<MatrixNamedRow>
-queryWithoutDataset(SelectStatement& stm, SqlExpressionMldbContext& mldbContext)
+queryWithoutDataset(const SelectStatement& stm, SqlExpressionMldbContext& mldbContext)
 {
     auto boundSelect = stm.select.bind(mldbContext);
     SqlRowScope context;
@@ -116,7 +116,7 @@ getEmbedding(const SelectStatement & stm,
 
 /* SELECT without FROM */
 std::vector<MatrixNamedRow>
-queryWithoutDataset(SelectStatement& stm, SqlExpressionMldbContext& mldbContext);
+queryWithoutDataset(const SelectStatement& stm, SqlExpressionMldbContext& mldbContext);
 
 } // namespace MLDB
 } // namespace Datacratic
@@ -10,13 +10,17 @@
 #include "mldb/core/dataset.h"
 #include "mldb/server/dataset_context.h"
 #include "mldb/jml/utils/worker_task.h"
+#include "mldb/jml/utils/hash_specializations.h"
 #include "mldb/server/per_thread_accumulator.h"
 #include "mldb/server/parallel_merge_sort.h"
+#include "mldb/server/query_spill.h"
+#include "mldb/jml/db/persistent.h"
 #include "mldb/arch/timers.h"
 #include "mldb/types/basic_value_descriptions.h"
 #include "mldb/sql/sql_expression_operations.h"
 #include "mldb/http/http_exception.h"
 #include <boost/algorithm/string.hpp>
+#include <mutex>
 
 #include "mldb/jml/utils/profile.h"
 
@@ -30,9 +34,161 @@ namespace MLDB {
 const int MIN_ROW_PER_TASK = 32;
 const int TASK_PER_THREAD = 8;
 
+/// The groups of a GROUP BY are partitioned on the top bits of the hash of
+/// their key, so that the partitions can be merged independently
+const int GROUP_BY_PARTITION_BITS = 6;
+const int GROUP_BY_NUM_PARTITIONS = 1 << GROUP_BY_PARTITION_BITS;
+
+/// Guess at the memory used by the state of an aggregator for one group,
+/// which is opaque to us, for the query memory budget
+const int GROUP_BY_AGGREGATOR_BYTES = 64;
+
 __thread int QueryThreadTracker::depth = 0;
 
 
+/*****************************************************************************/
+/* SORTED RUN SPILLER                                                        */
+/*****************************************************************************/
+
+namespace {
+
+/// Row with its sort key and calculated values, as sorted by ORDER BY
+typedef std::tuple<std::vector<ExpressionValue>,
+                   NamedRowValue,
+                   std::vector<ExpressionValue> > SortedRow;
+
+size_t estimateMemory(const SortedRow & row)
+{
+    return estimateMemory(std::get<0>(row))
+        + estimateMemory(std::get<1>(row))
+        + estimateMemory(std::get<2>(row));
+}
+
+/** Sorted rows of a query that went over its memory budget.  Rows are
+    sorted and written to disk in runs; once they are all there, the runs
+    are merged together with the rows that are still in memory.
+*/
+
+struct SortedRunSpiller {
+    typedef std::function<bool (const SortedRow &, const SortedRow &)> Compare;
+
+    SortedRunSpiller(const QueryMemoryBudget & budget, Compare compare)
+        : budget(budget), compare(std::move(compare))
+    {
+    }
+
+    /** Sort the rows, write them out as a new run and clear them.  This is
+        thread safe.
+    */
+    void spill(std::vector<SortedRow> & rows)
+    {
+        std::sort(rows.begin(), rows.end(), compare);
+
+        auto run = std::make_shared<SpillFile>(budget.directory);
+        for (auto & row: rows) {
+            run->append([&] (ML::DB::Store_Writer & store)
+                        {
+                            serializeSpilled(store, std::get<0>(row));
+                            serializeSpilled(store, std::get<1>(row));
+                            serializeSpilled(store, std::get<2>(row));
+                        });
+        }
+        run->finish();
+
+        std::vector<SortedRow>().swap(rows);
+
+        std::unique_lock<std::mutex> guard(runsLock);
+        runs.emplace_back(std::move(run));
+    }
+
+    /// Has anything been spilled?
+    bool empty() const
+    {
+        return runs.empty();
+    }
+
+    /** Merge the spilled runs with the given rows that are still in memory,
+        calling onRow in sorted order until it returns false.
+    */
+    void merge(const std::vector<std::vector<SortedRow> *> & inMemory,
+               const std::function<bool (SortedRow & row)> & onRow)
+    {
+        struct Source {
+            std::unique_ptr<ML::DB::Store_Reader> store;
+            std::vector<SortedRow> * rows;
+            size_t remaining;
+            SortedRow current;
+
+            bool next()
+            {
+                if (remaining == 0)
+                    return false;
+                if (store) {
+                    reconstituteSpilled(*store, std::get<0>(current));
+                    reconstituteSpilled(*store, std::get<1>(current));
+                    reconstituteSpilled(*store, std::get<2>(current));
+                }
+                else {
+                    current = std::move((*rows)[rows->size() - remaining]);
+                }
+                --remaining;
+                return true;
+            }
+        };
+
+        std::vector<Source> sources(runs.size() + inMemory.size());
+        for (unsigned i = 0;  i < runs.size();  ++i) {
+            sources[i].store = runs[i]->read();
+            sources[i].rows = nullptr;
+            sources[i].remaining = runs[i]->size();
+        }
+        for (unsigned i = 0;  i < inMemory.size();  ++i) {
+            Source & source = sources[runs.size() + i];
+            std::sort(inMemory[i]->begin(), inMemory[i]->end(), compare);
+            source.rows = inMemory[i];
+            source.remaining = inMemory[i]->size();
+        }
+
+        // The heap holds the sources that aren't exhausted, with the one
+        // with the smallest current row (earliest source for ties) on top
+        auto heapCompare = [&] (int s1, int s2)
+            {
+                if (compare(sources[s2].current, sources[s1].current))
+                    return true;
+                if (compare(sources[s1].current, sources[s2].current))
+                    return false;
+                return s1 > s2;
+            };
+
+        std::vector<int> heap;
+        for (unsigned i = 0;  i < sources.size();  ++i) {
+            if (sources[i].next())
+                heap.push_back(i);
+        }
+        std::make_heap(heap.begin(), heap.end(), heapCompare);
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), heapCompare);
+            int s = heap.back();
+
+            if (!onRow(sources[s].current))
+                return;
+
+            if (sources[s].next())
+                std::push_heap(heap.begin(), heap.end(), heapCompare);
+            else heap.pop_back();
+        }
+    }
+
+    const QueryMemoryBudget & budget;
+    Compare compare;
+    std::mutex runsLock;
+    std::vector<std::shared_ptr<SpillFile> > runs;
+};
+
+} // file scope
+
+
 /*****************************************************************************/
 /* BOUND SELECT QUERY                                                        */
 /*****************************************************************************/
@@ -346,11 +502,23 @@ struct OrderedExecutor: public BoundSelectQuery::Executor {
    
         // For each one, generate the order by key
 
-        typedef std::tuple<std::vector<ExpressionValue>, NamedRowValue, std::vector<ExpressionValue> > SortedRow;
         typedef std::vector<SortedRow> SortedRows;
         
         PerThreadAccumulator<SortedRows> accum;
 
+        // Compare two rows according to the sort criteria
+        auto compareRows = [&] (const SortedRow & row1,
+                                const SortedRow & row2) -> bool
+            {
+                return boundOrderBy.less(std::get<0>(row1), std::get<0>(row2));
+            };
+
+        // If the rows don't fit in the query's memory budget, each thread
+        // spills its sorted rows to disk once it goes over
+        QueryMemoryBudget budget(context.dataset);
+        SortedRunSpiller spiller(budget, compareRows);
+        PerThreadAccumulator<size_t> bytesAccum;
+
         std::atomic<int64_t> rowsAdded(0);
 
         // Do we have where TRUE?  In that case we can avoid evaluating 
@@ -403,6 +571,18 @@ struct OrderedExecutor: public BoundSelectQuery::Executor {
                                          std::move(outputRow),
                                          std::move(calcd));
 
+                if (budget.limited()) {
+                    size_t & threadBytes = bytesAccum.get();
+                    size_t bytes = estimateMemory(sortedRows->back());
+                    threadBytes += bytes;
+                    budget.add(bytes);
+                    if (budget.shouldSpill(threadBytes)) {
+                        spiller.spill(*sortedRows);
+                        budget.add(-(ssize_t)threadBytes);
+                        threadBytes = 0;
+                    }
+                }
+
                 ++rowsAdded;
                 return true;
             };
@@ -413,13 +593,30 @@ struct OrderedExecutor: public BoundSelectQuery::Executor {
 
         cerr << "map took " << timer.elapsed() << endl;
         timer.restart();
-        
-        // Compare two rows according to the sort criteria
-        auto compareRows = [&] (const SortedRow & row1,
-                                const SortedRow & row2) -> bool
-            {
-                return boundOrderBy.less(std::get<0>(row1), std::get<0>(row2));
-            };
+
+        if (!spiller.empty()) {
+            ExcAssertGreaterEqual(offset, 0);
+
+            // Merge the spilled runs with what's left in memory, skipping
+            // the rows before the offset
+            std::vector<SortedRows *> inMemory;
+            for (auto & t: accum.threads)
+                inMemory.push_back(t.get());
+
+            ssize_t rowNum = 0;
+            auto onRow = [&] (SortedRow & row) -> bool
+                {
+                    if (limit != -1 && rowNum >= offset + limit)
+                        return false;
+                    if (rowNum >= offset)
+                        aggregator(std::get<1>(row), std::get<2>(row), rowNum);
+                    ++rowNum;
+                    return true;
+                };
+
+            spiller.merge(inMemory, onRow);
+            return;
+        }
             
         auto rowsSorted = parallelMergeSort(accum.threads, compareRows);
 
@@ -659,17 +856,91 @@ struct RowHashOrderedExecutor: public BoundSelectQuery::Executor {
                 }
             };
 
+        // When we need all of the rows and the select expression can work
+        // over several rows at once (for example, it calls a function that
+        // scores rows in batches), then we process them in blocks.
+        bool batched = limit == -1 && !selectStar && boundSelect.batchExec;
+
+        auto doBlock = [&] (size_t begin, size_t end)
+            {
+                QueryThreadTracker childTracker = parentTracker.child();
+
+                std::vector<MatrixNamedRow> blockRows;
+                blockRows.reserve(end - begin);
+
+                try {
+                    for (size_t i = begin;  i < end;  ++i) {
+                        MatrixNamedRow row = matrix->getRow(rows[i]);
+                        auto rowContext = context.getRowContext(row);
+
+                        if (!whereTrue && !whereBound(rowContext).isTrue())
+                            continue;
+
+                        whenBound.filterInPlace(row, rowContext);
+                        blockRows.emplace_back(std::move(row));
+                    }
+
+                    std::vector<SqlExpressionDatasetContext::RowContext>
+                        rowContexts;
+                    std::vector<const SqlRowScope *> rowScopes;
+                    rowContexts.reserve(blockRows.size());
+                    rowScopes.reserve(blockRows.size());
+                    for (auto & row: blockRows) {
+                        rowContexts.emplace_back(context.getRowContext(row));
+                        rowScopes.push_back(&rowContexts.back());
+                    }
+
+                    std::vector<ExpressionValue> selectOutputs;
+                    boundSelect.execBatch(rowScopes, selectOutputs);
+
+                    for (size_t i = 0;  i < blockRows.size();  ++i) {
+                        NamedRowValue outputRow;
+                        outputRow.rowName = blockRows[i].rowName;
+                        outputRow.rowHash = blockRows[i].rowName;
+                        selectOutputs[i].mergeToRowDestructive(outputRow.columns);
+
+                        vector<ExpressionValue> calcd(boundCalc.size());
+                        for (unsigned j = 0;  j < boundCalc.size();  ++j) {
+                            calcd[j] = std::move(boundCalc[j](rowContexts[i]));
+                        }
+
+                        std::unique_lock<ML::Spinlock> guard(mutex);
+                        sorted.emplace_back(blockRows[i].rowHash,
+                                            std::move(outputRow),
+                                            std::move(calcd));
+                    }
+                } catch (...) {
+                    rethrowHttpException(-1, "Executing non-grouped query bound to rows: " + ML::getExceptionString(),
+                                         "firstRowHash", rows[begin],
+                                         "numRows", end - begin);
+                }
+            };
+
+        if (batched) {
+            size_t batchSize = 256;
+            size_t numBlocks = (rows.size() + batchSize - 1) / batchSize;
+
+            auto doBlockNum = [&] (size_t block)
+                {
+                    size_t begin = block * batchSize;
+                    doBlock(begin, std::min(begin + batchSize, rows.size()));
+                };
+
+            ML::run_in_parallel_blocked(0, numBlocks, doBlockNum);
+        }
+
         // Do the first 100 in a single thread, to see what our hit rate is
         static constexpr size_t NUM_TO_SAMPLE = 100;
 
-        for (unsigned i = 0;  i < NUM_TO_SAMPLE && i < rows.size()
+        for (unsigned i = 0;  !batched && i < NUM_TO_SAMPLE && i < rows.size()
                  && (limit == -1 || sorted.size() < offset + limit);  ++i)
             doRow(i);
 
         //cerr << "Done first " << NUM_TO_SAMPLE << " rows with "
         //     << sorted.size() << " total" << endl;
 
-        size_t numProcessed = std::min(NUM_TO_SAMPLE, rows.size());
+        size_t numProcessed
+            = batched ? rows.size() : std::min(NUM_TO_SAMPLE, rows.size());
 
         while (numProcessed < rows.size()
                && (limit == -1 || (sorted.size() < offset + limit))) {
@@ -1296,6 +1567,168 @@ struct GroupContext: public SqlExpressionDatasetContext {
     bool evaluateEmptyGroups;
 };
 
+/*****************************************************************************/
+/* GROUP BY HASH TABLE                                                       */
+/*****************************************************************************/
+
+namespace {
+
+/** Hash of a single element of a group key.  This must be consistent with
+    ExpressionValue::operator ==, which means that it must ignore timestamps
+    and the order of the columns of a row.
+*/
+uint64_t groupKeyElementHash(const ExpressionValue & val)
+{
+    if (val.isAtom() || val.empty())
+        return val.hash();
+
+    uint64_t result = 0;
+    auto onAtom = [&] (const Coord & columnName,
+                       const Coord & prefix,
+                       const CellValue & atom,
+                       Date ts)
+        {
+            // Commutative so that the column order doesn't matter
+            result += ML::chain_hash(prefix.hash(),
+                                     ML::chain_hash(columnName.hash(),
+                                                    atom.hash()));
+            return true;
+        };
+    val.forEachAtom(onAtom);
+    return result;
+}
+
+uint64_t groupKeyHash(const ExpressionValue * key, size_t keyLength)
+{
+    uint64_t result = keyLength;
+    for (size_t i = 0;  i < keyLength;  ++i)
+        result = ML::chain_hash(groupKeyElementHash(key[i]), result);
+    return result;
+}
+
+int groupKeyPartition(uint64_t hash)
+{
+    return hash >> (64 - GROUP_BY_PARTITION_BITS);
+}
+
+/** Open addressing hash table from a group key to its aggregator state.
+    The entries are stored densely in insertion order and the slots hold
+    their index, so that growing the table only rehashes the slots.  The
+    full hash is kept with each entry so that the keys only need to be
+    compared when their hashes match.
+*/
+
+struct GroupByHashTable {
+
+    typedef std::vector<ExpressionValue> RowKey;
+
+    struct Entry {
+        Entry(uint64_t hash, RowKey key)
+            : hash(hash), key(std::move(key))
+        {
+        }
+
+        uint64_t hash;
+        RowKey key;
+        GroupMapValue value;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> slots;   ///< Index of entry plus one, or 0 if empty
+
+    /** Return the entry for the given key, creating it if it doesn't exist
+        yet, in which case inserted is set to true.  The reference is only
+        valid until the next insertion.
+    */
+    Entry & find(uint64_t hash, const ExpressionValue * key, size_t keyLength,
+                 bool & inserted)
+    {
+        reserveOne();
+        size_t slot = probe(hash, key, keyLength);
+        inserted = slots[slot] == 0;
+        if (!inserted)
+            return entries[slots[slot] - 1];
+        return add(slot, hash, RowKey(key, key + keyLength));
+    }
+
+    /// Return the entry for the given key, or null if there is none
+    Entry * lookup(uint64_t hash, const ExpressionValue * key,
+                   size_t keyLength)
+    {
+        if (slots.empty())
+            return nullptr;
+        size_t slot = probe(hash, key, keyLength);
+        return slots[slot] ? &entries[slots[slot] - 1] : nullptr;
+    }
+
+    /** Merge all entries of other into this one, calling mergeValue for the
+        keys that are in both.  The other table is left empty.
+    */
+    template<typename MergeValue>
+    void mergeFrom(GroupByHashTable & other, const MergeValue & mergeValue)
+    {
+        for (auto & e: other.entries) {
+            reserveOne();
+            size_t slot = probe(e.hash, e.key.data(), e.key.size());
+            if (slots[slot]) {
+                mergeValue(entries[slots[slot] - 1].value, e.value);
+            }
+            else {
+                add(slot, e.hash, std::move(e.key)).value = std::move(e.value);
+            }
+        }
+
+        other.entries.clear();
+        other.slots.clear();
+    }
+
+private:
+    /// Return the slot that holds the key, or the empty slot where it
+    /// should go
+    size_t probe(uint64_t hash, const ExpressionValue * key,
+                 size_t keyLength) const
+    {
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash & mask;  ;  slot = (slot + 1) & mask) {
+            uint32_t index = slots[slot];
+            if (index == 0)
+                return slot;
+            const Entry & e = entries[index - 1];
+            if (e.hash == hash && std::equal(key, key + keyLength, e.key.begin()))
+                return slot;
+        }
+    }
+
+    Entry & add(size_t slot, uint64_t hash, RowKey key)
+    {
+        entries.emplace_back(hash, std::move(key));
+        slots[slot] = entries.size();
+        return entries.back();
+    }
+
+    /// Make sure that there is space for one more entry, keeping the load
+    /// factor below 3/4
+    void reserveOne()
+    {
+        if ((entries.size() + 1) * 4 <= slots.size() * 3)
+            return;
+
+        size_t newSize = std::max<size_t>(16, slots.size() * 2);
+        slots.clear();
+        slots.resize(newSize, 0);
+
+        size_t mask = newSize - 1;
+        for (size_t i = 0;  i < entries.size();  ++i) {
+            size_t slot = entries[i].hash & mask;
+            while (slots[slot])
+                slot = (slot + 1) & mask;
+            slots[slot] = i + 1;
+        }
+    }
+};
+
+} // file scope
+
 /*****************************************************************************/
 /* BOUND GROUP BY QUERY                                               */
 /*****************************************************************************/
@@ -1354,6 +1787,24 @@ BoundGroupByQuery(const SelectExpression & select,
     //false means no implicit sort by rowhash, we want unsorted
     subSelect.reset(new BoundSelectQuery(subSelectExpr, from, alias, when, where, subOrderBy, calc, false, numBuckets));
 
+    // These aggregators ignore nulls and only use the value of each
+    // row as a double, so they can be fed from whole numeric columns
+    if (groupBy.clauses.empty() && when.when->isConstantTrue()
+        && where.isConstantTrue()) {
+        for (auto & expr: aggregatorsExpr) {
+            auto fn = dynamic_cast<const FunctionCallWrapper *>(expr.get());
+            const ReadVariableExpression * var = nullptr;
+            if (fn->args.size() == 1
+                && (fn->functionName == "count" || fn->functionName == "sum"
+                    || fn->functionName == "avg"))
+                var = dynamic_cast<const ReadVariableExpression *>(fn->args[0].get());
+            if (!var) {
+                numericColumns.clear();
+                break;
+            }
+            numericColumns.emplace_back(rowContext->getVariableColumnName(var->variableName));
+        }
+    }
 }
 
 void
@@ -1366,17 +1817,18 @@ execute(std::function<bool (NamedRowValue & output)> aggregator,
 {
     //STACK_PROFILE(BoundGroupByQuery);
 
-    typedef std::tuple<std::vector<ExpressionValue>,
-                       NamedRowValue,
-                       std::vector<ExpressionValue> >
-        SortedRow;
-
     std::vector<SortedRow> rowsSorted;
     std::atomic<ssize_t> groupsDone(0);
 
-    typedef std::vector<ExpressionValue> RowKey;
-    typedef std::map<RowKey, GroupMapValue> GroupByMapType;
-    std::vector<GroupByMapType> accum(numBuckets);
+    typedef GroupByHashTable::RowKey RowKey;
+    typedef GroupByHashTable::Entry GroupEntry;
+
+    // Each bucket accumulates into its own set of partitions, which are
+    // merged across buckets once they are all done
+    std::vector<std::vector<GroupByHashTable> >
+        accum(numBuckets,
+              std::vector<GroupByHashTable>(GROUP_BY_NUM_PARTITIONS));
+    size_t keyLength = groupBy.clauses.size();
 
     //bind the selectexpression, this will create the bound aggregators (which we wont use, ah!)
     auto boundSelect = select.bind(*groupContext);
@@ -1389,85 +1841,318 @@ execute(std::function<bool (NamedRowValue & output)> aggregator,
     if (!having.isConstantTrue() && !having.isConstantFalse() && dynamic_cast<BooleanValueInfo*>(boundHaving.info.get()) == nullptr)
         throw HttpReturnException(400, "HAVING must be a boolean expression");
 
+    // Once the groups go over the query's memory budget, partitions are
+    // spilled one by one from the last: new groups in a spilled partition
+    // have their rows written to disk, to be aggregated once the rest is
+    // done.  Groups that are already in memory continue to be updated.
+    QueryMemoryBudget budget(from);
+    std::atomic<int> firstSpilledPartition(GROUP_BY_NUM_PARTITIONS);
+    std::vector<std::unique_ptr<SpillFile> >
+        partitionSpills(GROUP_BY_NUM_PARTITIONS);
+    std::mutex partitionSpillsLock;
+
+    size_t bytesPerGroup = sizeof(GroupEntry) + 2 * sizeof(uint32_t)
+        + groupContext->outputAgg.size() * GROUP_BY_AGGREGATOR_BYTES;
+
+    auto spillGroupRow = [&] (int partition,
+                              const std::vector<ExpressionValue> & calc)
+    {
+        SpillFile * file;
+        {
+            std::unique_lock<std::mutex> guard(partitionSpillsLock);
+            if (!partitionSpills[partition])
+                partitionSpills[partition].reset(new SpillFile(budget.directory));
+            file = partitionSpills[partition].get();
+        }
+        file->append([&] (ML::DB::Store_Writer & store)
+                     {
+                         serializeSpilled(store, calc);
+                     });
+    };
+
     // When we get a row, we record it under the group key
     auto onRow = [&] (NamedRowValue & row,
                       const std::vector<ExpressionValue> & calc,
                       int groupNum)
     {
-       GroupByMapType & map = accum[groupNum];
-       RowKey rowKey(calc.begin(), calc.begin() + groupBy.clauses.size());
+       uint64_t hash = groupKeyHash(calc.data(), keyLength);
+       int partition = groupKeyPartition(hash);
+       GroupByHashTable & table = accum[groupNum][partition];
+
+       if (JML_UNLIKELY(partition >= firstSpilledPartition)) {
+           GroupEntry * entry = table.lookup(hash, calc.data(), keyLength);
+           if (entry)
+               groupContext->aggregateRow(entry->value, calc);
+           else spillGroupRow(partition, calc);
+           return true;
+       }
 
-       auto pair = map.insert({rowKey, GroupMapValue()});
-       auto iter = pair.first;
-       if (pair.second)
+       bool inserted;
+       GroupEntry & entry = table.find(hash, calc.data(), keyLength, inserted);
+       if (inserted)
        {
           //initialize aggregator data
-          groupContext->initializePerThreadAggregators(iter->second);
+          groupContext->initializePerThreadAggregators(entry.value);
+
+          if (budget.limited()
+              && budget.add(bytesPerGroup + estimateMemory(entry.key))) {
+              int first = firstSpilledPartition;
+              while (first > 0
+                     && !firstSpilledPartition.compare_exchange_weak(first, first - 1))
+                  ;
+          }
        }
 
-       groupContext->aggregateRow(iter->second, calc);
+       groupContext->aggregateRow(entry.value, calc);
 
        return true;
     };  
             
-    subSelect->execute(onRow, 0, -1, onProgress, allowMT);
-  
-    //merge the maps in fixed order
-    GroupByMapType destMap;
-    std::vector<GroupByMapType>& threads = accum;
-    if (threads.size() > 0)
-    {
-//        STACK_PROFILE(MergingBuckets);
-        for (auto & srcMap : threads)
-        {
-            for (auto it = srcMap.begin(); it != srcMap.end(); ++it)
+    // Feed the aggregators directly from the numeric columns if we can,
+    // which avoids materializing every row of the dataset
+    bool scannedColumns = false;
+    auto columnIndex = numericColumns.empty()
+        ? nullptr : from.getColumnIndex();
+    if (columnIndex) {
+        NamedRowValue row;
+        std::vector<ExpressionValue> rowCalc(calc.size());
+        ExcAssertEqual(rowCalc.size(), numericColumns.size());
+
+        auto onBlock = [&] (size_t numRows,
+                            const double * const * values,
+                            const bool * const * isNull,
+                            const Date * timestamps)
             {
-                auto pair = destMap.insert({it->first, GroupMapValue()});
-                auto destiter = pair.first;
-                if (pair.second)
+                for (size_t i = 0;  i < numRows;  ++i) {
+                    for (size_t j = 0;  j < rowCalc.size();  ++j) {
+                        if (isNull[j][i])
+                            rowCalc[j] = ExpressionValue::null(timestamps[i]);
+                        else rowCalc[j] = ExpressionValue(values[j][i], timestamps[i]);
+                    }
+                    onRow(row, rowCalc, 0 /* bucket */);
+                }
+            };
+
+        scannedColumns
+            = columnIndex->forEachNumericBlock(numericColumns, onBlock);
+    }
+
+    if (!scannedColumns)
+        subSelect->execute(onRow, 0, -1, onProgress, allowMT);
+
+    // Merge the buckets in fixed order into the first one.  A key always
+    // lands in the same partition, so each partition is merged separately.
+    auto mergeBuckets = [&] (int p)
+        {
+            GroupByHashTable & dest = accum[0][p];
+            for (size_t i = 1;  i < accum.size();  ++i) {
+                dest.mergeFrom(accum[i][p],
+                               [&] (GroupMapValue & out, const GroupMapValue & in)
+                               {
+                                   groupContext->mergeThreadMap(out, in);
+                               });
+            }
+        };
+
+    // Evaluate the HAVING, row name and select expressions for a group into
+    // outputRow, and the sort fields if asked for.  Returns false if the
+    // group is filtered out by the HAVING clause.
+    auto evaluateGroup = [&] (const GroupEntry & group,
+                              NamedRowValue & outputRow,
+                              std::vector<ExpressionValue> * sortFields) -> bool
+        {
+            const RowKey & rowKey = group.key;
+            groupContext->aggData = group.value;
+
+            // Create the context to evaluate the row name and order by
+            auto rowContext = groupContext->getRowContext(outputRow, rowKey);
+
+            //Evaluate the HAVING expression
+            ExpressionValue havingResult = boundHaving(rowContext);
+
+            if (havingResult.isFalse())
+                return false;
+
+            outputRow.rowName = RowName(boundRowName(rowContext).toUtf8String());
+            outputRow.rowHash = outputRow.rowName;        
+
+            //Evaluating the whole bound select expression
+            ExpressionValue result = boundSelect(rowContext);
+            result.mergeToRowDestructive(outputRow.columns);
+
+            if (sortFields) {
+                if (boundOrderBy.empty())
+                    *sortFields = rowKey;
+                else *sortFields = boundOrderBy.apply(rowContext);
+            }
+
+            return true;
+        };
+
+    // Compare two rows according to the sort criteria, which are the group
+    // keys when there is no ORDER BY
+    auto compareRows = [&] (const SortedRow & row1,
+                            const SortedRow & row2)
+        {
+            if (boundOrderBy.empty())
+                return std::get<0>(row1) < std::get<0>(row2);
+            return boundOrderBy.less(std::get<0>(row1),
+                                     std::get<0>(row2));
+        };
+
+    SortedRunSpiller spiller(budget, compareRows);
+
+    // Output the sorted rows between offset and limit, merging them with
+    // the spilled runs if there are any.  Without an ORDER BY, only the
+    // limit applies.
+    auto outputSorted = [&] ()
+        {
+            ExcAssertGreaterEqual(offset, 0);
+
+            if (!spiller.empty()) {
+                ssize_t first = boundOrderBy.empty() ? 0 : offset;
+                ssize_t rowNum = 0;
+                auto onRow = [&] (SortedRow & row) -> bool
+                    {
+                        if (limit != -1 && rowNum >= first + limit)
+                            return false;
+                        if (rowNum >= first)
+                            aggregator(std::get<1>(row));
+                        ++rowNum;
+                        return true;
+                    };
+
+                spiller.merge({ &rowsSorted }, onRow);
+                return;
+            }
+
+            // Sort our output rows
+            std::sort(rowsSorted.begin(), rowsSorted.end(), compareRows);
+
+            auto doSelect = [&] (int rowNum) -> bool
                 {
-                    //initialize aggregator data
-                    groupContext->initializePerThreadAggregators(destiter->second);
+                    auto & row = std::get<1>(rowsSorted[rowNum]);
+
+                    /* Finally, pass to the terminator to continue. */
+                    return aggregator(row);
+                };
+
+            // Now select only the required subset of sorted rows
+            if (limit == -1)
+                limit = rowsSorted.size();
+
+            ssize_t begin = std::min<ssize_t>(offset, rowsSorted.size());
+            ssize_t end = std::min<ssize_t>(offset + limit, rowsSorted.size());
+
+            for (unsigned i = begin;  i < end;  ++i) {
+                doSelect(i);
+            } 
+        };
+
+    if (firstSpilledPartition < GROUP_BY_NUM_PARTITIONS) {
+        // Some groups are on disk.  Finish the partitions one at a time,
+        // aggregating their spilled rows, and write each one's output rows
+        // as a sorted run so that only one partition is in memory at once.
+        for (auto & file: partitionSpills) {
+            if (file)
+                file->finish();
+        }
+
+        for (int p = 0;  p < GROUP_BY_NUM_PARTITIONS;  ++p) {
+            mergeBuckets(p);
+            GroupByHashTable & dest = accum[0][p];
+
+            if (partitionSpills[p]) {
+                auto store = partitionSpills[p]->read();
+                std::vector<ExpressionValue> calc;
+                for (size_t i = 0;  i < partitionSpills[p]->size();  ++i) {
+                    reconstituteSpilled(*store, calc);
+                    uint64_t hash = groupKeyHash(calc.data(), keyLength);
+                    bool inserted;
+                    GroupEntry & entry
+                        = dest.find(hash, calc.data(), keyLength, inserted);
+                    if (inserted)
+                        groupContext->initializePerThreadAggregators(entry.value);
+                    groupContext->aggregateRow(entry.value, calc);
                 }
+                partitionSpills[p].reset();
+            }
 
-                groupContext->mergeThreadMap(destiter->second, it->second);
+            for (auto & group: dest.entries) {
+                NamedRowValue outputRow;
+                std::vector<ExpressionValue> sortFields;
+                if (!evaluateGroup(group, outputRow, &sortFields))
+                    continue;
+                rowsSorted.emplace_back(std::move(sortFields),
+                                        std::move(outputRow),
+                                        std::vector<ExpressionValue>());
             }
+
+            dest = GroupByHashTable();
+            if (!rowsSorted.empty())
+                spiller.spill(rowsSorted);
         }
-    }
 
-    if (destMap.empty() && groupContext->evaluateEmptyGroups && groupBy.clauses.empty())
-    {
-        auto pair = destMap.emplace(RowKey(), GroupMapValue());
-        groupContext->initializePerThreadAggregators(pair.first->second);
+        outputSorted();
+        return;
     }
 
-    //output rows
-    //each entry in the final map should be an output row for us   
-    for (auto it = destMap.begin(); it != destMap.end(); ++it)
-    {
-        RowKey rowKey = it->first;
-        groupContext->aggData = it->second;
+    std::vector<std::shared_ptr<std::vector<GroupEntry *> > >
+        partitions(GROUP_BY_NUM_PARTITIONS);
 
-         // Create the context to evaluate the row name and order by
-        NamedRowValue outputRow;
+    auto mergePartition = [&] (int p)
+        {
+            mergeBuckets(p);
+
+            GroupByHashTable & dest = accum[0][p];
+            partitions[p] = std::make_shared<std::vector<GroupEntry *> >();
+            partitions[p]->reserve(dest.entries.size());
+            for (auto & e: dest.entries)
+                partitions[p]->push_back(&e);
+        };
+
+    if (allowMT) {
+        ML::run_in_parallel(0, GROUP_BY_NUM_PARTITIONS, mergePartition);
+    }
+    else {
+        for (int p = 0;  p < GROUP_BY_NUM_PARTITIONS;  ++p)
+            mergePartition(p);
+    }
 
-        auto rowContext = groupContext->getRowContext(outputRow, rowKey);
+    size_t numGroups = 0;
+    for (auto & p: partitions)
+        numGroups += p->size();
 
-        //Evaluate the HAVING expression
-        ExpressionValue havingResult = boundHaving(rowContext);
+    if (numGroups == 0 && groupContext->evaluateEmptyGroups && groupBy.clauses.empty())
+    {
+        uint64_t hash = groupKeyHash(nullptr, 0);
+        int p = groupKeyPartition(hash);
+        bool inserted;
+        GroupEntry & entry = accum[0][p].find(hash, nullptr, 0, inserted);
+        groupContext->initializePerThreadAggregators(entry.value);
+        partitions[p]->push_back(&entry);
+    }
 
-        if (havingResult.isFalse())
-            continue;
+    // Output the groups in key order, as they always have been
+    auto compareKeys = [] (const GroupEntry * e1, const GroupEntry * e2)
+        {
+            return e1->key < e2->key;
+        };
 
-        outputRow.rowName = RowName(boundRowName(rowContext).toUtf8String());
-        outputRow.rowHash = outputRow.rowName;        
+    std::vector<GroupEntry *> groups = parallelMergeSort(partitions, compareKeys);
 
-        //Evaluating the whole bound select expression
-        ExpressionValue result = boundSelect(rowContext);
-        result.mergeToRowDestructive(outputRow.columns);
+    //output rows
+    //each group should be an output row for us
+    size_t sortedBytes = 0;
+    for (GroupEntry * group: groups)
+    {
+        NamedRowValue outputRow;
 
         //In case of no output ordering, we can early exit
         if (boundOrderBy.empty()) {
+            if (!evaluateGroup(*group, outputRow, nullptr))
+                continue;
+
             ssize_t n = groupsDone.fetch_add(1);
             if (limit != -1 && n >= limit)
                break;
@@ -1477,51 +2162,243 @@ execute(std::function<bool (NamedRowValue & output)> aggregator,
         else
         {
              //Else we add the result to the output rows
-            std::vector<ExpressionValue> sortFields
-            = boundOrderBy.apply(rowContext);
+            std::vector<ExpressionValue> sortFields;
+            if (!evaluateGroup(*group, outputRow, &sortFields))
+                continue;
 
             std::vector<ExpressionValue> calcd;
                 
             rowsSorted.emplace_back(std::move(sortFields),
                                     std::move(outputRow),
                                     std::move(calcd));
+
+            if (budget.limited()) {
+                size_t bytes = estimateMemory(rowsSorted.back());
+                sortedBytes += bytes;
+                budget.add(bytes);
+                if (budget.shouldSpill(sortedBytes)) {
+                    spiller.spill(rowsSorted);
+                    budget.add(-(ssize_t)sortedBytes);
+                    sortedBytes = 0;
+                }
+            }
         }           
     }
 
     if (boundOrderBy.empty())
         return;
 
-    // Compare two rows according to the sort criteria
-    auto compareRows = [&] (const SortedRow & row1,
-                            const SortedRow & row2)
-        {
-            return boundOrderBy.less(std::get<0>(row1),
-                                     std::get<0>(row2));
-        };
+    outputSorted();
+}
 
-    // Sort our output rows
-    std::sort(rowsSorted.begin(), rowsSorted.end(), compareRows);
 
-    auto doSelect = [&] (int rowNum) -> bool
-        {
-            auto & row = std::get<1>(rowsSorted[rowNum]);
+/*****************************************************************************/
+/* BOUND DATASET QUERY                                                       */
+/*****************************************************************************/
 
-            /* Finally, pass to the terminator to continue. */
-            return aggregator(row);
-        };
+namespace {
+
+/// Is this a call to timestamp(), which gives the timestamp of the cell
+/// in a WHEN clause?
+bool isCellTimestamp(const SqlExpression & expr)
+{
+    auto call = dynamic_cast<const FunctionCallWrapper *>(&expr);
+    return call && call->functionName == "timestamp" && call->args.empty();
+}
+
+/// If expr is a constant timestamp, put it in result and return true
+bool getConstantTimestamp(const SqlExpression & expr, Date & result)
+{
+    if (!expr.isConstant())
+        return false;
+    ExpressionValue val = expr.constantValue();
+    if (!val.isTimestamp())
+        return false;
+    result = val.getAtom().toTimestamp();
+    return true;
+}
+
+/** Narrow [earliest, latest] to the range of cell timestamps that can
+    pass the given WHEN condition.  Only conditions made up of
+    comparisons and BETWEEN of timestamp() against constant timestamps,
+    combined with AND, are understood; anything else leaves the range
+    alone, which is always correct.  The bounds are inclusive, even for
+    strict comparisons.
+*/
+void narrowTimeRange(const SqlExpression & when, Date & earliest, Date & latest)
+{
+    if (auto op = dynamic_cast<const BooleanOperatorExpression *>(&when)) {
+        if (op->op == "AND" && op->lhs && op->rhs) {
+            narrowTimeRange(*op->lhs, earliest, latest);
+            narrowTimeRange(*op->rhs, earliest, latest);
+        }
+        return;
+    }
+
+    if (auto between = dynamic_cast<const BetweenExpression *>(&when)) {
+        Date lower, upper;
+        if (!between->notBetween
+            && isCellTimestamp(*between->expr)
+            && getConstantTimestamp(*between->lower, lower)
+            && getConstantTimestamp(*between->upper, upper)) {
+            earliest.setMax(lower);
+            latest.setMin(upper);
+        }
+        return;
+    }
+
+    if (auto compare = dynamic_cast<const ComparisonExpression *>(&when)) {
+        std::string op = compare->op;
+        Date bound;
+        if (!isCellTimestamp(*compare->lhs)
+            || !getConstantTimestamp(*compare->rhs, bound)) {
+            if (!isCellTimestamp(*compare->rhs)
+                || !getConstantTimestamp(*compare->lhs, bound))
+                return;
+
+            // Turn it around so that timestamp() is on the left
+            if (op[0] == '<')
+                op[0] = '>';
+            else if (op[0] == '>')
+                op[0] = '<';
+        }
 
-    // Now select only the required subset of sorted rows
-    if (limit == -1)
-        limit = rowsSorted.size();
+        if (op == ">" || op == ">=")
+            earliest.setMax(bound);
+        else if (op == "<" || op == "<=")
+            latest.setMin(bound);
+        else if (op == "=" || op == "==") {
+            earliest.setMax(bound);
+            latest.setMin(bound);
+        }
+    }
+}
 
-    ExcAssertGreaterEqual(offset, 0);
+/** Return a view of the dataset that skips what the WHEN clause would
+    filter out anyway, or null if there is none.
 
-    ssize_t begin = std::min<ssize_t>(offset, rowsSorted.size());
-    ssize_t end = std::min<ssize_t>(offset + limit, rowsSorted.size());
+    The WHERE clause sees the row before WHEN is applied, so this is only
+    possible when there isn't one.  Similarly, WHEN is evaluated for each
+    cell against the whole row, so it can't refer to any column.  Rows are
+    kept even if all of their cells are skipped, as WHEN doesn't remove
+    rows either.
+*/
+std::shared_ptr<Dataset>
+restrictToWhen(const Dataset & from, const WhenExpression & when,
+               const SqlExpression & where)
+{
+    if (!where.isConstantTrue() || !when.when)
+        return nullptr;
+
+    UnboundEntities unbound = when.when->getUnbound();
+    if (!unbound.vars.empty() || !unbound.wildcards.empty()
+        || !unbound.tables.empty())
+        return nullptr;
+
+    Date earliest = Date::negativeInfinity();
+    Date latest = Date::positiveInfinity();
+    narrowTimeRange(*when.when, earliest, latest);
+
+    if (earliest == Date::negativeInfinity()
+        && latest == Date::positiveInfinity())
+        return nullptr;
+
+    return from.restrictTimeRange(earliest, latest);
+}
 
-    for (unsigned i = begin;  i < end;  ++i) {
-        doSelect(i);
-    } 
+} // file scope
+
+
+BoundDatasetQuery::
+BoundDatasetQuery(const SelectExpression & select,
+                  const Dataset & from,
+                  const Utf8String & alias,
+                  const WhenExpression & when,
+                  const SqlExpression & where,
+                  const OrderByExpression & orderBy,
+                  const TupleExpression & groupBy,
+                  const SqlExpression & having,
+                  const SqlExpression & rowName,
+                  ssize_t offset,
+                  ssize_t limit,
+                  bool allowMT)
+    : select(select),
+      restricted(restrictToWhen(from, when, where)),
+      from(restricted ? *restricted : from),
+      alias(alias), when(when), where(where),
+      orderBy(orderBy), groupBy(groupBy), having(having), rowName(rowName),
+      offset(offset), limit(limit), allowMT(allowMT)
+{
+    ExcAssert(&where);
+    ExcAssert(&having);
+    ExcAssert(&rowName);
+
+    if (!having.isConstantTrue() && groupBy.clauses.empty())
+        throw HttpReturnException(400, "HAVING expression requires a GROUP BY expression");
+
+    aggregators = select.findAggregators();
+    std::vector< std::shared_ptr<SqlExpression> > havingaggregators = having.findAggregators();
+
+    // Do it ungrouped if possible
+    if (groupBy.clauses.empty() && aggregators.empty()) {
+        // MLDB-154: if we have a limit or offset, we probably want a stable ordering
+        // Due to a bug that led to it being always enabled we will always do this
+        selectOrderBy = orderBy;
+        if (limit != -1 || offset != 0 || true) {
+            selectOrderBy.clauses.emplace_back(SqlExpression::parse("rowHash()"), ASC);
+        }
+
+        selectQuery.reset(new BoundSelectQuery(select, from, alias, when, where,
+                                               selectOrderBy,
+                                               { rowName.shallowCopy() }));
+    }
+    else {
+        aggregators.insert(aggregators.end(), havingaggregators.begin(), havingaggregators.end());
+    }
+}
+
+void
+BoundDatasetQuery::
+execute(const std::function<bool (MatrixNamedRow & row)> & onRow)
+{
+    std::mutex lock;
+    bool stopped = false;
+
+    // Pass on a row, unless onRow has already asked us to stop
+    auto output = [&] (MatrixNamedRow & row)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (stopped)
+                return false;
+            if (!onRow(row))
+                stopped = true;
+            return !stopped;
+        };
+
+    if (selectQuery) {
+        std::function<bool (NamedRowValue &, std::vector<ExpressionValue> &)>
+            aggregator = [&] (NamedRowValue & row_,
+                              std::vector<ExpressionValue> & calc)
+            {
+                MatrixNamedRow row = row_.flattenDestructive();
+                row.rowName = RowName(calc.at(0).toUtf8String());
+                row.rowHash = row.rowName;
+                return output(row);
+            };
+
+        selectQuery->execute(aggregator, offset, limit, nullptr);
+    }
+    else {
+        auto aggregator = [&] (NamedRowValue & row_)
+            {
+                MatrixNamedRow row = row_.flattenDestructive();
+                return output(row);
+            };
+
+        BoundGroupByQuery(select, from, alias, when, where, groupBy,
+                          aggregators, having, rowName, orderBy)
+            .execute(aggregator, offset, limit, nullptr, allowMT);
+    }
 }
 
 } // namespace MLDB
@@ -169,9 +169,88 @@ struct BoundGroupByQuery {
     /// The group by query runs on top of a select query
     std::shared_ptr<BoundSelectQuery> subSelect;
 
+    /** If the query only counts, sums or averages columns over the whole
+        dataset, these are the columns, one per calc expression, and the
+        rows are fed from ColumnIndex::forEachNumericBlock() rather than
+        from the sub select where possible.  Empty otherwise.
+    */
+    std::vector<ColumnName> numericColumns;
+
     size_t numBuckets;
 
 };
 
+
+/*****************************************************************************/
+/* BOUND DATASET QUERY                                                       */
+/*****************************************************************************/
+
+/** A whole SELECT statement over a dataset, as run by
+    Dataset::queryStructuredIncremental().  Queries without GROUP BY or
+    aggregators are bound on construction, and can then be executed any
+    number of times (one at a time), which is what allows their plans to
+    be cached.  Grouped queries bind part of themselves as they run, so
+    they are bound on each call to execute().
+
+    The expressions and the dataset must outlive this object.
+*/
+struct BoundDatasetQuery {
+    BoundDatasetQuery(const SelectExpression & select,
+                      const Dataset & from,
+                      const Utf8String & alias,
+                      const WhenExpression & when,
+                      const SqlExpression & where,
+                      const OrderByExpression & orderBy,
+                      const TupleExpression & groupBy,
+                      const SqlExpression & having,
+                      const SqlExpression & rowName,
+                      ssize_t offset,
+                      ssize_t limit,
+                      bool allowMT = true);
+
+    // The bound query refers to selectOrderBy, so it can't be moved
+    BoundDatasetQuery(const BoundDatasetQuery &) = delete;
+    void operator = (const BoundDatasetQuery &) = delete;
+
+    /** Run the query, passing each output row to onRow until it returns
+        false.  onRow is never called from two threads at once.
+    */
+    void execute(const std::function<bool (MatrixNamedRow & row)> & onRow);
+
+    /// Can the query be executed more than once without being rebound?
+    bool reusable() const
+    {
+        return !!selectQuery;
+    }
+
+    const SelectExpression & select;
+
+    /// View of the dataset that leaves out cells that the WHEN clause
+    /// would filter out, if the dataset can provide one
+    std::shared_ptr<Dataset> restricted;
+
+    /// Dataset that the query reads from; the restricted view if there is one
+    const Dataset & from;
+    Utf8String alias;
+    const WhenExpression & when;
+    const SqlExpression & where;
+    const OrderByExpression & orderBy;
+    const TupleExpression & groupBy;
+    const SqlExpression & having;
+    const SqlExpression & rowName;
+    ssize_t offset;
+    ssize_t limit;
+    bool allowMT;
+
+    /// Order by clause of the ungrouped query, with the row hash added
+    OrderByExpression selectOrderBy;
+
+    /// Bound form of the query if it's not grouped
+    std::unique_ptr<BoundSelectQuery> selectQuery;
+
+    /// Aggregators of the select and having clauses if it's grouped
+    std::vector<std::shared_ptr<SqlExpression> > aggregators;
+};
+
 } // namespace MLDB
 } // namespace Datacratic
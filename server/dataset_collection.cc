@@ -18,6 +18,7 @@
 #include "mldb/types/vector_description.h"
 #include "mldb/types/pointer_description.h"
 #include "mldb/types/tuple_description.h"
+#include "mldb/types/json_printing.h"
 
 using namespace std;
 
@@ -67,6 +68,271 @@ registerDatasetType(const Package & package,
                                            docRoute, customRoute, config);
 }
 
+namespace {
+
+/// Amount of output that is accumulated before it's sent as a chunk
+static const size_t QUERY_OUTPUT_CHUNK_SIZE = 64 * 1024;
+
+/** Output of a query that is sent back over a connection as it's produced.
+    JSON is printed to a buffer by the context, which is sent once it holds
+    enough for a chunk.  If the query finishes before that, the output is
+    sent as a normal response; otherwise the first chunk starts a response
+    with chunked transfer encoding.
+*/
+struct HttpQueryOutput {
+    HttpQueryOutput(RestConnection & connection, std::string contentType)
+        : connection(connection), contentType(std::move(contentType)),
+          context(buffer), chunked(false)
+    {
+    }
+
+    /** Send the buffered output if there is enough of it.  Returns false
+        if the other end has gone away, in which case there is no point in
+        producing more output.
+    */
+    bool flushIfFull()
+    {
+        if (buffer.size() >= QUERY_OUTPUT_CHUNK_SIZE)
+            flush();
+        return connection.isConnected();
+    }
+
+    void flush()
+    {
+        if (!chunked) {
+            connection.sendHttpResponseHeader(200, contentType,
+                                              RestConnection::CHUNKED_ENCODING);
+            chunked = true;
+        }
+        if (!buffer.empty())
+            connection.sendPayload(std::move(buffer));
+        buffer.clear();
+    }
+
+    void finish()
+    {
+        if (!chunked) {
+            connection.sendResponse(200, std::move(buffer), contentType);
+            return;
+        }
+        flush();
+        connection.finishResponse();
+    }
+
+    RestConnection & connection;
+    std::string contentType;
+    std::string buffer;
+    StringJsonPrintingContext context;
+    bool chunked;  ///< Has the response been started?
+};
+
+/** Convert a cell for the table format, which has no representation for
+    timestamps, intervals or special floating point values.
+*/
+CellValue toTableCell(CellValue cellValue)
+{
+    if (cellValue.isTimestamp())
+    {
+        //in table format print dates as epoch
+        cellValue = cellValue.coerceToString();
+    }
+    else if (cellValue.isTimeinterval())
+    {
+        //in table format print time intervals as string
+        cellValue = cellValue.coerceToString();
+    }
+    else if (cellValue.isDouble())
+    {
+        //in table format print 'special' floats as string
+        double value = cellValue.toDouble();
+        if (std::isnan(value))
+        {
+            std::string stringVal = std::signbit(value) ? "-NaN" : "NaN";
+            cellValue = CellValue(stringVal);
+        }
+        else if (std::isinf(value))
+        {
+            std::string stringVal = std::signbit(value) ? "-Inf" : "Inf";
+            cellValue = CellValue(stringVal);
+        }                      
+    }
+
+    return cellValue;
+}
+
+/// Row of the table format, with cells as (column number, value)
+struct TableRow {
+    CellValue rowName;
+    CellValue rowHash;
+    std::vector<std::pair<int, CellValue> > cells;
+};
+
+
+/*****************************************************************************/
+/* BINARY QUERY OUTPUT                                                       */
+/*****************************************************************************/
+
+/* The binary format is columnar, with one buffer of values per column and a
+   dictionary for strings, so that clients can decode it straight into
+   arrays.  All numbers are little endian.  It's described in QueryAPI.md:
+
+   header:  "MLDBCOLS" uint32 version, uint64 numRows, uint32 numColumns
+   column:  uint32 nameLength, name (utf-8), uint8 type,
+            validity bitmap of (numRows + 7) / 8 bytes (bit i % 8 of byte
+            i / 8 is set if row i has a value), then the values by type
+*/
+
+static const char BINARY_MAGIC[8] = { 'M', 'L', 'D', 'B', 'C', 'O', 'L', 'S' };
+static const uint32_t BINARY_VERSION = 1;
+
+enum BinaryColumnType : uint8_t {
+    BINARY_NULL = 0,       ///< No values
+    BINARY_INT64 = 1,      ///< numRows int64
+    BINARY_FLOAT64 = 2,    ///< numRows float64
+    BINARY_STRING = 3,     ///< Dictionary, then numRows uint32 indexes into it
+    BINARY_TIMESTAMP = 4,  ///< numRows float64 seconds since the epoch
+    BINARY_JSON = 5        ///< As string, with the JSON of each value
+};
+
+template<typename T>
+void appendBinary(std::string & out, T val)
+{
+    out.append((const char *)&val, sizeof(val));
+}
+
+void appendBinary(std::string & out, const char * data, size_t length)
+{
+    appendBinary(out, (uint32_t)length);
+    out.append(data, length);
+}
+
+/** Choose the type of a column from the types of its values.  Integers
+    that don't fit in an int64 and mixtures of types other than integers
+    and floats can only be represented as JSON.
+*/
+BinaryColumnType binaryColumnType(const std::vector<CellValue> & vals)
+{
+    bool any = false, allInt = true, allNumeric = true;
+    bool allString = true, allTimestamp = true;
+
+    for (auto & v: vals) {
+        if (v.empty())
+            continue;
+        any = true;
+        CellValue::CellType type = v.cellType();
+        // Integers above INT64_MAX would lose precision as a float64,
+        // so they send the column to JSON
+        bool isBigInt = type == CellValue::INTEGER && !v.isInt64();
+        bool isNumeric = type == CellValue::INTEGER || type == CellValue::FLOAT;
+        allInt = allInt && type == CellValue::INTEGER && !isBigInt;
+        allNumeric = allNumeric && isNumeric && !isBigInt;
+        allString = allString && v.isString();
+        allTimestamp = allTimestamp && type == CellValue::TIMESTAMP;
+    }
+
+    if (!any)
+        return BINARY_NULL;
+    if (allInt)
+        return BINARY_INT64;
+    if (allNumeric)
+        return BINARY_FLOAT64;
+    if (allString)
+        return BINARY_STRING;
+    if (allTimestamp)
+        return BINARY_TIMESTAMP;
+    return BINARY_JSON;
+}
+
+/** Write a column of values in the binary format.  flush is called
+    regularly so that large columns are sent in several chunks.
+*/
+template<typename Flush>
+void appendBinaryColumn(std::string & out,
+                        const Utf8String & name,
+                        const std::vector<CellValue> & vals,
+                        Flush flush)
+{
+    BinaryColumnType type = binaryColumnType(vals);
+
+    appendBinary(out, name.rawData(), name.rawLength());
+    appendBinary(out, (uint8_t)type);
+
+    // Validity bitmap
+    for (size_t i = 0;  i < vals.size();  i += 8) {
+        uint8_t bits = 0;
+        for (size_t j = i;  j < i + 8 && j < vals.size();  ++j) {
+            if (!vals[j].empty())
+                bits |= 1 << (j - i);
+        }
+        out += (char)bits;
+    }
+    flush();
+
+    switch (type) {
+    case BINARY_NULL:
+        break;
+
+    case BINARY_INT64:
+        for (auto & v: vals) {
+            appendBinary(out, v.empty() ? (int64_t)0 : v.toInt());
+            flush();
+        }
+        break;
+
+    case BINARY_FLOAT64:
+        for (auto & v: vals) {
+            appendBinary(out, v.empty() ? 0.0 : v.toDouble());
+            flush();
+        }
+        break;
+
+    case BINARY_TIMESTAMP:
+        for (auto & v: vals) {
+            appendBinary(out, v.empty()
+                         ? 0.0 : v.toTimestamp().secondsSinceEpoch());
+            flush();
+        }
+        break;
+
+    case BINARY_STRING:
+    case BINARY_JSON: {
+        // Number the distinct values in order of first appearance
+        std::unordered_map<CellValue, uint32_t> index;
+        std::vector<const CellValue *> dictionary;
+        std::vector<uint32_t> indexes(vals.size(), 0);
+
+        for (size_t i = 0;  i < vals.size();  ++i) {
+            if (vals[i].empty())
+                continue;
+            auto it = index.insert({ vals[i], dictionary.size() });
+            if (it.second)
+                dictionary.push_back(&vals[i]);
+            indexes[i] = it.first->second;
+        }
+
+        appendBinary(out, (uint32_t)dictionary.size());
+        for (auto & v: dictionary) {
+            if (type == BINARY_STRING) {
+                appendBinary(out, v->stringChars(), v->toStringLength());
+            }
+            else {
+                std::string json = jsonEncodeStr(*v);
+                appendBinary(out, json.data(), json.length());
+            }
+            flush();
+        }
+
+        for (uint32_t i: indexes) {
+            appendBinary(out, i);
+            flush();
+        }
+        break;
+    }
+    }
+}
+
+} // file scope
+
 void runHttpQuery(std::function<std::vector<MatrixNamedRow> ()> runQuery,
                   RestConnection & connection,
                   const std::string & format,
@@ -74,169 +340,317 @@ void runHttpQuery(std::function<std::vector<MatrixNamedRow> ()> runQuery,
                   bool rowNames,
                   bool rowHashes)
 {
-    std::vector<MatrixNamedRow> sparseOutput = runQuery();
+    auto runIncremental = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+        {
+            for (auto & row: runQuery()) {
+                if (!onRow(row))
+                    break;
+            }
+        };
+
+    streamHttpQuery(runIncremental, connection, format, createHeaders,
+                    rowNames, rowHashes);
+}
+
+void streamHttpQuery(std::function<void (const std::function<bool (MatrixNamedRow & row)> & onRow)> runQuery,
+                     RestConnection & connection,
+                     const std::string & format,
+                     bool createHeaders,
+                     bool rowNames,
+                     bool rowHashes)
+{
+    HttpQueryOutput output(connection,
+                           format == "binary"
+                           ? "application/octet-stream" : "application/json");
+    StringJsonPrintingContext & context = output.context;
+
+    // Each format writes its output from onRow if it can, or accumulates
+    // what it needs and writes it from onFinish if it depends on all rows
+    std::function<bool (MatrixNamedRow & row)> onRow;
+    std::function<void ()> onFinish;
+
+    // Used by the soa format
+    std::map<ColumnName, std::vector<CellValue> > columnValues;
+    size_t numRows = 0;
+
+    // Used by the table and binary formats
+    std::vector<ColumnName> columns;
+    ML::Lightweight_Hash<ColumnHash, int> columnIndex;
+    std::vector<TableRow> tableRows;
+    std::vector<std::vector<CellValue> > binaryColumns;
 
     if (format == "full" || format == "") {
-        connection.sendResponse(200, jsonEncodeStr(sparseOutput),
-                                "application/json");
+        static auto desc = getDefaultDescriptionSharedT<MatrixNamedRow>();
+
+        context.startArray();
+        onRow = [&] (MatrixNamedRow & row)
+            {
+                context.newArrayElement();
+                desc->printJson(&row, context);
+                return output.flushIfFull();
+            };
+        onFinish = [&] () { context.endArray(); };
     }
     else if (format == "sparse") {
-        std::vector<std::vector<std::pair<ColumnName, CellValue> > > output;
-        output.reserve(sparseOutput.size());
-
-        for (auto & row: sparseOutput) {
-            
-            std::vector<std::pair<ColumnName, CellValue> > rowOut;
-            rowOut.reserve(row.columns.size() + rowNames + rowHashes);
+        static auto desc = getDefaultDescriptionSharedT
+            <std::vector<std::pair<ColumnName, CellValue> > >();
+
+        context.startArray();
+        onRow = [&] (MatrixNamedRow & row)
+            {
+                std::vector<std::pair<ColumnName, CellValue> > rowOut;
+                rowOut.reserve(row.columns.size() + rowNames + rowHashes);
                         
-            if (rowNames)
-                rowOut.emplace_back(ColumnName("_rowName"), row.rowName.toUtf8String());
-            if (rowHashes)
-                rowOut.emplace_back(ColumnName("_rowHash"), row.rowHash.toString());
-
-            for (auto & c: row.columns) {
-                rowOut.emplace_back(std::get<0>(c), std::get<1>(c));
-            }
+                if (rowNames)
+                    rowOut.emplace_back(ColumnName("_rowName"), row.rowName.toUtf8String());
+                if (rowHashes)
+                    rowOut.emplace_back(ColumnName("_rowHash"), row.rowHash.toString());
 
-            std::sort(rowOut.begin() + rowNames + rowHashes, rowOut.end());
+                for (auto & c: row.columns) {
+                    rowOut.emplace_back(std::get<0>(c), std::get<1>(c));
+                }
 
-            output.emplace_back(std::move(rowOut));
-        }
+                std::sort(rowOut.begin() + rowNames + rowHashes, rowOut.end());
 
-        connection.sendResponse(200, jsonEncodeStr(output),
-                                "application/json");
+                context.newArrayElement();
+                desc->printJson(&rowOut, context);
+                return output.flushIfFull();
+            };
+        onFinish = [&] () { context.endArray(); };
     }
     else if (format == "soa") {
-        // Structure of arrays; one array per column
-        std::map<ColumnName, std::vector<CellValue> > output;
-        for (unsigned i = 0;  i < sparseOutput.size();  ++i) {
-            if (rowNames)
-                output[ColumnName("_rowName")]
-                    .push_back(sparseOutput[i].rowName.toUtf8String());
-            if (rowHashes)
-                output[ColumnName("_rowHash")]
-                    .push_back(sparseOutput[i].rowHash.toString());
+        // Structure of arrays; one array per column.  Nothing can be
+        // written until all of the columns are known.
+        onRow = [&] (MatrixNamedRow & row)
+            {
+                if (rowNames)
+                    columnValues[ColumnName("_rowName")]
+                        .push_back(row.rowName.toUtf8String());
+                if (rowHashes)
+                    columnValues[ColumnName("_rowHash")]
+                        .push_back(row.rowHash.toString());
             
-            for (auto & c: sparseOutput[i].columns) {
-                const ColumnName & col = std::get<0>(c);
-                const CellValue & val = std::get<1>(c);
-
-                std::vector<CellValue> & vals = output[col];
-                if (vals.empty())
-                    vals.resize(sparseOutput.size());
-                vals[i] = val;
-            }
-        }
-        connection.sendResponse(200, jsonEncodeStr(output),
-                                "application/json");
+                for (auto & c: row.columns) {
+                    const ColumnName & col = std::get<0>(c);
+                    const CellValue & val = std::get<1>(c);
+
+                    std::vector<CellValue> & vals = columnValues[col];
+                    if (vals.size() <= numRows)
+                        vals.resize(numRows + 1);
+                    vals[numRows] = val;
+                }
+
+                ++numRows;
+                return true;
+            };
+
+        onFinish = [&] ()
+            {
+                static auto desc
+                    = getDefaultDescriptionSharedT<std::vector<CellValue> >();
+
+                context.startObject();
+                for (auto & c: columnValues) {
+                    c.second.resize(numRows);
+                    context.startMember(keyToString(c.first));
+                    desc->printJson(&c.second, context);
+                    std::vector<CellValue>().swap(c.second);
+                    output.flushIfFull();
+                }
+                context.endObject();
+            };
     }
     else if (format == "aos") {
         // Array of structures; one structure per row
-        std::vector<std::map<ColumnName, CellValue> > output;
-        for (unsigned i = 0;  i < sparseOutput.size();  ++i) {
-
-            std::map<ColumnName, CellValue> row;
-
-            if (rowNames)
-                row[ColumnName("_rowName")] = sparseOutput[i].rowName.toUtf8String();
-            if (rowHashes)
-                row[ColumnName("_rowHash")] = sparseOutput[i].rowHash.toString();
-
-            for (auto & c: sparseOutput[i].columns) {
-                const ColumnName & col = std::get<0>(c);
-                const CellValue & val = std::get<1>(c);
-                row[col] = val;
-            }
+        static auto desc
+            = getDefaultDescriptionSharedT<std::map<ColumnName, CellValue> >();
+
+        context.startArray();
+        onRow = [&] (MatrixNamedRow & row)
+            {
+                std::map<ColumnName, CellValue> rowOut;
+
+                if (rowNames)
+                    rowOut[ColumnName("_rowName")] = row.rowName.toUtf8String();
+                if (rowHashes)
+                    rowOut[ColumnName("_rowHash")] = row.rowHash.toString();
+
+                for (auto & c: row.columns) {
+                    const ColumnName & col = std::get<0>(c);
+                    const CellValue & val = std::get<1>(c);
+                    rowOut[col] = val;
+                }
 
-            output.emplace_back(std::move(row));
-        }
-        connection.sendResponse(200, jsonEncodeStr(output),
-                                "application/json");
+                context.newArrayElement();
+                desc->printJson(&rowOut, context);
+                return output.flushIfFull();
+            };
+        onFinish = [&] () { context.endArray(); };
     }
     else if (format == "table") {
         // TODO: the SQL knows what columns could be created... this could
         // be greatly optimized.
 
-        // First, find all columns
-        std::vector<ColumnName> columns;
-        ML::Lightweight_Hash<ColumnHash, int> columnIndex;
-        for (auto & o: sparseOutput) {
-            for (auto & c: o.columns) {
-                auto & columnName = std::get<0>(c);
-                if (columnIndex.insert({columnName, columns.size()}).second) {
-                    columns.push_back(columnName);
+        // The header and the width of the rows depend on all of the columns,
+        // so rows are kept in a compact form until the end.
+        onRow = [&] (MatrixNamedRow & row)
+            {
+                TableRow rowOut;
+                if (rowNames)
+                    rowOut.rowName = row.rowName.toUtf8String();
+                if (rowHashes)
+                    rowOut.rowHash = row.rowHash.toString();
+
+                rowOut.cells.reserve(row.columns.size());
+                for (auto & c: row.columns) {
+                    const ColumnName & columnName = std::get<0>(c);
+                    auto inserted
+                        = columnIndex.insert({columnName, columns.size()});
+                    if (inserted.second)
+                        columns.push_back(columnName);
+                    rowOut.cells.emplace_back(inserted.first->second,
+                                              toTableCell(std::get<1>(c)));
                 }
-            }
-        }
 
-        // Now, send them back
-        std::vector<std::vector<CellValue> > output;
-        output.reserve(sparseOutput.size() + createHeaders);
+                tableRows.emplace_back(std::move(rowOut));
+                return true;
+            };
 
-        if (createHeaders) {
+        onFinish = [&] ()
+            {
+                static auto desc
+                    = getDefaultDescriptionSharedT<std::vector<CellValue> >();
 
-            std::vector<CellValue> headers;
-            if (rowNames)
-                headers.push_back("_rowName");
-            if (rowHashes)
-                headers.push_back("_rowHash");
+                context.startArray();
+
+                if (createHeaders) {
+                    std::vector<CellValue> headers;
+                    if (rowNames)
+                        headers.push_back("_rowName");
+                    if (rowHashes)
+                        headers.push_back("_rowHash");
             
-            for (auto & c: columns) {
-                headers.push_back(c.toUtf8String());
-            }
-            output.push_back(headers);
-        }
+                    for (auto & c: columns) {
+                        headers.push_back(c.toUtf8String());
+                    }
 
-        for (auto & row: sparseOutput) {
-            std::vector<CellValue> rowOut(columns.size() + rowNames + rowHashes);
-            if (rowNames)
-                rowOut[0] = row.rowName.toUtf8String();
-            if (rowHashes)
-                rowOut[rowNames] = row.rowHash.toString();
-
-            for (auto & c: row.columns) {
-                const ColumnName & columnName = std::get<0>(c);
-                CellValue cellValue = std::get<1>(c);
-
-                //Special output options for table format
-                if (cellValue.isTimestamp())
-                {
-                    //in table format print dates as epoch
-                    cellValue = cellValue.coerceToString();
+                    context.newArrayElement();
+                    desc->printJson(&headers, context);
                 }
-                else if (cellValue.isTimeinterval())
-                {
-                    //in table format print time intervals as string
-                    cellValue = cellValue.coerceToString();
+
+                for (auto & row: tableRows) {
+                    std::vector<CellValue> rowOut(columns.size() + rowNames + rowHashes);
+                    if (rowNames)
+                        rowOut[0] = std::move(row.rowName);
+                    if (rowHashes)
+                        rowOut[rowNames] = std::move(row.rowHash);
+
+                    for (auto & c: row.cells)
+                        rowOut[c.first + rowHashes + rowNames] = std::move(c.second);
+                    std::vector<std::pair<int, CellValue> >().swap(row.cells);
+
+                    context.newArrayElement();
+                    desc->printJson(&rowOut, context);
+                    output.flushIfFull();
                 }
-                else if (cellValue.isDouble())
-                {
-                    //in table format print 'special' floats as string
-                    double value = cellValue.toDouble();
-                    if (std::isnan(value))
-                    {
-                        std::string stringVal = std::signbit(value) ? "-NaN" : "NaN";
-                        cellValue = CellValue(stringVal);
+
+                context.endArray();
+            };
+    }
+    else if (format == "binary") {
+        // Columnar, so like soa nothing can be written until all of the
+        // columns are known.  The implicit columns come first, then the
+        // others in the order they first appear.  The implicit columns
+        // are in the index so that a real column with the same name is
+        // caught instead of being written twice.
+        if (rowNames) {
+            columnIndex[ColumnName("_rowName")] = columns.size();
+            columns.push_back(ColumnName("_rowName"));
+            binaryColumns.emplace_back();
+        }
+        if (rowHashes) {
+            columnIndex[ColumnName("_rowHash")] = columns.size();
+            columns.push_back(ColumnName("_rowHash"));
+            binaryColumns.emplace_back();
+        }
+        int numImplicit = columns.size();
+
+        onRow = [&, numImplicit] (MatrixNamedRow & row)
+            {
+                if (rowNames)
+                    binaryColumns[0].push_back(row.rowName.toUtf8String());
+                if (rowHashes)
+                    binaryColumns[rowNames].push_back(row.rowHash.toString());
+
+                for (auto & c: row.columns) {
+                    const ColumnName & columnName = std::get<0>(c);
+                    auto inserted
+                        = columnIndex.insert({columnName, columns.size()});
+                    if (inserted.second) {
+                        columns.push_back(columnName);
+                        binaryColumns.emplace_back();
                     }
-                    else if (std::isinf(value))
-                    {
-                        std::string stringVal = std::signbit(value) ? "-Inf" : "Inf";
-                        cellValue = CellValue(stringVal);
-                    }                      
+                    else if (inserted.first->second < numImplicit) {
+                        // Nothing has been written yet, so this is a
+                        // normal error response
+                        throw HttpReturnException
+                            (400, "Column '" + columnName.toUtf8String()
+                             + "' has the same name as an implicit column "
+                             "of the binary format; rename it or turn off "
+                             "rowNames and rowHashes");
+                    }
+
+                    auto & vals = binaryColumns[inserted.first->second];
+                    if (vals.size() <= numRows)
+                        vals.resize(numRows + 1);
+                    vals[numRows] = std::get<1>(c);
                 }
 
-                rowOut[columnIndex[columnName] + rowHashes + rowNames] = std::move(cellValue);
-            }
+                ++numRows;
+                return true;
+            };
 
-            output.push_back(rowOut);
-        }
+        onFinish = [&] ()
+            {
+                std::string & out = output.buffer;
+                out.append(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+                appendBinary(out, BINARY_VERSION);
+                appendBinary(out, (uint64_t)numRows);
+                appendBinary(out, (uint32_t)columns.size());
 
-        connection.sendResponse(200, jsonEncodeStr(output),
-                                "application/json");
+                auto flush = [&] ()
+                    {
+                        if (out.size() >= QUERY_OUTPUT_CHUNK_SIZE)
+                            output.flush();
+                    };
+
+                for (unsigned i = 0;  i < columns.size();  ++i) {
+                    binaryColumns[i].resize(numRows);
+                    appendBinaryColumn(out, columns[i].toUtf8String(),
+                                       binaryColumns[i], flush);
+                    std::vector<CellValue>().swap(binaryColumns[i]);
+                }
+            };
     }
     else {
         connection.sendErrorResponse(400, "Unknown output format '" + format + "'");
+        return;
     }
+
+    try {
+        runQuery(onRow);
+        onFinish();
+    } catch (const std::exception & exc) {
+        // Until the response is started, errors are returned as normal
+        if (!output.chunked)
+            throw;
+        cerr << "error after query output was started; response is "
+             << "aborted: " << exc.what() << endl;
+        connection.abortResponse(exc.what());
+        return;
+    }
+
+    output.finish();
 }
 
 
@@ -607,14 +1021,14 @@ queryStructured(const Dataset * dataset,
     //cerr << "limit = " << limit << endl;
     //cerr << "offset = " << offset << endl;
 
-    auto runQuery = [&] ()
+    auto runQuery = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
         {
-            return dataset->queryStructured
-                (selectParsed, whenParsed, *whereParsed, orderByParsed,
+            dataset->queryStructuredIncremental
+                (onRow, selectParsed, whenParsed, *whereParsed, orderByParsed,
                  groupByParsed, *havingParsed, *rowNameParsed, offset, limit);
         };
     
-    runHttpQuery(runQuery, connection, format, createHeaders,rowNames, rowHashes);
+    streamHttpQuery(runQuery, connection, format, createHeaders,rowNames, rowHashes);
 }
 
 } // namespace MLDB
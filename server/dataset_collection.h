@@ -33,6 +33,21 @@ void runHttpQuery(std::function<std::vector<MatrixNamedRow> ()> runQuery,
                   bool createHeaders,
                   bool rowNames,
                   bool rowHashes);
+
+/** Same, but the query (run by calling the given function) passes each
+    row of output to the function it's given as soon as it's available, and
+    the results are sent back as they are produced.  Once there is more
+    output than fits in a single chunk, it is sent with HTTP chunked
+    transfer encoding; errors after that point abort the response, closing
+    the connection before the final chunk so the client sees that it is
+    incomplete.
+*/
+void streamHttpQuery(std::function<void (const std::function<bool (MatrixNamedRow & row)> & onRow)> runQuery,
+                     RestConnection & connection,
+                     const std::string & format,
+                     bool createHeaders,
+                     bool rowNames,
+                     bool rowHashes);
                       
 
 /*****************************************************************************/
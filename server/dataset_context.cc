@@ -21,6 +21,84 @@ namespace Datacratic {
 namespace MLDB {
 
 
+/*****************************************************************************/
+/* BINDING DEPENDENCIES                                                      */
+/*****************************************************************************/
+
+namespace {
+
+/// Dependencies being recorded by this thread, if any
+__thread BindingDependencies * currentDependencies = nullptr;
+
+} // file scope
+
+bool
+BindingDependencies::
+current(const MldbServer * server) const
+{
+    if (unrepeatable)
+        return false;
+
+    for (auto & d: dependencies) {
+        if (d.function) {
+            auto entry = server->functions->tryGetExistingEntry(d.name);
+            if (entry.get() != d.function.get())
+                return false;
+        }
+        else {
+            auto entry = server->datasets->tryGetExistingEntry(d.name);
+            if (entry.get() != d.dataset.get()
+                || d.dataset->getCommitGeneration() != d.generation)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void
+BindingDependencies::
+recordFunction(const Utf8String & name,
+               const std::shared_ptr<Function> & function)
+{
+    if (!currentDependencies)
+        return;
+    currentDependencies->dependencies.push_back({ name, function, nullptr, 0 });
+}
+
+void
+BindingDependencies::
+recordDataset(const Utf8String & name,
+              const std::shared_ptr<Dataset> & dataset)
+{
+    if (!currentDependencies)
+        return;
+    currentDependencies->dependencies
+        .push_back({ name, nullptr, dataset, dataset->getCommitGeneration() });
+}
+
+void
+BindingDependencies::
+recordUnrepeatable()
+{
+    if (currentDependencies)
+        currentDependencies->unrepeatable = true;
+}
+
+RecordBindingDependencies::
+RecordBindingDependencies(BindingDependencies & dependencies)
+    : previous(currentDependencies)
+{
+    currentDependencies = &dependencies;
+}
+
+RecordBindingDependencies::
+~RecordBindingDependencies()
+{
+    currentDependencies = previous;
+}
+
+
 /*****************************************************************************/
 /* ROW EXPRESSION MLDB CONTEXT                                               */
 /*****************************************************************************/
@@ -45,20 +123,25 @@ std::shared_ptr<Function>
 SqlExpressionMldbContext::
 doGetFunctionEntity(const Utf8String & functionName)
 {
-    return mldb->functions->getExistingEntity(functionName.rawString());
+    auto result = mldb->functions->getExistingEntity(functionName.rawString());
+    BindingDependencies::recordFunction(functionName, result);
+    return result;
 }
 
 std::shared_ptr<Dataset>
 SqlExpressionMldbContext::
 doGetDataset(const Utf8String & datasetName)
 {
-    return mldb->datasets->getExistingEntity(datasetName.rawString());
+    auto result = mldb->datasets->getExistingEntity(datasetName.rawString());
+    BindingDependencies::recordDataset(datasetName, result);
+    return result;
 }
 
 std::shared_ptr<Dataset>
 SqlExpressionMldbContext::
 doGetDatasetFromConfig(const Any & datasetConfig)
 {
+    BindingDependencies::recordUnrepeatable();
     return obtainDataset(mldb, datasetConfig.convert<PolyConfig>());
 }
 
@@ -80,6 +163,13 @@ getMldbServer() const
     return mldb;
 }
 
+ssize_t
+SqlExpressionMldbContext::
+getHashJoinMinRows() const
+{
+    return mldb->getHashJoinMinRows();
+}
+
 
 
 /*****************************************************************************/
@@ -279,19 +369,22 @@ resolveTableName(const Utf8String& variable) const
     return resolveTableName(variable, resolvedTableName);
 }
 
+ColumnName
+SqlExpressionDatasetContext::
+getVariableColumnName(const Utf8String & variableName) const
+{
+    if (!childaliases.empty())
+        return ColumnName(resolveTableName(variableName));
+    else
+        return ColumnName(removeQuotes(removeTableName(variableName)));
+}
+
 VariableGetter
 SqlExpressionDatasetContext::
 doGetVariable(const Utf8String & tableName,
               const Utf8String & variableName)
 {   
-    Utf8String simplifiedVariableName;
-    
-    if (!childaliases.empty())
-        simplifiedVariableName = resolveTableName(variableName);
-    else
-        simplifiedVariableName = removeQuotes(removeTableName(variableName));
-
-    ColumnName columnName(simplifiedVariableName);
+    ColumnName columnName = getVariableColumnName(variableName);
 
     return {[=] (const SqlRowScope & context,
                  ExpressionValue & storage,
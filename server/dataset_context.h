@@ -16,6 +16,61 @@ namespace Datacratic {
 namespace MLDB {
 
 struct BoundTableExpression;
+struct MldbServer;
+
+
+/*****************************************************************************/
+/* BINDING DEPENDENCIES                                                      */
+/*****************************************************************************/
+
+/** Functions and datasets that were looked up while binding an expression.
+    A bound expression holds on to them, so it can only be reused while
+    the names still refer to the same entities and the datasets haven't
+    been committed to since.
+*/
+
+struct BindingDependencies {
+    struct Dependency {
+        Utf8String name;
+        std::shared_ptr<Function> function;
+        std::shared_ptr<Dataset> dataset;
+        uint64_t generation;
+    };
+
+    std::vector<Dependency> dependencies;
+
+    /// A dataset was created from a configuration.  That happens afresh
+    /// each time the expression is bound, so it can never be reused.
+    bool unrepeatable = false;
+
+    /** Are all of the dependencies still current?  The generations of
+        the datasets are read before binding, so that a commit during the
+        bind makes the dependencies stale rather than wrong.
+    */
+    bool current(const MldbServer * server) const;
+
+    /// Record a lookup made on this thread, if it's being recorded
+    static void recordFunction(const Utf8String & name,
+                               const std::shared_ptr<Function> & function);
+    static void recordDataset(const Utf8String & name,
+                              const std::shared_ptr<Dataset> & dataset);
+    static void recordUnrepeatable();
+};
+
+/** Records the lookups that binding does on this thread into the given
+    dependencies, for as long as it exists.
+*/
+struct RecordBindingDependencies {
+    RecordBindingDependencies(BindingDependencies & dependencies);
+    ~RecordBindingDependencies();
+
+    RecordBindingDependencies(const RecordBindingDependencies &) = delete;
+    void operator = (const RecordBindingDependencies &) = delete;
+
+private:
+    BindingDependencies * previous;
+};
+
 
 /*****************************************************************************/
 /* SQL EXPRESSION MLDB CONTEXT                                               */
@@ -47,6 +102,8 @@ struct SqlExpressionMldbContext: public SqlBindingScope {
     doGetTable(const Utf8String & tableName);
 
     virtual MldbServer * getMldbServer() const;
+
+    virtual ssize_t getHashJoinMinRows() const;
 };
 
 
@@ -84,6 +141,10 @@ struct SqlExpressionDatasetContext: public SqlExpressionMldbContext {
     virtual VariableGetter doGetVariable(const Utf8String & tableName,
                                          const Utf8String & variableName);
 
+    /// Return the dataset column that doGetVariable() reads for the
+    /// given variable name
+    ColumnName getVariableColumnName(const Utf8String & variableName) const;
+
     GetAllColumnsOutput
     doGetAllColumns(const Utf8String & tableName,
                     std::function<Utf8String (const Utf8String &)> keep);
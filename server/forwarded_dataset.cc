@@ -121,6 +121,14 @@ commit()
     underlying->commit();
 }
 
+uint64_t
+ForwardedDataset::
+getCommitGeneration() const
+{
+    ExcAssert(underlying);
+    return underlying->getCommitGeneration();
+}
+
 std::vector<MatrixNamedRow>
 ForwardedDataset::
 queryStructured(const SelectExpression & select,
@@ -140,6 +148,27 @@ queryStructured(const SelectExpression & select,
             groupBy, having, rowName, offset, limit, alias, allowMT);
 }
 
+void
+ForwardedDataset::
+queryStructuredIncremental(const std::function<bool (MatrixNamedRow & row)> & onRow,
+                           const SelectExpression & select,
+                           const WhenExpression & when,
+                           const SqlExpression & where,
+                           const OrderByExpression & orderBy,
+                           const TupleExpression & groupBy,
+                           const SqlExpression & having,
+                           const SqlExpression & rowName,
+                           ssize_t offset,
+                           ssize_t limit,
+                           Utf8String alias,
+                           bool allowMT) const
+{
+    ExcAssert(underlying);
+    underlying->queryStructuredIncremental(onRow, select, when, where,
+                                           orderBy, groupBy, having, rowName,
+                                           offset, limit, alias, allowMT);
+}
+
 std::vector<MatrixNamedRow>
 ForwardedDataset::
 queryString(const Utf8String & query) const
@@ -227,6 +256,14 @@ getTimestampRange() const
     return underlying->getTimestampRange();
 }
 
+std::shared_ptr<Dataset>
+ForwardedDataset::
+restrictTimeRange(Date earliest, Date latest) const
+{
+    ExcAssert(underlying);
+    return underlying->restrictTimeRange(earliest, latest);
+}
+
 Date
 ForwardedDataset::
 quantizeTimestamp(Date timestamp) const
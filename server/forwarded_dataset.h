@@ -57,6 +57,8 @@ struct ForwardedDataset: public Dataset {
 
     virtual void commit();
 
+    virtual uint64_t getCommitGeneration() const;
+
     virtual std::vector<MatrixNamedRow>
     queryStructured(const SelectExpression & select,
                     const WhenExpression & when,
@@ -70,6 +72,20 @@ struct ForwardedDataset: public Dataset {
                     Utf8String alias = "",
                     bool allowMT = true) const;
 
+    virtual void
+    queryStructuredIncremental(const std::function<bool (MatrixNamedRow & row)> & onRow,
+                               const SelectExpression & select,
+                               const WhenExpression & when,
+                               const SqlExpression & where,
+                               const OrderByExpression & orderBy,
+                               const TupleExpression & groupBy,
+                               const SqlExpression & having,
+                               const SqlExpression & rowName,
+                               ssize_t offset,
+                               ssize_t limit,
+                               Utf8String alias = "",
+                               bool allowMT = true) const;
+
     virtual std::vector<MatrixNamedRow>
     queryString(const Utf8String & query) const;
     
@@ -110,6 +126,8 @@ struct ForwardedDataset: public Dataset {
     virtual void getChildAliases(std::vector<Utf8String>&) const;
 
     virtual std::pair<Date, Date> getTimestampRange() const;
+    virtual std::shared_ptr<Dataset>
+    restrictTimeRange(Date earliest, Date latest) const;
     virtual Date quantizeTimestamp(Date timestamp) const;
 
     virtual std::shared_ptr<MatrixView> getMatrixView() const;
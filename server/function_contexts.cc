@@ -13,6 +13,7 @@
 #include "mldb/types/basic_value_descriptions.h"
 #include "mldb/server/mldb_server.h"
 #include "mldb/server/function_collection.h"
+#include "mldb/server/dataset_context.h"
 
 using namespace std;
 
@@ -279,7 +280,9 @@ std::shared_ptr<Function>
 FunctionExpressionContext::
 doGetFunctionEntity(const Utf8String & functionName)
 {
-    return mldb->functions->getExistingEntity(functionName.rawString());
+    auto result = mldb->functions->getExistingEntity(functionName.rawString());
+    BindingDependencies::recordFunction(functionName, result);
+    return result;
 }
 
 Utf8String 
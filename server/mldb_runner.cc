@@ -16,6 +16,7 @@
 #include "mldb/arch/futex.h"
 #include "mldb/server/mldb_server.h"
 #include "mldb/server/plugin_resource.h"
+#include "mldb/sql/sql_expression.h"
 #include "mldb/http/http_rest_proxy.h"
 #include "mldb/credentials/credentials_daemon.h"
 #include "mldb/vfs/filter_streams.h"
@@ -106,6 +107,8 @@ int main(int argc, char ** argv)
     bool dontExitAfterScript = false;
 
     string cacheDir;
+    size_t queryMemoryLimitMb = 0;
+    ssize_t hashJoinMinRows = SqlBindingScope::DEFAULT_HASH_JOIN_MIN_ROWS;
 
 #if 0
     string peerListenPort = "18000-19000";
@@ -155,6 +158,15 @@ int main(int argc, char ** argv)
          "directory to serve documentation from")
         ("cache-dir", value(&cacheDir),
          "Cache directory to memory map large files and store downloads")
+        ("query-memory-limit", value(&queryMemoryLimitMb),
+         "Megabytes of rows that a query may hold in memory while sorting "
+         "or grouping before spilling them to the cache directory "
+         "(0 for no limit)")
+        ("hash-join-min-rows",
+         value(&hashJoinMinRows)->default_value(hashJoinMinRows),
+         "Equijoins with a side of at least this many rows are done as hash "
+         "joins if the other side is known to be smaller (0 to always use "
+         "merge joins)")
         
 #if 0
         ("peer-listen-port,l",
@@ -318,6 +330,9 @@ int main(int argc, char ** argv)
         server.setCacheDirectory(cacheDir);
     }
 
+    server.setQueryMemoryLimit(queryMemoryLimitMb * 1024 * 1024);
+    server.setHashJoinMinRows(hashJoinMinRows);
+
     // Scan each of our plugin directories
     for (auto & d: pluginDirectory) {
         server.scanPlugins(d);
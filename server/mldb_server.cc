@@ -28,7 +28,9 @@
 #include "mldb/vfs/fs_utils.h"
 #include "mldb/vfs/filter_streams.h"
 #include "mldb/server/analytics.h"
+#include "mldb/server/query_plan_cache.h"
 #include "mldb/types/meta_value_description.h"
+#include "mldb/jml/utils/worker_task.h"
 
 
 using namespace std;
@@ -68,7 +70,10 @@ MldbServer(const std::string & serviceName,
            bool enableAccessLog)
     : ServicePeer(serviceName, "MLDB", "global", enableAccessLog),
       EventRecorder(serviceName, std::make_shared<NullEventService>()),
-      versionNode(nullptr)
+      queryPlanCache(std::make_shared<QueryPlanCache>()),
+      versionNode(nullptr),
+      queryMemoryLimit_(0),
+      hashJoinMinRows_(SqlBindingScope::DEFAULT_HASH_JOIN_MIN_ROWS)
 {
     // Don't allow URIs without a scheme
     setGlobalAcceptUrisWithoutScheme(false);
@@ -183,6 +188,12 @@ initRoutes()
                            this,
                            RestParam<std::string>("type", "The type to look up"));
     
+    addRouteSyncJsonReturn(versionNode, "/queryPlanCache", {"GET"},
+                           "Get statistics of the query plan cache",
+                           "Size of the cache and its hit and miss counters",
+                           &MldbServer::getQueryPlanCacheStats,
+                           this);
+
     versionNode.addRoute("/shutdown", "POST", "Shutdown the service",
                          handleShutdown,
                          Json::Value());
@@ -204,7 +215,18 @@ initRoutes()
                                          true),
                   RestParamDefault<bool>("rowHashes",
                                          "Do we include row hashes in output",
-                                         false));
+                                         false),
+                  RestParamDefault<std::string>("priority",
+                                                "Priority of the query's work "
+                                                "relative to other queries "
+                                                "and procedures: low, normal "
+                                                "or high",
+                                                "normal"),
+                  RestParamDefault<int>("maxParallelism",
+                                        "Maximum number of threads the "
+                                        "query can use at once, or -1 for "
+                                        "no limit",
+                                        -1));
     
     this->versionNode = &versionNode;
 }
@@ -216,31 +238,41 @@ runHttpQuery(const Utf8String& query,
              const std::string & format,
              bool createHeaders,
              bool rowNames,
-             bool rowHashes) const
+             bool rowHashes,
+             const std::string & priority,
+             int maxParallelism) const
 {
-    auto stm = SelectStatement::parse(query.rawString());
+    RunPriority runPriority;
+    try {
+        runPriority = jsonDecode<RunPriority>(Json::Value(priority));
+    } catch (const std::exception &) {
+        throw HttpReturnException(400, "Invalid query priority '" + priority
+                                  + "'; must be low, normal or high");
+    }
+    validateMaxParallelism(maxParallelism);
+
+    // Schedule the query's work in the thread pool with its priority
+    ML::Job_Class_Guard jobClass((ML::Job_Priority)runPriority,
+                                 maxParallelism);
+
+    auto stm = queryPlanCache->getStatement(query);
     SqlExpressionMldbContext mldbContext(this);
 
-    BoundTableExpression table = stm.from->bind(mldbContext);
+    BoundTableExpression table = stm->from->bind(mldbContext);
     
     if (table.dataset) {
-        auto runQuery = [&] ()
+        // Rows are sent back as the query produces them
+        auto runQuery = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
             {
-                return table.dataset->queryStructured(stm.select, stm.when,
-                                                      *stm.where,
-                                                      stm.orderBy, stm.groupBy,
-                                                      *stm.having,
-                                                      *stm.rowName,
-                                                      stm.offset, stm.limit, 
-                                                      table.asName);
+                queryPlanCache->runQuery(query, stm, table, onRow);
             };
     
-        MLDB::runHttpQuery(runQuery, connection, format, createHeaders,rowNames, rowHashes);
+        MLDB::streamHttpQuery(runQuery, connection, format, createHeaders,rowNames, rowHashes);
     }
     else {
         auto runQuery = [&] () -> std::vector<MatrixNamedRow>
             {
-                return queryWithoutDataset(stm, mldbContext);
+                return queryWithoutDataset(*stm, mldbContext);
             };
 
         MLDB::runHttpQuery(runQuery, connection, format, createHeaders,rowNames, rowHashes);
@@ -251,26 +283,36 @@ std::vector<MatrixNamedRow>
 MldbServer::
 query(const Utf8String& query) const
 {
-    auto stm = SelectStatement::parse(query.rawString());
+    auto stm = queryPlanCache->getStatement(query);
 
     SqlExpressionMldbContext mldbContext(this);
 
-    BoundTableExpression table = stm.from->bind(mldbContext);
+    BoundTableExpression table = stm->from->bind(mldbContext);
     
     if (table.dataset) {
-        return table.dataset->queryStructured(stm.select, stm.when,
-                                              *stm.where,
-                                              stm.orderBy, stm.groupBy,
-                                              *stm.having,
-                                              *stm.rowName,
-                                              stm.offset, stm.limit, 
-                                              table.asName);
+        std::vector<MatrixNamedRow> output;
+
+        auto onRow = [&] (MatrixNamedRow & row)
+            {
+                output.emplace_back(std::move(row));
+                return true;
+            };
+
+        queryPlanCache->runQuery(query, stm, table, onRow);
+        return output;
     }
     else {
-        return queryWithoutDataset(stm, mldbContext);
+        return queryWithoutDataset(*stm, mldbContext);
     }
 }
 
+Json::Value
+MldbServer::
+getQueryPlanCacheStats() const
+{
+    return queryPlanCache->getStats();
+}
+
 Json::Value
 MldbServer::
 getTypeInfo(const std::string & typeName)
@@ -512,6 +554,34 @@ getCacheDirectory() const
     return cacheDirectory_;
 }
 
+void
+MldbServer::
+setQueryMemoryLimit(size_t bytes)
+{
+    queryMemoryLimit_ = bytes;
+}
+
+size_t
+MldbServer::
+getQueryMemoryLimit() const
+{
+    return queryMemoryLimit_;
+}
+
+void
+MldbServer::
+setHashJoinMinRows(ssize_t rows)
+{
+    hashJoinMinRows_ = rows;
+}
+
+ssize_t
+MldbServer::
+getHashJoinMinRows() const
+{
+    return hashJoinMinRows_;
+}
+
 
 namespace {
 struct OnInit {
@@ -28,6 +28,7 @@ struct DatasetCollection;
 struct ProcedureCollection;
 struct FunctionCollection;
 struct TypeClassCollection;
+struct QueryPlanCache;
 
 struct Plugin;
 struct Dataset;
@@ -78,6 +79,12 @@ struct MldbServer: public ServicePeer, public EventRecorder {
     */
     void setCacheDirectory(const std::string & dir);
 
+    /** Set the number of bytes of rows or groups that a single query may
+        hold in memory while sorting or grouping, beyond which they are
+        spilled to the cache directory.  Zero means no limit.
+    */
+    void setQueryMemoryLimit(size_t bytes);
+
     /** Initialize the server in standalone mode, with the given
         configuration path.  No remote
         discovery or message passing is supported in this configuration.
@@ -103,23 +110,33 @@ struct MldbServer: public ServicePeer, public EventRecorder {
     std::shared_ptr<FunctionCollection> functions;
     std::shared_ptr<TypeClassCollection> types;
 
+    /// Parsed and bound plans of recent queries
+    std::shared_ptr<QueryPlanCache> queryPlanCache;
+
     /** Parse and perform an SQL query. */
     std::vector<MatrixNamedRow> query(const Utf8String& query) const;
 
     /** Parse and perform an SQL query, returning the results
-        on the given HTTP connection.
+        on the given HTTP connection.  The query's work is scheduled with
+        the given priority and maximum number of threads.
     */
     void runHttpQuery(const Utf8String& query,
                       RestConnection & connection,
                       const std::string & format,
                       bool createHeaders,
                       bool rowNames,
-                      bool rowHashes) const;
+                      bool rowHashes,
+                      const std::string & priority,
+                      int maxParallelism) const;
 
     /** Get a type info structure for the given type. */
     Json::Value
     getTypeInfo(const std::string & typeName);
 
+    /** Get the size and hit and miss counters of the query plan cache. */
+    Json::Value
+    getQueryPlanCacheStats() const;
+
     /** Get the documentation path for the given package.  This will look
         at the working directory of the package that loaded it.
     */
@@ -130,6 +147,18 @@ struct MldbServer: public ServicePeer, public EventRecorder {
     */
     std::string getCacheDirectory() const;
 
+    /** Get the memory limit of a single query, or zero if unlimited. */
+    size_t getQueryMemoryLimit() const;
+
+    /** Set the number of rows above which an equijoin is done as a hash
+        join, provided that the other side is known to have fewer rows
+        than that.  Zero or less means that hash joins are never used.
+    */
+    void setHashJoinMinRows(ssize_t rows);
+
+    /** Get the number of rows above which equijoins are hash joins. */
+    ssize_t getHashJoinMinRows() const;
+
     std::string httpBoundAddress;
 
 private:
@@ -141,6 +170,8 @@ private:
                          bool hideInternalEntities);
     RestRequestRouter * versionNode;
     std::string cacheDirectory_;
+    size_t queryMemoryLimit_;
+    ssize_t hashJoinMinRows_;
 };
 
 } // namespace MLDB
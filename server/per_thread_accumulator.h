@@ -8,8 +8,12 @@
     at the end.
 */
 
+#pragma once
+
 #include "mldb/arch/thread_specific.h"
+#include "mldb/jml/utils/worker_task.h"
 #include <functional>
+#include <unordered_map>
 
 namespace Datacratic {
 namespace MLDB {
@@ -69,5 +73,77 @@ struct PerThreadAccumulator {
     }
 };
 
+
+/*****************************************************************************/
+/* SHARDED MAP                                                               */
+/*****************************************************************************/
+
+/** Hash map that is split into shards by the hash of the key.  When each
+    thread accumulates into its own map, the maps can then be merged in
+    parallel, one shard at a time; see mergeShards().
+*/
+
+template<typename Key, typename Value, typename Hash = std::hash<Key> >
+struct ShardedMap {
+    enum { NUM_SHARDS = 64 };
+
+    typedef std::unordered_map<Key, Value, Hash> Shard;
+
+    ShardedMap()
+        : shards(NUM_SHARDS)
+    {
+    }
+
+    Value & operator [] (const Key & key)
+    {
+        return shards[shardFor(key)][key];
+    }
+
+    static size_t shardFor(const Key & key)
+    {
+        // High bits, as the shard's own buckets use the low ones
+        return (Hash()(key) >> 32) % NUM_SHARDS;
+    }
+
+    std::vector<Shard> shards;
+};
+
+/** Merge the sharded maps accumulated by each thread.  Each shard is merged
+    into that of the first thread as a separate job, using merge(into, from)
+    for keys that occur in more than one thread, after which
+    onShard(shardNumber, shard) is called for it.  onShard is called from
+    multiple threads, but only once for each shard.
+*/
+template<typename Key, typename Value, typename Hash,
+         typename Merge, typename OnShard>
+void mergeShards(PerThreadAccumulator<ShardedMap<Key, Value, Hash> > & accum,
+                 Merge merge, OnShard onShard)
+{
+    typedef ShardedMap<Key, Value, Hash> Map;
+
+    std::vector<Map *> maps;
+    accum.forEach([&] (Map * map) { maps.push_back(map); });
+    if (maps.empty())
+        return;
+
+    auto doShard = [&] (int i)
+        {
+            auto & result = maps[0]->shards[i];
+            for (unsigned t = 1;  t < maps.size();  ++t) {
+                auto & shard = maps[t]->shards[i];
+                for (auto & entry: shard) {
+                    auto it = result.find(entry.first);
+                    if (it == result.end())
+                        result.emplace(std::move(entry));
+                    else merge(it->second, entry.second);
+                }
+                shard.clear();
+            }
+            onShard(i, result);
+        };
+
+    ML::run_in_parallel(0, (int)Map::NUM_SHARDS, doShard);
+}
+
 } // namespace MLDB
 } // namespace Datacratic
@@ -0,0 +1,358 @@
+/** query_plan_cache.cc
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Cache of parsed and bound query plans.
+*/
+
+#include "mldb/server/query_plan_cache.h"
+#include "mldb/server/bound_queries.h"
+#include "mldb/server/dataset_context.h"
+#include "mldb/core/dataset.h"
+#include "mldb/sql/table_expression_operations.h"
+#include "mldb/base/exc_assert.h"
+#include <cctype>
+
+
+using namespace std;
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* QUERY PLAN CACHE                                                          */
+/*****************************************************************************/
+
+/// A bound query, along with everything that it refers to
+struct QueryPlanCache::Plan {
+    std::shared_ptr<const SelectStatement> statement;
+    std::shared_ptr<Dataset> dataset;
+    uint64_t generation;
+
+    /// Functions and other datasets that binding looked up
+    BindingDependencies dependencies;
+
+    std::unique_ptr<BoundDatasetQuery> query;
+};
+
+struct QueryPlanCache::Entry {
+    std::list<std::string>::iterator lruPos;
+    std::shared_ptr<const SelectStatement> statement;
+
+    /// Plan that's ready to run, or null if there is none or it's
+    /// checked out
+    std::unique_ptr<Plan> plan;
+};
+
+namespace {
+
+/// Plans are only kept for queries over a dataset that's looked up by
+/// name; anything else creates a new dataset each time it's bound.
+bool isNamedDataset(const SelectStatement & statement)
+{
+    auto from = dynamic_cast<const DatasetExpression *>(statement.from.get());
+    return from && from->config.empty();
+}
+
+} // file scope
+
+QueryPlanCache::
+QueryPlanCache(size_t capacity)
+    : capacity(capacity),
+      statementHits(0), statementMisses(0),
+      planHits(0), planMisses(0), planInvalidations(0),
+      evictions(0), functionHits(0), functionMisses(0)
+{
+}
+
+QueryPlanCache::
+~QueryPlanCache()
+{
+}
+
+std::string
+QueryPlanCache::
+normalize(const std::string & query)
+{
+    std::string result;
+    result.reserve(query.size());
+
+    char quote = 0;
+    bool pendingSpace = false;
+
+    for (size_t i = 0;  i < query.size();  ++i) {
+        char c = query[i];
+
+        if (quote) {
+            // A doubled quote ends and restarts the string, which gives
+            // the right answer without special handling.
+            result += c;
+            if (c == quote)
+                quote = 0;
+            continue;
+        }
+
+        if (isspace((unsigned char)c)) {
+            pendingSpace = !result.empty();
+            continue;
+        }
+
+        if (i + 1 < query.size()
+            && ((c == '-' && query[i + 1] == '-')
+                || (c == '/' && query[i + 1] == '*')))
+            return query;
+
+        if (pendingSpace) {
+            result += ' ';
+            pendingSpace = false;
+        }
+
+        result += c;
+        if (c == '\'' || c == '"')
+            quote = c;
+    }
+
+    return result;
+}
+
+QueryPlanCache::Entry *
+QueryPlanCache::
+touch(const std::string & key)
+{
+    auto it = entries.find(key);
+    if (it == entries.end())
+        return nullptr;
+    lru.splice(lru.begin(), lru, it->second->lruPos);
+    return it->second.get();
+}
+
+void
+QueryPlanCache::
+evict(size_t maxEntries, std::vector<std::unique_ptr<Entry> > & evicted)
+{
+    while (entries.size() > maxEntries) {
+        auto it = entries.find(lru.back());
+        evicted.emplace_back(std::move(it->second));
+        entries.erase(it);
+        lru.pop_back();
+        ++evictions;
+    }
+}
+
+QueryPlanCache::Entry *
+QueryPlanCache::
+insert(const std::string & key,
+       std::shared_ptr<const SelectStatement> statement,
+       std::vector<std::unique_ptr<Entry> > & evicted)
+{
+    if (capacity == 0)
+        return nullptr;
+
+    evict(capacity - 1, evicted);
+
+    lru.push_front(key);
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->lruPos = lru.begin();
+    entry->statement = std::move(statement);
+
+    Entry * result = entry.get();
+    entries[key] = std::move(entry);
+    return result;
+}
+
+void
+QueryPlanCache::
+sweep(std::vector<std::unique_ptr<Plan> > & dropped)
+{
+    // Several plans may be for the same dataset, in which case it's only
+    // gone when they are all that refer to it
+    std::unordered_map<const Dataset *, long> numPlans;
+    for (auto & e: entries) {
+        if (e.second->plan)
+            numPlans[e.second->plan->dataset.get()] += 1;
+    }
+
+    for (auto & e: entries) {
+        auto & plan = e.second->plan;
+        if (plan && plan->dataset.use_count() == numPlans[plan->dataset.get()])
+            dropped.emplace_back(std::move(plan));
+    }
+}
+
+std::shared_ptr<const SelectStatement>
+QueryPlanCache::
+getStatement(const Utf8String & query)
+{
+    std::string key = normalize(query.rawString());
+
+    {
+        std::unique_lock<std::mutex> guard(mutex);
+        if (Entry * entry = touch(key)) {
+            ++statementHits;
+            return entry->statement;
+        }
+        ++statementMisses;
+    }
+
+    // Parse without holding the lock.  Errors aren't cached.
+    auto statement = std::make_shared<SelectStatement>
+        (SelectStatement::parse(query.rawString()));
+
+    std::vector<std::unique_ptr<Entry> > evicted;  // destroyed after unlock
+    std::unique_lock<std::mutex> guard(mutex);
+
+    // Someone else may have parsed the same query in the meantime
+    if (Entry * entry = touch(key))
+        return entry->statement;
+
+    insert(key, statement, evicted);
+    return statement;
+}
+
+void
+QueryPlanCache::
+runQuery(const Utf8String & query,
+         std::shared_ptr<const SelectStatement> statement,
+         const BoundTableExpression & table,
+         const std::function<bool (MatrixNamedRow & row)> & onRow)
+{
+    ExcAssert(statement);
+    ExcAssert(table.dataset);
+
+    std::string key;
+    std::unique_ptr<Plan> plan;
+    bool cacheable = isNamedDataset(*statement);
+
+    if (cacheable) {
+        key = normalize(query.rawString());
+
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            if (Entry * entry = touch(key))
+                plan = std::move(entry->plan);
+        }
+
+        // Checking the dependencies looks them up by name, so it's done
+        // without holding the lock.  A stale plan is destroyed here too.
+        bool stale = plan
+            && (plan->dataset != table.dataset
+                || plan->generation != table.dataset->getCommitGeneration()
+                || !plan->dependencies.current(table.dataset->server));
+        if (stale)
+            plan.reset();
+
+        std::unique_lock<std::mutex> guard(mutex);
+        if (plan)
+            ++planHits;
+        else ++planMisses;
+        if (stale)
+            ++planInvalidations;
+    }
+
+    if (!plan) {
+        const SelectStatement & stm = *statement;
+
+        plan.reset(new Plan());
+        plan->statement = statement;
+        plan->dataset = table.dataset;
+        // Read the generation before binding, so that a commit that
+        // happens while we bind makes the plan stale rather than wrong
+        plan->generation = table.dataset->getCommitGeneration();
+        RecordBindingDependencies recordDependencies(plan->dependencies);
+        plan->query.reset(new BoundDatasetQuery(stm.select, *plan->dataset,
+                                                table.asName, stm.when,
+                                                *stm.where, stm.orderBy,
+                                                stm.groupBy, *stm.having,
+                                                *stm.rowName,
+                                                stm.offset, stm.limit));
+    }
+
+    plan->query->execute(onRow);
+
+    if (cacheable && plan->query->reusable()
+        && !plan->dependencies.unrepeatable)
+        release(key, std::move(plan));
+}
+
+void
+QueryPlanCache::
+release(const std::string & key, std::unique_ptr<Plan> plan)
+{
+    std::vector<std::unique_ptr<Plan> > dropped;
+    std::unique_lock<std::mutex> guard(mutex);
+
+    auto it = entries.find(key);
+
+    // If the entry was evicted and recreated, or another run of the same
+    // query got there first, the plan is simply dropped.
+    if (it == entries.end()
+        || it->second->statement != plan->statement
+        || it->second->plan) {
+        dropped.emplace_back(std::move(plan));
+        return;
+    }
+
+    it->second->plan = std::move(plan);
+    sweep(dropped);
+}
+
+void
+QueryPlanCache::
+recordFunctionBind(bool hit)
+{
+    std::unique_lock<std::mutex> guard(mutex);
+    if (hit)
+        ++functionHits;
+    else ++functionMisses;
+}
+
+void
+QueryPlanCache::
+setCapacity(size_t capacity)
+{
+    std::vector<std::unique_ptr<Entry> > evicted;  // destroyed after unlock
+    std::unique_lock<std::mutex> guard(mutex);
+    this->capacity = capacity;
+    evict(capacity, evicted);
+}
+
+void
+QueryPlanCache::
+clear()
+{
+    std::unordered_map<std::string, std::unique_ptr<Entry> > dropped;
+    std::unique_lock<std::mutex> guard(mutex);
+    dropped.swap(entries);
+    lru.clear();
+}
+
+Json::Value
+QueryPlanCache::
+getStats() const
+{
+    std::unique_lock<std::mutex> guard(mutex);
+
+    size_t numPlans = 0;
+    for (auto & e: entries)
+        numPlans += !!e.second->plan;
+
+    Json::Value result;
+    result["capacity"] = (Json::UInt)capacity;
+    result["size"] = (Json::UInt)entries.size();
+    result["plans"] = (Json::UInt)numPlans;
+    result["evictions"] = (Json::UInt)evictions;
+    result["statementCache"]["hits"] = (Json::UInt)statementHits;
+    result["statementCache"]["misses"] = (Json::UInt)statementMisses;
+    result["planCache"]["hits"] = (Json::UInt)planHits;
+    result["planCache"]["misses"] = (Json::UInt)planMisses;
+    result["planCache"]["invalidations"] = (Json::UInt)planInvalidations;
+    result["functionCache"]["hits"] = (Json::UInt)functionHits;
+    result["functionCache"]["misses"] = (Json::UInt)functionMisses;
+    return result;
+}
+
+} // namespace MLDB
+} // namespace Datacratic
@@ -0,0 +1,136 @@
+/** query_plan_cache.h                                             -*- C++ -*-
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Cache of parsed and bound query plans, keyed by the text of the query.
+*/
+
+#pragma once
+
+#include "mldb/sql/sql_expression.h"
+#include "mldb/ext/jsoncpp/json.h"
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+namespace Datacratic {
+namespace MLDB {
+
+struct Dataset;
+struct BoundDatasetQuery;
+
+
+/*****************************************************************************/
+/* QUERY PLAN CACHE                                                          */
+/*****************************************************************************/
+
+/** Bounded LRU cache of the work that's done before a query starts
+    running.  It's keyed by the query text, with runs of whitespace outside
+    of quotes collapsed so that formatting doesn't matter, and holds:
+
+    - the parsed SelectStatement, which is valid for as long as the entry
+      is in the cache;
+    - for queries over a single named dataset, the BoundDatasetQuery that
+      was bound against it.  This is only reused while FROM refers to the
+      same dataset object (ie, it hasn't been deleted and recreated) and
+      that dataset's commit generation hasn't changed, and the same holds
+      for every function and dataset that binding looked up by name (see
+      BindingDependencies).  Queries that create a dataset while binding,
+      such as a subquery, are never reused.  A plan whose dependencies
+      have changed is dropped the next time its query is run or when it's
+      evicted.
+
+    A bound plan can only run one query at a time, so it's checked out of
+    the cache while it runs and given back afterwards; a concurrent run of
+    the same query binds a plan of its own.  Grouped queries can't reuse
+    their bound form, so only their parse is cached.
+*/
+
+struct QueryPlanCache {
+    QueryPlanCache(size_t capacity = 256);
+    ~QueryPlanCache();
+
+    /** Return the parsed form of the query, parsing it on a miss. */
+    std::shared_ptr<const SelectStatement>
+    getStatement(const Utf8String & query);
+
+    /** Run the given query over the dataset that its FROM clause was
+        bound to, reusing the bound plan from a previous run if it's
+        still valid.  The statement must have come from getStatement()
+        for the same query.
+    */
+    void runQuery(const Utf8String & query,
+                  std::shared_ptr<const SelectStatement> statement,
+                  const BoundTableExpression & table,
+                  const std::function<bool (MatrixNamedRow & row)> & onRow);
+
+    /** Record whether a sql.query function could reuse its bound
+        pipeline, so that it shows up in the statistics.
+    */
+    void recordFunctionBind(bool hit);
+
+    /** Change the number of queries that are held.  Zero disables the
+        cache.
+    */
+    void setCapacity(size_t capacity);
+
+    /** Drop everything that's cached. */
+    void clear();
+
+    /** Return the size of the cache and its hit and miss counters. */
+    Json::Value getStats() const;
+
+    /** Normalize the query text into a cache key.  Queries with comments
+        are used as-is, since a newline may end a comment.
+    */
+    static std::string normalize(const std::string & query);
+
+private:
+    struct Plan;
+    struct Entry;
+
+    /// Find the entry for the key, and make it the most recently used
+    Entry * touch(const std::string & key);
+
+    /** Take out the least recently used entries until there are no more
+        than maxEntries, so that they can be destroyed once the lock is
+        released.
+    */
+    void evict(size_t maxEntries,
+               std::vector<std::unique_ptr<Entry> > & evicted);
+
+    /// Insert a new entry, evicting the least recently used ones if needed
+    Entry * insert(const std::string & key,
+                   std::shared_ptr<const SelectStatement> statement,
+                   std::vector<std::unique_ptr<Entry> > & evicted);
+
+    /** Take out the bound plans of datasets that nobody else refers to
+        anymore, so that they can be destroyed once the lock is released.
+    */
+    void sweep(std::vector<std::unique_ptr<Plan> > & dropped);
+
+    /// Give a plan back once it's finished running
+    void release(const std::string & key, std::unique_ptr<Plan> plan);
+
+    mutable std::mutex mutex;
+    size_t capacity;
+
+    /// Keys in order of use, the most recent at the front
+    std::list<std::string> lru;
+    std::unordered_map<std::string, std::unique_ptr<Entry> > entries;
+
+    uint64_t statementHits;
+    uint64_t statementMisses;
+    uint64_t planHits;
+    uint64_t planMisses;
+    uint64_t planInvalidations;
+    uint64_t evictions;
+    uint64_t functionHits;
+    uint64_t functionMisses;
+};
+
+} // namespace MLDB
+} // namespace Datacratic
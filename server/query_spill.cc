@@ -0,0 +1,337 @@
+/** query_spill.cc
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Spilling of query rows and groups to temporary files.
+*/
+
+#include "mldb/server/query_spill.h"
+#include "mldb/server/mldb_server.h"
+#include "mldb/core/dataset.h"
+#include "mldb/jml/db/persistent.h"
+#include "mldb/jml/utils/worker_task.h"
+#include "mldb/http/http_exception.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+using namespace std;
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* QUERY MEMORY BUDGET                                                       */
+/*****************************************************************************/
+
+namespace {
+
+/// Threads holding less than this share of the budget don't spill
+const int MIN_SPILL_FRACTION = 4;
+
+size_t minSpillBytes(size_t limit)
+{
+    return limit / (MIN_SPILL_FRACTION * ML::num_threads());
+}
+
+} // file scope
+
+QueryMemoryBudget::
+QueryMemoryBudget(size_t limit, std::string directory)
+    : limit(limit), directory(std::move(directory)), used(0),
+      minSpill(minSpillBytes(limit))
+{
+}
+
+QueryMemoryBudget::
+QueryMemoryBudget(const Dataset & dataset)
+    : limit(0), used(0), minSpill(0)
+{
+    if (dataset.server) {
+        limit = dataset.server->getQueryMemoryLimit();
+        directory = dataset.server->getCacheDirectory();
+    }
+
+    if (directory.empty()) {
+        const char * tmpdir = getenv("TMPDIR");
+        directory = tmpdir && *tmpdir ? tmpdir : "/tmp";
+    }
+
+    minSpill = minSpillBytes(limit);
+}
+
+
+/*****************************************************************************/
+/* SPILL FILE                                                                */
+/*****************************************************************************/
+
+std::atomic<uint64_t> SpillFile::numCreated(0);
+
+SpillFile::
+SpillFile(const std::string & directory)
+    : numRecords(0)
+{
+    std::string pattern = directory + "/mldb-query-spill-XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back(0);
+
+    int fd = mkstemp(name.data());
+    if (fd == -1)
+        throw HttpReturnException(500, "Couldn't create query spill file",
+                                  "directory", directory,
+                                  "error", string(strerror(errno)));
+    close(fd);
+
+    filename = name.data();
+    stream.open(filename, std::ios::binary | std::ios::trunc);
+    if (!stream)
+        throw HttpReturnException(500, "Couldn't open query spill file",
+                                  "filename", filename);
+    store.reset(new ML::DB::Store_Writer(stream));
+
+    ++numCreated;
+}
+
+SpillFile::
+~SpillFile()
+{
+    store.reset();
+    stream.close();
+    unlink(filename.c_str());
+}
+
+void
+SpillFile::
+append(const std::function<void (ML::DB::Store_Writer &)> & write)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    ExcAssert(store);
+    write(*store);
+    ++numRecords;
+}
+
+void
+SpillFile::
+finish()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    store.reset();
+    stream.close();
+    if (stream.fail())
+        throw HttpReturnException(500, "Couldn't write query spill file",
+                                  "filename", filename);
+}
+
+std::unique_ptr<ML::DB::Store_Reader>
+SpillFile::
+read() const
+{
+    ExcAssert(!store);
+    return std::unique_ptr<ML::DB::Store_Reader>
+        (new ML::DB::Store_Reader(filename));
+}
+
+
+/*****************************************************************************/
+/* SERIALIZATION                                                             */
+/*****************************************************************************/
+
+namespace {
+
+enum SpilledType : unsigned char {
+    SPILLED_ATOM,
+    SPILLED_ROW,
+    SPILLED_EMBEDDING
+};
+
+size_t estimateMemory(const CellValue & cell)
+{
+    size_t result = sizeof(CellValue);
+    if (cell.isString())
+        result += cell.toStringLength();
+    else if (cell.isBlob())
+        result += cell.blobLength();
+    return result;
+}
+
+size_t estimateMemory(const Coord & coord)
+{
+    // Short coords are stored inline; longer ones are allocated
+    return sizeof(Coord) + (coord.complex_ ? coord.dataLength() : 0);
+}
+
+void serializeSpilled(ML::DB::Store_Writer & store, const Coord & coord)
+{
+    store << std::string(coord.data(), coord.dataLength());
+}
+
+void reconstituteSpilled(ML::DB::Store_Reader & store, Coord & coord)
+{
+    std::string str;
+    store >> str;
+    coord = Coord(str.data(), str.length());
+}
+
+} // file scope
+
+size_t estimateMemory(const ExpressionValue & val)
+{
+    if (val.isAtom())
+        return sizeof(ExpressionValue) + estimateMemory(val.getAtom())
+            - sizeof(CellValue);
+
+    if (val.isEmbedding())
+        return sizeof(ExpressionValue) + val.rowLength() * sizeof(CellValue);
+
+    size_t result = sizeof(ExpressionValue);
+    auto onColumn = [&] (const Coord & columnName,
+                         const Coord & prefix,
+                         const ExpressionValue & columnValue)
+        {
+            result += estimateMemory(columnName) + estimateMemory(columnValue);
+            return true;
+        };
+    val.forEachSubexpression(onColumn);
+    return result;
+}
+
+size_t estimateMemory(const std::vector<ExpressionValue> & vals)
+{
+    size_t result = sizeof(vals);
+    for (auto & v: vals)
+        result += estimateMemory(v);
+    return result;
+}
+
+size_t estimateMemory(const NamedRowValue & row)
+{
+    size_t result = sizeof(row) + estimateMemory(row.rowName);
+    for (auto & c: row.columns)
+        result += estimateMemory(std::get<0>(c)) + estimateMemory(std::get<1>(c));
+    return result;
+}
+
+void serializeSpilled(ML::DB::Store_Writer & store,
+                      const ExpressionValue & val)
+{
+    double ts = val.getEffectiveTimestamp().secondsSinceEpoch();
+
+    if (val.isAtom()) {
+        store << (unsigned char)SPILLED_ATOM << ts;
+        val.getAtom().serialize(store);
+    }
+    else if (val.isEmbedding()) {
+        store << (unsigned char)SPILLED_EMBEDDING << ts
+              << val.getEmbeddingShape();
+        auto cells = val.getEmbeddingCell();
+        store << ML::DB::compact_size_t(cells.size());
+        for (auto & c: cells)
+            c.serialize(store);
+    }
+    else {
+        store << (unsigned char)SPILLED_ROW << ts
+              << ML::DB::compact_size_t(val.rowLength());
+        auto onColumn = [&] (const Coord & columnName,
+                             const Coord & prefix,
+                             const ExpressionValue & columnValue)
+            {
+                serializeSpilled(store, columnName);
+                serializeSpilled(store, columnValue);
+                return true;
+            };
+        val.forEachSubexpression(onColumn);
+    }
+}
+
+void serializeSpilled(ML::DB::Store_Writer & store,
+                      const std::vector<ExpressionValue> & vals)
+{
+    store << ML::DB::compact_size_t(vals.size());
+    for (auto & v: vals)
+        serializeSpilled(store, v);
+}
+
+void serializeSpilled(ML::DB::Store_Writer & store,
+                      const NamedRowValue & row)
+{
+    serializeSpilled(store, row.rowName);
+    store << (uint64_t)row.rowHash.hash()
+          << ML::DB::compact_size_t(row.columns.size());
+    for (auto & c: row.columns) {
+        serializeSpilled(store, std::get<0>(c));
+        serializeSpilled(store, std::get<1>(c));
+    }
+}
+
+void reconstituteSpilled(ML::DB::Store_Reader & store, ExpressionValue & val)
+{
+    unsigned char type;
+    double tsSeconds;
+    store >> type >> tsSeconds;
+    Date ts = Date::fromSecondsSinceEpoch(tsSeconds);
+
+    switch (type) {
+    case SPILLED_ATOM: {
+        CellValue cell;
+        cell.reconstitute(store);
+        val = ExpressionValue(std::move(cell), ts);
+        return;
+    }
+    case SPILLED_EMBEDDING: {
+        std::vector<size_t> shape;
+        store >> shape;
+        ML::DB::compact_size_t n(store);
+        std::vector<CellValue> cells(n);
+        for (auto & c: cells)
+            c.reconstitute(store);
+        val = ExpressionValue(std::move(cells), ts, std::move(shape));
+        return;
+    }
+    case SPILLED_ROW: {
+        ML::DB::compact_size_t n(store);
+        ExpressionValue::Row row(n);
+        for (auto & c: row) {
+            reconstituteSpilled(store, std::get<0>(c));
+            reconstituteSpilled(store, std::get<1>(c));
+        }
+        val = ExpressionValue(std::move(row));
+        val.setEffectiveTimestamp(ts);
+        return;
+    }
+    default:
+        throw HttpReturnException(500, "Unknown value type in query spill file",
+                                  "type", (int)type);
+    }
+}
+
+void reconstituteSpilled(ML::DB::Store_Reader & store,
+                         std::vector<ExpressionValue> & vals)
+{
+    ML::DB::compact_size_t n(store);
+    vals.resize(n);
+    for (auto & v: vals)
+        reconstituteSpilled(store, v);
+}
+
+void reconstituteSpilled(ML::DB::Store_Reader & store, NamedRowValue & row)
+{
+    reconstituteSpilled(store, row.rowName);
+    uint64_t rowHash;
+    store >> rowHash;
+    row.rowHash = RowHash(rowHash);
+
+    ML::DB::compact_size_t n(store);
+    row.columns.resize(n);
+    for (auto & c: row.columns) {
+        reconstituteSpilled(store, std::get<0>(c));
+        reconstituteSpilled(store, std::get<1>(c));
+    }
+}
+
+} // namespace MLDB
+} // namespace Datacratic
@@ -0,0 +1,156 @@
+/** query_spill.h                                                  -*- C++ -*-
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Support for queries that need to hold more rows or groups than their
+    memory budget allows, by spilling them to temporary files.
+*/
+
+#pragma once
+
+#include "mldb/sql/expression_value.h"
+#include "mldb/jml/db/persistent_fwd.h"
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <memory>
+
+
+namespace Datacratic {
+namespace MLDB {
+
+struct Dataset;
+
+
+/*****************************************************************************/
+/* QUERY MEMORY BUDGET                                                       */
+/*****************************************************************************/
+
+/** Number of bytes of rows or groups that a query may hold in memory, and
+    the directory where it spills them once that is exceeded.  Memory is
+    accounted approximately, using estimateMemory().
+*/
+
+struct QueryMemoryBudget {
+    QueryMemoryBudget(size_t limit, std::string directory);
+
+    /** Budget for a query over the given dataset.  The limit comes from
+        the server's settings, and spill files go in its cache directory
+        (or the system temporary directory if there is none).
+    */
+    explicit QueryMemoryBudget(const Dataset & dataset);
+
+    /// Is there a limit?  If not, the query never spills.
+    bool limited() const
+    {
+        return limit != 0;
+    }
+
+    /** Account for the given number of bytes, which is negative when memory
+        is released.  Returns true if the query is now over its budget.
+    */
+    bool add(ssize_t bytes)
+    {
+        ssize_t newUsed = used.fetch_add(bytes) + bytes;
+        return limited() && newUsed > (ssize_t)limit;
+    }
+
+    /// Is the query over its budget?
+    bool exceeded() const
+    {
+        return limited() && used > (ssize_t)limit;
+    }
+
+    /** Should a thread that holds the given number of bytes spill them?
+        Only if the query is over budget and the thread holds enough to be
+        worth writing; otherwise it's up to the other threads, so that we
+        don't write lots of tiny files.
+    */
+    bool shouldSpill(size_t threadBytes) const
+    {
+        return exceeded() && threadBytes >= minSpill;
+    }
+
+    size_t limit;
+    std::string directory;
+    std::atomic<ssize_t> used;
+    size_t minSpill;   ///< Smallest amount worth spilling for a thread
+};
+
+
+/*****************************************************************************/
+/* SPILL FILE                                                                */
+/*****************************************************************************/
+
+/** Temporary file of records that didn't fit in memory.  Records are
+    appended, from any number of threads, and then read back in the order
+    they were written once finish() has been called.  The file is removed
+    when this object is destroyed.
+*/
+
+struct SpillFile {
+    SpillFile(const std::string & directory);
+    ~SpillFile();
+
+    SpillFile(const SpillFile & other) = delete;
+    void operator = (const SpillFile & other) = delete;
+
+    /** Append a record, which is written to the store by the given
+        function.  This is thread safe.
+    */
+    void append(const std::function<void (ML::DB::Store_Writer &)> & write);
+
+    /// Finish writing, so that the records can be read
+    void finish();
+
+    /// Read the records back from the start of the file
+    std::unique_ptr<ML::DB::Store_Reader> read() const;
+
+    /// Number of records that have been appended
+    size_t size() const
+    {
+        return numRecords;
+    }
+
+    std::string filename;
+
+    /// Number of spill files that have been created by this process, so
+    /// that tests can check that a query really did spill
+    static std::atomic<uint64_t> numCreated;
+
+private:
+    std::mutex lock;
+    std::ofstream stream;
+    std::unique_ptr<ML::DB::Store_Writer> store;
+    size_t numRecords;
+};
+
+
+/*****************************************************************************/
+/* SERIALIZATION                                                             */
+/*****************************************************************************/
+
+/** Approximate number of bytes of memory used by the given values. */
+size_t estimateMemory(const ExpressionValue & val);
+size_t estimateMemory(const std::vector<ExpressionValue> & vals);
+size_t estimateMemory(const NamedRowValue & row);
+
+/** Binary serialization of values to spill files.  Unlike the JSON
+    representation, this keeps the timestamps of nested values and the
+    exact type of each atom.
+*/
+void serializeSpilled(ML::DB::Store_Writer & store,
+                      const ExpressionValue & val);
+void serializeSpilled(ML::DB::Store_Writer & store,
+                      const std::vector<ExpressionValue> & vals);
+void serializeSpilled(ML::DB::Store_Writer & store,
+                      const NamedRowValue & row);
+
+void reconstituteSpilled(ML::DB::Store_Reader & store, ExpressionValue & val);
+void reconstituteSpilled(ML::DB::Store_Reader & store,
+                         std::vector<ExpressionValue> & vals);
+void reconstituteSpilled(ML::DB::Store_Reader & store, NamedRowValue & row);
+
+} // namespace MLDB
+} // namespace Datacratic
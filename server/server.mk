@@ -23,6 +23,8 @@ LIBMLDB_SOURCES:= \
 	static_content_macro.cc \
 	external_plugin.cc \
 	bound_queries.cc \
+	query_spill.cc \
+	query_plan_cache.cc \
 	script_output.cc \
 	forwarded_dataset.cc \
 	serial_function.cc \
@@ -9,6 +9,7 @@
 
 #include "mldb/sql/sql_expression.h"
 #include "mldb/server/function_contexts.h"
+#include "mldb/base/exc_assert.h"
 
 
 using namespace std;
@@ -17,6 +18,35 @@ using namespace std;
 namespace Datacratic {
 namespace MLDB {
 
+namespace {
+
+/** Run the with expression over each of the rows, and then apply the
+    function to all of them at once.  Returns the context for each row,
+    containing both the function's input and output.
+*/
+std::vector<FunctionContext>
+applyFunctionBatch(const BoundSqlExpression & boundWith,
+                   const std::shared_ptr<FunctionApplier> & applier,
+                   const std::vector<const SqlRowScope *> & rows)
+{
+    std::vector<ExpressionValue> withVals;
+    boundWith.execBatch(rows, withVals);
+
+    std::vector<FunctionContext> contexts(rows.size());
+    for (size_t i = 0;  i < rows.size();  ++i)
+        contexts[i].update(FunctionOutput(std::move(withVals[i])));
+
+    auto outputs = applier->applyBatch(contexts);
+    ExcAssertEqual(outputs.size(), rows.size());
+
+    for (size_t i = 0;  i < rows.size();  ++i)
+        contexts[i].update(std::move(outputs[i]));
+
+    return contexts;
+}
+
+} // file scope
+
 /** Bind the apply function expression with the given parameters into a bound
     SqlExpression.
 
@@ -46,9 +76,9 @@ bindApplyFunctionExpression(const Utf8String & functionName,
     // Extract gets bound on the output values, since it happens after the function
     auto boundExtract = extract.bind(extractContext);
 
-    return {[=] (const SqlRowScope & row, 
-                 ExpressionValue & storage, 
-                 const VariableFilter & filter) -> const ExpressionValue &
+    auto exec = [=] (const SqlRowScope & row, 
+                     ExpressionValue & storage, 
+                     const VariableFilter & filter) -> const ExpressionValue &
             {
                 // Run the with expressions
                 ExpressionValue withVal = boundWith(row);
@@ -74,9 +104,26 @@ bindApplyFunctionExpression(const Utf8String & functionName,
                 auto val = boundExtract(rowFunctionContext, storage);               
 
                 return storage = val;
-            },
-            expr,
-            boundExtract.info};
+            };
+
+    BoundSqlExpression result(exec, expr, boundExtract.info);
+
+    // Over a batch of rows, the function is applied to all of them at once
+    result.batchExec = [=] (const std::vector<const SqlRowScope *> & rows,
+                            std::vector<ExpressionValue> & output,
+                            const VariableFilter & filter)
+        {
+            auto contexts = applyFunctionBatch(boundWith, applier, rows);
+
+            output.resize(rows.size());
+            for (size_t i = 0;  i < rows.size();  ++i) {
+                auto rowFunctionContext
+                    = extractContext.getRowContext(contexts[i]);
+                output[i] = boundExtract(rowFunctionContext);
+            }
+        };
+
+    return result;
 }
 
 extern BoundSqlExpression
@@ -149,6 +196,21 @@ bindSelectApplyFunctionExpression(const Utf8String & functionName,
             };
 
     BoundSqlExpression result(exec, expr, allColumns.info);
+
+    result.batchExec = [=] (const std::vector<const SqlRowScope *> & rows,
+                            std::vector<ExpressionValue> & output,
+                            const VariableFilter & filter)
+        {
+            auto contexts = applyFunctionBatch(boundWith, applier, rows);
+
+            output.resize(rows.size());
+            for (size_t i = 0;  i < rows.size();  ++i) {
+                auto rowFunctionContext
+                    = extractContext.getRowContext(contexts[i]);
+                output[i] = allColumns.exec(rowFunctionContext);
+            }
+        };
+
     return std::move(result);
 }
 
@@ -75,6 +75,11 @@ struct ReadThroughBindingContext: public SqlBindingScope {
     {
         return outer.getMldbServer();
     }
+
+    virtual ssize_t getHashJoinMinRows() const
+    {
+        return outer.getHashJoinMinRows();
+    }
 };
 
 
@@ -120,6 +125,11 @@ struct ColumnExpressionBindingContext: public SqlBindingScope {
     {
         return outer.getMldbServer();
     }
+
+    virtual ssize_t getHashJoinMinRows() const
+    {
+        return outer.getHashJoinMinRows();
+    }
 };
 
 
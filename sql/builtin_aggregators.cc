@@ -13,6 +13,8 @@
 #include "mldb/jml/utils/csv.h"
 #include "mldb/types/vector_description.h"
 #include <array>
+#include <set>
+#include <cmath>
 
 
 using namespace std;
@@ -58,6 +60,16 @@ struct RegisterAggregator {
     std::vector<std::shared_ptr<void> > handles;
 };
 
+/** Number of arguments that an aggregator takes after the value that it
+    aggregates.  These are parameters with the same value for every row, like
+    the quantile in approx_quantile(x, 0.5), and are passed to the state's
+    process() after the value.  Specialized for aggregators that take them.
+*/
+template<typename State>
+struct AggregatorParams {
+    enum { numParams = 0 };
+};
+
 template<typename State>
 struct AggregatorT {
     /** This is the function that is actually called when we want to use
@@ -66,8 +78,13 @@ struct AggregatorT {
     */
     static BoundAggregator entry(const std::vector<BoundSqlExpression> & args)
     {
-        // These can only take a single argument
-        ExcAssertEqual(args.size(), 1);
+        // These take a single value, followed by any parameters
+        size_t expected = 1 + AggregatorParams<State>::numParams;
+        if (args.size() != expected)
+            throw HttpReturnException(400, "aggregator expected "
+                                      + to_string(expected) + " argument"
+                                      + (expected == 1 ? "" : "s") + ", got "
+                                      + to_string(args.size()));
         ExcAssert(args[0].info);
 
         if (args[0].info->isRow()) {
@@ -119,6 +136,28 @@ struct AggregatorT {
 
     //////// Row ///////////
 
+    /** Arguments for the state of a single column of a row: the value of
+        the column, followed by the parameters of the aggregator.  When there
+        are no parameters the value is passed directly, without a copy.
+    */
+    struct ColumnArgs {
+        ColumnArgs(const ExpressionValue * args, size_t nargs)
+        {
+            if (nargs > 1)
+                params.assign(args, args + nargs);
+        }
+
+        const ExpressionValue * operator () (const ExpressionValue & val)
+        {
+            if (params.empty())
+                return &val;
+            params[0] = val;
+            return params.data();
+        }
+
+        std::vector<ExpressionValue> params;
+    };
+
     /** Structure used to keep the state when in row mode.  It keeps a separate
         state for each of the columns.
     */
@@ -131,14 +170,15 @@ struct AggregatorT {
 
         void process(const ExpressionValue * args, size_t nargs)
         {
-            ExcAssertEqual(nargs, 1);
+            ExcAssertGreaterEqual(nargs, 1);
             const ExpressionValue & val = args[0];
+            ColumnArgs columnArgs(args, nargs);
 
             // This must be a row...
             auto onSubExpression = [&] (const Coord & columnName,
                                         const ExpressionValue & val)
                 {
-                    columns[columnName].process(&val, 1);
+                    columns[columnName].process(columnArgs(val), nargs);
                     return true;
                 };
 
@@ -188,14 +228,15 @@ struct AggregatorT {
 
         void process(const ExpressionValue * args, size_t nargs)
         {
-            ExcAssertEqual(nargs, 1);
+            ExcAssertGreaterEqual(nargs, 1);
             const ExpressionValue & val = args[0];
+            ColumnArgs columnArgs(args, nargs);
             
             int64_t n = 0;
             for (auto & col: val.getRow()) {
                 ExcAssertLess(n, columnNames.size());
                 ExcAssertEqual(columnNames[n], std::get<0>(col));
-                columnState[n++].process(&std::get<1>(col), 1);
+                columnState[n++].process(columnArgs(std::get<1>(col)), nargs);
             }
         }
 
@@ -286,7 +327,7 @@ struct AggregatorT {
         // b) what is the best way to implement the query
         // First output: information about the row
         // Second output: is it dense (in other words, all rows are the same)?
-        ExcAssertEqual(args.size(), 1);
+        ExcAssertGreaterEqual(args.size(), 1);
         ExcAssert(args[0].info);
 
         // Create a value info object for the output.  It has the same
@@ -364,7 +405,7 @@ struct AggregatorT {
 
         if (!state->isDetermined) {
             state->isDetermined = true;
-            ExcAssertEqual(nargs, 1);
+            ExcAssertGreaterEqual(nargs, 1);
             state->isRow = args[0].isRow();
         }
 
@@ -604,6 +645,427 @@ struct CountAccum {
 
 static RegisterAggregatorT<CountAccum> registerCount("count");
 
+/*****************************************************************************/
+/* APPROXIMATE AGGREGATORS                                                   */
+/*****************************************************************************/
+
+/* These keep a fixed size sketch of the values in each group rather than the
+   values themselves, so that distinct counts, quantiles and frequent values
+   can be calculated in a single pass in bounded memory.  The sketches merge,
+   so that groups can be accumulated in parallel.
+*/
+
+/** HyperLogLog estimate of the number of distinct values.  Small groups keep
+    the exact hashes of their values (and so give an exact count) until they
+    would take more memory than the registers of the sketch.
+*/
+
+/// Number of bits of the hash used to select a register
+static const int HLL_PRECISION = 14;
+static const size_t HLL_NUM_REGISTERS = 1 << HLL_PRECISION;
+
+/// Maximum number of hashes kept before switching to the sketch
+static const size_t HLL_MAX_EXACT = HLL_NUM_REGISTERS / sizeof(uint64_t);
+
+struct DistinctCountAccum {
+    DistinctCountAccum()
+        : ts(Date::negativeInfinity())
+    {
+    }
+
+    static std::shared_ptr<ExpressionValueInfo>
+    info(const std::vector<BoundSqlExpression> & args)
+    {
+        return std::make_shared<IntegerValueInfo>();
+    }
+
+    void process(const ExpressionValue * args, size_t nargs)
+    {
+        ExcAssertEqual(nargs, 1);
+        const ExpressionValue & val = args[0];
+        if (val.empty())
+            return;
+        add(val.hash());
+        ts.setMax(val.getEffectiveTimestamp());
+    }
+
+    ExpressionValue extract()
+    {
+        if (registers.empty())
+            return ExpressionValue(hashes.size(), ts);
+
+        double sum = 0.0;
+        size_t numZero = 0;
+        for (uint8_t r: registers) {
+            sum += ldexp(1.0, -(int)r);
+            numZero += (r == 0);
+        }
+
+        double m = HLL_NUM_REGISTERS;
+        double alpha = 0.7213 / (1.0 + 1.079 / m);
+        double estimate = alpha * m * m / sum;
+
+        // Linear counting is more accurate while many registers are empty
+        if (estimate <= 2.5 * m && numZero != 0)
+            estimate = m * log(m / numZero);
+
+        return ExpressionValue((uint64_t)llround(estimate), ts);
+    }
+
+    void merge(DistinctCountAccum* src)
+    {
+        if (src->registers.empty()) {
+            for (uint64_t h: src->hashes)
+                add(h);
+        }
+        else {
+            if (registers.empty())
+                toRegisters();
+            for (unsigned i = 0;  i < HLL_NUM_REGISTERS;  ++i)
+                registers[i] = std::max(registers[i], src->registers[i]);
+        }
+        ts.setMax(src->ts);
+    }
+
+    void add(uint64_t hash)
+    {
+        if (!registers.empty()) {
+            addToRegisters(hash);
+            return;
+        }
+
+        auto it = std::lower_bound(hashes.begin(), hashes.end(), hash);
+        if (it != hashes.end() && *it == hash)
+            return;
+        hashes.insert(it, hash);
+        if (hashes.size() > HLL_MAX_EXACT)
+            toRegisters();
+    }
+
+    void addToRegisters(uint64_t hash)
+    {
+        size_t index = hash >> (64 - HLL_PRECISION);
+        // The guard bit bounds the rank when the rest of the hash is zero
+        uint64_t rest
+            = (hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+        uint8_t rank = __builtin_clzll(rest) + 1;
+        registers[index] = std::max(registers[index], rank);
+    }
+
+    void toRegisters()
+    {
+        registers.resize(HLL_NUM_REGISTERS);
+        for (uint64_t h: hashes)
+            addToRegisters(h);
+        std::vector<uint64_t>().swap(hashes);
+    }
+
+    std::vector<uint64_t> hashes;    ///< Sorted; only until we use registers
+    std::vector<uint8_t> registers;
+    Date ts;
+};
+
+static RegisterAggregatorT<DistinctCountAccum>
+registerApproxCountDistinct("approx_count_distinct");
+
+/** t-digest estimate of a quantile of the values, as in
+    approx_quantile(x, 0.95).  Values are buffered and merged into a sorted
+    list of centroids, which are kept smaller near the extremes so that the
+    tails of the distribution stay accurate.
+*/
+
+/// Bounds the number of centroids, and so the memory and accuracy
+static const double TDIGEST_COMPRESSION = 100.0;
+
+/// Number of values buffered before being merged into the centroids
+static const size_t TDIGEST_BUFFER_SIZE = 500;
+
+struct QuantileAccum {
+    /// Mean and weight of a group of values
+    typedef std::pair<double, double> Centroid;
+
+    QuantileAccum()
+        : quantile(-1.0), count(0.0),
+          min(INFINITY), max(-INFINITY),
+          ts(Date::negativeInfinity())
+    {
+    }
+
+    static std::shared_ptr<ExpressionValueInfo>
+    info(const std::vector<BoundSqlExpression> & args)
+    {
+        return std::make_shared<Float64ValueInfo>();
+    }
+
+    void process(const ExpressionValue * args, size_t nargs)
+    {
+        ExcAssertEqual(nargs, 2);
+        const ExpressionValue & val = args[0];
+        if (val.empty())
+            return;
+
+        if (quantile < 0.0) {
+            double q = args[1].toDouble();
+            if (!(q >= 0.0 && q <= 1.0))
+                throw HttpReturnException(400, "approx_quantile quantile "
+                                          "must be between 0 and 1",
+                                          "quantile", args[1]);
+            quantile = q;
+        }
+
+        double x = val.toDouble();
+        if (std::isnan(x))
+            return;
+
+        buffer.emplace_back(x, 1.0);
+        count += 1.0;
+        min = std::min(min, x);
+        max = std::max(max, x);
+        ts.setMax(val.getEffectiveTimestamp());
+
+        if (buffer.size() >= TDIGEST_BUFFER_SIZE)
+            compress();
+    }
+
+    ExpressionValue extract()
+    {
+        compress();
+        if (centroids.empty())
+            return ExpressionValue::null(ts);
+
+        double target = quantile * count;
+
+        // Interpolate between the centres of the centroids, and between the
+        // outer centroids and the exact extremes
+        const Centroid & first = centroids.front();
+        if (target <= first.second / 2)
+            return ExpressionValue(interpolate(min, first.first,
+                                               target / (first.second / 2)),
+                                   ts);
+
+        double before = 0.0;
+        for (unsigned i = 0;  i + 1 < centroids.size();  ++i) {
+            const Centroid & c = centroids[i];
+            const Centroid & next = centroids[i + 1];
+            double centre = before + c.second / 2;
+            double nextCentre = before + c.second + next.second / 2;
+            if (target <= nextCentre)
+                return ExpressionValue
+                    (interpolate(c.first, next.first,
+                                 (target - centre) / (nextCentre - centre)),
+                     ts);
+            before += c.second;
+        }
+
+        const Centroid & last = centroids.back();
+        double lastCentre = count - last.second / 2;
+        return ExpressionValue(interpolate(last.first, max,
+                                           (target - lastCentre)
+                                           / (last.second / 2)),
+                               ts);
+    }
+
+    void merge(QuantileAccum* src)
+    {
+        if (quantile < 0.0)
+            quantile = src->quantile;
+        buffer.insert(buffer.end(),
+                      src->centroids.begin(), src->centroids.end());
+        buffer.insert(buffer.end(),
+                      src->buffer.begin(), src->buffer.end());
+        count += src->count;
+        min = std::min(min, src->min);
+        max = std::max(max, src->max);
+        ts.setMax(src->ts);
+        compress();
+    }
+
+    static double interpolate(double x0, double x1, double t)
+    {
+        return x0 + (x1 - x0) * std::min(std::max(t, 0.0), 1.0);
+    }
+
+    /** Maximum quantile that a centroid starting at quantile q may reach.
+        This uses the arcsine scale function, which allows centroids of
+        about sqrt(q * (1 - q)) of the values.
+    */
+    static double quantileLimit(double q)
+    {
+        double k = TDIGEST_COMPRESSION / (2 * M_PI)
+            * asin(std::min(2 * q - 1, 1.0)) + 1.0;
+        double angle = std::min(k * 2 * M_PI / TDIGEST_COMPRESSION, M_PI / 2);
+        return (sin(angle) + 1) / 2;
+    }
+
+    /// Merge the buffered values and centroids into a new set of centroids
+    void compress()
+    {
+        if (buffer.empty())
+            return;
+
+        buffer.insert(buffer.end(), centroids.begin(), centroids.end());
+        std::sort(buffer.begin(), buffer.end());
+
+        std::vector<Centroid> result;
+        Centroid current = buffer[0];
+        double before = 0.0;
+        double limit = count * quantileLimit(0.0);
+
+        for (unsigned i = 1;  i < buffer.size();  ++i) {
+            const Centroid & c = buffer[i];
+            if (before + current.second + c.second <= limit) {
+                current.second += c.second;
+                current.first += (c.first - current.first)
+                    * c.second / current.second;
+            }
+            else {
+                before += current.second;
+                result.push_back(current);
+                limit = count * quantileLimit(before / count);
+                current = c;
+            }
+        }
+        result.push_back(current);
+
+        centroids.swap(result);
+        buffer.clear();
+    }
+
+    double quantile;    ///< Negative until we've seen the first row
+    double count;
+    double min, max;
+    std::vector<Centroid> centroids;
+    std::vector<Centroid> buffer;
+    Date ts;
+};
+
+template<>
+struct AggregatorParams<QuantileAccum> {
+    enum { numParams = 1 };
+};
+
+static RegisterAggregatorT<QuantileAccum> registerApproxQuantile("approx_quantile");
+
+/** Space-saving estimate of the most frequent values, as in
+    approx_top_k(x, 10).  It keeps counters for a fixed number of values;
+    when a new value arrives and all counters are in use, it replaces the
+    value with the lowest count, and takes over that count.  Counts are
+    overestimates, by at most the number of values divided by the number of
+    counters.  The result is a row with the value as the column name and the
+    count as the value, most frequent first.
+*/
+
+/// Number of counters kept for each value returned
+static const size_t TOP_K_COUNTERS_PER_VALUE = 4;
+
+/// Minimum number of counters, so that small k are still accurate
+static const size_t TOP_K_MIN_COUNTERS = 64;
+
+struct TopKAccum {
+    TopKAccum()
+        : k(0), ts(Date::negativeInfinity())
+    {
+    }
+
+    static std::shared_ptr<ExpressionValueInfo>
+    info(const std::vector<BoundSqlExpression> & args)
+    {
+        return std::make_shared<UnknownRowValueInfo>();
+    }
+
+    void process(const ExpressionValue * args, size_t nargs)
+    {
+        ExcAssertEqual(nargs, 2);
+        const ExpressionValue & val = args[0];
+        if (val.empty())
+            return;
+
+        if (k == 0) {
+            int64_t n = args[1].toInt();
+            if (n <= 0)
+                throw HttpReturnException(400, "approx_top_k number of values "
+                                          "must be positive",
+                                          "k", args[1]);
+            k = n;
+        }
+
+        add(val.getAtom(), 1);
+        ts.setMax(val.getEffectiveTimestamp());
+    }
+
+    ExpressionValue extract()
+    {
+        std::vector<std::pair<uint64_t, CellValue> > sorted
+            (byCount.begin(), byCount.end());
+
+        auto moreFrequent = [] (const std::pair<uint64_t, CellValue> & p1,
+                                const std::pair<uint64_t, CellValue> & p2)
+            {
+                return p1.first > p2.first
+                    || (p1.first == p2.first && p1.second < p2.second);
+            };
+
+        size_t n = std::min(k, sorted.size());
+        std::partial_sort(sorted.begin(), sorted.begin() + n, sorted.end(),
+                          moreFrequent);
+
+        StructValue result;
+        for (unsigned i = 0;  i < n;  ++i) {
+            result.emplace_back(ColumnName(sorted[i].second.toUtf8String()),
+                                ExpressionValue(sorted[i].first, ts));
+        }
+
+        return ExpressionValue(std::move(result));
+    }
+
+    void merge(TopKAccum* src)
+    {
+        if (k == 0)
+            k = src->k;
+        for (auto & c: src->counts)
+            add(c.first, c.second);
+        ts.setMax(src->ts);
+    }
+
+    void add(const CellValue & value, uint64_t n)
+    {
+        auto it = counts.find(value);
+        if (it != counts.end()) {
+            byCount.erase({ it->second, value });
+            it->second += n;
+            byCount.emplace(it->second, value);
+            return;
+        }
+
+        uint64_t count = n;
+        size_t maxCounters
+            = std::max(k * TOP_K_COUNTERS_PER_VALUE, TOP_K_MIN_COUNTERS);
+        if (counts.size() >= maxCounters) {
+            // Evict the least frequent value; the new one may have been
+            // among the values it counted
+            auto smallest = byCount.begin();
+            count += smallest->first;
+            counts.erase(smallest->second);
+            byCount.erase(smallest);
+        }
+
+        counts.emplace(value, count);
+        byCount.emplace(count, value);
+    }
+
+    size_t k;    ///< Zero until we've seen the first row
+    std::unordered_map<CellValue, uint64_t> counts;
+    std::set<std::pair<uint64_t, CellValue> > byCount;
+    Date ts;
+};
+
+template<>
+struct AggregatorParams<TopKAccum> {
+    enum { numParams = 1 };
+};
+
+static RegisterAggregatorT<TopKAccum> registerApproxTopK("approx_top_k");
+
 struct LikelihoodRatioAccum {
     LikelihoodRatioAccum()
         : ts(Date::negativeInfinity())
@@ -15,6 +15,7 @@
 #include "cell_value_impl.h"
 #include "mldb/base/parse_context.h"
 #include "interval.h"
+#include "mldb/jml/db/persistent.h"
 
 using namespace std;
 
@@ -932,6 +933,126 @@ isExactDouble() const
     }
 }
 
+void
+CellValue::
+serialize(ML::DB::Store_Writer & store) const
+{
+    unsigned char version = 0;
+    unsigned char storageType = type;
+    store << version << storageType;
+
+    switch (type) {
+    case ST_EMPTY:
+        return;
+    case ST_INTEGER:
+        store << (int64_t)intVal;
+        return;
+    case ST_UNSIGNED:
+        store << (uint64_t)uintVal;
+        return;
+    case ST_FLOAT:
+        store << (double)floatVal;
+        return;
+    case ST_ASCII_SHORT_STRING:
+    case ST_ASCII_LONG_STRING:
+    case ST_UTF8_SHORT_STRING:
+    case ST_UTF8_LONG_STRING:
+        store << std::string(stringChars(), toStringLength());
+        return;
+    case ST_TIMESTAMP:
+        store << (double)timestamp;
+        return;
+    case ST_TIMEINTERVAL:
+        store << (uint16_t)timeInterval.months << (uint16_t)timeInterval.days
+              << (double)timeInterval.seconds;
+        return;
+    case ST_SHORT_BLOB:
+    case ST_LONG_BLOB:
+        store << std::string((const char *)blobData(), blobLength());
+        return;
+    default:
+        throw HttpReturnException(500, "Can't serialize unknown CellValue type");
+    }
+}
+
+void
+CellValue::
+reconstitute(ML::DB::Store_Reader & store)
+{
+    unsigned char version, storageType;
+    store >> version >> storageType;
+    if (version != 0)
+        throw HttpReturnException(400, "Unknown CellValue serialization version",
+                                  "version", (int)version);
+
+    CellValue result;
+
+    switch (storageType) {
+    case ST_EMPTY:
+        break;
+    case ST_INTEGER: {
+        int64_t i;
+        store >> i;
+        result = CellValue(i);
+        break;
+    }
+    case ST_UNSIGNED: {
+        uint64_t i;
+        store >> i;
+        result = CellValue(i);
+        break;
+    }
+    case ST_FLOAT: {
+        double d;
+        store >> d;
+        result = CellValue(d);
+        break;
+    }
+    case ST_ASCII_SHORT_STRING:
+    case ST_ASCII_LONG_STRING: {
+        std::string s;
+        store >> s;
+        result = CellValue(s.data(), s.length(), STRING_IS_VALID_ASCII);
+        break;
+    }
+    case ST_UTF8_SHORT_STRING:
+    case ST_UTF8_LONG_STRING: {
+        std::string s;
+        store >> s;
+        result = CellValue(s.data(), s.length(), STRING_IS_VALID_UTF8_NOT_ASCII);
+        break;
+    }
+    case ST_TIMESTAMP: {
+        double d;
+        store >> d;
+        result = CellValue(Date::fromSecondsSinceEpoch(d));
+        break;
+    }
+    case ST_TIMEINTERVAL: {
+        uint16_t months, days;
+        double seconds;
+        store >> months >> days >> seconds;
+        result.type = ST_TIMEINTERVAL;
+        result.timeInterval.months = months;
+        result.timeInterval.days = days;
+        result.timeInterval.seconds = seconds;
+        break;
+    }
+    case ST_SHORT_BLOB:
+    case ST_LONG_BLOB: {
+        std::string s;
+        store >> s;
+        result = CellValue::blob(std::move(s));
+        break;
+    }
+    default:
+        throw HttpReturnException(400, "Can't reconstitute unknown CellValue type",
+                                  "type", (int)storageType);
+    }
+
+    swap(result);
+}
+
 void
 CellValue::
 deleteString()
@@ -10,6 +10,7 @@
 #include "mldb/types/hash_wrapper.h"
 #include "mldb/types/date.h"
 #include "mldb/types/value_description_fwd.h"
+#include "mldb/jml/db/persistent_fwd.h"
 
 
 namespace Datacratic {
@@ -321,6 +322,13 @@ struct CellValue {
         return !operator < (other);
     }
 
+    /** Serialize in a compact binary form, preserving the exact storage
+        type.  Used for binary on-disk formats; JSON should be used
+        everywhere else.
+    */
+    void serialize(ML::DB::Store_Writer & store) const;
+    void reconstitute(ML::DB::Store_Reader & store);
+
 private:
     double toDoubleImpl() const;
     
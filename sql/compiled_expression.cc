@@ -0,0 +1,366 @@
+/** compiled_expression.cc
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Fused evaluation of scalar expressions.
+*/
+
+#include "compiled_expression.h"
+#include "mldb/http/http_exception.h"
+#include "mldb/types/basic_value_descriptions.h"
+#include "mldb/base/exc_assert.h"
+#include <cmath>
+
+
+using namespace std;
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* COMPILED SCALAR EXPRESSION                                                */
+/*****************************************************************************/
+
+namespace {
+
+typedef CompiledScalarExpression::Value Value;
+
+/// Integers with a larger magnitude than this can't be held exactly in a
+/// double, and so would compare differently from CellValue
+static const int64_t MAX_EXACT_INTEGER = 1LL << 53;
+
+/** Unbox a value read from a variable.  This must agree with the
+    CellValue operations that the generic path uses, so only numbers
+    whose double is exact are accepted.
+*/
+bool unbox(const ExpressionValue & val, Value & result)
+{
+    result.ts = val.getEffectiveTimestamp();
+    result.val = 0;
+
+    if (val.empty()) {
+        result.null = true;
+        return true;
+    }
+
+    if (!val.isAtom())
+        return false;
+
+    const CellValue & cell = val.getAtom();
+    switch (cell.cellType()) {
+    case CellValue::INTEGER: {
+        if (!cell.isInt64())
+            return false;
+        int64_t i = cell.toInt();
+        if (i > MAX_EXACT_INTEGER || i < -MAX_EXACT_INTEGER)
+            return false;
+        result.val = i;
+        break;
+    }
+    case CellValue::FLOAT:
+        result.val = cell.toDouble();
+        if (std::isnan(result.val))
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    result.null = false;
+    return true;
+}
+
+bool couldBeNumeric(const ExpressionValueInfo & info)
+{
+    return info.isScalar()
+        && !dynamic_cast<const StringValueInfo *>(&info)
+        && !dynamic_cast<const Utf8StringValueInfo *>(&info)
+        && !dynamic_cast<const BlobValueInfo *>(&info)
+        && !dynamic_cast<const TimestampValueInfo *>(&info);
+}
+
+bool isArithmetic(CompiledScalarExpression::OpCode op)
+{
+    return op >= CompiledScalarExpression::PLUS
+        && op <= CompiledScalarExpression::DIVIDE;
+}
+
+bool isComparison(CompiledScalarExpression::OpCode op)
+{
+    return op >= CompiledScalarExpression::EQUAL
+        && op <= CompiledScalarExpression::GREATER_EQUAL;
+}
+
+} // file scope
+
+std::shared_ptr<CompiledScalarExpression>
+CompiledScalarExpression::
+read(BoundSqlExpression::ExecFunction exec,
+     const ExpressionValueInfo & info)
+{
+    if (!couldBeNumeric(info))
+        return nullptr;
+
+    auto result = std::make_shared<CompiledScalarExpression>();
+    result->code.push_back({ READ, 0 });
+    result->reads.push_back({ std::move(exec), true /* inheritFilter */ });
+    result->stackDepth = 1;
+    return result;
+}
+
+std::shared_ptr<CompiledScalarExpression>
+CompiledScalarExpression::
+constant(const ExpressionValue & val)
+{
+    Value unboxed;
+    if (!unbox(val, unboxed))
+        return nullptr;
+
+    auto result = std::make_shared<CompiledScalarExpression>();
+    result->code.push_back({ CONSTANT, 0 });
+    result->constants.push_back(unboxed);
+    result->stackDepth = 1;
+    return result;
+}
+
+std::shared_ptr<CompiledScalarExpression>
+CompiledScalarExpression::
+combine(OpCode op,
+        const CompiledScalarExpression * lhs,
+        const CompiledScalarExpression & rhs)
+{
+    auto result = std::make_shared<CompiledScalarExpression>();
+    result->stackDepth = rhs.stackDepth;
+
+    // The operands are run one after the other, so the instructions of
+    // the rhs need to refer to its constants and reads after those of
+    // the lhs.
+    auto append = [&] (const CompiledScalarExpression & operand)
+        {
+            uint32_t constantOffset = result->constants.size();
+            uint32_t readOffset = result->reads.size();
+            for (Instruction i: operand.code) {
+                if (i.op == CONSTANT)
+                    i.arg += constantOffset;
+                else if (i.op == READ)
+                    i.arg += readOffset;
+                result->code.push_back(i);
+            }
+            result->constants.insert(result->constants.end(),
+                                     operand.constants.begin(),
+                                     operand.constants.end());
+            result->reads.insert(result->reads.end(),
+                                 operand.reads.begin(),
+                                 operand.reads.end());
+        };
+
+    if (lhs) {
+        append(*lhs);
+        result->stackDepth = std::max(lhs->stackDepth, rhs.stackDepth + 1);
+    }
+    append(rhs);
+    result->code.push_back({ op, 0 });
+
+    if (result->stackDepth > MAX_STACK)
+        return nullptr;
+
+    // Arithmetic and comparisons read their operands with GET_ALL, not
+    // with the filter they were given.
+    if (isArithmetic(op) || isComparison(op)) {
+        for (auto & r: result->reads)
+            r.inheritFilter = false;
+    }
+
+    return result;
+}
+
+bool
+CompiledScalarExpression::
+run(const SqlRowScope & row,
+    const VariableFilter & filter,
+    Value & result) const
+{
+    Value stack[MAX_STACK];
+    int sp = 0;
+
+    for (const Instruction & i: code) {
+        switch (i.op) {
+        case CONSTANT:
+            stack[sp++] = constants[i.arg];
+            continue;
+
+        case READ: {
+            const Read & r = reads[i.arg];
+            ExpressionValue storage;
+            const ExpressionValue & val
+                = r.exec(row, storage, r.inheritFilter ? filter : GET_ALL);
+            if (!unbox(val, stack[sp++]))
+                return false;
+            continue;
+        }
+
+        case NOT: {
+            // A null stays as it is
+            Value & r = stack[sp - 1];
+            if (!r.null)
+                r.val = !r.isTrue();
+            continue;
+        }
+
+        default:
+            break;
+        }
+
+        // Binary operators replace the lhs with the result
+        Value & l = stack[sp - 2];
+        const Value & r = stack[sp - 1];
+        --sp;
+
+        if (isArithmetic(i.op)) {
+            // As in the generic operators, a null lhs gives null and a
+            // null rhs gives the lhs.
+            if (!l.null && !r.null) {
+                switch (i.op) {
+                case PLUS:      l.val = l.val + r.val;  break;
+                case MINUS:     l.val = l.val - r.val;  break;
+                case MULTIPLY:  l.val = l.val * r.val;  break;
+                case DIVIDE:    l.val = l.val / r.val;  break;
+                default:        break;
+                }
+                if (std::isnan(l.val))
+                    return false;
+            }
+            l.ts = std::max(l.ts, r.ts);
+        }
+        else if (isComparison(i.op)) {
+            l.ts = std::max(l.ts, r.ts);
+            if (l.null || r.null) {
+                l.null = true;
+                continue;
+            }
+            switch (i.op) {
+            case EQUAL:          l.val = l.val == r.val;  break;
+            case NOT_EQUAL:      l.val = l.val != r.val;  break;
+            case LESS:           l.val = l.val < r.val;   break;
+            case GREATER:        l.val = l.val > r.val;   break;
+            case LESS_EQUAL:     l.val = l.val <= r.val;  break;
+            case GREATER_EQUAL:  l.val = l.val >= r.val;  break;
+            default:             break;
+            }
+        }
+        else if (i.op == AND) {
+            // Same truth table and timestamps as the generic AND
+            if (l.isFalse() && r.isFalse()) {
+                l.ts = std::min(l.ts, r.ts);
+            }
+            else if (l.isFalse()) {
+            }
+            else if (r.isFalse()) {
+                l = r;
+            }
+            else if (l.null && r.null) {
+                l.ts = std::min(l.ts, r.ts);
+            }
+            else if (l.null) {
+            }
+            else if (r.null) {
+                l = r;
+            }
+            else {
+                l.val = 1;
+                l.ts = std::max(l.ts, r.ts);
+            }
+            if (!l.null)
+                l.val = l.isTrue();
+        }
+        else if (i.op == OR) {
+            if (l.isTrue() && r.isTrue()) {
+                l.ts = std::max(l.ts, r.ts);
+            }
+            else if (l.isTrue()) {
+            }
+            else if (r.isTrue()) {
+                l = r;
+            }
+            else if (l.null && r.null) {
+                l.ts = std::max(l.ts, r.ts);
+            }
+            else if (l.null) {
+            }
+            else if (r.null) {
+                l = r;
+            }
+            else {
+                l.val = 0;
+                l.ts = std::min(l.ts, r.ts);
+            }
+            if (!l.null)
+                l.val = l.isTrue();
+        }
+        else {
+            throw HttpReturnException(500, "Unknown compiled expression op",
+                                      "op", (int)i.op);
+        }
+    }
+
+    ExcAssertEqual(sp, 1);
+    result = stack[0];
+    return true;
+}
+
+const ExpressionValue &
+CompiledScalarExpression::
+exec(const SqlRowScope & row,
+     ExpressionValue & storage,
+     const VariableFilter & filter) const
+{
+    Value result;
+    if (!run(row, filter, result))
+        return generic(row, storage, filter);
+
+    // Box the result the same way as the generic operator at the root
+    OpCode op = code.back().op;
+    if (isArithmetic(op)) {
+        if (result.null)
+            return storage = ExpressionValue(CellValue(), result.ts);
+        return storage = ExpressionValue(result.val, result.ts);
+    }
+
+    if (result.null)
+        return storage = ExpressionValue::null(result.ts);
+    return storage = ExpressionValue(result.val != 0, result.ts);
+}
+
+BoundSqlExpression
+compileScalarOp(CompiledScalarExpression::OpCode op,
+                BoundSqlExpression generic,
+                const BoundSqlExpression * lhs,
+                const BoundSqlExpression & rhs)
+{
+    if (!rhs.compiled || (lhs && !lhs->compiled))
+        return generic;
+
+    auto compiled
+        = CompiledScalarExpression::combine(op,
+                                            lhs ? lhs->compiled.get() : nullptr,
+                                            *rhs.compiled);
+    if (!compiled)
+        return generic;
+
+    compiled->generic = std::move(generic.exec);
+    generic.exec = [=] (const SqlRowScope & row,
+                        ExpressionValue & storage,
+                        const VariableFilter & filter)
+        -> const ExpressionValue &
+        {
+            return compiled->exec(row, storage, filter);
+        };
+    generic.compiled = std::move(compiled);
+    return generic;
+}
+
+} // namespace MLDB
+} // namespace Datacratic
@@ -0,0 +1,144 @@
+/** compiled_expression.h                                          -*- C++ -*-
+    Copyright (c) 2016 Datacratic Inc.  All rights reserved.
+
+    This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+    Fused evaluation of scalar arithmetic, comparison and boolean
+    expressions over unboxed numbers.
+*/
+
+#pragma once
+
+#include "sql_expression.h"
+
+
+namespace Datacratic {
+namespace MLDB {
+
+
+/*****************************************************************************/
+/* COMPILED SCALAR EXPRESSION                                                */
+/*****************************************************************************/
+
+/** A tree of scalar operations (arithmetic, comparisons, AND/OR/NOT) over
+    variables and constants, flattened into a postfix program that runs
+    over a stack of unboxed doubles.  This avoids the std::function call
+    and the ExpressionValue that each node of the tree would otherwise
+    need; only the variables are read through their bound getters, and only
+    the result is boxed.
+
+    Programs are built bottom up as the expression is bound: variables and
+    numeric constants get a program of one instruction, and operators whose
+    operands both have a program combine them.  See compileScalarOp().
+
+    The program only handles numbers and nulls.  If a variable turns out to
+    hold anything else (a string, a timestamp, a row, an integer that
+    doesn't fit exactly in a double) or a NaN is produced, run() returns
+    false and the expression is evaluated by the generic path, so the
+    result is always the same as without compilation.
+*/
+
+struct CompiledScalarExpression {
+
+    enum OpCode : uint8_t {
+        CONSTANT,        ///< Push constants[arg]
+        READ,            ///< Push the value of reads[arg]
+        PLUS,
+        MINUS,
+        MULTIPLY,
+        DIVIDE,
+        EQUAL,
+        NOT_EQUAL,
+        LESS,
+        GREATER,
+        LESS_EQUAL,
+        GREATER_EQUAL,
+        AND,
+        OR,
+        NOT
+    };
+
+    /// Unboxed value on the stack
+    struct Value {
+        double val;
+        Date ts;
+        bool null;
+
+        bool isTrue() const { return !null && val != 0; }
+        bool isFalse() const { return !null && val == 0; }
+    };
+
+    struct Instruction {
+        OpCode op;
+        uint32_t arg;
+    };
+
+    struct Read {
+        BoundSqlExpression::ExecFunction exec;
+
+        /// Read with the filter we were called with, or with GET_ALL
+        /// as the arithmetic and comparison operators do?
+        bool inheritFilter;
+    };
+
+    /// Deepest stack a program may use; deeper trees aren't compiled
+    enum { MAX_STACK = 64 };
+
+    /** Program that reads the given variable, or null if values of the
+        given type can't be numbers.
+    */
+    static std::shared_ptr<CompiledScalarExpression>
+    read(BoundSqlExpression::ExecFunction exec,
+         const ExpressionValueInfo & info);
+
+    /** Program that pushes the given constant, or null if it's not a
+        number or null.
+    */
+    static std::shared_ptr<CompiledScalarExpression>
+    constant(const ExpressionValue & val);
+
+    /** Program that applies op to the results of lhs and rhs (or only rhs
+        for NOT), or null if the result would be too deep.
+    */
+    static std::shared_ptr<CompiledScalarExpression>
+    combine(OpCode op,
+            const CompiledScalarExpression * lhs,
+            const CompiledScalarExpression & rhs);
+
+    /** Run the program.  Returns false if it met a value that it can't
+        handle, in which case the generic path must be used.
+    */
+    bool run(const SqlRowScope & row,
+             const VariableFilter & filter,
+             Value & result) const;
+
+    /** Exec function for the expression: runs the program and boxes the
+        result, or falls back to generic.
+    */
+    const ExpressionValue &
+    exec(const SqlRowScope & row,
+         ExpressionValue & storage,
+         const VariableFilter & filter) const;
+
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    std::vector<Read> reads;
+    int stackDepth;
+
+    /// Uncompiled version of the expression, used when run() fails
+    BoundSqlExpression::ExecFunction generic;
+};
+
+/** Return the bound expression for an operator, given its generic version
+    and its bound operands (lhs is null for unary operators).  If all of
+    the operands were compiled, the result runs the fused program;
+    otherwise generic is returned unchanged.
+*/
+BoundSqlExpression
+compileScalarOp(CompiledScalarExpression::OpCode op,
+                BoundSqlExpression generic,
+                const BoundSqlExpression * lhs,
+                const BoundSqlExpression & rhs);
+
+} // namespace MLDB
+} // namespace Datacratic
@@ -34,6 +34,18 @@ PipelineResultsDescription()
 }
 
 
+/*****************************************************************************/
+/* PIPELINE BATCH                                                            */
+/*****************************************************************************/
+
+size_t
+PipelineBatch::
+numSelected() const
+{
+    return std::count(selected.begin(), selected.end(), true);
+}
+
+
 /*****************************************************************************/
 /* LEXICAL SCOPE                                                             */
 /*****************************************************************************/
@@ -243,6 +255,13 @@ getMldbServer() const
     return context_->getMldbServer();
 }
 
+ssize_t
+PipelineExpressionScope::
+getHashJoinMinRows() const
+{
+    return context_->getHashJoinMinRows();
+}
+
 std::shared_ptr<Dataset>
 PipelineExpressionScope::
 doGetDataset(const Utf8String & datasetName)
@@ -290,6 +309,26 @@ doGetFunction(const Utf8String & functionName,
 /* ELEMENT EXECUTOR                                                          */
 /*****************************************************************************/
 
+constexpr size_t ElementExecutor::DEFAULT_BATCH_SIZE;
+
+bool
+ElementExecutor::
+takeBatch(size_t maxRows, PipelineBatch & batch)
+{
+    batch.clear();
+
+    std::shared_ptr<PipelineResults> res;
+    while (batch.size() < maxRows && (res = take())) {
+        // Rows may be shared (for example a group holds a reference to
+        // its key), in which case we can't steal their contents.
+        if (res.unique())
+            batch.add(std::move(*res));
+        else batch.add(*res);
+    }
+
+    return batch.size() > 0;
+}
+
 bool
 ElementExecutor::
 takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
@@ -301,6 +340,23 @@ takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
     return true;
 }
 
+bool
+ElementExecutor::
+takeAllInBatches(const std::function<bool (std::shared_ptr<PipelineResults> &)> & onResult)
+{
+    PipelineBatch batch;
+    while (takeBatch(DEFAULT_BATCH_SIZE, batch)) {
+        for (size_t i = 0;  i < batch.size();  ++i) {
+            if (!batch.selected[i])
+                continue;
+            auto res = std::make_shared<PipelineResults>(std::move(batch.rows[i]));
+            if (!onResult(res))
+                return false;
+        }
+    }
+    return true;
+}
+
 /*****************************************************************************/
 /* PIPELINE ELEMENT                                                          */
 /*****************************************************************************/
@@ -37,6 +37,57 @@ struct PipelineResults: public SqlRowScope {
 DECLARE_STRUCTURE_DESCRIPTION(PipelineResults);
 
 
+/*****************************************************************************/
+/* PIPELINE BATCH                                                            */
+/*****************************************************************************/
+
+/** A batch of rows that move through the pipeline together.  The rows are
+    held by value, so a batch costs a few allocations rather than one
+    shared pointer per row, and each element is called once per batch
+    rather than once per row.  Rows that are filtered out are deselected
+    in the selection mask rather than being removed, so that filtering
+    doesn't need to move anything.
+
+    The values of each row are still kept together, since bound
+    expressions read them from the row scope by field offset.
+*/
+
+struct PipelineBatch {
+    /// The rows in the batch.  Only those that are selected are live.
+    std::vector<PipelineResults> rows;
+
+    /// Selection mask; rows[i] is part of the output iff selected[i]
+    std::vector<char> selected;
+
+    size_t size() const
+    {
+        return rows.size();
+    }
+
+    /// Number of rows that are still selected
+    size_t numSelected() const;
+
+    /// Append a selected row to the batch
+    void add(PipelineResults row)
+    {
+        rows.emplace_back(std::move(row));
+        selected.push_back(true);
+    }
+
+    void clear()
+    {
+        rows.clear();
+        selected.clear();
+    }
+
+    void reserve(size_t n)
+    {
+        rows.reserve(n);
+        selected.reserve(n);
+    }
+};
+
+
 /*****************************************************************************/
 /* LEXICAL SCOPE                                                             */
 /*****************************************************************************/
@@ -159,6 +210,8 @@ struct PipelineExpressionScope:
 
     virtual MldbServer * getMldbServer() const;
 
+    virtual ssize_t getHashJoinMinRows() const;
+
     virtual std::shared_ptr<Dataset> doGetDataset(const Utf8String & datasetName);
     virtual std::shared_ptr<Dataset> doGetDatasetFromConfig(const Any & datasetConfig);
 
@@ -208,6 +261,9 @@ private:
 
 struct ElementExecutor {
 
+    /// Number of rows that are asked for at once when running in batches
+    static constexpr size_t DEFAULT_BATCH_SIZE = 1024;
+
     virtual ~ElementExecutor()
     {
     }
@@ -215,6 +271,18 @@ struct ElementExecutor {
     /** Take one element from the pipeline. */
     virtual std::shared_ptr<PipelineResults> take() = 0;
 
+    /** Take up to maxRows elements from the pipeline at once into the
+        given batch, which is cleared first.  Some of the rows returned
+        may already be deselected.  Returns false once the pipeline is
+        exhausted, in which case the batch is empty.
+
+        The default implementation calls take() for each row; elements
+        that can process a batch at once override it.  An executor should
+        be consumed either with take() or with takeBatch(), but not a
+        mixture of the two.
+    */
+    virtual bool takeBatch(size_t maxRows, PipelineBatch & batch);
+
     /** Take all elements from the pipeline.  inParallel describes whether
         the function can be called from multiple threads at once.
     */
@@ -222,6 +290,12 @@ struct ElementExecutor {
 
     /** Restart the executor from the start. */
     virtual void restart() = 0;
+
+protected:
+    /** Implementation of takeAll() for executors that implement
+        takeBatch() natively.
+    */
+    bool takeAllInBatches(const std::function<bool (std::shared_ptr<PipelineResults> &)> & onResult);
 };
 
 
@@ -254,6 +328,17 @@ struct BoundPipelineElement {
     {
         return outputScope()->numOutputFields();
     }
+
+    /** Return an estimate of the number of rows this element will
+        produce, or -1 if unknown.  This is used to plan joins.  The
+        default passes through to the source element, which gives an
+        upper bound for elements that only filter or transform rows.
+    */
+    virtual ssize_t estimateRowCount() const
+    {
+        auto source = boundSource();
+        return source ? source->estimateRowCount() : -1;
+    }
 };
 
 
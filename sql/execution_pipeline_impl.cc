@@ -13,6 +13,7 @@
 #include "table_expression_operations.h"
 #include <algorithm>
 #include "mldb/sql/sql_expression_operations.h"
+#include "mldb/jml/utils/worker_task.h"
 
 using namespace std;
 
@@ -241,6 +242,47 @@ take()
     return result;
 }
 
+bool
+GenerateRowsExecutor::
+takeBatch(size_t maxRows, PipelineBatch & batch)
+{
+    batch.clear();
+
+    // The rows from our source carry only the parameters and enclosing
+    // scope, which are the same for every row, so we take a single one
+    // per batch and copy it rather than taking one per row.
+    auto proto = source->take();
+    if (!proto)
+        return false;
+
+    batch.reserve(maxRows);
+
+    while (batch.size() < maxRows) {
+        if (currentDone == current.size() && !generateMore(*proto))
+            break;
+
+        size_t n = std::min(maxRows - batch.size(),
+                            current.size() - currentDone);
+        for (size_t i = 0;  i < n;  ++i, ++currentDone) {
+            PipelineResults row(*proto);
+            row.values.reserve(row.values.size() + 2);
+            row.values.emplace_back(current[currentDone].rowName.toUtf8String(),
+                                    Date::notADate());
+            row.values.emplace_back(std::move(current[currentDone].columns));
+            batch.add(std::move(row));
+        }
+    }
+
+    return batch.size() > 0;
+}
+
+bool
+GenerateRowsExecutor::
+takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
+{
+    return takeAllInBatches(onResult);
+}
+
 void
 GenerateRowsExecutor::
 restart()
@@ -328,6 +370,15 @@ outputScope() const
     return outputScope_;
 }
 
+ssize_t
+GenerateRowsElement::Bound::
+estimateRowCount() const
+{
+    if (!parent->from.getRowCount)
+        return -1;
+    return parent->from.getRowCount();
+}
+
 
 /*****************************************************************************/
 /* JOIN LEXICAL SCOPE                                                        */
@@ -620,6 +671,17 @@ JoinElement(std::shared_ptr<PipelineElement> root,
         ->from(right, when, selectAll, rightCondition,
                condition.right.orderBy)
         ->select(rightEmbedding);
+
+    // The hash join doesn't need its inputs sorted
+    leftUnorderedImpl = root
+        ->where(constantWhere)
+        ->from(left, when, selectAll, leftCondition, OrderByExpression())
+        ->select(leftEmbedding);
+
+    rightUnorderedImpl = root
+        ->where(constantWhere)
+        ->from(right, when, selectAll, rightCondition, OrderByExpression())
+        ->select(rightEmbedding);
 }
 
 std::shared_ptr<BoundPipelineElement>
@@ -629,11 +691,57 @@ bind() const
     return std::make_shared<Bound>(root->bind(),
                                    leftImpl->bind(),
                                    rightImpl->bind(),
+                                   leftUnorderedImpl->bind(),
+                                   rightUnorderedImpl->bind(),
                                    condition,
                                    joinQualification);
 }
 
 
+/*****************************************************************************/
+/* BATCHED INPUT EXECUTOR                                                    */
+/*****************************************************************************/
+
+BatchedInputExecutor::
+BatchedInputExecutor(std::shared_ptr<ElementExecutor> source)
+    : source(std::move(source)), batchPos(0), done(false)
+{
+    ExcAssert(this->source);
+}
+
+std::shared_ptr<PipelineResults>
+BatchedInputExecutor::
+take()
+{
+    for (;;) {
+        while (batchPos < batch.size()) {
+            size_t i = batchPos++;
+            if (batch.selected[i])
+                return std::make_shared<PipelineResults>(std::move(batch.rows[i]));
+        }
+
+        if (done)
+            return nullptr;
+
+        batchPos = 0;
+        if (!source->takeBatch(DEFAULT_BATCH_SIZE, batch)) {
+            done = true;
+            return nullptr;
+        }
+    }
+}
+
+void
+BatchedInputExecutor::
+restart()
+{
+    source->restart();
+    batch.clear();
+    batchPos = 0;
+    done = false;
+}
+
+
 /*****************************************************************************/
 /* CROSS JOIN EXECUTOR                                                       */
 /*****************************************************************************/
@@ -719,7 +827,8 @@ EquiJoinExecutor(const Bound * parent,
     : parent(parent),
       root(std::move(root)),
       left(std::move(left)),
-      right(std::move(right))
+      right(std::move(right)),
+      runPos(0)
 {
     l = this->left->take();
     r = this->right->take();
@@ -777,7 +886,14 @@ take()
     bool outerRight = parent->joinQualification_ == JOIN_RIGHT
         || parent->joinQualification_ == JOIN_FULL;
 
-    while (l && r) {
+    for (;;) {
+        // Finish joining the rows that share the key of the last match
+        auto fromRun = takeFromRun();
+        if (fromRun)
+            return fromRun;
+
+        if (!l || !r)
+            break;
 
         ExpressionValue & lEmbedding = l->values.back();
         ExpressionValue & rEmbedding = r->values.back();
@@ -820,35 +936,23 @@ take()
         }
 
         if (lField == rField) {
-            // Got a row!
-            //cerr << "*** got row match on " << jsonEncode(lField) << endl;
+            // Got a match.  Every left row with this key is joined with
+            // every right row with it, so we gather up all of the right
+            // rows with the key before going through the left ones.
+            runKey = lField;
+            rightRun.clear();
+            do {
+                // Pop the selected join condition from r
+                r->values.pop_back();
+                rightRun.emplace_back(std::move(r));
+                r = right->take();
+            } while (r && sameKey(*r, runKey, outerRight));
 
             // Pop the selected join condition from l
             l->values.pop_back();
-
-            // Pop the selected join condition from r
-            r->values.pop_back();
-
-            for (auto & v: r->values)
-                l->values.emplace_back(std::move(v));
-
-            //cerr << "returning " << jsonEncode(l) << endl;
-
-            auto result = std::move(l);
-
+            lRun = std::move(l);
             l = left->take();
-            r = right->take();
-
-            //cerr << "applying where " << parent->crossWhere_.expr->print()
-            //     << " to " << jsonEncode(result->values) << endl;
-
-            ExpressionValue storage;
-            if (!parent->crossWhere_(*result, storage).isTrue())
-            {
-                continue;
-            }
-
-            return result;
+            runPos = 0;
         }
         else if (lField < rField) {
             do {
@@ -889,11 +993,62 @@ take()
     return nullptr;
 }
 
+bool
+JoinElement::EquiJoinExecutor::
+sameKey(const PipelineResults & row, const ExpressionValue & key,
+        bool isOuter)
+{
+    const ExpressionValue & embedding = row.values.back();
+    if (embedding.empty())
+        return false;
+    // On an outer side, rows that fail the side's where clause can't match
+    if (isOuter && !embedding.getField(1).isTrue())
+        return false;
+    return embedding.getField(0) == key;
+}
+
+std::shared_ptr<PipelineResults>
+JoinElement::EquiJoinExecutor::
+takeFromRun()
+{
+    bool outerLeft = parent->joinQualification_ == JOIN_LEFT
+        || parent->joinQualification_ == JOIN_FULL;
+
+    while (lRun) {
+        while (runPos < rightRun.size()) {
+            auto result = std::make_shared<PipelineResults>(*lRun);
+            const PipelineResults & rRow = *rightRun[runPos++];
+            result->values.insert(result->values.end(),
+                                  rRow.values.begin(), rRow.values.end());
+
+            ExpressionValue storage;
+            if (parent->crossWhere_(*result, storage).isTrue())
+                return result;
+        }
+
+        // The next left row joins with the same right rows if it has the
+        // same key
+        lRun.reset();
+        if (l && sameKey(*l, runKey, outerLeft)) {
+            l->values.pop_back();
+            lRun = std::move(l);
+            l = left->take();
+            runPos = 0;
+        }
+    }
+
+    rightRun.clear();
+    return nullptr;
+}
+
 void
 JoinElement::EquiJoinExecutor::
 restart()
 {
     //cerr << "**** equijoin restart" << endl;
+    lRun.reset();
+    rightRun.clear();
+    runPos = 0;
     left->restart();
     right->restart();
     l = left->take();
@@ -902,6 +1057,324 @@ restart()
 }
 
 
+/*****************************************************************************/
+/* HASH JOIN EXECUTOR                                                        */
+/*****************************************************************************/
+
+namespace {
+
+/// Number of partitions of the hash table when building in parallel
+static constexpr size_t HASH_JOIN_PARTITIONS = 32;
+
+/// Minimum number of build rows before we build the table in parallel
+static constexpr size_t HASH_JOIN_PARALLEL_MIN_ROWS = 10000;
+
+} // file scope
+
+JoinElement::HashJoinExecutor::
+HashJoinExecutor(const Bound * parent,
+                 std::shared_ptr<ElementExecutor> root,
+                 std::shared_ptr<ElementExecutor> build,
+                 std::shared_ptr<ElementExecutor> probe,
+                 bool buildIsLeft,
+                 bool allowParallel)
+    : parent(parent),
+      root(std::move(root)),
+      build(std::move(build)),
+      probe(std::move(probe)),
+      buildIsLeft(buildIsLeft),
+      allowParallel(allowParallel),
+      built(false),
+      probeBatchPos(0),
+      probeDone(false),
+      haveProbeRow(false),
+      probeMatched(false),
+      currentMatches(nullptr),
+      matchNum(0),
+      unmatchedPos(0)
+{
+    ExcAssert(parent && this->root && this->build && this->probe);
+
+    bool outerLeft = parent->joinQualification_ == JOIN_LEFT
+        || parent->joinQualification_ == JOIN_FULL;
+    bool outerRight = parent->joinQualification_ == JOIN_RIGHT
+        || parent->joinQualification_ == JOIN_FULL;
+
+    buildOuter = buildIsLeft ? outerLeft : outerRight;
+    probeOuter = buildIsLeft ? outerRight : outerLeft;
+}
+
+bool
+JoinElement::HashJoinExecutor::
+extractKey(PipelineResults & row, bool isOuter,
+           ExpressionValue & key, bool & canMatch)
+{
+    ExcAssert(!row.values.empty());
+    ExpressionValue embedding = std::move(row.values.back());
+    row.values.pop_back();
+
+    if (embedding.empty())
+        return false;
+
+    key = embedding.getField(0);
+
+    if (isOuter) {
+        // The side's where clause was moved into the join condition so
+        // that we see all of its rows
+        canMatch = !key.empty() && embedding.getField(1).isTrue();
+        return true;
+    }
+
+    canMatch = true;
+    return !key.empty();
+}
+
+void
+JoinElement::HashJoinExecutor::
+buildTable()
+{
+    ExcAssert(!built);
+
+    std::vector<ExpressionValue> keys;
+    std::vector<char> canMatch;
+
+    PipelineBatch batch;
+    while (build->takeBatch(ElementExecutor::DEFAULT_BATCH_SIZE, batch)) {
+        for (size_t i = 0;  i < batch.size();  ++i) {
+            if (!batch.selected[i])
+                continue;
+            PipelineResults & row = batch.rows[i];
+            ExpressionValue key;
+            bool match = false;
+            if (!extractKey(row, buildOuter, key, match))
+                continue;
+            buildRows.emplace_back(std::move(row));
+            keys.emplace_back(std::move(key));
+            canMatch.push_back(match);
+        }
+    }
+
+    if (buildRows.size() > std::numeric_limits<uint32_t>::max())
+        throw HttpReturnException(400, "Too many rows on build side of "
+                                  "hash join",
+                                  "numRows", buildRows.size());
+
+    buildMatched.clear();
+    buildMatched.resize(buildRows.size(), false);
+
+    size_t numPartitions
+        = allowParallel && buildRows.size() >= HASH_JOIN_PARALLEL_MIN_ROWS
+        ? HASH_JOIN_PARTITIONS : 1;
+
+    // Assign each row to its partition
+    std::vector<std::vector<uint32_t> > partitionRows(numPartitions);
+    for (size_t i = 0;  i < buildRows.size();  ++i) {
+        if (!canMatch[i])
+            continue;
+        size_t p = numPartitions == 1 ? 0 : keys[i].hash() % numPartitions;
+        partitionRows[p].push_back(i);
+    }
+
+    // Each partition is built independently, and so they can be done in
+    // parallel
+    partitions.clear();
+    partitions.resize(numPartitions);
+
+    auto buildPartition = [&] (int p)
+        {
+            Partition & partition = partitions[p];
+            partition.reserve(partitionRows[p].size());
+            for (uint32_t i: partitionRows[p])
+                partition[std::move(keys[i])].push_back(i);
+        };
+
+    if (numPartitions == 1)
+        buildPartition(0);
+    else ML::run_in_parallel(0, numPartitions, buildPartition);
+
+    built = true;
+}
+
+bool
+JoinElement::HashJoinExecutor::
+takeProbeRow()
+{
+    for (;;) {
+        if (probeBatchPos == probeBatch.size()) {
+            if (probeDone)
+                return false;
+            probeBatchPos = 0;
+            if (!probe->takeBatch(ElementExecutor::DEFAULT_BATCH_SIZE,
+                                  probeBatch)) {
+                probeDone = true;
+                return false;
+            }
+        }
+
+        size_t i = probeBatchPos++;
+        if (!probeBatch.selected[i])
+            continue;
+
+        PipelineResults & row = probeBatch.rows[i];
+        ExpressionValue key;
+        bool canMatch = false;
+        if (!extractKey(row, probeOuter, key, canMatch))
+            continue;
+
+        probeRow = std::move(row);
+        haveProbeRow = true;
+        probeMatched = false;
+        currentMatches = nullptr;
+        matchNum = 0;
+
+        if (canMatch) {
+            const Partition & partition
+                = partitions[partitions.size() == 1
+                             ? 0 : key.hash() % partitions.size()];
+            auto it = partition.find(key);
+            if (it != partition.end())
+                currentMatches = &it->second;
+        }
+
+        return true;
+    }
+}
+
+PipelineResults
+JoinElement::HashJoinExecutor::
+joinRows(const PipelineResults & buildRow) const
+{
+    const PipelineResults & l = buildIsLeft ? buildRow : probeRow;
+    const PipelineResults & r = buildIsLeft ? probeRow : buildRow;
+
+    PipelineResults result(l.inner);
+    result.getParam = l.getParam;
+    result.values.reserve(l.values.size() + r.values.size());
+    result.values.insert(result.values.end(),
+                         l.values.begin(), l.values.end());
+    result.values.insert(result.values.end(),
+                         r.values.begin(), r.values.end());
+    return result;
+}
+
+PipelineResults
+JoinElement::HashJoinExecutor::
+unmatchedRow(const PipelineResults & row, bool isLeft) const
+{
+    // Fill in the row name and row of the other side with empty values,
+    // in the same layout as the merge join
+    PipelineResults result(row);
+    if (isLeft) {
+        result.values.emplace_back(ExpressionValue("", Date::notADate()));
+        result.values.emplace_back(ExpressionValue("", Date::notADate()));
+    }
+    else {
+        result.values.insert(result.values.begin(),
+                             ExpressionValue("", Date::notADate()));
+        result.values.insert(result.values.begin(),
+                             ExpressionValue("", Date::notADate()));
+    }
+    return result;
+}
+
+bool
+JoinElement::HashJoinExecutor::
+next(PipelineResults & output)
+{
+    if (!built)
+        buildTable();
+
+    for (;;) {
+        // Return the matches of the current probe row
+        while (currentMatches && matchNum < currentMatches->size()) {
+            uint32_t b = (*currentMatches)[matchNum++];
+            output = joinRows(buildRows[b]);
+
+            ExpressionValue storage;
+            if (!parent->crossWhere_(output, storage).isTrue())
+                continue;
+
+            buildMatched[b] = true;
+            probeMatched = true;
+            return true;
+        }
+
+        if (haveProbeRow) {
+            haveProbeRow = false;
+            currentMatches = nullptr;
+            if (probeOuter && !probeMatched) {
+                output = unmatchedRow(probeRow, !buildIsLeft);
+                return true;
+            }
+        }
+
+        if (!takeProbeRow())
+            break;
+    }
+
+    // The probe side is finished; for outer joins, return the build side
+    // rows that never matched
+    if (buildOuter) {
+        while (unmatchedPos < buildRows.size()) {
+            size_t i = unmatchedPos++;
+            if (!buildMatched[i]) {
+                output = unmatchedRow(buildRows[i], buildIsLeft);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+std::shared_ptr<PipelineResults>
+JoinElement::HashJoinExecutor::
+take()
+{
+    PipelineResults output;
+    if (!next(output))
+        return nullptr;
+    return std::make_shared<PipelineResults>(std::move(output));
+}
+
+bool
+JoinElement::HashJoinExecutor::
+takeBatch(size_t maxRows, PipelineBatch & batch)
+{
+    batch.clear();
+
+    PipelineResults output;
+    while (batch.size() < maxRows && next(output))
+        batch.add(std::move(output));
+
+    return batch.size() > 0;
+}
+
+bool
+JoinElement::HashJoinExecutor::
+takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
+{
+    return takeAllInBatches(onResult);
+}
+
+void
+JoinElement::HashJoinExecutor::
+restart()
+{
+    // The hash table is kept; only the probe side needs to be re-run
+    probe->restart();
+    std::fill(buildMatched.begin(), buildMatched.end(), false);
+    probeBatch.clear();
+    probeBatchPos = 0;
+    probeDone = false;
+    haveProbeRow = false;
+    probeMatched = false;
+    currentMatches = nullptr;
+    matchNum = 0;
+    unmatchedPos = 0;
+}
+
+
 /*****************************************************************************/
 /* BOUND JOIN EXECUTOR                                                       */
 /*****************************************************************************/
@@ -910,15 +1383,20 @@ JoinElement::Bound::
 Bound(std::shared_ptr<BoundPipelineElement> root,
       std::shared_ptr<BoundPipelineElement> left,
       std::shared_ptr<BoundPipelineElement> right,
+      std::shared_ptr<BoundPipelineElement> leftUnordered,
+      std::shared_ptr<BoundPipelineElement> rightUnordered,
       AnnotatedJoinCondition condition,
       JoinQualification joinQualification)
     : root_(std::move(root)),
       left_(std::move(left)),
       right_(std::move(right)),
+      leftUnordered_(std::move(leftUnordered)),
+      rightUnordered_(std::move(rightUnordered)),
       outputScope_(createOutputScope()),
       crossWhere_(condition.crossWhere->bind(*outputScope_)),
       condition_(std::move(condition)),
-      joinQualification_(joinQualification)
+      joinQualification_(joinQualification),
+      hashJoinMinRows_(root_->outputScope()->getHashJoinMinRows())
 {
 }
 
@@ -962,18 +1440,57 @@ start(const BoundParameters & getParam,
     switch (condition_.style) {
 
     case AnnotatedJoinCondition::CROSS_JOIN:
+        // The left side is restarted for each row on the right, and an
+        // ordered side would have to be sorted again each time if it were
+        // read in batches, so only the right side is
         return std::make_shared<CrossJoinExecutor>
             (this,
              root_->start(getParam, allowParallel),
              left_->start(getParam, allowParallel),
-             right_->start(getParam, allowParallel));
+             std::make_shared<BatchedInputExecutor>
+                 (right_->start(getParam, allowParallel)));
+
+    case AnnotatedJoinCondition::EQUIJOIN: {
+        ssize_t leftRows = leftUnordered_->estimateRowCount();
+        ssize_t rightRows = rightUnordered_->estimateRowCount();
+
+        // We build the hash table on the side that's known to be smaller.
+        // It's only worth it (and only safe to hold in memory) when that
+        // side is known to be below the threshold and the other isn't;
+        // everything else is sorted and merged, which also keeps the
+        // output in join key order.
+        bool buildIsLeft = leftRows != -1
+            && (rightRows == -1 || leftRows < rightRows);
+        ssize_t buildRows = buildIsLeft ? leftRows : rightRows;
+        ssize_t probeRows = buildIsLeft ? rightRows : leftRows;
+
+        bool useHashJoin = buildRows != -1
+            && buildRows < hashJoinMinRows_
+            && (probeRows == -1 || probeRows >= hashJoinMinRows_);
+
+        if (!useHashJoin) {
+            // The merge steps through both sides a row at a time, but
+            // they can still produce their rows in batches
+            return std::make_shared<EquiJoinExecutor>
+                (this,
+                 root_->start(getParam, allowParallel),
+                 std::make_shared<BatchedInputExecutor>
+                     (left_->start(getParam, allowParallel)),
+                 std::make_shared<BatchedInputExecutor>
+                     (right_->start(getParam, allowParallel)));
+        }
 
-    case AnnotatedJoinCondition::EQUIJOIN:
-        return std::make_shared<EquiJoinExecutor>
+        auto leftExec = leftUnordered_->start(getParam, allowParallel);
+        auto rightExec = rightUnordered_->start(getParam, allowParallel);
+
+        return std::make_shared<HashJoinExecutor>
             (this,
              root_->start(getParam, allowParallel),
-             left_->start(getParam, allowParallel),
-             right_->start(getParam, allowParallel));
+             buildIsLeft ? leftExec : rightExec,
+             buildIsLeft ? rightExec : leftExec,
+             buildIsLeft,
+             allowParallel);
+    }
 
     default:
         throw HttpReturnException(400, "Can't execute that kind of join",
@@ -995,6 +1512,13 @@ outputScope() const
     return outputScope_;
 }
 
+ssize_t
+JoinElement::Bound::
+estimateRowCount() const
+{
+    return -1;
+}
+
 
 /*****************************************************************************/
 /* ROOT ELEMENT                                                              */
@@ -1181,6 +1705,32 @@ take()
     }
 }
 
+bool
+FilterWhereElement::Executor::
+takeBatch(size_t maxRows, PipelineBatch & batch)
+{
+    if (!source_->takeBatch(maxRows, batch))
+        return false;
+
+    // Deselect the rows for which the where expression isn't true
+    ExpressionValue storage;
+    for (size_t i = 0;  i < batch.size();  ++i) {
+        if (!batch.selected[i])
+            continue;
+        const ExpressionValue & pass = parent_->where_(batch.rows[i], storage);
+        batch.selected[i] = pass.isTrue();
+    }
+
+    return true;
+}
+
+bool
+FilterWhereElement::Executor::
+takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
+{
+    return takeAllInBatches(onResult);
+}
+
 void
 FilterWhereElement::Executor::
 restart()
@@ -1279,6 +1829,40 @@ take()
     }
 }
 
+bool
+SelectElement::Executor::
+takeBatch(size_t maxRows, PipelineBatch & batch)
+{
+    if (!source->takeBatch(maxRows, batch))
+        return false;
+
+    // Run the select expression over all selected rows at once, which
+    // allows function calls within it to work on the whole batch
+    std::vector<const SqlRowScope *> rows;
+    rows.reserve(batch.size());
+    for (size_t i = 0;  i < batch.size();  ++i) {
+        if (batch.selected[i])
+            rows.push_back(&batch.rows[i]);
+    }
+
+    std::vector<ExpressionValue> selected;
+    parent->select_.execBatch(rows, selected);
+
+    for (size_t i = 0, n = 0;  i < batch.size();  ++i) {
+        if (batch.selected[i])
+            batch.rows[i].values.emplace_back(std::move(selected[n++]));
+    }
+
+    return true;
+}
+
+bool
+SelectElement::Executor::
+takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
+{
+    return takeAllInBatches(onResult);
+}
+
 void
 SelectElement::Executor::
 restart()
@@ -1355,7 +1939,7 @@ OrderByElement::Executor::
 Executor(const Bound * parent,
          std::shared_ptr<ElementExecutor> source)
     : parent(parent), source(std::move(source)),
-      numDone(-1)
+      numDone(-1), numRowsDone(-1)
 {
 }
 
@@ -1405,12 +1989,73 @@ take()
     return sorted[numDone++];
 }
 
+bool
+OrderByElement::Executor::
+takeBatch(size_t maxRows, PipelineBatch & batch)
+{
+    // As for take(), the first call grabs and sorts the entire input, but
+    // the rows are kept by value and read from the source in batches.
+    if (numRowsDone == -1) {
+        PipelineBatch input;
+        while (source->takeBatch(maxRows, input)) {
+            for (size_t i = 0;  i < input.size();  ++i) {
+                if (input.selected[i])
+                    sortedRows.emplace_back(std::move(input.rows[i]));
+            }
+        }
+
+        int offset
+            = parent->scope_->numOutputFields()
+            - parent->orderBy_.clauses.size();
+
+        auto compare = [&] (const PipelineResults & p1,
+                            const PipelineResults & p2)
+            -> bool
+            {
+                return parent->orderBy_.less(p1.values, p2.values, offset);
+            };
+
+        std::sort(sortedRows.begin(), sortedRows.end(), compare);
+
+        numRowsDone = 0;
+    }
+
+    batch.clear();
+
+    size_t n = std::min<size_t>(maxRows, sortedRows.size() - numRowsDone);
+    if (n == 0) {
+        sortedRows.clear();
+        return false;
+    }
+
+    batch.reserve(n);
+    for (size_t i = 0;  i < n;  ++i)
+        batch.add(std::move(sortedRows[numRowsDone++]));
+
+    return true;
+}
+
+bool
+OrderByElement::Executor::
+takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult)
+{
+    return takeAllInBatches(onResult);
+}
+
 void
 OrderByElement::Executor::
 restart()
 {
     // Don't re-sort the elements...
     numDone = 0;
+
+    // ... unless they were taken in batches, in which case they were
+    // moved out as they were returned and we need to start again.
+    if (numRowsDone != -1) {
+        source->restart();
+        sortedRows.clear();
+        numRowsDone = -1;
+    }
 }
 
 
@@ -9,6 +9,8 @@
 
 #include "execution_pipeline.h"
 #include "join_utils.h"
+#include <unordered_map>
+#include <atomic>
 
 namespace Datacratic {
 namespace MLDB {
@@ -75,6 +77,10 @@ struct GenerateRowsExecutor: public ElementExecutor {
 
     virtual std::shared_ptr<PipelineResults> take();
 
+    virtual bool takeBatch(size_t maxRows, PipelineBatch & batch);
+
+    virtual bool takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult);
+
     virtual void restart();
 };
 
@@ -120,6 +126,9 @@ struct GenerateRowsElement: public PipelineElement {
 
         virtual std::shared_ptr<PipelineExpressionScope>
         outputScope() const;
+
+        /** Asks the table how many rows it contains. */
+        virtual ssize_t estimateRowCount() const;
     };
 
     std::shared_ptr<BoundPipelineElement> bind() const;
@@ -179,13 +188,42 @@ struct JoinLexicalScope: public LexicalScope {
 };
 
 
+/*****************************************************************************/
+/* BATCHED INPUT EXECUTOR                                                    */
+/*****************************************************************************/
+
+/** Executor that reads its source a batch at a time, and hands the rows
+    out one at a time with take().  This is for elements such as the merge
+    join that need to step through their input row by row, so that the
+    elements feeding them can still run in batches.
+*/
+
+struct BatchedInputExecutor: public ElementExecutor {
+    BatchedInputExecutor(std::shared_ptr<ElementExecutor> source);
+
+    std::shared_ptr<ElementExecutor> source;
+
+    /// Batch read from the source, and the next row of it to return
+    PipelineBatch batch;
+    size_t batchPos;
+    bool done;
+
+    virtual std::shared_ptr<PipelineResults> take();
+
+    virtual void restart();
+};
+
+
 /*****************************************************************************/
 /* JOIN ELEMENT                                                              */
 /*****************************************************************************/
 
 /** An element that joins two tables together.  This is typically implemented
     by generating both sides sorted on the join key, and then iterating
-    through matching rows.
+    through matching rows.  When one side of an equijoin is large, a hash
+    join is used instead which avoids sorting either side: the smaller
+    side is loaded into a hash table, and the larger side streamed past
+    it.
 */
 
 struct JoinElement: public PipelineElement {
@@ -211,6 +249,11 @@ struct JoinElement: public PipelineElement {
     std::shared_ptr<PipelineElement> leftImpl;
     std::shared_ptr<PipelineElement> rightImpl;
 
+    /// Same as leftImpl and rightImpl, but without sorting on the join
+    /// key.  Used for hash joins.
+    std::shared_ptr<PipelineElement> leftUnorderedImpl;
+    std::shared_ptr<PipelineElement> rightUnorderedImpl;
+
     struct Bound;
 
     struct CrossJoinExecutor: public ElementExecutor {
@@ -240,13 +283,109 @@ struct JoinElement: public PipelineElement {
         
         std::shared_ptr<PipelineResults> l,r;
 
+        /// Right rows (without their join condition) with the key of the
+        /// last match, the left row being joined with them and the next
+        /// one of them to join it with
+        std::vector<std::shared_ptr<PipelineResults> > rightRun;
+        ExpressionValue runKey;
+        std::shared_ptr<PipelineResults> lRun;
+        size_t runPos;
+
         void takeMoreInput();
+
+        /// Does the row have the given key, and can it be matched?
+        static bool sameKey(const PipelineResults & row,
+                            const ExpressionValue & key,
+                            bool isOuter);
+
+        /// Return the next joined row from the current run, or null
+        std::shared_ptr<PipelineResults> takeFromRun();
             
         virtual std::shared_ptr<PipelineResults> take();
 
         virtual void restart();
     };
 
+    /** Executor for an equijoin that loads one side (the build side) into
+        a hash table keyed on the join key, and then streams the other
+        side (the probe side) through it.  Neither side needs to be
+        sorted, and only the build side is held in memory, so the build
+        side should be the smaller of the two.  Output rows are in the
+        order of the probe side, followed by unmatched build side rows
+        for outer joins.
+    */
+    struct HashJoinExecutor: public ElementExecutor {
+        HashJoinExecutor(const Bound * parent,
+                         std::shared_ptr<ElementExecutor> root,
+                         std::shared_ptr<ElementExecutor> build,
+                         std::shared_ptr<ElementExecutor> probe,
+                         bool buildIsLeft,
+                         bool allowParallel);
+
+        const Bound * parent;
+        std::shared_ptr<ElementExecutor> root, build, probe;
+        bool buildIsLeft;
+        bool buildOuter, probeOuter;
+        bool allowParallel;
+
+        /// Have we read the build side and constructed the hash table?
+        bool built;
+
+        /// Rows of the build side, with the join condition popped off
+        std::vector<PipelineResults> buildRows;
+
+        /// Has each build row been matched (for outer joins)?
+        std::vector<char> buildMatched;
+
+        /// Index of build rows for each join key.  The table is split into
+        /// partitions on the hash of the key so that it can be built in
+        /// parallel.
+        typedef std::unordered_map<ExpressionValue, std::vector<uint32_t> >
+            Partition;
+        std::vector<Partition> partitions;
+
+        /// Batch of rows read from the probe side
+        PipelineBatch probeBatch;
+        size_t probeBatchPos;
+        bool probeDone;
+
+        /// Current row of the probe side and the build rows it matches
+        PipelineResults probeRow;
+        bool haveProbeRow;
+        bool probeMatched;
+        const std::vector<uint32_t> * currentMatches;
+        size_t matchNum;
+
+        /// Position in buildRows when returning unmatched rows
+        size_t unmatchedPos;
+
+        /** Extract the join key from the row's join condition, which is
+            then popped off.  Returns false if the row should be dropped
+            entirely.  canMatch is set to false for rows of an outer side
+            which are output but can't match anything.
+        */
+        static bool extractKey(PipelineResults & row, bool isOuter,
+                               ExpressionValue & key, bool & canMatch);
+
+        void buildTable();
+        bool takeProbeRow();
+        PipelineResults joinRows(const PipelineResults & buildRow) const;
+        PipelineResults unmatchedRow(const PipelineResults & row,
+                                     bool isLeft) const;
+
+        /// Put the next output row into output.  Returns false once the
+        /// join is finished.
+        bool next(PipelineResults & output);
+
+        virtual std::shared_ptr<PipelineResults> take();
+
+        virtual bool takeBatch(size_t maxRows, PipelineBatch & batch);
+
+        virtual bool takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult);
+
+        virtual void restart();
+    };
+
     struct Bound: public BoundPipelineElement {
 
         /** Bind this in.  The main difficulty is with the output scope, which
@@ -256,17 +395,24 @@ struct JoinElement: public PipelineElement {
         Bound(std::shared_ptr<BoundPipelineElement> root,
               std::shared_ptr<BoundPipelineElement> left,
               std::shared_ptr<BoundPipelineElement> right,
+              std::shared_ptr<BoundPipelineElement> leftUnordered,
+              std::shared_ptr<BoundPipelineElement> rightUnordered,
               AnnotatedJoinCondition condition,
               JoinQualification joinQualification);
 
         std::shared_ptr<BoundPipelineElement> root_;
         std::shared_ptr<BoundPipelineElement> left_;
         std::shared_ptr<BoundPipelineElement> right_;
+        std::shared_ptr<BoundPipelineElement> leftUnordered_;
+        std::shared_ptr<BoundPipelineElement> rightUnordered_;
         std::shared_ptr<PipelineExpressionScope> outputScope_;
         BoundSqlExpression crossWhere_;
         AnnotatedJoinCondition condition_;
         JoinQualification joinQualification_;
 
+        /// Taken from the binding scope; see getHashJoinMinRows()
+        ssize_t hashJoinMinRows_;
+
         /** Our output scope has:
             - The left and right tables
             - A default scope for the common join
@@ -274,6 +420,11 @@ struct JoinElement: public PipelineElement {
         std::shared_ptr<PipelineExpressionScope>
         createOutputScope();
         
+        /** Start the join.  Equijoins use a hash join when either side is
+            known to be large, building the hash table on the smaller
+            side.  Small joins use the merge join on sorted
+            inputs, which gives ordered output.
+        */
         std::shared_ptr<ElementExecutor>
         start(const BoundParameters & getParam,
               bool allowParallel) const;
@@ -285,6 +436,9 @@ struct JoinElement: public PipelineElement {
             output context is the same as its input context.
         */
         virtual std::shared_ptr<PipelineExpressionScope> outputScope() const;
+
+        /** The size of a join can't be estimated from its inputs. */
+        virtual ssize_t estimateRowCount() const;
     };
 
     std::shared_ptr<BoundPipelineElement>
@@ -382,6 +536,10 @@ struct FilterWhereElement: public PipelineElement {
 
         virtual std::shared_ptr<PipelineResults> take();
 
+        virtual bool takeBatch(size_t maxRows, PipelineBatch & batch);
+
+        virtual bool takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult);
+
         virtual void restart();
     };
 
@@ -437,6 +595,10 @@ struct SelectElement: public PipelineElement {
 
         virtual std::shared_ptr<PipelineResults> take();
 
+        virtual bool takeBatch(size_t maxRows, PipelineBatch & batch);
+
+        virtual bool takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult);
+
         virtual void restart();
     };
 
@@ -491,9 +653,17 @@ struct OrderByElement: public PipelineElement {
         std::vector<std::shared_ptr<PipelineResults> > sorted;
         ssize_t numDone;
 
+        /// Rows sorted by value for takeBatch(), and how many we've returned
+        std::vector<PipelineResults> sortedRows;
+        ssize_t numRowsDone;
+
         // When we take elements, we take a group at a time
         virtual std::shared_ptr<PipelineResults> take();
 
+        virtual bool takeBatch(size_t maxRows, PipelineBatch & batch);
+
+        virtual bool takeAll(std::function<bool (std::shared_ptr<PipelineResults> &)> onResult);
+
         virtual void restart();
     };
 
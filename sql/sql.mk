@@ -5,6 +5,7 @@ SQL_EXPRESSION_SOURCES := \
 	sql_expression.cc \
 	expression_value.cc \
 	sql_expression_operations.cc \
+	compiled_expression.cc \
 	table_expression_operations.cc \
 	binding_contexts.cc \
 	builtin_functions.cc \
@@ -19,5 +20,5 @@ SQL_EXPRESSION_SOURCES := \
 	coord.cc
 
 # NOTE: the SQL library should NOT depend on MLDB.  See the comment in testing/testing.mk
-$(eval $(call library,sql_expression,$(SQL_EXPRESSION_SOURCES),types utils value_description any ml services_base json_diff siphash hash))
+$(eval $(call library,sql_expression,$(SQL_EXPRESSION_SOURCES),types utils value_description any ml services_base json_diff siphash hash worker_task))
 
@@ -110,6 +110,23 @@ BoundSqlExpression(ExecFunction exec,
 {
 }
 
+void
+BoundSqlExpression::
+execBatch(const std::vector<const SqlRowScope *> & rows,
+          std::vector<ExpressionValue> & output,
+          const VariableFilter & filter) const
+{
+    if (batchExec) {
+        batchExec(rows, output, filter);
+        ExcAssertEqual(output.size(), rows.size());
+        return;
+    }
+
+    output.resize(rows.size());
+    for (size_t i = 0;  i < rows.size();  ++i)
+        output[i] = (*this)(*rows[i], filter);
+}
+
 ExpressionValue
 BoundSqlExpression::
 constantValue() const
@@ -409,6 +426,13 @@ getMldbServer() const
     return nullptr;
 }
 
+ssize_t
+SqlBindingScope::
+getHashJoinMinRows() const
+{
+    return DEFAULT_HASH_JOIN_MIN_ROWS;
+}
+
 /*****************************************************************************/
 /* SCOPED NAME                                                               */
 /*****************************************************************************/
@@ -2864,7 +2888,36 @@ bind(SqlBindingScope & context) const
             return storage = std::move(ExpressionValue(std::move(result)));
         };
 
-    return BoundSqlExpression(exec, this, outputInfo, isConstant);
+    BoundSqlExpression result(exec, this, outputInfo, isConstant);
+
+    // If one of the clauses can run over a batch, then we run each of the
+    // clauses over the whole batch so that it gets the chance
+    bool anyBatch = false;
+    for (auto & c: boundClauses)
+        anyBatch = anyBatch || c.batchExec;
+
+    if (anyBatch) {
+        result.batchExec = [=] (const std::vector<const SqlRowScope *> & rows,
+                                std::vector<ExpressionValue> & output,
+                                const VariableFilter & filter)
+            {
+                std::vector<StructValue> results(rows.size());
+                std::vector<ExpressionValue> clauseOutput;
+
+                for (auto & c: boundClauses) {
+                    c.execBatch(rows, clauseOutput, filter);
+                    for (size_t i = 0;  i < rows.size();  ++i)
+                        clauseOutput[i].mergeToRowDestructive(results[i]);
+                }
+
+                output.clear();
+                output.reserve(rows.size());
+                for (auto & r: results)
+                    output.emplace_back(std::move(r));
+            };
+    }
+
+    return result;
 }
 
 Utf8String
@@ -74,6 +74,7 @@ struct SqlRowExpression;
 struct OrderByExpression;
 struct TupleExpression;
 struct GenerateRowsWhereFunction;
+struct CompiledScalarExpression;
 struct SelectExpression;
 struct Function;
 struct SqlBindingScope;
@@ -167,7 +168,29 @@ struct BoundSqlExpression {
     
     operator bool () const { return !!exec; };
 
+    /** Function type to execute the expression over a batch of rows,
+        writing one value per row into output (which is resized to the
+        number of rows).
+    */
+    typedef std::function<void (const std::vector<const SqlRowScope *> & rows,
+                                std::vector<ExpressionValue> & output,
+                                const VariableFilter & filter)> BatchExecFunction;
+
     ExecFunction exec;
+
+    /** Optional version of exec for a batch of rows.  It's provided by
+        expressions that can share work between rows, for example calls to
+        functions that score many rows at once.  Use execBatch() rather
+        than calling it directly.
+    */
+    BatchExecFunction batchExec;
+
+    /** Optional fused program for scalar expressions over numbers, which
+        exec runs when it can.  Operators whose operands are all compiled
+        combine their programs into one.  See compiled_expression.h.
+    */
+    std::shared_ptr<const CompiledScalarExpression> compiled;
+
     std::shared_ptr<const SqlExpression> expr;
 
     /// What kind of value does this return?
@@ -200,6 +223,13 @@ struct BoundSqlExpression {
         return res;
     }
 
+    /** Execute the expression over each of the rows.  This uses batchExec
+        if the expression provides it, and otherwise calls exec on each
+        row.
+    */
+    void execBatch(const std::vector<const SqlRowScope *> & rows,
+                   std::vector<ExpressionValue> & output,
+                   const VariableFilter & filter = GET_ALL) const;
 };
 
 DECLARE_STRUCTURE_DESCRIPTION(BoundSqlExpression);
@@ -235,6 +265,11 @@ struct TableOperations {
                                      bool allowParallel)>
     runQuery;
 
+    /// Estimate the number of rows in the table, or -1 if unknown.  This
+    /// is used for planning only (eg, picking the build side of a join)
+    /// and may be left unset.
+    std::function<ssize_t ()> getRowCount;
+
     bool operator ! () const {return !getRowInfo && !getFunction  && !runQuery; }
 };
 
@@ -582,6 +617,16 @@ struct SqlBindingScope {
     */
     virtual MldbServer * getMldbServer() const;
 
+    /// Default for getHashJoinMinRows()
+    static constexpr ssize_t DEFAULT_HASH_JOIN_MIN_ROWS = 100000;
+
+    /** Return the size above which an equijoin is worth doing as a hash
+        join rather than a merge join, if the other side is known to be
+        smaller than it (see JoinElement).  Default returns
+        DEFAULT_HASH_JOIN_MIN_ROWS.
+    */
+    virtual ssize_t getHashJoinMinRows() const;
+
     size_t functionStackDepth;
 };
 
@@ -6,6 +6,7 @@
 */
 
 #include "sql_expression_operations.h"
+#include "compiled_expression.h"
 #include "mldb/server/function_contexts.h"
 #include "mldb/http/http_exception.h"
 #include <boost/algorithm/string.hpp>
@@ -81,29 +82,37 @@ bind(SqlBindingScope & context) const
     auto boundLhs = lhs->bind(context);
     auto boundRhs = rhs->bind(context);
 
+    auto compile = [&] (CompiledScalarExpression::OpCode compiledOp,
+                        bool (ExpressionValue::* fn)(const ExpressionValue &) const)
+        {
+            return compileScalarOp(compiledOp,
+                                   doComparison(this, boundLhs, boundRhs, fn),
+                                   &boundLhs, boundRhs);
+        };
+
     if (op == "=" || op == "==") {
-        return doComparison(this, boundLhs, boundRhs,
-                            &ExpressionValue::operator ==);
+        return compile(CompiledScalarExpression::EQUAL,
+                       &ExpressionValue::operator ==);
     }
     else if (op == "!=") {
-        return doComparison(this, boundLhs, boundRhs,
-                            &ExpressionValue::operator !=);
+        return compile(CompiledScalarExpression::NOT_EQUAL,
+                       &ExpressionValue::operator !=);
     }
     else if (op == ">") {
-        return doComparison(this, boundLhs, boundRhs,
-                            &ExpressionValue::operator > );
+        return compile(CompiledScalarExpression::GREATER,
+                       &ExpressionValue::operator > );
     }
     else if (op == "<") {
-        return doComparison(this, boundLhs, boundRhs,
-                            &ExpressionValue::operator < );
+        return compile(CompiledScalarExpression::LESS,
+                       &ExpressionValue::operator < );
     }
     else if (op == ">=") {
-        return doComparison(this, boundLhs, boundRhs,
-                            &ExpressionValue::operator >=);
+        return compile(CompiledScalarExpression::GREATER_EQUAL,
+                       &ExpressionValue::operator >=);
     }
     else if (op == "<=") {
-        return doComparison(this, boundLhs, boundRhs,
-                            &ExpressionValue::operator <=);
+        return compile(CompiledScalarExpression::LESS_EQUAL,
+                       &ExpressionValue::operator <=);
     }
     else throw HttpReturnException(400, "Unknown comparison op " + op);
 }
@@ -1120,21 +1129,31 @@ bind(SqlBindingScope & context) const
     auto boundRhs = rhs->bind(context);
 
     if (op == "+" && lhs) {
-        return BinaryOpHelper<BinaryPlusOp>::bind(this, boundLhs, boundRhs);
+        return compileScalarOp(CompiledScalarExpression::PLUS,
+                               BinaryOpHelper<BinaryPlusOp>
+                               ::bind(this, boundLhs, boundRhs),
+                               &boundLhs, boundRhs);
     }
     else if (op == "-" && lhs) {
-        return BinaryOpHelper<BinaryMinusOp>::bind(this, boundLhs, boundRhs);
+        return compileScalarOp(CompiledScalarExpression::MINUS,
+                               BinaryOpHelper<BinaryMinusOp>
+                               ::bind(this, boundLhs, boundRhs),
+                               &boundLhs, boundRhs);
     }
     else if (op == "-" && !lhs) {
         return doUnaryArithmetic<AtomValueInfo>(this, boundRhs, &unaryMinus);
     }
     else if (op == "*" && lhs) {
-        return BinaryOpHelper<BinaryMultiplicationOp>
-            ::bind(this, boundLhs, boundRhs);
+        return compileScalarOp(CompiledScalarExpression::MULTIPLY,
+                               BinaryOpHelper<BinaryMultiplicationOp>
+                               ::bind(this, boundLhs, boundRhs),
+                               &boundLhs, boundRhs);
     }
     else if (op == "/" && lhs) {
-        return BinaryOpHelper<BinaryDivisionOp>
-            ::bind(this, boundLhs, boundRhs);
+        return compileScalarOp(CompiledScalarExpression::DIVIDE,
+                               BinaryOpHelper<BinaryDivisionOp>
+                               ::bind(this, boundLhs, boundRhs),
+                               &boundLhs, boundRhs);
     }
     else if (op == "%" && lhs) {
         return BinaryOpHelper<BinaryModulusOp>
@@ -1378,15 +1397,21 @@ bind(SqlBindingScope & context) const
                             + "' didn't return info");
     }
 
-    return {[=] (const SqlRowScope & row,
-                 ExpressionValue & storage,
-                 const VariableFilter & filter) -> const ExpressionValue &
-            {
-                // TODO: allow it access to storage
-                return getVariable(row, storage, filter);
-            },
-            this,
-            getVariable.info};
+    BoundSqlExpression result
+        {[=] (const SqlRowScope & row,
+              ExpressionValue & storage,
+              const VariableFilter & filter) -> const ExpressionValue &
+         {
+             // TODO: allow it access to storage
+             return getVariable(row, storage, filter);
+         },
+         this,
+         getVariable.info};
+
+    // Let operators over this variable be compiled
+    result.compiled
+        = CompiledScalarExpression::read(getVariable.exec, *getVariable.info);
+    return result;
 }
 
 Utf8String
@@ -1454,15 +1479,19 @@ bind(SqlBindingScope & context) const
 {
     ExpressionValue val = constant;
 
-    return {[=] (const SqlRowScope &,
-                 ExpressionValue & storage,
-                 const VariableFilter & filter) -> const ExpressionValue &
-            {
-                return storage=val;
-            },
-            this,
-            constant.getSpecializedValueInfo(),
-            true /* is constant */};
+    BoundSqlExpression result
+        {[=] (const SqlRowScope &,
+              ExpressionValue & storage,
+              const VariableFilter & filter) -> const ExpressionValue &
+         {
+             return storage=val;
+         },
+         this,
+         constant.getSpecializedValueInfo(),
+         true /* is constant */};
+
+    result.compiled = CompiledScalarExpression::constant(constant);
+    return result;
 }
 
 Utf8String
@@ -1774,7 +1803,9 @@ bind(SqlBindingScope & context) const
     auto boundRhs = rhs->bind(context);
 
     if (op == "AND" && lhs) {
-        return {[=] (const SqlRowScope & row,
+        return compileScalarOp
+            (CompiledScalarExpression::AND,
+             {[=] (const SqlRowScope & row,
                      ExpressionValue & storage,
                      const VariableFilter & filter) -> const ExpressionValue &
                 {
@@ -1806,10 +1837,13 @@ bind(SqlBindingScope & context) const
                     return storage = std::move(ExpressionValue(true, ts));
                 },
                 this,
-                std::make_shared<BooleanValueInfo>()};
+                std::make_shared<BooleanValueInfo>()},
+             &boundLhs, boundRhs);
     }
     else if (op == "OR" && lhs) {
-        return {[=] (const SqlRowScope & row,
+        return compileScalarOp
+            (CompiledScalarExpression::OR,
+             {[=] (const SqlRowScope & row,
                      ExpressionValue & storage,
                      const VariableFilter & filter)
                 -> const ExpressionValue &
@@ -1844,10 +1878,13 @@ bind(SqlBindingScope & context) const
                     return storage = std::move(ExpressionValue(false, ts));
                 },
                 this,
-                std::make_shared<BooleanValueInfo>()};
+                std::make_shared<BooleanValueInfo>()},
+             &boundLhs, boundRhs);
     }
     else if (op == "NOT" && !lhs) {
-        return {[=] (const SqlRowScope & row,
+        return compileScalarOp
+            (CompiledScalarExpression::NOT,
+             {[=] (const SqlRowScope & row,
                      ExpressionValue & storage,
                      const VariableFilter & filter)
                 -> const ExpressionValue &
@@ -1859,7 +1896,8 @@ bind(SqlBindingScope & context) const
                     return storage = std::move(ExpressionValue(!r.isTrue(), r.getEffectiveTimestamp()));
                 },
                 this,
-                std::make_shared<BooleanValueInfo>()};
+                std::make_shared<BooleanValueInfo>()},
+             nullptr, boundRhs);
     }
     else throw HttpReturnException(400, "Unknown boolean op " + op
                              + (lhs ? " binary" : " unary"));
@@ -3218,6 +3256,23 @@ bind(SqlBindingScope & context) const
             };
 
         BoundSqlExpression result(exec, this, info);
+
+        if (exprBound.batchExec) {
+            result.batchExec = [=] (const std::vector<const SqlRowScope *> & rows,
+                                    std::vector<ExpressionValue> & output,
+                                    const VariableFilter & filter)
+                {
+                    exprBound.execBatch(rows, output, filter);
+                    for (auto & val: output) {
+                        if (val.isAtom())
+                            throw HttpReturnException(400, "Expression with AS * must return a row",
+                                                      "valueReturned", val,
+                                                      "ast", print(),
+                                                      "surface", surface);
+                    }
+                };
+        }
+
         return result;
     }
     else {
@@ -3250,6 +3305,20 @@ bind(SqlBindingScope & context) const
         auto info = std::make_shared<RowValueInfo>(knownColumns, SCHEMA_CLOSED);
 
         BoundSqlExpression result(exec, this, info);
+
+        if (exprBound.batchExec) {
+            result.batchExec = [=] (const std::vector<const SqlRowScope *> & rows,
+                                    std::vector<ExpressionValue> & output,
+                                    const VariableFilter & filter)
+                {
+                    exprBound.execBatch(rows, output, filter);
+                    for (auto & val: output) {
+                        StructValue row;
+                        row.emplace_back(aliasCol, std::move(val));
+                        val = ExpressionValue(std::move(row));
+                    }
+                };
+        }
         
         return result;
     }
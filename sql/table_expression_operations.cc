@@ -52,6 +52,12 @@ bindDataset(std::shared_ptr<Dataset> dataset, Utf8String asName)
                                        offset, limit, allowParallel);
         };
 
+    // Allow joins to plan based upon the size of the dataset
+    result.table.getRowCount = [=] () -> ssize_t
+        {
+            return dataset->getMatrixView()->getRowCount();
+        };
+
     return result;
 }
 
@@ -0,0 +1,105 @@
+#
+# approx_aggregators_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks the approx_count_distinct, approx_quantile and approx_top_k
+# aggregators against exact results.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_ROWS = 20000
+
+
+def query_rows(q):
+    res = mldb.query(q)
+    return [dict(zip(res[0], r)) for r in res[1:]]
+
+
+class ApproxAggregatorsTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        ds = mldb.create_dataset({'id': 'ds', 'type': 'sparse.mutable'})
+        for i in range(NUM_ROWS):
+            cols = [['x', i, 0], ['y', i % 3, 0], ['small', i % 37, 0]]
+            # Value k appears 10 * (40 - k) times
+            if i < 8200:
+                k = 0
+                n = i
+                while n >= 10 * (40 - k):
+                    n -= 10 * (40 - k)
+                    k += 1
+                cols.append(['freq', 'v{}'.format(k), 0])
+            ds.record_row('row{}'.format(i), cols)
+        ds.commit()
+
+    def test_count_distinct_exact_when_small(self):
+        rows = query_rows('select approx_count_distinct(small) as c, '
+                          'approx_count_distinct(y) as cy from ds')
+        self.assertEqual(rows[0]['c'], 37)
+        self.assertEqual(rows[0]['cy'], 3)
+
+    def test_count_distinct(self):
+        rows = query_rows('select approx_count_distinct(x) as c from ds')
+        self.assertAlmostEqual(rows[0]['c'], NUM_ROWS, delta=NUM_ROWS * 0.03)
+
+        rows = query_rows('select y, approx_count_distinct(x) as c from ds '
+                          'group by y order by y')
+        self.assertEqual(len(rows), 3)
+        for r in rows:
+            self.assertAlmostEqual(r['c'], NUM_ROWS / 3,
+                                   delta=NUM_ROWS / 3 * 0.03)
+
+    def test_quantile(self):
+        rows = query_rows('select approx_quantile(x, 0) as q0, '
+                          'approx_quantile(x, 0.5) as q50, '
+                          'approx_quantile(x, 0.99) as q99, '
+                          'approx_quantile(x, 1) as q100 from ds')
+        self.assertEqual(rows[0]['q0'], 0)
+        self.assertEqual(rows[0]['q100'], NUM_ROWS - 1)
+        self.assertAlmostEqual(rows[0]['q50'], NUM_ROWS * 0.5,
+                               delta=NUM_ROWS * 0.01)
+        self.assertAlmostEqual(rows[0]['q99'], NUM_ROWS * 0.99,
+                               delta=NUM_ROWS * 0.002)
+
+    def test_quantile_group_by(self):
+        rows = query_rows('select y, approx_quantile(small, 0.5) as med '
+                          'from ds group by y order by y')
+        self.assertEqual(len(rows), 3)
+        for r in rows:
+            self.assertAlmostEqual(r['med'], 18, delta=1)
+
+    def test_quantile_bad_quantile(self):
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.query('select approx_quantile(x, 1.5) from ds')
+
+    def test_top_k(self):
+        res = mldb.get('/v1/query',
+                       q='select approx_top_k(freq, 5) as top from ds',
+                       format='aos').json()
+        top = res[0]
+        self.assertEqual(len(top), 5)
+        for k in range(5):
+            self.assertEqual(top['top.v{}'.format(k)], 10 * (40 - k))
+
+    def test_row_arguments(self):
+        rows = query_rows('select approx_count_distinct({y, small}) as c, '
+                          'approx_quantile({x, small}, 1) as q from ds')
+        self.assertEqual(rows[0]['c.y'], 3)
+        self.assertEqual(rows[0]['c.small'], 37)
+        self.assertEqual(rows[0]['q.x'], NUM_ROWS - 1)
+        self.assertEqual(rows[0]['q.small'], 36)
+
+    def test_wrong_number_of_arguments(self):
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.query('select approx_quantile(x) from ds')
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.query('select approx_count_distinct(x, 2) from ds')
+
+
+mldb.run_tests()
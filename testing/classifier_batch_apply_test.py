@@ -0,0 +1,124 @@
+#
+# classifier_batch_apply_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that applying a classifier over a whole query, which scores the rows
+# in batches, gives the same results as applying it to each row alone.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+class ClassifierBatchApplyTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        mldb.create_dataset({
+            "id": "iris",
+            "type": "text.csv.tabular",
+            "params": {
+                "dataFileUrl": "file://mldb/testing/dataset/iris.data",
+                "headers": ["a", "b", "c", "d", "class"]
+            }
+        })
+
+        for name, mode, label, algorithm in [
+                ("bin_cls", "boolean", "class = 'Iris-setosa'", "dt"),
+                ("cat_cls", "categorical", "class", "dt"),
+                # Boosted stumps can't be optimized, so can't be batched
+                ("bs_cls", "boolean", "class = 'Iris-setosa'", "bs")]:
+            mldb.put("/v1/procedures/train_" + name, {
+                'type' : 'classifier.train',
+                'params' : {
+                    'trainingData' : """
+                        select {a, b, c, d} as features, %s as label
+                        from iris
+                    """ % label,
+                    "modelFileUrl": "file://tmp/classifier_batch_%s.cls"
+                                    % name,
+                    "configuration": {
+                        "dt": {
+                            "type": "decision_tree",
+                            "max_depth": 8,
+                            "update_alg": "prob"
+                        },
+                        "bs": {
+                            "type": "boosted_stumps",
+                            "min_iter": 10,
+                            "max_iter": 20
+                        }
+                    },
+                    "algorithm": algorithm,
+                    "mode": mode,
+                    "functionName": name,
+                    "runOnCreation": True
+                }
+            })
+
+    def query_both_ways(self, q):
+        """Run the query without an ORDER BY, which applies the function in
+        batches, and with one, which applies it one row at a time, and
+        return both sorted by row name."""
+        def run(q):
+            res = mldb.get('/v1/query', format='aos', rowNames='true',
+                           q=q).json()
+            return sorted(res, key=lambda r: r['_rowName'])
+
+        return run(q), run(q + " order by rowName()")
+
+    def assert_same_rows(self, rows1, rows2):
+        self.assertEqual(len(rows1), len(rows2))
+        for row1, row2 in zip(rows1, rows2):
+            self.assertEqual(sorted(row1.keys()), sorted(row2.keys()))
+            for col, val in row1.items():
+                if isinstance(val, float):
+                    self.assertAlmostEqual(val, row2[col], places=5)
+                else:
+                    self.assertEqual(val, row2[col])
+
+    def check_same_as_row_by_row(self, fn):
+        batched, unbatched = self.query_both_ways("""
+            select %s({features: {a, b, c, d}}) as *, a, b, c, d
+            from iris
+        """ % fn)
+        self.assertEqual(len(batched), 150)
+        self.assert_same_rows(batched, unbatched)
+
+        # Without a dataset, the function is applied to a single row
+        for row in batched[::7]:
+            single = mldb.get('/v1/query', format='aos', q="""
+                select %s({features: {%r as a, %r as b, %r as c, %r as d}})
+                as *, %r as a, %r as b, %r as c, %r as d
+            """ % ((fn,) + tuple(row[k] for k in 'abcd') * 2)).json()[0]
+
+            single.pop('_rowName', None)
+            self.assertEqual(sorted(k for k in row if k != '_rowName'),
+                             sorted(single.keys()))
+            for col, val in single.items():
+                self.assertAlmostEqual(row[col], val, places=5)
+
+    def test_boolean(self):
+        self.check_same_as_row_by_row('bin_cls')
+
+    def test_categorical(self):
+        self.check_same_as_row_by_row('cat_cls')
+
+    def test_not_optimizable(self):
+        self.check_same_as_row_by_row('bs_cls')
+
+    def test_sparse_rows(self):
+        # Rows with some features null are mixed in with complete ones
+        for fn in ['bin_cls', 'cat_cls', 'bs_cls']:
+            batched, unbatched = self.query_both_ways("""
+                select %s({features: {a, b, c, d}}) as *
+                from (select case when rowHash() %% 3 = 0 then null else a end as a,
+                             b, c, d from iris)
+            """ % fn)
+            self.assertEqual(len(batched), 150)
+            self.assert_same_rows(batched, unbatched)
+
+mldb.run_tests()
@@ -0,0 +1,177 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* compiled_expression_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test that compiled scalar expressions give exactly the same results as
+   the generic evaluation, and time the two.
+*/
+
+#include "mldb/sql/sql_expression.h"
+#include "mldb/sql/compiled_expression.h"
+#include "mldb/arch/timers.h"
+#include "mldb/types/value_description.h"
+#include <random>
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+struct TestContext: public SqlRowScope {
+    std::map<Utf8String, ExpressionValue> vars;
+};
+
+struct TestBindingContext: public SqlBindingScope {
+    VariableGetter doGetVariable(const Utf8String & tableName,
+                                 const Utf8String & variableName)
+    {
+        return {[=] (const SqlRowScope & context,
+                     ExpressionValue & storage,
+                     const VariableFilter & filter) -> const ExpressionValue &
+                {
+                    auto & vars = static_cast<const TestContext &>(context).vars;
+                    auto it = vars.find(variableName);
+                    if (it == vars.end())
+                        return storage = ExpressionValue();
+                    return it->second;
+                },
+                std::make_shared<AtomValueInfo>()};
+    }
+};
+
+/// Random value, mostly small numbers but with everything that the
+/// compiled path has to hand back to the generic one
+CellValue randomValue(std::mt19937 & rng)
+{
+    switch (rng() % 12) {
+    case 0:  return CellValue();
+    case 1:  return CellValue("str");
+    case 2:  return CellValue(Date::fromSecondsSinceEpoch(rng() % 1000));
+    case 3:  return CellValue((1LL << 60) + 1);
+    case 4:  return CellValue(0.5 * (int)(rng() % 7));
+    case 5:  return CellValue(0);
+    default: return CellValue((int)(rng() % 7) - 3);
+    }
+}
+
+TestContext randomRow(std::mt19937 & rng)
+{
+    TestContext result;
+    for (auto name: { "x", "y", "z" }) {
+        if (rng() % 8 == 0)
+            continue;  // missing
+        Date ts = Date::fromSecondsSinceEpoch(rng() % 3);
+        result.vars[Utf8String(name)] = ExpressionValue(randomValue(rng), ts);
+    }
+    return result;
+}
+
+std::string describe(const ExpressionValue & val)
+{
+    return jsonEncodeStr(val) + " at "
+        + val.getEffectiveTimestamp().print(3);
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_compiled_matches_generic )
+{
+    std::vector<std::string> expressions = {
+        "x + 1",
+        "x * 2 + y > z",
+        "x - y / 2",
+        "x / y",
+        "x = y OR y != z",
+        "x < y AND y <= z",
+        "NOT (x >= 1) OR z > 0",
+        "x AND y",
+        "x OR y",
+        "NOT x",
+        "(x > y) + (y > z) * 2",
+        "x * 1.5 - 3 < y",
+        "1 + NULL",
+        "NULL + x",
+        "x + 1 > NULL OR x = 0"
+    };
+
+    std::mt19937 rng(1);
+    TestBindingContext context;
+
+    for (auto & e: expressions) {
+        auto bound = SqlExpression::parse(e)->bind(context);
+        BOOST_REQUIRE_MESSAGE(bound.compiled, e + " wasn't compiled");
+
+        for (unsigned i = 0;  i < 2000;  ++i) {
+            TestContext row = randomRow(rng);
+
+            ExpressionValue storage1, storage2;
+            const ExpressionValue & compiled = bound(row, storage1);
+            const ExpressionValue & generic
+                = bound.compiled->generic(row, storage2, GET_ALL);
+
+            BOOST_CHECK_EQUAL(describe(compiled), describe(generic));
+            BOOST_CHECK_EQUAL(compiled.empty(), generic.empty());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_not_compiled )
+{
+    TestBindingContext context;
+
+    // String constants, modulus and unary minus aren't compiled
+    for (auto e: { "x + 'a'", "x % 2", "-x" }) {
+        auto bound = SqlExpression::parse(e)->bind(context);
+        BOOST_CHECK_MESSAGE(!bound.compiled, std::string(e) + " was compiled");
+    }
+
+    TestContext row;
+    row.vars[Utf8String("x")] = ExpressionValue(3, Date());
+    auto bound = SqlExpression::parse("(x % 2) + x * 2 > 5")->bind(context);
+    BOOST_CHECK(!bound.compiled);
+    BOOST_CHECK_EQUAL(bound(row).getAtom(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_compiled_expression )
+{
+    TestBindingContext context;
+    auto bound = SqlExpression::parse("x * 2 + y > z AND x - y < 10")
+        ->bind(context);
+    BOOST_REQUIRE(bound.compiled);
+
+    TestContext row;
+    row.vars[Utf8String("x")] = ExpressionValue(3, Date());
+    row.vars[Utf8String("y")] = ExpressionValue(1.5, Date());
+    row.vars[Utf8String("z")] = ExpressionValue(4, Date());
+
+    const int n = 1000000;
+    int count1 = 0, count2 = 0;
+
+    ML::Timer timer;
+    for (int i = 0;  i < n;  ++i) {
+        ExpressionValue storage;
+        count1 += bound(row, storage).isTrue();
+    }
+    double compiledTime = timer.elapsed_wall();
+
+    timer.restart();
+    for (int i = 0;  i < n;  ++i) {
+        ExpressionValue storage;
+        count2 += bound.compiled->generic(row, storage, GET_ALL).isTrue();
+    }
+    double genericTime = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(count1, n);
+    BOOST_CHECK_EQUAL(count2, n);
+
+    cerr << "compiled " << compiledTime << "s generic " << genericTime
+         << "s speedup " << genericTime / compiledTime << endl;
+}
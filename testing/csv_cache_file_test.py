@@ -0,0 +1,109 @@
+#
+# csv_cache_file_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+import os
+import tempfile
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+class CsvCacheFileTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp_dir = tempfile.mkdtemp(prefix='csv_cache_file_test')
+        cls.csv_file = os.path.join(cls.tmp_dir, 'data.csv')
+        with open(cls.csv_file, 'w') as f:
+            f.write("a,b,c,d\n")
+            for i in range(20000):
+                f.write('{},{},{},"{}"\n'.format(
+                    i, i % 7, i * 0.5 if i % 3 else '', 'str' + str(i % 13)))
+
+    def create(self, name, cache_file, **extra):
+        params = {
+            'dataFileUrl': 'file://' + self.csv_file,
+            'cacheFileUrl': 'file://' + cache_file
+        }
+        params.update(extra)
+        return mldb.put('/v1/datasets/' + name, {
+            'type': 'text.csv.tabular',
+            'params': params
+        }).json()
+
+    def query(self, name):
+        return mldb.query("""
+            SELECT rowName(), a, b, c, d, rowHash() AS h FROM {}
+            ORDER BY a
+        """.format(name))
+
+    def test_cache_round_trip(self):
+        cache_file = os.path.join(self.tmp_dir, 'round_trip.bin')
+
+        res = self.create('parsed', cache_file)
+        self.assertFalse(res['status']['loadedFromCache'])
+        self.assertTrue(os.path.exists(cache_file))
+
+        res = self.create('cached', cache_file)
+        self.assertTrue(res['status']['loadedFromCache'])
+        self.assertEqual(res['status']['rowCount'], 20000)
+
+        # Loading from the cache must give exactly the same dataset as
+        # parsing the CSV file
+        self.assertEqual(self.query('parsed')[1:], self.query('cached')[1:])
+
+        self.assertEqual(
+            mldb.get('/v1/datasets/cached/columns').json(),
+            mldb.get('/v1/datasets/parsed/columns').json())
+
+        self.assertEqual(
+            mldb.query("SELECT * FROM cached WHERE rowName() = '12345'"),
+            mldb.query("SELECT * FROM parsed WHERE rowName() = '12345'"))
+
+    def test_cache_invalidated_by_config(self):
+        cache_file = os.path.join(self.tmp_dir, 'config.bin')
+
+        res = self.create('config1', cache_file)
+        self.assertFalse(res['status']['loadedFromCache'])
+
+        # A different configuration can't use the same cache
+        res = self.create('config2', cache_file, limit=100)
+        self.assertFalse(res['status']['loadedFromCache'])
+        self.assertEqual(res['status']['rowCount'], 100)
+
+        res = self.create('config3', cache_file, limit=100)
+        self.assertTrue(res['status']['loadedFromCache'])
+        self.assertEqual(res['status']['rowCount'], 100)
+
+    def test_truncated_cache(self):
+        cache_file = os.path.join(self.tmp_dir, 'truncated.bin')
+
+        res = self.create('truncated1', cache_file)
+        self.assertFalse(res['status']['loadedFromCache'])
+        size = os.path.getsize(cache_file)
+
+        # Simulate a cache file that was only partly written
+        with open(cache_file, 'r+b') as f:
+            f.truncate(size // 2)
+
+        # An unreadable cache file is a cache miss, not an error
+        res = self.create('truncated2', cache_file)
+        self.assertFalse(res['status']['loadedFromCache'])
+        self.assertEqual(res['status']['rowCount'], 20000)
+        self.assertEqual(self.query('truncated1')[1:],
+                         self.query('truncated2')[1:])
+
+        # The cache file was written again, in one piece
+        self.assertEqual(os.path.getsize(cache_file), size)
+        self.assertFalse(os.path.exists(cache_file + '.tmp'))
+
+        res = self.create('truncated3', cache_file)
+        self.assertTrue(res['status']['loadedFromCache'])
+        self.assertEqual(self.query('truncated1')[1:],
+                         self.query('truncated3')[1:])
+
+mldb.run_tests()
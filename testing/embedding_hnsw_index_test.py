@@ -0,0 +1,89 @@
+#
+# embedding_hnsw_index_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks the approximate nearest neighbour index of the embedding dataset.
+#
+import math
+import random
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+DIMS = 16
+NUM_COMMITS = 3
+ROWS_PER_COMMIT = 1500
+
+
+def cosine(v1, v2):
+    dot = sum(a * b for a, b in zip(v1, v2))
+    return 1 - dot / (math.sqrt(sum(a * a for a in v1))
+                      * math.sqrt(sum(b * b for b in v2)))
+
+
+class EmbeddingHnswIndexTest(unittest.TestCase):
+
+    def test_bad_config(self):
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.put('/v1/datasets/bad_hnsw', {
+                'type': 'embedding',
+                'params': {'index': 'hnsw', 'hnswNeighbours': 1}
+            })
+
+    def test_recall(self):
+        mldb.put('/v1/datasets/hnsw', {
+            'type': 'embedding',
+            'params': {
+                'metric': 'cosine',
+                'index': 'hnsw',
+                'hnswEfSearch': 50
+            }
+        })
+
+        random.seed(4321)
+        points = {}
+        cols = ['c{}'.format(i) for i in range(DIMS)]
+
+        for commit in range(NUM_COMMITS):
+            for i in range(ROWS_PER_COMMIT):
+                name = 'row{}_{}'.format(commit, i)
+                vec = [random.gauss(0, 1) for _ in range(DIMS)]
+                points[name] = vec
+                mldb.post('/v1/datasets/hnsw/rows', {
+                    'rowName': name,
+                    'columns': [[c, v, 0] for c, v in zip(cols, vec)]
+                })
+            mldb.post('/v1/datasets/hnsw/commit')
+
+            found = total = 0
+            for _ in range(20):
+                query = [random.gauss(0, 1) for _ in range(DIMS)]
+                params = dict(zip(cols, query))
+                params['numNeighbours'] = 10
+                res = mldb.get('/v1/datasets/hnsw/routes/neighbours',
+                               **params).json()
+                self.assertEqual(len(res), 10)
+
+                # Distances are sorted and correct
+                for i in range(1, len(res)):
+                    self.assertLessEqual(res[i - 1][2], res[i][2])
+                for row in res:
+                    self.assertAlmostEqual(
+                        row[2], cosine(points[row[0]], query), places=4)
+
+                exact = sorted(points, key=lambda r: cosine(points[r], query))
+                found += len(set(exact[:10]) & set(row[0] for row in res))
+                total += 10
+
+            mldb.log('recall after commit {}: {}'.format(commit,
+                                                         1.0 * found / total))
+            self.assertGreaterEqual(1.0 * found / total, 0.9)
+
+        res = mldb.get('/v1/datasets/hnsw/routes/rowNeighbours',
+                       row='row1_7', numNeighbours=3).json()
+        self.assertEqual(res[0][0], 'row1_7')
+
+mldb.run_tests()
@@ -0,0 +1,68 @@
+#
+# embedding_incremental_commit_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that nearest neighbour queries on an embedding dataset see the rows
+# of every commit when rows are appended and committed repeatedly, which
+# indexes them incrementally.
+#
+import math
+import random
+import time
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_COMMITS = 6
+ROWS_PER_COMMIT = 2500
+
+
+class EmbeddingIncrementalCommitTest(unittest.TestCase):
+
+    def check_neighbours(self, points, x, y):
+        res = mldb.get('/v1/datasets/incr/routes/neighbours',
+                       x=x, y=y, numNeighbours=5).json()
+        expected = sorted(math.hypot(px - x, py - y)
+                          for px, py in points.values())[:5]
+        self.assertEqual(len(res), len(expected))
+        for row, dist in zip(res, expected):
+            self.assertAlmostEqual(row[2], dist, places=4)
+            px, py = points[row[0]]
+            self.assertAlmostEqual(math.hypot(px - x, py - y), dist,
+                                   places=4)
+
+    def test_incremental_commits(self):
+        ds = mldb.create_dataset({'type': 'embedding', 'id': 'incr'})
+        random.seed(1234)
+        points = {}
+
+        for commit in range(NUM_COMMITS):
+            for i in range(ROWS_PER_COMMIT):
+                name = 'row{}_{}'.format(commit, i)
+                x, y = random.random(), random.random()
+                points[name] = (x, y)
+                ds.record_row(name, [['x', x, 0], ['y', y, 0]])
+            ds.commit()
+
+            for _ in range(5):
+                self.check_neighbours(points, random.random(),
+                                      random.random())
+
+        # Give a background rebuild of the index a chance to finish, and
+        # make sure that switching over to it loses nothing
+        time.sleep(2)
+        ds.record_row('last', [['x', 2.0, 0], ['y', 2.0, 0]])
+        points['last'] = (2.0, 2.0)
+        ds.commit()
+
+        self.check_neighbours(points, 2.0, 2.0)
+        self.check_neighbours(points, 0.5, 0.5)
+
+        res = mldb.get('/v1/datasets/incr/routes/rowNeighbours',
+                       row='row0_0', numNeighbours=1).json()
+        self.assertEqual(res[0][0], 'row0_0')
+
+mldb.run_tests()
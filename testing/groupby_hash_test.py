@@ -0,0 +1,83 @@
+#
+# groupby_hash_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks the results and ordering of GROUP BY queries with many groups.
+#
+import collections
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_ROWS = 20000
+NUM_KEYS = 5003
+
+
+def query_rows(q):
+    res = mldb.query(q)
+    return [dict(zip(res[0], r)) for r in res[1:]]
+
+
+class GroupByHashTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        ds = mldb.create_dataset({'id': 'ds', 'type': 'sparse.mutable'})
+        for i in range(NUM_ROWS):
+            cols = [['x', i % NUM_KEYS, 0], ['y', i % 3, 0], ['v', i, 0]]
+            if i % 11 != 0:
+                cols.append(['s', 'str{}'.format(i % 17), 0])
+            ds.record_row('row{}'.format(i), cols)
+        ds.commit()
+
+        cls.counts = collections.Counter()
+        cls.sums = collections.Counter()
+        for i in range(NUM_ROWS):
+            key = (i % NUM_KEYS, i % 3)
+            cls.counts[key] += 1
+            cls.sums[key] += i
+
+    def test_many_groups(self):
+        rows = query_rows('select x, y, count(*) as cnt, sum(v) as total '
+                          'from ds group by x, y')
+        self.assertEqual(len(rows), len(self.counts))
+
+        for r in rows:
+            key = (r['x'], r['y'])
+            self.assertEqual(r['cnt'], self.counts[key])
+            self.assertEqual(r['total'], self.sums[key])
+
+        # Without an ORDER BY, groups come out in key order
+        keys = [(r['x'], r['y']) for r in rows]
+        self.assertEqual(keys, sorted(keys))
+
+    def test_order_by(self):
+        rows = query_rows('select x, y, sum(v) as total from ds '
+                          'group by x, y order by sum(v) desc, x, y '
+                          'offset 10 limit 100')
+        expected = sorted(self.counts, key=lambda k: (-self.sums[k], k))
+        self.assertEqual([(r['x'], r['y']) for r in rows], expected[10:110])
+
+    def test_null_and_string_keys(self):
+        rows = query_rows('select s, count(*) as cnt from ds group by s')
+        counts = collections.Counter()
+        for i in range(NUM_ROWS):
+            counts[None if i % 11 == 0 else 'str{}'.format(i % 17)] += 1
+
+        self.assertEqual(len(rows), len(counts))
+        # NULL sorts before strings
+        self.assertEqual(rows[0].get('s'), None)
+        self.assertEqual(dict((r.get('s'), r['cnt']) for r in rows), counts)
+
+    def test_having(self):
+        rows = query_rows('select x, count(*) as cnt from ds group by x '
+                          'having count(*) > 3')
+        expected = collections.Counter(i % NUM_KEYS for i in range(NUM_ROWS))
+        self.assertEqual(
+            [r['x'] for r in rows],
+            sorted(k for k, v in expected.items() if v > 3))
+
+mldb.run_tests()
@@ -0,0 +1,102 @@
+#
+# hash_join_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks joins between a fact table large enough to use the hash join and a
+# small dimension table, for inner and outer joins and with the small table
+# on either side.
+#
+import os
+import tempfile
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+# Above the size where the join switches from merge join to hash join
+NUM_FACT_ROWS = 120000
+
+# Key 3 is missing, key 5 is duplicated and key 42 is not in the facts
+DIM_KEYS = [0, 1, 2, 4, 5, 5, 6, 7, 42]
+
+
+class HashJoinTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        tmp_dir = tempfile.mkdtemp(prefix='hash_join_test')
+        csv_file = os.path.join(tmp_dir, 'fact.csv')
+        with open(csv_file, 'w') as f:
+            f.write('k,v\n')
+            for i in range(NUM_FACT_ROWS):
+                f.write('{},{}\n'.format(i % 10, i))
+
+        mldb.put('/v1/datasets/fact', {
+            'type': 'text.csv.tabular',
+            'params': {
+                'dataFileUrl': 'file://' + csv_file
+            }
+        })
+
+        ds = mldb.create_dataset({'type': 'sparse.mutable', 'id': 'dim'})
+        for i, k in enumerate(DIM_KEYS):
+            ds.record_row('dim' + str(i), [['k', k, 0], ['w', k * 10, 0]])
+        ds.commit()
+
+    def run_join(self, from_expr):
+        mldb.put('/v1/functions/join_stats', {
+            'type': 'sql.query',
+            'params': {
+                'query': 'SELECT count(*) AS cnt, count(fact.v) AS facts, '
+                         'count(dim.w) AS dims, sum(dim.w) AS total '
+                         'FROM ' + from_expr + ' GROUP BY true'
+            }
+        })
+        res = mldb.get('/v1/functions/join_stats/application', input={})
+        return res.json()['output']
+
+    def expected(self, outer_fact, outer_dim):
+        fact_keys = [i % 10 for i in range(NUM_FACT_ROWS)]
+        cnt = facts = dims = total = 0
+        for k in fact_keys:
+            matches = DIM_KEYS.count(k)
+            if matches:
+                cnt += matches
+                facts += matches
+                dims += matches
+                total += matches * k * 10
+            elif outer_fact:
+                cnt += 1
+                facts += 1
+        if outer_dim:
+            unmatched = [k for k in DIM_KEYS if k not in fact_keys[:10]]
+            cnt += len(unmatched)
+            dims += len(unmatched)
+            total += sum(k * 10 for k in unmatched)
+        return {'cnt': cnt, 'facts': facts, 'dims': dims, 'total': total}
+
+    def check(self, from_expr, outer_fact, outer_dim):
+        output = self.run_join(from_expr)
+        expected = self.expected(outer_fact, outer_dim)
+        for key, value in expected.items():
+            self.assertEqual(output[key], value, from_expr + ' ' + key)
+
+    def test_inner(self):
+        self.check('fact JOIN dim ON fact.k = dim.k', False, False)
+        self.check('dim JOIN fact ON fact.k = dim.k', False, False)
+
+    def test_left(self):
+        self.check('fact LEFT JOIN dim ON fact.k = dim.k', True, False)
+        self.check('dim LEFT JOIN fact ON fact.k = dim.k', False, True)
+
+    def test_right(self):
+        self.check('fact RIGHT JOIN dim ON fact.k = dim.k', False, True)
+        self.check('dim RIGHT JOIN fact ON fact.k = dim.k', True, False)
+
+    def test_full(self):
+        self.check('fact FULL JOIN dim ON fact.k = dim.k', True, True)
+
+mldb.run_tests()
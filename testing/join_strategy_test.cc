@@ -0,0 +1,89 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* join_strategy_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test that equijoins give the same results whether they are done as a
+   merge join or as a hash join, including with duplicate keys.
+*/
+
+#include "mldb/server/mldb_server.h"
+#include "mldb/core/dataset.h"
+#include "mldb/types/value_description.h"
+#include "mldb/arch/format.h"
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+void recordKeys(MldbServer & server, const std::string & name,
+                int numRows, int numKeys)
+{
+    PolyConfig config;
+    config.id = name;
+    config.type = "sparse.mutable";
+    auto dataset = obtainDataset(&server, config);
+
+    Date ts;
+    std::vector<std::pair<RowName, std::vector<std::tuple<ColumnName, CellValue, Date> > > > rows;
+    for (int i = 0;  i < numRows;  ++i) {
+        std::vector<std::tuple<ColumnName, CellValue, Date> > cols;
+        cols.emplace_back(ColumnName("k"), i % numKeys, ts);
+        cols.emplace_back(ColumnName("v"), i, ts);
+        rows.emplace_back(RowName(ML::format("%s%d", name.c_str(), i)),
+                          std::move(cols));
+    }
+    dataset->recordRows(rows);
+    dataset->commit();
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_merge_and_hash_join_agree )
+{
+    MldbServer server;
+    server.init();
+
+    // Every key is duplicated on both sides; keys 5 and 6 are only on the
+    // left
+    recordKeys(server, "lhs", 70, 7);
+    recordKeys(server, "rhs", 20, 5);
+
+    std::vector<std::string> queries = {
+        "select * from lhs join rhs on lhs.k = rhs.k order by rowName()",
+        "select * from rhs join lhs on lhs.k = rhs.k order by rowName()",
+        "select * from lhs join rhs on lhs.k = rhs.k and lhs.v > rhs.v "
+            "order by rowName()",
+        "select lhs.k, count(*) as cnt from lhs join rhs on lhs.k = rhs.k "
+            "group by lhs.k order by lhs.k",
+    };
+
+    for (auto & q: queries) {
+        cerr << "query " << q << endl;
+
+        // Both sides are far below the threshold, so it's a merge join
+        server.setHashJoinMinRows(1000000);
+        auto merged = jsonEncodeStr(server.query(q));
+
+        // Only the right side is below the threshold, so it's a hash join
+        // that builds on it
+        server.setHashJoinMinRows(50);
+        auto hashed = jsonEncodeStr(server.query(q));
+
+        BOOST_CHECK_EQUAL(merged, hashed);
+    }
+
+    // Each of the 10 left rows with keys 0 to 4 joins with each of the 4
+    // right rows with the same key
+    server.setHashJoinMinRows(1000000);
+    auto rows = server.query("select * from lhs join rhs on lhs.k = rhs.k");
+    BOOST_CHECK_EQUAL(rows.size(), 5 * 10 * 4);
+}
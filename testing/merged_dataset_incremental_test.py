@@ -0,0 +1,179 @@
+#
+# merged_dataset_incremental_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that merges over many partitions, merges that reuse the work of an
+# earlier merge and queries whose WHEN clause skips partitions all give the
+# same results as the same data in a single dataset.
+#
+import unittest
+import datetime
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_PARTITIONS = 40
+START = datetime.datetime(2016, 1, 1)
+
+
+def ts(hour):
+    return (START + datetime.timedelta(hours=hour)).isoformat() + 'Z'
+
+
+def partition_name(i):
+    return 'part{}'.format(i)
+
+
+def record_partition(i, reference):
+    ds = mldb.create_dataset({'id': partition_name(i),
+                              'type': 'sparse.mutable'})
+    # Each partition has rows of its own and a row shared by all of them
+    for r in range(3):
+        ds.record_row('p{}_r{}'.format(i, r),
+                      [['x', i * 10 + r, ts(i)], ['y', r, ts(i)]])
+        reference.record_row('p{}_r{}'.format(i, r),
+                             [['x', i * 10 + r, ts(i)], ['y', r, ts(i)]])
+    ds.record_row('shared', [['p{}'.format(i), i, ts(i)]])
+    reference.record_row('shared', [['p{}'.format(i), i, ts(i)]])
+    ds.commit()
+
+
+def create_merged(name, partitions):
+    mldb.put('/v1/datasets/' + name, {
+        'type': 'merged',
+        'params': {
+            'datasets': [{'id': partition_name(i)} for i in partitions]
+        }
+    })
+
+
+def merge_stats(name):
+    return mldb.get('/v1/datasets/' + name + '/routes/stats').json()
+
+
+def query(q):
+    res = mldb.get('/v1/query', q=q, format='aos', rowNames='true').json()
+    return sorted(res, key=lambda r: r['_rowName'])
+
+
+class MergedDatasetIncrementalTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        reference = mldb.create_dataset({'id': 'reference',
+                                         'type': 'sparse.mutable'})
+        for i in range(NUM_PARTITIONS):
+            record_partition(i, reference)
+        reference.commit()
+        create_merged('merged', range(NUM_PARTITIONS))
+
+    def check_same(self, q):
+        self.assertEqual(query(q.format('merged')),
+                         query(q.format('reference')))
+
+    def test_all_partitions(self):
+        self.check_same('SELECT * FROM {}')
+        res = mldb.get('/v1/query',
+                       q='SELECT count(*) AS cnt FROM merged').json()
+        self.assertEqual(res[0]['columns'][0][1], NUM_PARTITIONS * 3 + 1)
+
+    def test_status(self):
+        # The status is the list of the merged datasets' statuses
+        status = mldb.get('/v1/datasets/merged').json()['status']
+        self.assertEqual(len(status), NUM_PARTITIONS)
+        self.assertEqual(status[0],
+                         mldb.get('/v1/datasets/' + partition_name(0))
+                         .json()['status'])
+
+    def test_when_skips_partitions(self):
+        before = merge_stats('merged')
+
+        # Rows from partitions outside the range are still there, but
+        # without cells, just as for a single dataset
+        self.check_same("SELECT * FROM {} "
+                        "WHEN timestamp() BETWEEN CAST ('%s' AS TIMESTAMP) "
+                        "AND CAST ('%s' AS TIMESTAMP)" % (ts(5), ts(7)))
+        self.check_same("SELECT * FROM {} "
+                        "WHEN timestamp() > CAST ('%s' AS TIMESTAMP)" % ts(30))
+        self.check_same("SELECT * FROM {} "
+                        "WHEN CAST ('%s' AS TIMESTAMP) >= timestamp() "
+                        "AND timestamp() >= CAST ('%s' AS TIMESTAMP)" % (ts(3), ts(1)))
+        self.check_same("SELECT * FROM {} "
+                        "WHEN timestamp() = CAST ('%s' AS TIMESTAMP)" % ts(12))
+
+        after = merge_stats('merged')
+        self.assertGreater(after['timeRestrictions'],
+                           before['timeRestrictions'])
+        self.assertGreater(after['datasetsSkipped'], before['datasetsSkipped'])
+
+    def test_when_reading_columns(self):
+        # WHEN is evaluated against the whole row, including cells outside
+        # of the time range, so nothing can be skipped.  The shared row
+        # has a cell in each partition.
+        before = merge_stats('merged')
+
+        self.check_same("SELECT * FROM {} "
+                        "WHEN timestamp() >= CAST ('%s' AS TIMESTAMP) "
+                        "AND p0 = 0" % ts(30))
+        self.check_same("SELECT * FROM {} "
+                        "WHEN timestamp() >= CAST ('%s' AS TIMESTAMP) "
+                        "AND latest_timestamp(p1) < CAST ('%s' AS TIMESTAMP)"
+                        % (ts(30), ts(2)))
+        res = query("SELECT * FROM merged "
+                    "WHEN timestamp() >= CAST ('%s' AS TIMESTAMP) "
+                    "AND p0 = 0" % ts(30))
+        shared = [r for r in res if r['_rowName'] == 'shared'][0]
+        self.assertEqual(shared['p30'], 30)
+
+        after = merge_stats('merged')
+        self.assertEqual(after['timeRestrictions'], before['timeRestrictions'])
+
+    def test_when_with_where(self):
+        # WHERE sees all of the cells, so nothing can be skipped
+        self.check_same("SELECT * FROM {} "
+                        "WHEN timestamp() < CAST ('%s' AS TIMESTAMP) "
+                        "WHERE x > 100" % ts(20))
+
+    def test_when_with_group_by(self):
+        self.check_same("SELECT count(x) AS cnt FROM {} "
+                        "WHEN timestamp() <= CAST ('%s' AS TIMESTAMP) "
+                        "GROUP BY y" % ts(10))
+
+    def test_overlapping_merge(self):
+        # A window that has moved on by one partition reuses the work of
+        # the previous one, and must give the same answer as if it hadn't
+        create_merged('merged_later', range(1, NUM_PARTITIONS))
+        res = query('SELECT * FROM merged_later')
+        names = [r['_rowName'] for r in res]
+        self.assertNotIn('p0_r0', names)
+        self.assertIn('p1_r0', names)
+        self.assertIn('p{}_r2'.format(NUM_PARTITIONS - 1), names)
+        shared = [r for r in res if r['_rowName'] == 'shared'][0]
+        self.assertNotIn('p0', shared)
+        self.assertEqual(shared['p1'], 1)
+
+    def test_commit_seen_by_new_merge(self):
+        ds = mldb.create_dataset({'id': 'committed_part',
+                                  'type': 'sparse.mutable'})
+        ds.record_row('before', [['x', 1, ts(0)]])
+        ds.commit()
+        mldb.put('/v1/datasets/committed_merge', {
+            'type': 'merged',
+            'params': {'datasets': [{'id': 'committed_part'},
+                                    {'id': partition_name(0)}]}
+        })
+
+        ds.record_row('after', [['x', 2, ts(0)]])
+        ds.commit()
+        mldb.put('/v1/datasets/committed_merge2', {
+            'type': 'merged',
+            'params': {'datasets': [{'id': 'committed_part'},
+                                    {'id': partition_name(0)}]}
+        })
+        names = [r['_rowName'] for r in query('SELECT * FROM committed_merge2')]
+        self.assertIn('after', names)
+
+
+mldb.run_tests()
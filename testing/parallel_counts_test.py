@@ -0,0 +1,94 @@
+#
+# parallel_counts_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks the counts of the tfidf.train and statsTable.bagOfWords.train
+# procedures, which are accumulated in parallel, over enough rows that
+# many threads take part.
+#
+import collections
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_ROWS = 20000
+
+
+def words(i):
+    return ['w{}'.format(i % 101), 'x{}'.format(i % 37)]
+
+
+class ParallelCountsTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        ds = mldb.create_dataset({'id': 'docs', 'type': 'sparse.mutable'})
+        cls.trials = collections.Counter()
+        cls.positives = collections.Counter()
+        for i in range(NUM_ROWS):
+            label = i % 4 == 0
+            ds.record_row('doc{}'.format(i),
+                          [[w, 1, 0] for w in words(i)] + [['label', label, 0]])
+            for w in words(i):
+                cls.trials[w] += 1
+                cls.positives[w] += label
+        ds.commit()
+
+    def test_tfidf_document_frequencies(self):
+        mldb.put('/v1/procedures/tfidf_train', {
+            'type': 'tfidf.train',
+            'params': {
+                'trainingData': 'select * excluding (label) from docs',
+                'outputDataset': {'id': 'dfs', 'type': 'sparse.mutable'},
+                'runOnCreation': True
+            }
+        })
+
+        res = mldb.get('/v1/query', q='select * from dfs',
+                       format='aos').json()
+        self.assertEqual(len(res), 1)
+        dfs = dict(res[0])
+        del dfs['_rowName']
+        self.assertEqual(dfs, dict(self.trials))
+
+    def test_bag_of_words_stats_table(self):
+        mldb.put('/v1/procedures/bow_train', {
+            'type': 'statsTable.bagOfWords.train',
+            'params': {
+                'trainingData': 'select * excluding (label) from docs',
+                'outcomes': [['label', 'label']],
+                'statsTableFileUrl': 'file://tmp/parallel_counts_test.st',
+                'runOnCreation': True
+            }
+        })
+
+        mldb.put('/v1/functions/bow_posneg', {
+            'type': 'statsTable.bagOfWords.posneg',
+            'params': {
+                'numPos': 1000,
+                'numNeg': 1000,
+                'minTrials': 1,
+                'outcomeToUse': 'label',
+                'statsTableFileUrl': 'file://tmp/parallel_counts_test.st'
+            }
+        })
+
+        res = mldb.get('/v1/query',
+                       q='select bow_posneg({words: {* excluding (label)}}) '
+                         'as * from docs limit 500',
+                       format='aos').json()
+        self.assertEqual(len(res), 500)
+        for row in res:
+            for col, prob in row.items():
+                if col == '_rowName':
+                    continue
+                word = col[len('probs.'):-len('_label')]
+                self.assertAlmostEqual(
+                    prob, self.positives[word] / float(self.trials[word]),
+                    places=5)
+
+
+mldb.run_tests()
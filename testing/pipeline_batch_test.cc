@@ -0,0 +1,138 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* pipeline_batch_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test that the execution pipeline gives the same rows whether it's run a
+   row at a time with take() or in batches with takeBatch().
+*/
+
+#include "mldb/server/mldb_server.h"
+#include "mldb/server/dataset_context.h"
+#include "mldb/core/dataset.h"
+#include "mldb/sql/sql_expression.h"
+#include "mldb/sql/execution_pipeline_impl.h"
+#include "mldb/types/value_description.h"
+#include "mldb/arch/format.h"
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+void recordKeys(MldbServer & server, const std::string & name,
+                int numRows, int numKeys)
+{
+    PolyConfig config;
+    config.id = name;
+    config.type = "sparse.mutable";
+    auto dataset = obtainDataset(&server, config);
+
+    Date ts;
+    std::vector<std::pair<RowName, std::vector<std::tuple<ColumnName, CellValue, Date> > > > rows;
+    for (int i = 0;  i < numRows;  ++i) {
+        std::vector<std::tuple<ColumnName, CellValue, Date> > cols;
+        cols.emplace_back(ColumnName("k"), i % numKeys, ts);
+        cols.emplace_back(ColumnName("v"), i, ts);
+        rows.emplace_back(RowName(ML::format("%s%d", name.c_str(), i)),
+                          std::move(cols));
+    }
+    dataset->recordRows(rows);
+    dataset->commit();
+}
+
+/// Pipeline for a query that has been started.  Executors refer to their
+/// bound element, so it's kept alive with them.
+struct RunningQuery {
+    RunningQuery(MldbServer & server, const std::string & query)
+    {
+        // Built the same way the sql.query function does it
+        auto stm = SelectStatement::parse(query);
+
+        auto pipeline
+            = PipelineElement::root(std::make_shared<SqlExpressionMldbContext>(&server))
+            ->from(stm.from, stm.when, SelectExpression::STAR, stm.where)
+            ->where(stm.where)
+            ->select(stm.orderBy)
+            ->sort(stm.orderBy)
+            ->select(stm.select);
+
+        bound = pipeline->bind();
+        executor = bound->start(BoundParameters(), false /* allowParallel */);
+    }
+
+    std::shared_ptr<BoundPipelineElement> bound;
+    std::shared_ptr<ElementExecutor> executor;
+};
+
+vector<string> takeRows(MldbServer & server, const std::string & query)
+{
+    vector<string> result;
+    RunningQuery running(server, query);
+    while (auto row = running.executor->take())
+        result.push_back(jsonEncodeStr(row->values.back()));
+    return result;
+}
+
+vector<string> takeBatches(MldbServer & server, const std::string & query,
+                           size_t batchSize)
+{
+    vector<string> result;
+    RunningQuery running(server, query);
+    PipelineBatch batch;
+    while (running.executor->takeBatch(batchSize, batch)) {
+        BOOST_CHECK_LE(batch.size(), batchSize);
+        for (size_t i = 0;  i < batch.size();  ++i) {
+            if (batch.selected[i])
+                result.push_back(jsonEncodeStr(batch.rows[i].values.back()));
+        }
+    }
+    return result;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_batches_match_rows )
+{
+    MldbServer server;
+    server.init();
+
+    recordKeys(server, "lhs", 70, 7);
+    recordKeys(server, "rhs", 20, 5);
+
+    std::vector<std::string> queries = {
+        "select v, v * 2 as w from lhs where v % 3 != 0",
+        "select v, k from lhs where v % 3 != 0 order by k, v",
+        "select * from lhs join rhs on lhs.k = rhs.k",
+        "select * from lhs join rhs on lhs.k = rhs.k and lhs.v > rhs.v "
+            "where rhs.v % 2 = 0",
+        "select * from lhs left join rhs on lhs.k = rhs.k",
+        "select lhs.v, rhs.v from lhs join rhs order by lhs.v, rhs.v",
+    };
+
+    // Merge joins, and then hash joins that build on the right side
+    for (ssize_t minRows: { 1000000, 50 }) {
+        server.setHashJoinMinRows(minRows);
+
+        for (auto & q: queries) {
+            cerr << "query " << q << " hashJoinMinRows " << minRows << endl;
+
+            auto rows = takeRows(server, q);
+            BOOST_CHECK(!rows.empty());
+
+            // Batches that split the output in different places
+            for (size_t batchSize: { 1, 7, 1024 }) {
+                auto batched = takeBatches(server, q, batchSize);
+                BOOST_CHECK_EQUAL_COLLECTIONS(batched.begin(), batched.end(),
+                                              rows.begin(), rows.end());
+            }
+        }
+    }
+}
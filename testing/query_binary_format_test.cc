@@ -0,0 +1,286 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* query_binary_format_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test of the columnar binary output format of the query API, by decoding
+   the output of streamHttpQuery.
+*/
+
+#include "mldb/server/dataset_collection.h"
+#include "mldb/sql/dataset_types.h"
+#include "mldb/rest/in_process_rest_connection.h"
+#include "mldb/http/http_exception.h"
+#include "mldb/types/value_description.h"
+#include <cstring>
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+/// Reads the little endian values written by the binary format
+struct BinaryReader {
+    BinaryReader(const std::string & data)
+        : data(data), pos(0)
+    {
+    }
+
+    template<typename T>
+    T read()
+    {
+        BOOST_REQUIRE_LE(pos + sizeof(T), data.size());
+        T result;
+        std::memcpy(&result, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return result;
+    }
+
+    std::string readBytes(size_t n)
+    {
+        BOOST_REQUIRE_LE(pos + n, data.size());
+        std::string result(data, pos, n);
+        pos += n;
+        return result;
+    }
+
+    std::string readString()
+    {
+        return readBytes(read<uint32_t>());
+    }
+
+    const std::string & data;
+    size_t pos;
+};
+
+/// A decoded column, with its values converted back to CellValues
+struct DecodedColumn {
+    std::string name;
+    int type;
+    std::vector<CellValue> values;
+};
+
+std::vector<DecodedColumn>
+decode(const std::string & data, uint64_t & numRows)
+{
+    BinaryReader reader(data);
+    BOOST_REQUIRE_EQUAL(reader.readBytes(8), "MLDBCOLS");
+    BOOST_REQUIRE_EQUAL(reader.read<uint32_t>(), 1);
+    numRows = reader.read<uint64_t>();
+    uint32_t numColumns = reader.read<uint32_t>();
+
+    std::vector<DecodedColumn> result(numColumns);
+    for (auto & col: result) {
+        col.name = reader.readString();
+        col.type = reader.read<uint8_t>();
+
+        std::string bitmap = reader.readBytes((numRows + 7) / 8);
+        auto valid = [&] (size_t i) { return (bitmap[i / 8] >> (i % 8)) & 1; };
+
+        std::vector<std::string> dictionary;
+        if (col.type == 3 || col.type == 5) {
+            uint32_t n = reader.read<uint32_t>();
+            for (unsigned i = 0;  i < n;  ++i)
+                dictionary.push_back(reader.readString());
+        }
+
+        col.values.resize(numRows);
+        for (size_t i = 0;  i < numRows;  ++i) {
+            CellValue val;
+            switch (col.type) {
+            case 0:
+                break;
+            case 1:
+                val = reader.read<int64_t>();
+                break;
+            case 2:
+                val = reader.read<double>();
+                break;
+            case 3:
+                val = Utf8String(dictionary.at(reader.read<uint32_t>()));
+                break;
+            case 4:
+                val = Date::fromSecondsSinceEpoch(reader.read<double>());
+                break;
+            case 5:
+                val = jsonDecodeStr<CellValue>
+                    (dictionary.at(reader.read<uint32_t>()));
+                break;
+            default:
+                BOOST_FAIL("unknown column type");
+            }
+            if (valid(i))
+                col.values[i] = val;
+        }
+    }
+
+    BOOST_CHECK_EQUAL(reader.pos, data.size());
+    return result;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_binary_format )
+{
+    Date ts;
+    Date date = Date::fromSecondsSinceEpoch(1456000000.5);
+
+    std::vector<MatrixNamedRow> rows;
+    for (int i = 0;  i < 10000;  ++i) {
+        MatrixNamedRow row;
+        row.rowName = RowName(ML::format("row%d", i));
+        row.rowHash = row.rowName;
+        row.columns.emplace_back(ColumnName("int"), i - 5000, ts);
+        if (i % 3 == 0)
+            row.columns.emplace_back(ColumnName("sparse"), i * 0.5, ts);
+        row.columns.emplace_back(ColumnName("str"),
+                                 Utf8String(ML::format("été %d", i % 7)), ts);
+        row.columns.emplace_back(ColumnName("date"), date.plusSeconds(i), ts);
+        if (i % 2)
+            row.columns.emplace_back(ColumnName("mixed"), i, ts);
+        else row.columns.emplace_back(ColumnName("mixed"), "x", ts);
+        if (i == 9999)
+            row.columns.emplace_back(ColumnName("last"), 1, ts);
+        rows.emplace_back(std::move(row));
+    }
+
+    InProcessRestConnection connection;
+    auto runQuery = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+        {
+            for (auto row: rows)
+                if (!onRow(row))
+                    return;
+        };
+
+    streamHttpQuery(runQuery, connection, "binary",
+                    false /* headers */, true /* rowNames */,
+                    true /* rowHashes */);
+
+    BOOST_CHECK_EQUAL(connection.responseCode, 200);
+    BOOST_CHECK_EQUAL(connection.contentType, "application/octet-stream");
+
+    uint64_t numRows;
+    auto columns = decode(connection.response, numRows);
+    BOOST_REQUIRE_EQUAL(numRows, rows.size());
+
+    std::vector<std::pair<std::string, int> > expectedColumns = {
+        { "_rowName", 3 }, { "_rowHash", 3 }, { "int", 1 }, { "sparse", 2 },
+        { "str", 3 }, { "date", 4 }, { "mixed", 5 }, { "last", 1 }
+    };
+
+    BOOST_REQUIRE_EQUAL(columns.size(), expectedColumns.size());
+    for (unsigned i = 0;  i < columns.size();  ++i) {
+        BOOST_CHECK_EQUAL(columns[i].name, expectedColumns[i].first);
+        BOOST_CHECK_EQUAL(columns[i].type, expectedColumns[i].second);
+    }
+
+    for (unsigned i = 0;  i < rows.size();  ++i) {
+        const MatrixNamedRow & row = rows[i];
+        BOOST_CHECK_EQUAL(columns[0].values[i],
+                          CellValue(row.rowName.toUtf8String()));
+        BOOST_CHECK_EQUAL(columns[1].values[i],
+                          CellValue(row.rowHash.toString()));
+
+        std::vector<CellValue> expected(columns.size() - 2);
+        for (auto & c: row.columns) {
+            for (unsigned j = 2;  j < columns.size();  ++j)
+                if (std::get<0>(c).toUtf8String() == columns[j].name)
+                    expected[j - 2] = std::get<1>(c);
+        }
+
+        for (unsigned j = 2;  j < columns.size();  ++j) {
+            // Compare as JSON so that 3 and 3.0 in a float column are equal
+            BOOST_CHECK_EQUAL(jsonEncodeStr(columns[j].values[i]),
+                              jsonEncodeStr(expected[j - 2]));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_binary_format_empty )
+{
+    InProcessRestConnection connection;
+    auto runQuery = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+        {
+        };
+
+    streamHttpQuery(runQuery, connection, "binary", false, false, false);
+
+    BOOST_CHECK_EQUAL(connection.responseCode, 200);
+    uint64_t numRows;
+    auto columns = decode(connection.response, numRows);
+    BOOST_CHECK_EQUAL(numRows, 0);
+    BOOST_CHECK_EQUAL(columns.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_binary_format_big_integers )
+{
+    // Above INT64_MAX, so neither an int64 nor a float64 holds it exactly
+    uint64_t big = 18446744073709551557ULL;
+
+    std::vector<MatrixNamedRow> rows(3);
+    rows[0].columns.emplace_back(ColumnName("x"), big, Date());
+    rows[1].columns.emplace_back(ColumnName("x"), 1, Date());
+    rows[2].columns.emplace_back(ColumnName("x"), 0.5, Date());
+
+    InProcessRestConnection connection;
+    auto runQuery = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+        {
+            for (auto row: rows)
+                if (!onRow(row))
+                    return;
+        };
+
+    streamHttpQuery(runQuery, connection, "binary", false, false, false);
+
+    BOOST_CHECK_EQUAL(connection.responseCode, 200);
+    uint64_t numRows;
+    auto columns = decode(connection.response, numRows);
+    BOOST_REQUIRE_EQUAL(columns.size(), 1);
+    BOOST_CHECK_EQUAL(columns[0].type, 5);
+    BOOST_REQUIRE_EQUAL(columns[0].values.size(), 3);
+    BOOST_CHECK_EQUAL(columns[0].values[0].toUInt(), big);
+    BOOST_CHECK_EQUAL(jsonEncodeStr(columns[0].values[2]), "0.5");
+}
+
+BOOST_AUTO_TEST_CASE( test_binary_format_implicit_column_clash )
+{
+    MatrixNamedRow row;
+    row.rowName = RowName("row");
+    row.rowHash = row.rowName;
+    row.columns.emplace_back(ColumnName("_rowName"), "clash", Date());
+
+    auto runQuery = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+        {
+            MatrixNamedRow copy = row;
+            onRow(copy);
+        };
+
+    // With the implicit column, it's an error before anything is sent
+    {
+        InProcessRestConnection connection;
+        BOOST_CHECK_THROW(streamHttpQuery(runQuery, connection, "binary",
+                                          false, true, true),
+                          HttpReturnException);
+        BOOST_CHECK(connection.response.empty());
+    }
+
+    // Without it, it's an ordinary column
+    {
+        InProcessRestConnection connection;
+        streamHttpQuery(runQuery, connection, "binary", false, false, true);
+        BOOST_CHECK_EQUAL(connection.responseCode, 200);
+        uint64_t numRows;
+        auto columns = decode(connection.response, numRows);
+        BOOST_REQUIRE_EQUAL(columns.size(), 2);
+        BOOST_CHECK_EQUAL(columns[0].name, "_rowHash");
+        BOOST_CHECK_EQUAL(columns[1].name, "_rowName");
+        BOOST_CHECK_EQUAL(columns[1].values.at(0), CellValue("clash"));
+    }
+}
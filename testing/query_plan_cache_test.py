@@ -0,0 +1,206 @@
+#
+# query_plan_cache_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that parsed and bound query plans are reused, and that they are
+# thrown away when the dataset they read from is committed or recreated.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+def create_dataset(name, values):
+    ds = mldb.create_dataset({'id': name, 'type': 'sparse.mutable'})
+    for i, v in enumerate(values):
+        ds.record_row('row{}'.format(i), [['x', v, 0]])
+    ds.commit()
+    return ds
+
+
+def stats():
+    return mldb.get('/v1/queryPlanCache').json()
+
+
+def query_values(q):
+    return sorted(r['x'] for r in mldb.get('/v1/query', q=q,
+                                           format='aos').json())
+
+
+class QueryPlanCacheTest(unittest.TestCase):
+
+    def test_plan_reused(self):
+        create_dataset('reused', [1, 2, 3])
+        self.assertEqual(query_values('SELECT x FROM reused WHERE x > 1'),
+                         [2, 3])
+
+        before = stats()
+        # Whitespace differences map to the same plan
+        self.assertEqual(query_values('SELECT x  FROM reused\nWHERE x > 1'),
+                         [2, 3])
+        after = stats()
+        self.assertEqual(after['statementCache']['hits'],
+                         before['statementCache']['hits'] + 1)
+        self.assertEqual(after['planCache']['hits'],
+                         before['planCache']['hits'] + 1)
+
+        # Whitespace inside a string is significant
+        res = mldb.get('/v1/query', format='aos',
+                       q="SELECT 'a  b' AS s FROM reused LIMIT 1").json()
+        self.assertEqual(res[0]['s'], 'a  b')
+        res = mldb.get('/v1/query', format='aos',
+                       q="SELECT 'a b' AS s FROM reused LIMIT 1").json()
+        self.assertEqual(res[0]['s'], 'a b')
+
+    def test_commit_invalidates(self):
+        ds = create_dataset('committed', [1, 2])
+        q = 'SELECT x FROM committed'
+        self.assertEqual(query_values(q), [1, 2])
+
+        ds.record_row('row2', [['x', 3, 0]])
+        ds.commit()
+
+        before = stats()
+        self.assertEqual(query_values(q), [1, 2, 3])
+        after = stats()
+        self.assertEqual(after['planCache']['invalidations'],
+                         before['planCache']['invalidations'] + 1)
+
+    def test_recreate_invalidates(self):
+        create_dataset('recreated', [1, 2])
+        q = 'SELECT x FROM recreated'
+        self.assertEqual(query_values(q), [1, 2])
+
+        mldb.delete('/v1/datasets/recreated')
+        create_dataset('recreated', [5])
+
+        before = stats()
+        self.assertEqual(query_values(q), [5])
+        after = stats()
+        self.assertEqual(after['planCache']['invalidations'],
+                         before['planCache']['invalidations'] + 1)
+
+    def test_grouped_query(self):
+        create_dataset('grouped', [1, 1, 2])
+        q = 'SELECT count(*) AS x FROM grouped GROUP BY x'
+        self.assertEqual(query_values(q), [1, 2])
+
+        before = stats()
+        self.assertEqual(query_values(q), [1, 2])
+        after = stats()
+        self.assertEqual(after['statementCache']['hits'],
+                         before['statementCache']['hits'] + 1)
+        self.assertEqual(after['planCache']['hits'],
+                         before['planCache']['hits'])
+
+    def test_sql_query_function(self):
+        ds = create_dataset('fn_ds', [1, 2])
+        mldb.put('/v1/functions/fn', {
+            'type': 'sql.query',
+            'params': {
+                'query': 'SELECT sum(x) AS total FROM fn_ds GROUP BY 1'
+            }
+        })
+
+        def total():
+            res = mldb.get('/v1/functions/fn/application', input={})
+            return res.json()['output']['total']
+
+        self.assertEqual(total(), 3)
+        before = stats()
+        self.assertEqual(total(), 3)
+        after = stats()
+        self.assertGreater(after['functionCache']['hits'],
+                           before['functionCache']['hits'])
+
+        ds.record_row('row2', [['x', 4, 0]])
+        ds.commit()
+        self.assertEqual(total(), 7)
+
+    def test_write_visible_without_commit(self):
+        # In consistentAfterWrite mode, writes are seen without a commit,
+        # and so must make plans bound before them stale
+        ds = mldb.create_dataset({'id': 'after_write',
+                                  'type': 'sparse.mutable',
+                                  'params': {
+                                      'consistencyLevel': 'consistentAfterWrite'
+                                  }})
+        ds.record_row('row0', [['x', 1, 0], ['y', 2, 0]])
+        ds.commit()
+
+        q = 'SELECT * EXCLUDING (y) FROM after_write'
+
+        def columns():
+            res = mldb.get('/v1/query', q=q, format='aos').json()
+            return sorted(set(k for r in res for k in r))
+
+        self.assertEqual(columns(), ['x'])
+        self.assertEqual(columns(), ['x'])
+
+        ds.record_row('row1', [['z', 3, 0]])
+        self.assertEqual(columns(), ['x', 'z'])
+
+    def test_recreated_function_invalidates(self):
+        create_dataset('fn_input', [1, 2])
+
+        def put_function(factor):
+            mldb.put('/v1/functions/scale', {
+                'type': 'sql.expression',
+                'params': {'expression': 'x * {} AS y'.format(factor)}
+            })
+
+        put_function(2)
+        q = 'SELECT scale({x: x})[y] AS x FROM fn_input'
+        self.assertEqual(query_values(q), [2, 4])
+        self.assertEqual(query_values(q), [2, 4])
+
+        # Same name, new function; the plan bound to the old one is stale
+        mldb.delete('/v1/functions/scale')
+        put_function(3)
+
+        before = stats()
+        self.assertEqual(query_values(q), [3, 6])
+        after = stats()
+        self.assertEqual(after['planCache']['invalidations'],
+                         before['planCache']['invalidations'] + 1)
+
+    def test_replaced_subquery_dataset_invalidates(self):
+        create_dataset('outer_ds', [1, 2, 3])
+        create_dataset('inner_ds', [1])
+        q = 'SELECT x FROM outer_ds WHERE x IN (SELECT x FROM inner_ds)'
+        self.assertEqual(query_values(q), [1])
+        self.assertEqual(query_values(q), [1])
+
+        mldb.delete('/v1/datasets/inner_ds')
+        create_dataset('inner_ds', [2, 3])
+        self.assertEqual(query_values(q), [2, 3])
+
+    def test_deleted_dataset_released(self):
+        create_dataset('deleted', [1, 2])
+        query_values('SELECT x FROM deleted')
+        query_values('SELECT x FROM deleted WHERE x > 1')
+        before = stats()
+
+        mldb.delete('/v1/datasets/deleted')
+
+        # Plans are swept as others are given back
+        create_dataset('other', [1])
+        query_values('SELECT x FROM other')
+        after = stats()
+        self.assertLessEqual(after['plans'], before['plans'] - 1)
+
+    def test_bad_query_not_cached(self):
+        before = stats()
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.get('/v1/query', q='SELECT FROM WHERE')
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.get('/v1/query', q='SELECT FROM WHERE')
+        after = stats()
+        self.assertEqual(after['statementCache']['hits'],
+                         before['statementCache']['hits'])
+
+
+mldb.run_tests()
@@ -0,0 +1,66 @@
+#
+# query_priority_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks the priority and maxParallelism parameters of queries and procedure
+# runs.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+class QueryPriorityTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        ds = mldb.create_dataset({'id': 'ds', 'type': 'sparse.mutable'})
+        for i in range(2000):
+            ds.record_row('row{}'.format(i), [['x', i, 0], ['y', i % 7, 0]])
+        ds.commit()
+
+    def test_query(self):
+        q = 'select y, count(*) as cnt from ds group by y order by y'
+        expected = mldb.get('/v1/query', q=q).json()
+        for priority in ['low', 'normal', 'high']:
+            for max_parallelism in [-1, 1, 3]:
+                res = mldb.get('/v1/query', q=q, priority=priority,
+                               maxParallelism=max_parallelism).json()
+                self.assertEqual(res, expected)
+
+    def test_bad_query_params(self):
+        with self.assertRaises(mldb_wrapper.ResponseException) as re:
+            mldb.get('/v1/query', q='select 1', priority='urgent')
+        self.assertEqual(re.exception.response.status_code, 400)
+
+        with self.assertRaises(mldb_wrapper.ResponseException) as re:
+            mldb.get('/v1/query', q='select 1', maxParallelism=0)
+        self.assertEqual(re.exception.response.status_code, 400)
+
+    def test_procedure_run(self):
+        mldb.put('/v1/procedures/copy', {
+            'type': 'transform',
+            'params': {
+                'inputData': 'select x * 2 as x2 from ds',
+                'outputDataset': {'id': 'out', 'type': 'sparse.mutable'}
+            }
+        })
+
+        mldb.post('/v1/procedures/copy/runs',
+                  {'priority': 'low', 'maxParallelism': 2})
+
+        res = mldb.query('select count(*) from out')
+        self.assertEqual(res[1][1], 2000)
+
+        with self.assertRaises(mldb_wrapper.ResponseException) as re:
+            mldb.post('/v1/procedures/copy/runs', {'priority': 'urgent'})
+        self.assertEqual(re.exception.response.status_code, 400)
+
+        with self.assertRaises(mldb_wrapper.ResponseException) as re:
+            mldb.post('/v1/procedures/copy/runs', {'maxParallelism': -2})
+        self.assertEqual(re.exception.response.status_code, 400)
+
+mldb.run_tests()
@@ -0,0 +1,181 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* query_spill_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test that queries over their memory budget spill to disk and still give
+   the same results.
+*/
+
+#include "mldb/server/mldb_server.h"
+#include "mldb/server/query_spill.h"
+#include "mldb/core/dataset.h"
+#include "mldb/jml/db/persistent.h"
+#include "mldb/types/value_description.h"
+#include <boost/filesystem.hpp>
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+/// Temporary directory that is removed at the end of the test
+struct TempDirectory {
+    TempDirectory()
+        : path(boost::filesystem::temp_directory_path()
+               / boost::filesystem::unique_path("query_spill_test-%%%%-%%%%"))
+    {
+        boost::filesystem::create_directories(path);
+    }
+
+    ~TempDirectory()
+    {
+        boost::filesystem::remove_all(path);
+    }
+
+    size_t numFiles() const
+    {
+        return std::distance(boost::filesystem::directory_iterator(path),
+                             boost::filesystem::directory_iterator());
+    }
+
+    boost::filesystem::path path;
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_spill_file_round_trip )
+{
+    TempDirectory dir;
+
+    Date ts = Date::fromSecondsSinceEpoch(1000);
+    Date ts2 = Date::fromSecondsSinceEpoch(2000);
+
+    ExpressionValue::Row nested;
+    nested.emplace_back(ColumnName("a"), ExpressionValue(1, ts));
+    nested.emplace_back(ColumnName("b"), ExpressionValue("hello", ts2));
+
+    ExpressionValue::Row row;
+    row.emplace_back(ColumnName("x"), ExpressionValue(std::move(nested)));
+    row.emplace_back(ColumnName("y"), ExpressionValue(2.5, ts));
+
+    std::vector<ExpressionValue> vals = {
+        ExpressionValue(),
+        ExpressionValue(3, ts),
+        ExpressionValue(Utf8String("été"), ts2),
+        ExpressionValue(ts2, ts),
+        ExpressionValue(std::move(row)),
+        ExpressionValue(std::vector<double>{ 1.0, 2.0, 3.5 }, ts)
+    };
+
+    NamedRowValue namedRow;
+    namedRow.rowName = RowName("row1");
+    namedRow.rowHash = namedRow.rowName;
+    namedRow.columns.emplace_back(ColumnName("c"), ExpressionValue(4, ts));
+
+    {
+        SpillFile file(dir.path.string());
+        BOOST_CHECK_EQUAL(dir.numFiles(), 1);
+
+        for (unsigned i = 0;  i < 3;  ++i) {
+            file.append([&] (ML::DB::Store_Writer & store)
+                        {
+                            serializeSpilled(store, vals);
+                            serializeSpilled(store, namedRow);
+                        });
+        }
+        file.finish();
+        BOOST_CHECK_EQUAL(file.size(), 3);
+
+        auto store = file.read();
+        for (unsigned i = 0;  i < 3;  ++i) {
+            std::vector<ExpressionValue> vals2;
+            NamedRowValue namedRow2;
+            reconstituteSpilled(*store, vals2);
+            reconstituteSpilled(*store, namedRow2);
+
+            BOOST_REQUIRE_EQUAL(vals2.size(), vals.size());
+            for (unsigned j = 0;  j < vals.size();  ++j) {
+                BOOST_CHECK_EQUAL(jsonEncodeStr(vals2[j]),
+                                  jsonEncodeStr(vals[j]));
+                BOOST_CHECK_EQUAL(vals2[j].getEffectiveTimestamp(),
+                                  vals[j].getEffectiveTimestamp());
+            }
+            BOOST_CHECK_EQUAL(jsonEncodeStr(namedRow2),
+                              jsonEncodeStr(namedRow));
+        }
+
+        BOOST_CHECK_GT(estimateMemory(vals), 0);
+    }
+
+    // The file is removed with the object
+    BOOST_CHECK_EQUAL(dir.numFiles(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_queries_spill )
+{
+    TempDirectory dir;
+
+    MldbServer server;
+    server.init();
+    server.setCacheDirectory(dir.path.string());
+
+    PolyConfig config;
+    config.id = "ds";
+    config.type = "sparse.mutable";
+    auto dataset = obtainDataset(&server, config);
+
+    Date ts;
+    std::vector<std::pair<RowName, std::vector<std::tuple<ColumnName, CellValue, Date> > > > rows;
+    for (int i = 0;  i < 20000;  ++i) {
+        std::vector<std::tuple<ColumnName, CellValue, Date> > cols;
+        cols.emplace_back(ColumnName("x"), i % 5003, ts);
+        cols.emplace_back(ColumnName("y"), i % 3, ts);
+        cols.emplace_back(ColumnName("s"), ML::format("string value %d", i), ts);
+        rows.emplace_back(RowName(ML::format("row%d", i)), std::move(cols));
+    }
+    dataset->recordRows(rows);
+    dataset->commit();
+
+    // Each query, and whether it has enough to spill
+    std::vector<std::pair<std::string, bool> > queries = {
+        { "select * from ds order by s", true },
+        { "select * from ds order by x desc, s offset 100 limit 1000", true },
+        { "select x, y, count(*), sum(x), min(s) from ds group by x, y", true },
+        { "select x, y, count(*) from ds group by x, y limit 50", true },
+        { "select x, count(*) as c, max(s) from ds group by x "
+          "having count(*) > 3 order by max(s) desc offset 10 limit 500", true },
+        // Only three groups, which always fit in memory
+        { "select y, count(*) from ds group by y order by y", false },
+    };
+
+    for (auto & query: queries) {
+        const std::string & q = query.first;
+        cerr << "query " << q << endl;
+
+        uint64_t numSpills = SpillFile::numCreated;
+        server.setQueryMemoryLimit(0);
+        auto expected = jsonEncodeStr(server.query(q));
+        BOOST_CHECK_EQUAL(SpillFile::numCreated, numSpills);
+
+        // Small enough that the bigger queries spill
+        server.setQueryMemoryLimit(64 * 1024);
+        auto spilled = jsonEncodeStr(server.query(q));
+
+        if (query.second)
+            BOOST_CHECK_GT(SpillFile::numCreated, numSpills);
+        else BOOST_CHECK_EQUAL(SpillFile::numCreated, numSpills);
+
+        BOOST_CHECK_EQUAL(spilled, expected);
+
+        // Spill files don't outlive the query
+        BOOST_CHECK_EQUAL(dir.numFiles(), 0);
+    }
+}
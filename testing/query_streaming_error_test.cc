@@ -0,0 +1,146 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* query_streaming_error_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test that an error after streamed query output has started is visible to
+   the client, rather than looking like a complete but short response.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+#include "mldb/http/tcp_acceptor.h"
+#include "mldb/server/mldb_server.h"
+#include "mldb/server/dataset_collection.h"
+#include "mldb/rest/in_process_rest_connection.h"
+#include "mldb/arch/format.h"
+
+
+using namespace std;
+using namespace boost;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+
+namespace {
+
+/// Enough rows of output to go over several chunks
+const int NUM_ROWS = 1000;
+
+/// Output NUM_ROWS rows, then fail if asked to
+void runQuery(const std::function<bool (MatrixNamedRow & row)> & onRow,
+              bool fail)
+{
+    for (int i = 0;  i < NUM_ROWS;  ++i) {
+        MatrixNamedRow row;
+        row.rowName = RowName(ML::format("row%d", i));
+        row.rowHash = row.rowName;
+        row.columns.emplace_back(ColumnName("x"), string(1000, 'x'), Date());
+        if (!onRow(row))
+            return;
+    }
+
+    if (fail)
+        throw ML::Exception("query failed after output started");
+}
+
+void addQueryRoute(MldbServer & server, const std::string & path, bool fail)
+{
+    auto onRequest = [=] (RestConnection & connection,
+                          const RestRequest & request,
+                          RestRequestParsingContext & context)
+        {
+            auto run = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+                {
+                    runQuery(onRow, fail);
+                };
+            streamHttpQuery(run, connection, "full", true, true, false);
+            return RestRequestRouter::MR_YES;
+        };
+
+    server.router.addRoute(path, "GET", "Test query", onRequest,
+                           Json::Value());
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_streaming_error_over_http )
+{
+    MldbServer server;
+
+    server.init();
+    addQueryRoute(server, "/complete", false);
+    addQueryRoute(server, "/failing", true);
+
+    string httpBoundAddress = server.bindTcp(PortRange(17000,18000),
+                                             "127.0.0.1");
+    cerr << "http listening on " << httpBoundAddress << endl;
+
+    server.start();
+    auto & acceptor = *server.httpEndpoint->acceptor_;
+    int port = acceptor.effectiveTCPv4Port();
+    auto address = asio::ip::address::from_string("127.0.0.1");
+    asio::ip::tcp::endpoint serverEndpoint(address, port);
+    asio::io_service ioService;
+
+    // Send a GET and return everything that comes back until the server
+    // closes the connection
+    auto get = [&] (const string & path) {
+        auto socket = asio::ip::tcp::socket(ioService);
+        socket.connect(serverEndpoint);
+        string payload = ("GET " + path + " HTTP/1.1\r\n"
+                          "Host: *\r\n"
+                          "Connection: close\r\n\r\n");
+        socket.send(asio::buffer(payload));
+
+        string result;
+        char data[65536];
+        for (;;) {
+            system::error_code error;
+            size_t nBytes = socket.read_some(asio::buffer(data), error);
+            result.append(data, nBytes);
+            if (error)
+                break;
+        }
+        return result;
+    };
+
+    auto isFinished = [] (const string & response) {
+        string lastChunk = "\r\n0\r\n\r\n";
+        return response.size() >= lastChunk.size()
+            && response.compare(response.size() - lastChunk.size(),
+                                lastChunk.size(), lastChunk) == 0;
+    };
+
+    string complete = get("/complete");
+    BOOST_CHECK_EQUAL(complete.substr(0, 15), "HTTP/1.1 200 OK");
+    BOOST_CHECK(complete.find("chunked") != string::npos);
+    BOOST_CHECK(isFinished(complete));
+
+    // The response was started, but must not be terminated as if it were
+    // complete
+    string failing = get("/failing");
+    BOOST_CHECK_EQUAL(failing.substr(0, 15), "HTTP/1.1 200 OK");
+    BOOST_CHECK(failing.find("row0") != string::npos);
+    BOOST_CHECK(!isFinished(failing));
+    BOOST_CHECK_LT(failing.size(), complete.size());
+}
+
+BOOST_AUTO_TEST_CASE( test_streaming_error_in_process )
+{
+    auto run = [&] (const std::function<bool (MatrixNamedRow &)> & onRow)
+        {
+            runQuery(onRow, true);
+        };
+
+    // In process, nothing has reached the caller yet so the partial output
+    // is replaced by an error
+    InProcessRestConnection connection;
+    streamHttpQuery(run, connection, "full", true, true, false);
+    BOOST_CHECK_EQUAL(connection.responseCode, 500);
+    BOOST_CHECK(connection.response.find("query failed after output started")
+                != string::npos);
+}
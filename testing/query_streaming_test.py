@@ -0,0 +1,94 @@
+#
+# query_streaming_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks the output of the query endpoint in each format when it's large
+# enough to be streamed in several chunks.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_ROWS = 5000
+
+
+class QueryStreamingTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        ds = mldb.create_dataset({'id': 'ds', 'type': 'sparse.mutable'})
+        for i in range(NUM_ROWS):
+            cols = [['x', i, 0], ['s', 'some string value {}'.format(i), 0]]
+            if i % 7 == 0:
+                cols.append(['sparse', i * 0.5, 0])
+            ds.record_row('row{}'.format(i), cols)
+        ds.commit()
+
+    def query(self, fmt, **kwargs):
+        return mldb.get('/v1/query', q='select * from ds order by x',
+                        format=fmt, **kwargs).json()
+
+    def check_row(self, i, row):
+        self.assertEqual(row['_rowName'], 'row{}'.format(i))
+        self.assertEqual(row['x'], i)
+        self.assertEqual(row['s'], 'some string value {}'.format(i))
+        if i % 7 == 0:
+            self.assertEqual(row['sparse'], i * 0.5)
+        else:
+            self.assertIsNone(row.get('sparse'))
+
+    def test_full(self):
+        res = self.query('full')
+        self.assertEqual(len(res), NUM_ROWS)
+        for i, row in enumerate(res):
+            cols = {c[0]: c[1] for c in row['columns']}
+            cols['_rowName'] = row['rowName']
+            self.check_row(i, cols)
+
+    def test_sparse(self):
+        res = self.query('sparse')
+        self.assertEqual(len(res), NUM_ROWS)
+        for i, row in enumerate(res):
+            self.check_row(i, dict(row))
+
+    def test_aos(self):
+        res = self.query('aos')
+        self.assertEqual(len(res), NUM_ROWS)
+        for i, row in enumerate(res):
+            self.check_row(i, row)
+
+    def test_soa(self):
+        res = self.query('soa')
+        self.assertEqual(sorted(res.keys()),
+                         ['_rowName', 's', 'sparse', 'x'])
+        for col in res.values():
+            self.assertEqual(len(col), NUM_ROWS)
+        for i in range(NUM_ROWS):
+            self.check_row(i, {k: v[i] for k, v in res.items()})
+
+    def test_table(self):
+        res = self.query('table')
+        self.assertEqual(len(res), NUM_ROWS + 1)
+        header = res[0]
+        self.assertEqual(sorted(header), ['_rowName', 's', 'sparse', 'x'])
+        for i, row in enumerate(res[1:]):
+            self.check_row(i, dict(zip(header, row)))
+
+        res = self.query('table', headers='false', rowNames='false')
+        self.assertEqual(len(res), NUM_ROWS)
+        self.assertEqual(res[0][header.index('x') - 1], 0)
+
+    def test_unknown_format(self):
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            self.query('nonexistent')
+
+    def test_error_before_output(self):
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.get('/v1/query', q='select * from nonexistent_ds',
+                     format='aos')
+
+
+mldb.run_tests()
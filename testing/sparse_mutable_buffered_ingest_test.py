@@ -0,0 +1,86 @@
+#
+# sparse_mutable_buffered_ingest_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that writes buffered per thread by sparse.mutable in its
+# consistentAfterCommit mode all show up after a commit, including when
+# they come from many threads at once and fill the buffers.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+NUM_ROWS = 20000
+
+
+class SparseMutableBufferedIngestTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        ds = mldb.create_dataset({'id': 'ingest_input',
+                                  'type': 'sparse.mutable'})
+        # 4 cells per row is more than a thread's write buffer holds
+        for start in range(0, NUM_ROWS, 1000):
+            ds.record_rows([
+                ['row{}'.format(i),
+                 [['a', i, 0], ['b', i * 2, 0], ['c', 'v{}'.format(i % 7), 0],
+                  ['d', 1, 0]]]
+                for i in range(start, start + 1000)])
+        ds.commit()
+
+    def test_single_thread(self):
+        res = mldb.query('SELECT count(*), sum(a), sum(d) FROM ingest_input')
+        self.assertEqual(res[1][1:],
+                         [NUM_ROWS, sum(range(NUM_ROWS)), NUM_ROWS])
+
+    def test_not_visible_before_commit(self):
+        ds = mldb.create_dataset({'id': 'ingest_uncommitted',
+                                  'type': 'sparse.mutable'})
+        ds.record_row('r1', [['x', 1, 0]])
+        ds.record_row('r2', [['x', 2, 0]])
+        res = mldb.query('SELECT count(*) FROM ingest_uncommitted')
+        self.assertEqual(res[1][1], 0)
+        ds.commit()
+        res = mldb.query('SELECT count(*) FROM ingest_uncommitted')
+        self.assertEqual(res[1][1], 2)
+
+        # Rows written to after a commit keep their old values
+        ds.record_row('r1', [['y', 3, 0]])
+        ds.commit()
+        res = mldb.query('SELECT x, y FROM ingest_uncommitted '
+                         'WHERE rowName() = \'r1\'')
+        self.assertEqual(res[1][1:], [1, 3])
+
+    def test_empty_row_name(self):
+        ds = mldb.create_dataset({'id': 'ingest_bad',
+                                  'type': 'sparse.mutable'})
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            ds.record_rows([['ok', [['x', 1, 0]]], ['', [['x', 2, 0]]]])
+        ds.commit()
+        res = mldb.query('SELECT count(*) FROM ingest_bad')
+        self.assertEqual(res[1][1], 0)
+
+    def test_many_threads(self):
+        # The transform records its output from many threads
+        mldb.put('/v1/procedures/ingest_transform', {
+            'type': 'transform',
+            'params': {
+                'inputData': 'SELECT a, b, c, d FROM ingest_input',
+                'outputDataset': {'id': 'ingest_output',
+                                  'type': 'sparse.mutable'},
+                'runOnCreation': True
+            }
+        })
+
+        res = mldb.query('SELECT count(*), sum(a), sum(b) FROM ingest_output')
+        self.assertEqual(res[1][1:], [NUM_ROWS, sum(range(NUM_ROWS)),
+                                      2 * sum(range(NUM_ROWS))])
+        res = mldb.query('SELECT count(*) FROM ingest_output '
+                         'WHERE c = \'v3\'')
+        self.assertEqual(res[1][1], len(range(3, NUM_ROWS, 7)))
+
+
+mldb.run_tests()
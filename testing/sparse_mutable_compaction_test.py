@@ -0,0 +1,82 @@
+#
+# sparse_mutable_compaction_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that sparse.mutable returns the same data whether it's been
+# compacted by a commit, is still in the layers written since, or is
+# split between the two.
+#
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+MODES = [
+    ('after_commit', {'consistencyLevel': 'consistentAfterCommit'}),
+    ('favor_reads', {'consistencyLevel': 'consistentAfterWrite',
+                     'favor': 'favorReads'}),
+    ('favor_writes', {'consistencyLevel': 'consistentAfterWrite',
+                      'favor': 'favorWrites'}),
+]
+
+
+class SparseMutableCompactionTest(unittest.TestCase):
+
+    def check_mode(self, name, params):
+        ds = mldb.create_dataset({
+            'id': name,
+            'type': 'sparse.mutable',
+            'params': params
+        })
+
+        # Enough batches to stack up more layers than favorWrites keeps
+        for batch in range(40):
+            ds.record_rows([
+                ['row{}'.format(i),
+                 [['x', i, batch], ['s', 'str{}'.format(i % 3), batch]]]
+                for i in range(batch * 5, batch * 5 + 5)])
+            if batch == 10:
+                ds.commit()
+
+        # A row that's both compacted and written to afterwards
+        ds.record_row('row0', [['y', 'late', 100]])
+        ds.commit()
+
+        res = mldb.get('/v1/query', format='aos',
+                       q='SELECT * FROM {} ORDER BY rowName()'.format(name))
+        rows = {r['_rowName']: r for r in res.json()}
+        self.assertEqual(len(rows), 200)
+        self.assertEqual(rows['row0'], {'_rowName': 'row0', 'x': 0,
+                                        's': 'str0', 'y': 'late'})
+        self.assertEqual(rows['row199']['x'], 199)
+        self.assertEqual(rows['row199']['s'], 'str1')
+
+        res = mldb.query('SELECT count(*) FROM {}'.format(name))
+        self.assertEqual(res[1][1], 200)
+
+        # Commit with nothing new leaves the data unchanged
+        ds.commit()
+        res = mldb.query('SELECT count(*) FROM {} WHERE y IS NOT NULL'
+                         .format(name))
+        self.assertEqual(res[1][1], 1)
+
+        # Columns are compacted too
+        res = mldb.query('SELECT sum(x) FROM {}'.format(name))
+        self.assertEqual(res[1][1], sum(range(200)))
+
+    def test_modes(self):
+        for name, params in MODES:
+            self.check_mode('compaction_' + name, params)
+
+    def test_empty_commit(self):
+        ds = mldb.create_dataset({'id': 'empty_commit',
+                                  'type': 'sparse.mutable'})
+        ds.commit()
+        ds.commit()
+        res = mldb.query('SELECT count(*) FROM empty_commit')
+        self.assertEqual(res[1][1], 0)
+
+
+mldb.run_tests()
@@ -0,0 +1,100 @@
+#
+# sparse_mutable_persistence_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that a sparse.mutable dataset with a dataFileUrl gets its data
+# back when it's created again, from its snapshot and its write ahead log.
+#
+import os
+import shutil
+import tempfile
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+tmp_dir = tempfile.mkdtemp(dir='build/x86_64/tmp')
+
+
+def create(name, filename, **params):
+    params['dataFileUrl'] = 'file://' + os.path.join(tmp_dir, filename)
+    return mldb.create_dataset({
+        'id': name,
+        'type': 'sparse.mutable',
+        'params': params
+    })
+
+
+def query(name):
+    return mldb.query('SELECT * FROM {} ORDER BY rowName()'.format(name))
+
+
+class SparseMutablePersistenceTest(unittest.TestCase):
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(tmp_dir)
+
+    def test_snapshot_reload(self):
+        ds = create('snap', 'snap.bin', snapshotThresholdBytes=0)
+        ds.record_row('a', [['x', 1, 0], ['y', 'hello', 0]])
+        ds.record_row('b', [['x', 2.5, 0]])
+        ds.commit()
+        expected = query('snap')
+        self.assertTrue(os.path.exists(os.path.join(tmp_dir, 'snap.bin')))
+
+        mldb.delete('/v1/datasets/snap')
+        create('snap', 'snap.bin', snapshotThresholdBytes=0)
+        self.assertEqual(query('snap'), expected)
+
+    def test_log_replay(self):
+        # Data recorded after the last snapshot, committed or not, comes
+        # back from the log
+        ds = create('replay', 'replay.bin')
+        ds.record_row('a', [['x', 1, 0]])
+        ds.commit()
+        ds.record_row('b', [['x', 2, 0]])
+        # Below the threshold, so nothing but the log is written
+        self.assertFalse(os.path.exists(os.path.join(tmp_dir, 'replay.bin')))
+
+        mldb.delete('/v1/datasets/replay')
+        create('replay', 'replay.bin')
+        self.assertEqual(query('replay'), [
+            ['_rowName', 'x'],
+            ['a', 1],
+            ['b', 2]
+        ])
+
+    def test_snapshot_then_log(self):
+        ds = create('both', 'both.bin', snapshotThresholdBytes=0)
+        ds.record_row('a', [['x', 1, 0]])
+        ds.commit()
+        ds.record_row('b', [['x', 2, 0]])
+
+        mldb.delete('/v1/datasets/both')
+        ds = create('both', 'both.bin', snapshotThresholdBytes=0)
+        self.assertEqual(query('both'), [
+            ['_rowName', 'x'],
+            ['a', 1],
+            ['b', 2]
+        ])
+
+        # Keep writing after recovery
+        ds.record_row('c', [['x', 3, 0]])
+        ds.commit()
+        mldb.delete('/v1/datasets/both')
+        create('both', 'both.bin')
+        self.assertEqual(len(query('both')), 4)
+
+    def test_non_file_url(self):
+        with self.assertRaises(mldb_wrapper.ResponseException):
+            mldb.create_dataset({
+                'id': 'bad_url',
+                'type': 'sparse.mutable',
+                'params': {'dataFileUrl': 's3://bucket/file.bin'}
+            })
+
+
+mldb.run_tests()
@@ -0,0 +1,143 @@
+# -*- coding: utf-8 -*-
+#
+# tabular_frozen_column_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that each of the frozen column encodings of the tabular dataset
+# gives back exactly the values that were recorded.
+#
+import codecs
+import collections
+import os
+import tempfile
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+NUM_ROWS = 10000
+
+def expected_row(i):
+    return {
+        # small integers with nulls: bit-packed integer column
+        'ints': None if i % 10 == 0 else (i % 100) - 50,
+        # large integer range: bit-packed integer column with wide values
+        'bigints': i * 1000000007 - 5000000000,
+        # unique reals: dense double column
+        'reals': None if i % 17 == 0 else i * 0.25 + 0.125,
+        # strings, including UTF-8: dictionary string column
+        'strings': None if i % 11 == 0 else
+                   (u'ÉtéàÖ' if i % 3 == 0 else u'str') + str(i % 50),
+        # long runs of the same value: run length column
+        'runs': 'run' + str(i // 1000),
+        # mixed types: table column
+        'mixed': i if i % 2 else 'x' + str(i % 5)
+    }
+
+COLUMNS = ['ints', 'bigints', 'reals', 'strings', 'runs', 'mixed']
+
+class TabularFrozenColumnTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp_dir = tempfile.mkdtemp(prefix='tabular_frozen_column_test')
+        cls.csv_file = os.path.join(cls.tmp_dir, 'data.csv')
+        with codecs.open(cls.csv_file, 'w', 'utf8') as f:
+            f.write(','.join(COLUMNS) + '\n')
+            for i in range(NUM_ROWS):
+                row = expected_row(i)
+                f.write(','.join(
+                    u'' if row[c] is None else unicode(row[c])
+                    for c in COLUMNS) + '\n')
+
+        mldb.put('/v1/datasets/frozen', {
+            'type': 'text.csv.tabular',
+            'params': {
+                'dataFileUrl': 'file://' + cls.csv_file,
+                'cacheFileUrl': 'file://' + cls.csv_file + '.cache'
+            }
+        })
+
+        # Second copy is loaded through the cache file
+        mldb.put('/v1/datasets/frozen_cached', {
+            'type': 'text.csv.tabular',
+            'params': {
+                'dataFileUrl': 'file://' + cls.csv_file,
+                'cacheFileUrl': 'file://' + cls.csv_file + '.cache'
+            }
+        })
+
+    def check_dataset(self, dataset):
+        res = mldb.get('/v1/query', q="""
+            SELECT * FROM {} ORDER BY CAST (rowName() AS integer)
+        """.format(dataset), format='aos').json()
+        self.assertEqual(len(res), NUM_ROWS)
+
+        for i, row in enumerate(res):
+            expected = expected_row(i)
+            for c in COLUMNS:
+                self.assertEqual(row.get(c), expected[c],
+                                 (dataset, i, c, row.get(c), expected[c]))
+
+    def test_values(self):
+        self.check_dataset('frozen')
+
+    def test_cached_values(self):
+        self.check_dataset('frozen_cached')
+
+    def test_column_stats(self):
+        res = mldb.query("""
+            SELECT count(ints), count(strings), count(reals), count(runs)
+            FROM frozen
+        """)
+        self.assertEqual(res[1][1:], [NUM_ROWS - NUM_ROWS // 10,
+                                      NUM_ROWS - (NUM_ROWS + 10) // 11,
+                                      NUM_ROWS - (NUM_ROWS + 16) // 17,
+                                      NUM_ROWS])
+
+    def test_numeric_aggregates(self):
+        # Without a WHERE clause these are fed from the numeric columns;
+        # the WHERE clause makes them go through the rows instead
+        query = """
+            SELECT count(ints), sum(ints), avg(reals), sum(bigints),
+                   count(reals)
+            FROM {} {}
+        """
+        ints = [expected_row(i)['ints'] for i in range(NUM_ROWS)]
+        ints = [v for v in ints if v is not None]
+        reals = [expected_row(i)['reals'] for i in range(NUM_ROWS)]
+        reals = [v for v in reals if v is not None]
+
+        for dataset in ['frozen', 'frozen_cached']:
+            fast = mldb.query(query.format(dataset, ''))[1][1:]
+            slow = mldb.query(query.format(
+                dataset, 'WHERE rowName() IS NOT NULL'))[1][1:]
+            self.assertEqual(fast[0], len(ints))
+            self.assertEqual(fast[1], sum(ints))
+            self.assertAlmostEqual(fast[2], sum(reals) / len(reals))
+            self.assertEqual(fast[4], len(reals))
+            for f, s in zip(fast, slow):
+                self.assertAlmostEqual(f, s, delta=abs(s) * 1e-12)
+
+        # A string column can't be decoded as doubles, so this goes
+        # through the rows
+        res = mldb.query("SELECT count(ints), count(strings) FROM frozen")
+        self.assertEqual(res[1][1:], [len(ints),
+                                      NUM_ROWS - (NUM_ROWS + 10) // 11])
+
+    def test_value_counts(self):
+        # Counts come from the batch scans of the frozen columns
+        for c in ['runs', 'mixed', 'strings']:
+            expected = collections.Counter(
+                expected_row(i)[c] for i in range(NUM_ROWS))
+            expected.pop(None, None)
+            for dataset in ['frozen', 'frozen_cached']:
+                res = mldb.get('/v1/datasets/{}/columns/{}/valuecounts'
+                               .format(dataset, c)).json()
+                counts = {v: n for v, n in res if v is not None}
+                self.assertEqual(counts, dict(expected), (dataset, c))
+
+mldb.run_tests()
@@ -0,0 +1,97 @@
+#
+# tabular_predicate_pushdown_test.py
+# Datacratic, 2016
+# This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+#
+# Checks that WHERE clauses evaluated directly on the frozen columns of a
+# tabular dataset (with zone maps to skip chunks) give the same rows as
+# the generic evaluation.
+#
+import os
+import tempfile
+import unittest
+
+if False:
+    mldb_wrapper = None
+mldb = mldb_wrapper.wrap(mldb) # noqa
+
+
+# Enough for several chunks, so that the zone maps can skip some
+NUM_ROWS = 200000
+
+def row_values(i):
+    return {
+        'sorted': i,
+        'category': 'cat' + str(i % 7),
+        'maybe': i % 13 if i % 5 else None,
+        'step': i // 70000
+    }
+
+
+class TabularPredicatePushdownTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp_dir = tempfile.mkdtemp(prefix='tabular_predicate_test')
+        cls.csv_file = os.path.join(cls.tmp_dir, 'data.csv')
+        with open(cls.csv_file, 'w') as f:
+            f.write('sorted,category,maybe,step\n')
+            for i in range(NUM_ROWS):
+                v = row_values(i)
+                f.write('{},{},{},{}\n'.format(
+                    v['sorted'], v['category'],
+                    '' if v['maybe'] is None else v['maybe'], v['step']))
+
+        mldb.put('/v1/datasets/pushdown', {
+            'type': 'text.csv.tabular',
+            'params': {
+                'dataFileUrl': 'file://' + cls.csv_file
+            }
+        })
+
+    def check(self, where, expected_fn):
+        res = mldb.query("SELECT count(*) FROM pushdown WHERE " + where)
+        expected = sum(1 for i in range(NUM_ROWS)
+                       if expected_fn(row_values(i)))
+        count = res[1][1] if len(res) > 1 else 0
+        self.assertEqual(count, expected, where)
+
+    def test_equal(self):
+        self.check("sorted = 123456", lambda v: v['sorted'] == 123456)
+        self.check("123456 = sorted", lambda v: v['sorted'] == 123456)
+        self.check("category = 'cat3'", lambda v: v['category'] == 'cat3')
+        self.check("step = 2", lambda v: v['step'] == 2)
+        self.check("step = 7", lambda v: False)
+
+    def test_ranges(self):
+        self.check("sorted < 1000", lambda v: v['sorted'] < 1000)
+        self.check("sorted <= 1000", lambda v: v['sorted'] <= 1000)
+        self.check("sorted > 150000", lambda v: v['sorted'] > 150000)
+        self.check("sorted >= 150000", lambda v: v['sorted'] >= 150000)
+        self.check("1000 > sorted", lambda v: v['sorted'] < 1000)
+        self.check("sorted < -1", lambda v: False)
+
+    def test_in(self):
+        self.check("sorted IN (5, 70000, 199999, 300000)",
+                   lambda v: v['sorted'] in (5, 70000, 199999))
+        self.check("category IN ('cat1', 'cat6', 'dog')",
+                   lambda v: v['category'] in ('cat1', 'cat6'))
+
+    def test_nulls(self):
+        # Comparisons with nulls are never true
+        self.check("maybe = 3", lambda v: v['maybe'] == 3)
+        self.check("maybe < 3",
+                   lambda v: v['maybe'] is not None and v['maybe'] < 3)
+        self.check("sorted < NULL", lambda v: False)
+        self.check("sorted IN (NULL, 10)", lambda v: v['sorted'] == 10)
+
+    def test_conjunction(self):
+        self.check("sorted >= 100000 AND category = 'cat2' AND maybe > 10",
+                   lambda v: v['sorted'] >= 100000
+                   and v['category'] == 'cat2'
+                   and v['maybe'] is not None and v['maybe'] > 10)
+        # Not all of the clauses can be pushed down
+        self.check("sorted < 5000 AND sorted % 2 = 0",
+                   lambda v: v['sorted'] < 5000 and v['sorted'] % 2 == 0)
+
+mldb.run_tests()
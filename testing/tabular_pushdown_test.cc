@@ -0,0 +1,104 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* tabular_pushdown_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test that a selective WHERE clause over sorted data in a tabular dataset
+   uses the zone maps to skip chunks, rather than only giving the right
+   answer.
+*/
+
+#include "mldb/server/mldb_server.h"
+#include "mldb/core/dataset.h"
+#include "mldb/plugins/tabular_dataset.h"
+#include "mldb/types/any_impl.h"
+#include "mldb/types/value_description.h"
+#include <boost/filesystem.hpp>
+#include <fstream>
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+/// Temporary directory that is removed at the end of the test
+struct TempDirectory {
+    TempDirectory()
+        : path(boost::filesystem::temp_directory_path()
+               / boost::filesystem::unique_path("tabular_pushdown_test-%%%%-%%%%"))
+    {
+        boost::filesystem::create_directories(path);
+    }
+
+    ~TempDirectory()
+    {
+        boost::filesystem::remove_all(path);
+    }
+
+    boost::filesystem::path path;
+};
+
+// Enough for several chunks
+constexpr int NUM_ROWS = 300000;
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_selective_where_skips_chunks )
+{
+    TempDirectory dir;
+    string filename = (dir.path / "sorted.csv").string();
+
+    {
+        std::ofstream stream(filename);
+        stream << "sorted,category" << endl;
+        for (int i = 0;  i < NUM_ROWS;  ++i)
+            stream << i << ",cat" << i % 7 << "\n";
+    }
+
+    MldbServer server;
+    server.init();
+
+    Json::Value params;
+    params["dataFileUrl"] = "file://" + filename;
+
+    PolyConfig config;
+    config.id = "sorted";
+    config.type = "text.csv.tabular";
+    config.params = params;
+    obtainDataset(&server, config);
+
+    // The rows are spread over chunks by line block, so only the chunk
+    // with the first lines can contain these
+    uint64_t skipped = TabularDataStore::numChunksSkipped;
+    uint64_t scanned = TabularDataStore::numChunksScanned;
+
+    auto res = server.query("select count(*) as cnt from sorted "
+                            "where sorted < 1000");
+    BOOST_REQUIRE_EQUAL(res.size(), 1);
+    BOOST_CHECK_EQUAL(std::get<1>(res[0].columns.at(0)).toInt(), 1000);
+
+    uint64_t numSkipped = TabularDataStore::numChunksSkipped - skipped;
+    uint64_t numScanned = TabularDataStore::numChunksScanned - scanned;
+    cerr << "skipped " << numSkipped << " scanned " << numScanned << endl;
+    BOOST_CHECK_GT(numSkipped, 0);
+    BOOST_CHECK_GE(numScanned, 1);
+
+    // A predicate that every chunk might match skips nothing
+    skipped = TabularDataStore::numChunksSkipped;
+    scanned = TabularDataStore::numChunksScanned;
+
+    res = server.query("select count(*) as cnt from sorted "
+                       "where category = 'cat3'");
+    BOOST_REQUIRE_EQUAL(res.size(), 1);
+    BOOST_CHECK_EQUAL(std::get<1>(res[0].columns.at(0)).toInt(),
+                      (NUM_ROWS - 3 + 6) / 7);
+    BOOST_CHECK_EQUAL(TabularDataStore::numChunksSkipped, skipped);
+    BOOST_CHECK_GT(TabularDataStore::numChunksScanned, scanned);
+}
@@ -32,6 +32,7 @@ $(eval $(call test,cell_value_test,sql_expression,boost))
 # encapsulation.  Look at sql_expression_ops.cc for some ideas of how to
 # re-decouple them.
 $(eval $(call test,sql_expression_test,sql_expression,boost))
+$(eval $(call test,compiled_expression_test,sql_expression,boost))
 $(eval $(call test,dataset_select_test,mldb,boost))
 $(eval $(call test,embedding_dataset_test,mldb,boost))
 $(eval $(call test,procedure_run_test,mldb,boost))
@@ -50,6 +51,13 @@ $(eval $(call test,MLDB-267-delete-while-loading,mldb,boost))
 $(eval $(call test,mldb_crash_multiple_py_routes,mldb,boost manual))  #manual - intermittent - MLDB-787
 $(eval $(call test,mldb_function_pin_test,mldb,boost))
 $(eval $(call test,mldb_determinism_test,mldb,boost))
+$(eval $(call test,query_spill_test,mldb boost_filesystem boost_system,boost))
+$(eval $(call test,write_ahead_log_test,mldb_builtin_plugins boost_filesystem boost_system,boost))
+$(eval $(call test,join_strategy_test,mldb,boost))
+$(eval $(call test,pipeline_batch_test,mldb,boost))
+$(eval $(call test,tabular_pushdown_test,mldb mldb_builtin_plugins boost_filesystem boost_system,boost))
+$(eval $(call test,query_streaming_error_test,mldb,boost))
+$(eval $(call test,query_binary_format_test,mldb rest,boost))
 $(eval $(call test,credentials_daemon_test,credentials_daemon cloud,boost))
 $(eval $(call test,MLDB-1025-output-dataset-serialization-test,mldb,boost))
 
@@ -325,3 +333,20 @@ $(eval $(call mldb_unit_test,MLDB-1317-tensor-datatype.js))
 $(eval $(call mldb_unit_test,get_http_bound_address.py))
 $(eval $(call mldb_unit_test,get_http_bound_address.js))
 $(eval $(call mldb_unit_test,MLDB-815-sparse-mutable-record-strings.js))
+$(eval $(call mldb_unit_test,csv_cache_file_test.py))
+$(eval $(call mldb_unit_test,tabular_frozen_column_test.py))
+$(eval $(call mldb_unit_test,tabular_predicate_pushdown_test.py))
+$(eval $(call mldb_unit_test,hash_join_test.py))
+$(eval $(call mldb_unit_test,embedding_incremental_commit_test.py))
+$(eval $(call mldb_unit_test,embedding_hnsw_index_test.py))
+$(eval $(call mldb_unit_test,classifier_batch_apply_test.py))
+$(eval $(call mldb_unit_test,query_priority_test.py))
+$(eval $(call mldb_unit_test,groupby_hash_test.py))
+$(eval $(call mldb_unit_test,approx_aggregators_test.py))
+$(eval $(call mldb_unit_test,parallel_counts_test.py))
+$(eval $(call mldb_unit_test,query_streaming_test.py))
+$(eval $(call mldb_unit_test,query_plan_cache_test.py))
+$(eval $(call mldb_unit_test,sparse_mutable_persistence_test.py))
+$(eval $(call mldb_unit_test,sparse_mutable_compaction_test.py))
+$(eval $(call mldb_unit_test,sparse_mutable_buffered_ingest_test.py))
+$(eval $(call mldb_unit_test,merged_dataset_incremental_test.py))
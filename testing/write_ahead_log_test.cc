@@ -0,0 +1,147 @@
+// This file is part of MLDB. Copyright 2016 Datacratic. All rights reserved.
+
+/* write_ahead_log_test.cc
+   Copyright (c) 2016 Datacratic.  All rights reserved.
+
+   Test of the write ahead log, including what happens when writing it
+   fails.
+*/
+
+#include "mldb/plugins/write_ahead_log.h"
+#include "mldb/arch/exception.h"
+#include <boost/filesystem.hpp>
+#include <signal.h>
+#include <sys/resource.h>
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+
+using namespace std;
+using namespace Datacratic;
+using namespace Datacratic::MLDB;
+
+namespace {
+
+/// Temporary directory that is removed at the end of the test
+struct TempDirectory {
+    TempDirectory()
+        : path(boost::filesystem::temp_directory_path()
+               / boost::filesystem::unique_path("write_ahead_log_test-%%%%-%%%%"))
+    {
+        boost::filesystem::create_directories(path);
+    }
+
+    ~TempDirectory()
+    {
+        boost::filesystem::remove_all(path);
+    }
+
+    boost::filesystem::path path;
+};
+
+/// Limit the size of files that we can write, so that writes past it fail
+/// with EFBIG, for as long as the object exists
+struct FileSizeLimit {
+    FileSizeLimit(rlim_t limit)
+    {
+        oldHandler = signal(SIGXFSZ, SIG_IGN);
+        BOOST_REQUIRE_EQUAL(getrlimit(RLIMIT_FSIZE, &oldLimit), 0);
+        struct rlimit newLimit = oldLimit;
+        newLimit.rlim_cur = limit;
+        BOOST_REQUIRE_EQUAL(setrlimit(RLIMIT_FSIZE, &newLimit), 0);
+    }
+
+    ~FileSizeLimit()
+    {
+        setrlimit(RLIMIT_FSIZE, &oldLimit);
+        signal(SIGXFSZ, oldHandler);
+    }
+
+    struct rlimit oldLimit;
+    sighandler_t oldHandler;
+};
+
+vector<string> replayAll(WriteAheadLog & log)
+{
+    vector<string> result;
+    log.replay(0, 0, [&] (uint64_t seq, const char * data, size_t len)
+               {
+                   result.emplace_back(data, len);
+               });
+    return result;
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_round_trip )
+{
+    TempDirectory dir;
+    string base = (dir.path / "log").string();
+
+    {
+        WriteAheadLog log(base);
+        BOOST_CHECK(replayAll(log).empty());
+        log.append("hello");
+        log.sync(log.append("world"));
+        log.rotate();
+        log.sync(log.append("again"));
+    }
+
+    WriteAheadLog log(base);
+    vector<string> expected = { "hello", "world", "again" };
+    vector<string> records = replayAll(log);
+    BOOST_CHECK_EQUAL_COLLECTIONS(records.begin(), records.end(),
+                                  expected.begin(), expected.end());
+    BOOST_CHECK_EQUAL(log.lastSequence(), 3);
+}
+
+/* A write that fails part way through must not be acknowledged, must stop
+   the log from accepting anything more, and must not leave a torn record
+   that loses or resurrects data on replay.
+*/
+BOOST_AUTO_TEST_CASE( test_write_failure )
+{
+    TempDirectory dir;
+    string base = (dir.path / "log").string();
+
+    {
+        WriteAheadLog log(base);
+        replayAll(log);
+        log.sync(log.append("durable"));
+
+        {
+            // Room for the header of the next record, but not its data
+            FileSizeLimit limit(log.bytesSinceRotate() + 20);
+
+            uint64_t seq = log.append(string(1000, 'x'));
+            BOOST_CHECK_THROW(log.sync(seq), std::exception);
+        }
+
+        // The log has failed; nothing more can go into it
+        BOOST_CHECK_THROW(log.append("after"), ML::Exception);
+        BOOST_CHECK_THROW(log.sync(log.lastSequence()), ML::Exception);
+        BOOST_CHECK_THROW(log.rotate(), ML::Exception);
+
+        BOOST_CHECK_EQUAL(boost::filesystem::file_size(log.segmentPath(0)),
+                          log.bytesSinceRotate());
+    }
+
+    // Only what was acknowledged comes back, and the log can be written
+    // again once reopened
+    {
+        WriteAheadLog log(base);
+        vector<string> records = replayAll(log);
+        BOOST_REQUIRE_EQUAL(records.size(), 1);
+        BOOST_CHECK_EQUAL(records[0], "durable");
+        log.sync(log.append("more"));
+    }
+
+    WriteAheadLog log(base);
+    vector<string> expected = { "durable", "more" };
+    vector<string> records = replayAll(log);
+    BOOST_CHECK_EQUAL_COLLECTIONS(records.begin(), records.end(),
+                                  expected.begin(), expected.end());
+}